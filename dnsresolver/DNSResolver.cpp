@@ -132,18 +132,23 @@ void DNSResolver::Close()
 DNSResolver::DnsReqKey DNSResolver::Resolve(const std::string& host, uint16_t port, ResolverCallback cb, const void* contex)
 {
     RequestItem* request = new RequestItem(host, port, cb, contex);
-    DnsResultType ret = __get_dns_cache(request);
-    if(ret)
+    DnsResultType ret;
     {
-        delete request;
-        cb(ret);
-        return NULL; 
+        MutexGuard guard(resolve_mutex_);
+        ret = __get_dns_cache(request);
+        if(!ret)
+        {
+            //struct evdns_getaddrinfo_request *req = 
+            char port_str[10];
+            snprintf(port_str, 10, "%hu", port);
+            return evdns_getaddrinfo(dnsbase_, host.c_str(), port_str, 
+                &hints_, DNSResolver::__internal_callback, request);
+        }
     }
-    //struct evdns_getaddrinfo_request *req = 
-    char port_str[10];
-    snprintf(port_str, 10, "%hu", port);
-    return evdns_getaddrinfo(dnsbase_, host.c_str(), port_str, 
-        &hints_, DNSResolver::__internal_callback, request);
+    //回调不在锁里调
+    delete request;
+    cb(ret);
+    return NULL; 
 }
 
 void DNSResolver::Cancel(DNSResolver::DnsReqKey req_key)
@@ -16,6 +16,7 @@
 #include <boost/lexical_cast.hpp>
 #include "utility/murmur_hash.h"
 #include "utility/net_utility.h"
+#include "lock/lock.hpp"
 
 class DNSResolver
 {
@@ -100,6 +101,8 @@ protected:
     struct evdns_base *dnsbase_;
     struct evutil_addrinfo hints_;
     pthread_t pid_;
+    //HttpClient的多个调度线程会同时Resolve
+    Mutex  resolve_mutex_;
     static time_t dns_cache_time_;
     static DnsCache*   dns_cache_;
     bool   closed_;
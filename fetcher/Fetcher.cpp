@@ -18,15 +18,45 @@
 #include <arpa/inet.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 #if ENABLE_SSL
 # include <string.h>
 # include <openssl/ssl.h>
 #endif
+#if ENABLE_IO_URING
+# include "IoUring.hpp"
+#endif
+#include "Ring.hpp"
 
 #include <list.h>
 
 #define IOBUFSIZE			(64 * 1024)
+#define SSL_READ_MIN_ROOM		(4 * 1024)
+#define RX_THROTTLE_CHUNK		(4 * 1024)
+//回应的接收窗口为0时隔这么久再看
+#define RX_WINDOW_RETRY_MS		10
+#define SSL_SESSION_CACHE_MAX		10000
+#define CONN_SLAB_SIZE			64
+#define URING_ENTRIES			4096
+#define URING_BUF_SIZE			(16 * 1024)
+#define URING_BUF_COUNT			512
+#define URING_BGID			0
 #define SECS_PER_MINUTE		60
+#define RACE_MAX_ADDRS			8
+#define PIPELINE_MAX_DEPTH		16
+#define PIPELINE_SEND_MAX		(8 * 1024)
+#define PIPELINE_MAX_RETRY		2
+#define SSL_WRITE_CHUNK			(16 * 1024)
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+# define IP_BIND_ADDRESS_NO_PORT	24
+#endif
+#ifndef IP_LOCAL_PORT_RANGE
+# define IP_LOCAL_PORT_RANGE		51
+#endif
 
 #if ENABLE_SSL
 # define SCHEME_USE_SSL(scheme)		((scheme) & 1)
@@ -34,8 +64,11 @@
 #endif
 
 #define DEFAULT_QUEUE_MAX 100000
+#define RING_BATCH		256
 
 const struct timeval TIMEOUT_MS = {0, 1000};
+//有Wakeup时loop不必轮询, 只是兜底
+const struct timeval IDLE_TIMEOUT = {1, 0};
 #define SCHEME_USE_SSL(scheme)      ((scheme) & 1)
 
 /**
@@ -48,11 +81,11 @@ enum
     CS_CLOSED = 0,
     CS_CONNECTING,
     CS_READING,
+    CS_WRITING_WANT_WRITE,
 #if ENABLE_SSL
     CS_CONNECTING_WANT_READ,
     CS_CONNECTING_WANT_WRITE,
     CS_WRITING_WANT_READ,
-    CS_WRITING_WANT_WRITE,
     CS_READING_WANT_READ,
     CS_READING_WANT_WRITE,
 #endif
@@ -60,6 +93,133 @@ enum
     _CS_NTYPES
 };
 
+/**
+ * happy eyeballs: 一个Connection向多个候选地址赛跑connect.
+ * order[0]用conn->sockfd连(primary)，其余的作为attempt另开socket，
+ * 第一个连上的socket成为conn->sockfd
+ */
+struct ConnectRace
+{
+    /* addrs[0] is the original remote_addr of the connection */
+    int count;
+    struct sockaddr_storage addrs[RACE_MAX_ADDRS];
+    socklen_t addrlens[RACE_MAX_ADDRS];
+    /* the address connected last time, tried first */
+    int cur;
+    /* connect order of this round and the next one to start */
+    unsigned char order[RACE_MAX_ADDRS];
+    int next;
+    /* deadline of the whole race, 0 if not racing */
+    uint64_t deadline;
+    int error;
+    /* sockets connecting besides conn->sockfd, events carry gen */
+    unsigned short attempt_gen;
+    int nattempts;
+    struct {
+	int fd;
+	int addr;
+	unsigned short gen;
+    } attempts[RACE_MAX_ADDRS];
+};
+
+/**
+ * HTTP/1.1 pipelining: 一个连接上排队的请求, 按发出的顺序收回应.
+ * reqs[head]是正在收回应的请求(conn->user_data), 前sent个已发出,
+ * 之后sending个正在发
+ */
+struct ConnPipeline
+{
+    unsigned depth;	/* 同时在途的请求数上限 */
+    unsigned head;
+    unsigned count;
+    unsigned sent;
+    unsigned sending;
+    /* 连续重连而没收完一个回应的次数 */
+    unsigned retries;
+    /* 当前回应已收到的字节 */
+    size_t msg_bytes;
+    struct {
+	void *context;
+	uint64_t start_us;
+	uint64_t sent_us;
+    } reqs[PIPELINE_MAX_DEPTH];
+};
+
+#define PIPE_REQ(pipe, i)	((pipe)->reqs[((pipe)->head + (i)) % PIPELINE_MAX_DEPTH])
+
+/**
+ * 流水线上的一批请求, 一起发出
+ */
+struct PipelineBatch : RequestData
+{
+    std::vector<struct RequestData *> requests;
+    std::vector<struct iovec> iov;
+};
+
+/**
+ * 正在发的请求. 一次写不完的从iov[pos]接着写, 写了一半的iovec
+ * 就地调整; iov是request->vector的拷贝, 不拷贝数据
+ */
+struct ConnSend
+{
+    struct RequestData *request;
+    /* request is a PipelineBatch */
+    bool batch;
+    std::vector<struct iovec> iov;
+    size_t pos;
+    size_t left;
+    /* MSG_ZEROCOPY发过: 等内核通知zc_id及之前的发送用完才能释放 */
+    bool zerocopy;
+    uint32_t zc_id;
+    struct ConnSend *next;
+    /* SSL_write没写成的一段, 必须原样重试 */
+    const char *pending;
+    int pending_len;
+    /* 小的iovec(请求行, 头部)攒成一个TLS记录 */
+    char *stage;
+};
+
+static void __send_advance(ConnSend *send, size_t n)
+{
+    send->left -= n;
+    while (n) {
+	struct iovec *iov = &send->iov[send->pos];
+	if (n < iov->iov_len) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	    break;
+	}
+	n -= iov->iov_len;
+	send->pos++;
+    }
+    //跳过空的iovec
+    while (send->pos < send->iov.size() && !send->iov[send->pos].iov_len)
+	send->pos++;
+}
+
+static ConnSend *__send_new(struct RequestData *request, bool batch)
+{
+    ConnSend *send = new ConnSend;
+    send->request = request;
+    send->batch = batch;
+    send->iov.assign(request->vector, request->vector + request->count);
+    send->pos = 0;
+    send->left = 0;
+    for (int i = 0; i < request->count; i++)
+	send->left += request->vector[i].iov_len;
+    send->zerocopy = false;
+    send->zc_id = 0;
+    send->next = NULL;
+    send->pending = NULL;
+    send->pending_len = 0;
+    send->stage = NULL;
+    __send_advance(send, 0);
+    return send;
+}
+
+//Connection.close_pending, CLOSE_SSL只关https连接(SNI变了)
+enum { CLOSE_ALWAYS = 1, CLOSE_SSL = 2 };
+
 struct __connection
 {
     /*all connection we are visiting are arranged in a list*/
@@ -70,7 +230,8 @@ struct __connection
     unsigned int error : 10;
     int scheme;
     int sockfd;
-    time_t resp_time;
+    /* deadline of the current phase: connect, ttfb or idle read */
+    TimerNode timer;
     /* The current response message. */
     IFetchMessage *message;
     int socket_family;
@@ -78,11 +239,116 @@ struct __connection
     int protocol;
     FetchAddress address;
     void *user_data;
+    /* receive buffer leased while reading a response */
+    IOBuffer *rbuf;
+    /* rx shaping, shared by the ServChannel and private to this connection */
+    TokenBucket *serv_bucket;
+    TokenBucket *conn_bucket;
+    /* epoll interest removed until tokens are refilled */
+    int parked;
+    /* events registered on epoll, 0 if sockfd is not registered */
+    unsigned int ep_events;
+    /* being fetched by the owner loop, events of idle connections are not handled */
+    int active;
+    /* event seen while idle: remote closed or sent junk, don't reuse */
+    int stale;
+    /* closed by another thread (CLOSE_*), the owner loop closes the socket
+     * in the next Poll or before the next fetch, whichever comes first */
+    int close_pending;
+    /* io_uring backend: bumped on each new socket, completions of
+     * an older socket are only accounted */
+    unsigned short sock_gen;
+    /* io_uring backend: submitted ops not completed yet, the Connection
+     * can't be freed before they all complete */
+    int uring_ops;
+    int recv_armed;
+    /* the Fetcher(loop) which has driven this connection */
+    Fetcher *owner;
+    /* SNI, also part of the TLS session cache key */
+    char *server_name;
+    /* candidate addresses, NULL if there is only one */
+    struct ConnectRace *race;
+    /* queued requests, NULL if not pipelined */
+    struct ConnPipeline *pipe;
+    /* request being written, NULL if none */
+    struct ConnSend *send;
+    /* sent with MSG_ZEROCOPY and still referenced by the kernel, oldest first */
+    struct ConnSend *zc_sends;
+    /* MSG_ZEROCOPY: SO_ZEROCOPY set on sockfd, and the id of the next send */
+    int zerocopy;
+    uint32_t zc_seq;
+    /* phase stamps of the current fetch */
+    FetchTiming timing;
 #if ENABLE_SSL
     SSL *ssl;
 #endif
+    /* IP_LOCAL_PORT_RANGE value: max << 16 | min, 0 if not set */
+    uint32_t local_port_range;
+    /* address.remote_addr and address.local_addr point here */
+    struct sockaddr_storage remote_storage;
+    struct sockaddr_storage local_storage;
 };
 
+/**
+ * Connection按CONN_SLAB_SIZE个一批申请，FreeConnection后挂到空闲链表上复用，
+ * 不还给系统。CreateConnection/FreeConnection可能在不同线程，加锁。
+ */
+static pthread_mutex_t __conn_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(__conn_free_list);
+static uint64_t __conn_allocated = 0;
+static uint64_t __conn_created = 0;
+static size_t __conn_in_use = 0;
+
+static Connection *__conn_alloc()
+{
+    Connection *conn = NULL;
+    pthread_mutex_lock(&__conn_slab_lock);
+    if (list_empty(&__conn_free_list)) {
+	Connection *slab = (Connection *)malloc(CONN_SLAB_SIZE * sizeof(Connection));
+	if (slab) {
+	    for (int i = 0; i < CONN_SLAB_SIZE; i++)
+		list_add_tail(&slab[i].list, &__conn_free_list);
+	    __conn_allocated += CONN_SLAB_SIZE;
+	}
+    }
+    if (!list_empty(&__conn_free_list)) {
+	conn = list_entry(__conn_free_list.next, Connection, list);
+	list_del(&conn->list);
+	__conn_created++;
+	__conn_in_use++;
+    }
+    pthread_mutex_unlock(&__conn_slab_lock);
+    return conn;
+}
+
+static void __conn_release(Connection *conn)
+{
+    pthread_mutex_lock(&__conn_slab_lock);
+    //后进先出，刚释放的还在cache里
+    list_add(&conn->list, &__conn_free_list);
+    __conn_in_use--;
+    pthread_mutex_unlock(&__conn_slab_lock);
+}
+
+static inline void __release_rbuf(Connection *conn)
+{
+    if (conn->rbuf) {
+	IOBufferRelease(conn->rbuf);
+	conn->rbuf = NULL;
+    }
+}
+
+/**
+ * 等数据时缓冲区里已没有消息引用的数据就放回池子, 空等的连接不占slab;
+ * 还有引用时留着, 接着往后面读
+ */
+static inline void __drop_unused_rbuf(Connection *conn)
+{
+    //引用只在本loop线程增加, 读到1就只有连接自己
+    if (conn->rbuf && conn->rbuf->ref == 1)
+	__release_rbuf(conn);
+}
+
 static void __address_string(const struct sockaddr* addr, 
     char* addrstr, size_t addrstr_length) 
 {
@@ -107,6 +373,13 @@ static void __address_string(const struct sockaddr* addr,
         strncpy(addrstr, "0.0.0.0", addrstr_length);
 }
 
+static inline uint16_t __sockaddr_port(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET6)
+	return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+    return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
 /*
  *  \return : maximum time of timeout milliseconds for epoll wait 
  */
@@ -123,8 +396,188 @@ static int GetEpollTimeOut(const struct timeval *epoll_timeout) {
     return timeout/1000;
 }
 
-static inline int GetConnTimeOut (const struct timeval *conn_timeout) {
-    return conn_timeout->tv_sec ? conn_timeout->tv_sec : SECS_PER_MINUTE;
+/*
+ *  \return : timeout milliseconds of one phase, falls back to conn_timeout
+ */
+static inline unsigned int GetConnTimeOut (const Fetcher::Params *params, unsigned int phase_timeout_ms) {
+    if (phase_timeout_ms)
+	return phase_timeout_ms;
+    unsigned int timeout_ms = params->conn_timeout.tv_sec * 1000 + params->conn_timeout.tv_usec / 1000;
+    return timeout_ms ? timeout_ms : SECS_PER_MINUTE * 1000;
+}
+
+static inline uint64_t __monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#if ENABLE_SSL
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *__ssl_locks = NULL;
+
+static void __ssl_locking_callback(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+	pthread_mutex_lock(&__ssl_locks[n]);
+    else
+	pthread_mutex_unlock(&__ssl_locks[n]);
+}
+
+static unsigned long __ssl_thread_id()
+{
+    return (unsigned long)pthread_self();
+}
+#endif
+
+static pthread_once_t __ssl_init_once = PTHREAD_ONCE_INIT;
+
+/**
+ * 每个loop线程有自己的SSL_CTX和SSL对象，
+ * 老版本openssl的全局状态仍需要加锁回调
+ */
+static void __ssl_global_init()
+{
+    SSL_library_init();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    __ssl_locks = (pthread_mutex_t *)malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+    for (int i = 0; i < CRYPTO_num_locks(); i++)
+	pthread_mutex_init(&__ssl_locks[i], NULL);
+    CRYPTO_set_id_callback(__ssl_thread_id);
+    CRYPTO_set_locking_callback(__ssl_locking_callback);
+#endif
+}
+#endif
+
+/**
+ * 空闲长连接是否还可用：对端关闭或发来数据(如close_notify)都不能再复用
+ */
+static int __idle_conn_alive(Connection *conn)
+{
+    char c;
+    int n = recv(conn->sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * epoll上attempt的data: conn | gen << 48 | 1, 与data.ptr区分
+ */
+static inline uint64_t __race_data(Connection *conn, unsigned short gen)
+{
+    return (uint64_t)(uintptr_t)conn | ((uint64_t)gen << 48) | 1;
+}
+
+static inline Connection *__race_conn(uint64_t data)
+{
+    return (Connection *)(uintptr_t)(data & 0x0000fffffffffff8ULL);
+}
+
+static inline void __race_close_attempt(ConnectRace *race, int i, bool wake)
+{
+    if (wake)
+	shutdown(race->attempts[i].fd, SHUT_RDWR);
+    close(race->attempts[i].fd);
+    race->attempts[i] = race->attempts[--race->nattempts];
+}
+
+static inline void __race_cancel(ConnectRace *race, bool wake)
+{
+    while (race->nattempts)
+	__race_close_attempt(race, race->nattempts - 1, wake);
+    race->deadline = 0;
+}
+
+static inline void __race_set_addr(Connection *conn, int idx)
+{
+    ConnectRace *race = conn->race;
+    memcpy(&conn->remote_storage, &race->addrs[idx], race->addrlens[idx]);
+    conn->address.remote_addrlen = race->addrlens[idx];
+    conn->socket_family = race->addrs[idx].ss_family;
+    race->cur = idx;
+}
+
+static inline const struct sockaddr *__home_addr(const Connection *conn)
+{
+    return conn->race ? (const struct sockaddr *)&conn->race->addrs[0]
+	: conn->address.remote_addr;
+}
+
+static inline void __start_timing(Connection *conn)
+{
+    memset(&conn->timing, 0, sizeof(conn->timing));
+    conn->timing.start_us = LatencyNowUs();
+}
+
+/**
+ * 队头的回应收完, 下一个请求成为队头
+ */
+static inline void __pipe_pop(ConnPipeline *pipe)
+{
+    pipe->head = (pipe->head + 1) % PIPELINE_MAX_DEPTH;
+    pipe->count--;
+    if (pipe->sent)
+	pipe->sent--;
+    pipe->retries = 0;
+    pipe->msg_bytes = 0;
+}
+
+/**
+ * 流水线连接被对端reset(error)或关闭(error为0)时, 还没收完的请求换新连接重发.
+ * 对端可能只处理一个连接上的前几个请求就关掉，而reset会丢掉已收到的回应;
+ * 关闭只在两个回应之间才算
+ */
+static inline bool __pipe_retry(const Connection *conn, int error)
+{
+    if (!conn->pipe || conn->pipe->retries >= PIPELINE_MAX_RETRY)
+	return false;
+    if (error == EPIPE || error == ECONNRESET)
+	return true;
+    return !error && !conn->pipe->msg_bytes;
+}
+
+/**
+ * 队头请求的user_data和时间点
+ */
+static inline void __pipe_set_head(Connection *conn)
+{
+    ConnPipeline *pipe = conn->pipe;
+    conn->user_data = PIPE_REQ(pipe, 0).context;
+    memset(&conn->timing, 0, sizeof(conn->timing));
+    conn->timing.start_us = PIPE_REQ(pipe, 0).start_us;
+    conn->timing.sent_us = PIPE_REQ(pipe, 0).sent_us;
+}
+
+/**
+ * close后fd自动从epoll上摘除;
+ * io_uring上的op持有socket的引用，先shutdown让它们完成
+ */
+static inline void __close_socket(Connection *conn, bool wake)
+{
+    if (conn->sockfd >= 0) {
+	if (wake)
+	    shutdown(conn->sockfd, SHUT_RDWR);
+	close(conn->sockfd);
+    }
+    if (conn->race)
+	__race_cancel(conn->race, wake);
+    conn->sockfd = -1;
+    conn->ep_events = 0;
+    conn->active = 0;
+}
+
+/**
+ * 在loop线程执行DeferClose, 返回是否要关
+ */
+static inline bool __take_close_pending(Connection *conn)
+{
+    int how = conn->close_pending;
+    conn->close_pending = 0;
+#if ENABLE_SSL
+    if (how == CLOSE_SSL)
+	return conn->ssl != NULL;
+#endif
+    return how == CLOSE_ALWAYS;
 }
 
 static int __should_close_message(Connection *conn)
@@ -146,9 +599,10 @@ static inline int __get_state_events(int state)
 	case CS_CONNECTING:
 	case CS_FINISH:
 	    return EPOLLIN | EPOLLOUT | EPOLLET;
+	case CS_WRITING_WANT_WRITE:
+	    return EPOLLOUT | EPOLLET;
 #if ENABLE_SSL
 	case CS_CONNECTING_WANT_WRITE:
-	case CS_WRITING_WANT_WRITE:
 	case CS_READING_WANT_WRITE:
 	    return EPOLLOUT | EPOLLET;
 	case CS_CONNECTING_WANT_READ:
@@ -163,14 +617,6 @@ static inline int __get_state_events(int state)
     return -1;
 }
 
-static int __add__event(Connection *conn, int epfd)
-{
-    struct epoll_event event;
-    event.events = __get_state_events(conn->state);
-    event.data.ptr = conn;
-    return epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sockfd, &event);
-}
-
 static inline int __set_fd_nonblock(int fd)
 {
     int flags = fcntl(fd, F_GETFL);
@@ -200,33 +646,85 @@ static int __alloc_events_space(struct epoll_event **events,
     return nevents;
 }
 
-Fetcher::Fetcher (IMessageEvents *message_events, IFetcherEvents *fetcher_events) : 
+Fetcher::Fetcher (IMessageEvents *message_events, IFetcherEvents *fetcher_events, int backend) : 
 	epoll_events_(NULL), 
 	nconns_(0), 
 	max_events_(0),
-	rx_speed_max_(0),
+	now_ms_(__monotonic_ms()),
+	timer_wheel_(now_ms_),
 	total_rx_bytes_(0),
 	total_tx_bytes_(0),
-	last_total_rx_bytes_(0)
+	params_(NULL),
+	in_poll_(false)
 {
     INIT_LIST_HEAD(&conn_list_);
     INIT_LIST_HEAD(&new_conn_list_);
     message_events_ = message_events;
     fetch_events_ = fetcher_events;
-    cur_time_ = time(NULL);
-    gettimeofday(&last_rx_stat_time_, NULL);
     epfd_ = epoll_create(1); 
-    SSL_library_init();
-    ssl_ctx_ = SSL_CTX_new(SSLv3_client_method());
-    ssl_ctx_->references = 100000;
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    wake_pending_ = 0;
+    assert(wake_fd_ >= 0);
+    pthread_once(&__ssl_init_once, __ssl_global_init);
+    ssl_ctx_ = SSL_CTX_new(SSLv23_client_method());
+    assert(ssl_ctx_);
+    //客户端session缓存由Fetcher自己管理, 见SSLNewSession
+    SSL_CTX_set_session_cache_mode(ssl_ctx_, 
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx_, SSLNewSession);
+    SSL_CTX_set_app_data(ssl_ctx_, this);
+    ssl_handshakes_ = 0;
+    ssl_resumed_ = 0;
     conn_count_ = (unsigned int*)calloc(_CS_NTYPES , sizeof(unsigned int));
+    //每个Fetcher一个接收缓冲区池，多个loop线程之间不共享
+    rbuf_pool_ = new IOBufferPool(IOBUFSIZE);
+    spare_rbuf_ = NULL;
+    rx_bucket_ = &own_rx_bucket_;
+    memset(&syscalls_, 0, sizeof(syscalls_));
+    pthread_mutex_init(&free_mutex_, NULL);
+    INIT_LIST_HEAD(&free_list_);
+    uring_ = NULL;
+    uring_buf_pool_ = NULL;
+    uring_multishot_ = true;
+    backend_ = BACKEND_EPOLL;
+#if ENABLE_IO_URING
+    //内核不支持时退回epoll
+    if (backend == BACKEND_IO_URING && UringInit() == 0)
+	backend_ = BACKEND_IO_URING;
+#endif
+    if (!uring_) {
+	//data.ptr指向wake_fd_, 与Connection区分
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wake_fd_;
+	epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+    }
     assert(ssl_ctx_);
 }
 
 Fetcher::~Fetcher ()
 {
     Exit();
+    ReapConnections();
+    pthread_mutex_destroy(&free_mutex_);
     free(conn_count_); 
+    for (SSLSessionMap::iterator it = ssl_sessions_.begin(); it != ssl_sessions_.end(); ++it)
+	SSL_SESSION_free(it->second);
+    SSL_CTX_free(ssl_ctx_);
+    if (spare_rbuf_)
+	IOBufferRelease(spare_rbuf_);
+    rbuf_pool_->Close();
+    close(wake_fd_);
+}
+
+void Fetcher::Wakeup()
+{
+    //Poll处理唤醒之前只写一次
+    if (__sync_lock_test_and_set(&wake_pending_, 1))
+	return;
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0)
+	__sync_lock_release(&wake_pending_);
 }
 
 void Fetcher::Exit()
@@ -243,11 +741,14 @@ void Fetcher::Exit()
 	conn = list_entry(pos, Connection, list);
 	list_del(pos);
 	INIT_LIST_HEAD(&conn->list);
+	timer_wheel_.del(conn->timer);
 	if (__should_close_message(conn))
 	{
 	    message_events_->FreeFetchMessage(conn->message);
 	    conn->message = NULL;
 	}
+	__release_rbuf(conn);
+	conn->parked = 0;
 
 #if ENABLE_SSL
 	if (SCHEME_USE_SSL(conn->scheme) && conn->state != CS_CONNECTING) {
@@ -255,13 +756,17 @@ void Fetcher::Exit()
 	    conn->ssl = NULL;
 	}
 #endif
-	close(conn->sockfd);
+	ReleaseSends(conn);
+	__close_socket(conn, uring_ != NULL);
 	SetConnState(conn, CS_CLOSED);
     }
 
     if (epfd_ > 0) {
 	close(epfd_);
     }
+#if ENABLE_IO_URING
+    UringExit();
+#endif
 }
 
 int Fetcher::GetConnCount(size_t *connecting, size_t *established, size_t * closed)
@@ -271,11 +776,11 @@ int Fetcher::GetConnCount(size_t *connecting, size_t *established, size_t * clos
 
     if(established){
 	*established = conn_count_[CS_READING]
+	    + conn_count_[CS_WRITING_WANT_WRITE]
 #if ENABLE_SSL
 	    + conn_count_[CS_CONNECTING_WANT_READ]
 	    + conn_count_[CS_CONNECTING_WANT_WRITE]
 	    + conn_count_[CS_WRITING_WANT_READ]
-	    + conn_count_[CS_WRITING_WANT_WRITE]
 	    + conn_count_[CS_READING_WANT_READ]
 	    + conn_count_[CS_READING_WANT_WRITE]
 #endif
@@ -291,11 +796,19 @@ int Fetcher::GetConnCount(size_t *connecting, size_t *established, size_t * clos
 int Fetcher::SSLConnect(Connection *conn)
 {
     assert(conn->ssl);
+    //长连接上的SSL_connect直接返回成功，不计入握手次数
+    bool handshaking = !SSL_is_init_finished(conn->ssl);
     int ret = SSL_connect(conn->ssl);
     int error;
 
     if (ret > 0)
     {
+	if (handshaking) {
+	    conn->timing.tls_us = LatencyNowUs();
+	    ssl_handshakes_++;
+	    if (SSL_session_reused(conn->ssl))
+		ssl_resumed_++;
+	}
 	if (SendRequest(conn) < 0)
 	    return -1;
     }
@@ -307,17 +820,85 @@ int Fetcher::SSLConnect(Connection *conn)
 	    SetConnState(conn, CS_CONNECTING_WANT_WRITE);
 	else
 	{
+	    //握手失败，缓存的session可能已失效
+	    SSLRemoveSession(conn);
 	    if (error != SSL_ERROR_SYSCALL || errno == 0)
 		errno = SSL_ERROR_TO_ERRNO(error);
 	    return -1;
 	}
-
-	conn->resp_time = cur_time_;
     }
 
     return 0;
 }
 
+/**
+ * session缓存的key：对端地址(即ServChannel) + SNI
+ */
+void Fetcher::SSLSessionKey(Connection *conn, std::string *key)
+{
+    const struct sockaddr *addr = conn->address.remote_addr;
+    switch (addr->sa_family)
+    {
+	case AF_INET:
+	    key->assign((const char *)&((const struct sockaddr_in *)addr)->sin_addr, sizeof(struct in_addr));
+	    key->append((const char *)&((const struct sockaddr_in *)addr)->sin_port, sizeof(in_port_t));
+	    break;
+	case AF_INET6:
+	    key->assign((const char *)&((const struct sockaddr_in6 *)addr)->sin6_addr, sizeof(struct in6_addr));
+	    key->append((const char *)&((const struct sockaddr_in6 *)addr)->sin6_port, sizeof(in_port_t));
+	    break;
+	default:
+	    key->clear();
+	    break;
+    }
+    key->push_back('|');
+    if (conn->server_name)
+	key->append(conn->server_name);
+}
+
+int Fetcher::SSLNewSession(SSL *ssl, SSL_SESSION *session)
+{
+    Fetcher *fetcher = (Fetcher *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    Connection *conn = (Connection *)SSL_get_app_data(ssl);
+    if (!fetcher || !conn)
+	return 0;
+
+    std::string key;
+    fetcher->SSLSessionKey(conn, &key);
+    SSLSessionMap::iterator it = fetcher->ssl_sessions_.find(key);
+    if (it != fetcher->ssl_sessions_.end()) {
+	SSL_SESSION_free(it->second);
+	it->second = session;
+	return 1;
+    }
+    if (fetcher->ssl_sessions_.size() >= SSL_SESSION_CACHE_MAX) {
+	SSL_SESSION_free(fetcher->ssl_sessions_.begin()->second);
+	fetcher->ssl_sessions_.erase(fetcher->ssl_sessions_.begin());
+    }
+    fetcher->ssl_sessions_.insert(SSLSessionMap::value_type(key, session));
+    //返回1表示session的引用由我们持有
+    return 1;
+}
+
+void Fetcher::SSLRemoveSession(Connection *conn)
+{
+    std::string key;
+    SSLSessionKey(conn, &key);
+    SSLSessionMap::iterator it = ssl_sessions_.find(key);
+    if (it != ssl_sessions_.end()) {
+	SSL_SESSION_free(it->second);
+	ssl_sessions_.erase(it);
+    }
+}
+
+void Fetcher::GetSSLStats(uint64_t *handshakes, uint64_t *resumed)
+{
+    if (handshakes)
+	*handshakes = ssl_handshakes_;
+    if (resumed)
+	*resumed = ssl_resumed_;
+}
+
 int Fetcher::SSLNew(Connection *conn)
 {
     assert(conn);
@@ -327,8 +908,20 @@ int Fetcher::SSLNew(Connection *conn)
 	if ((bio = BIO_new_socket(conn->sockfd, BIO_NOCLOSE)))
 	{
 	    SSL_set_bio(conn->ssl, bio, bio);
+	    SSL_set_app_data(conn->ssl, conn);
+#ifdef SSL_set_tlsext_host_name
+	    if (conn->server_name)
+		SSL_set_tlsext_host_name(conn->ssl, conn->server_name);
+#endif
+	    std::string key;
+	    SSLSessionKey(conn, &key);
+	    SSLSessionMap::iterator it = ssl_sessions_.find(key);
+	    if (it != ssl_sessions_.end())
+		SSL_set_session(conn->ssl, it->second);
 	    return 0;
 	}
+	SSL_free(conn->ssl);
+	conn->ssl = NULL;
     }
 
     errno = SSL_ERROR_TO_ERRNO(SSL_ERROR_SYSCALL);
@@ -355,6 +948,7 @@ int Fetcher::SSLRead(Connection *conn, char *buf, int count)
     int ret = SSL_read(conn->ssl, buf, count);
     int error;
 
+    syscalls_.read++;
     if (ret >= 0)
 	return ret;
 
@@ -373,34 +967,48 @@ int Fetcher::SSLRead(Connection *conn, char *buf, int count)
     return -1;
 }
 
-int Fetcher::SSLWritev(Connection *conn, const struct iovec *vector, int count)
+/**
+ * 按TLS记录大小分段SSL_write, 大的iovec直接写, 不拼成一整块
+ * \return 0 写完, 1 等读写事件, -1 出错
+ */
+int Fetcher::SSLWritev(Connection *conn, ConnSend *send)
 {
-    size_t size = 0;
-    int i, ret;
+    int ret;
     int error;
-    void *buf;
-    char *p;
-
-    for (i = 0; i < count; i++)
-	size += vector[i].iov_len;
-
-    if (size == 0)
-	return 0;
 
-    if ((buf = malloc(size)))
-    {
-	p = (char *)buf;
-	for (i = 0; i < count; i++)
-	{
-	    memcpy(p, vector[i].iov_base, vector[i].iov_len);
-	    p += vector[i].iov_len;
+    assert(conn->ssl);
+    while (send->left) {
+	if (!send->pending_len) {
+	    size_t i, len = 0;
+	    for (i = send->pos; i < send->iov.size(); i++) {
+		if (send->iov[i].iov_len >= SSL_WRITE_CHUNK - len)
+		    break;
+		len += send->iov[i].iov_len;
+	    }
+	    if (i <= send->pos + 1) {
+		send->pending = (const char *)send->iov[send->pos].iov_base;
+		send->pending_len = MIN(send->iov[send->pos].iov_len, SSL_WRITE_CHUNK);
+	    } else {
+		if (!send->stage && !(send->stage = (char *)malloc(SSL_WRITE_CHUNK)))
+		    return -1;
+		char *p = send->stage;
+		for (size_t j = send->pos; j < i; j++) {
+		    memcpy(p, send->iov[j].iov_base, send->iov[j].iov_len);
+		    p += send->iov[j].iov_len;
+		}
+		send->pending = send->stage;
+		send->pending_len = len;
+	    }
 	}
 
-	assert(conn->ssl);
-	ret = SSL_write(conn->ssl, buf, size);
-	free(buf);
-	if (ret > 0)
-	    return 0;
+	ret = SSL_write(conn->ssl, send->pending, send->pending_len);
+	syscalls_.write++;
+	if (ret > 0) {
+	    total_tx_bytes_ += ret;
+	    __send_advance(send, send->pending_len);
+	    send->pending_len = 0;
+	    continue;
+	}
 
 	if ((error = SSL_get_error(conn->ssl, ret)) == SSL_ERROR_WANT_READ)
 	    SetConnState(conn, CS_WRITING_WANT_READ);
@@ -416,7 +1024,7 @@ int Fetcher::SSLWritev(Connection *conn, const struct iovec *vector, int count)
 	return 1;
     }
 
-    return -1;
+    return 0;
 }
 
 //static int __ssl_is_conn_alive(Connection *conn)
@@ -437,140 +1045,520 @@ int Fetcher::SSLWritev(Connection *conn, const struct iovec *vector, int count)
 
 #endif
 
-int Fetcher::SendFetchRequest(const struct RequestData *request, Connection *conn)
+/**
+ * 明文连接上写到写完或EAGAIN; 剩下的不少于zerocopy_threshold时用MSG_ZEROCOPY
+ * \return 0 写完, 1 等可写, -1 出错
+ */
+int Fetcher::SockWritev(Connection *conn, ConnSend *send)
+{
+    ssize_t n;
+
+    while (send->left) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &send->iov[send->pos];
+	msg.msg_iovlen = MIN(send->iov.size() - send->pos, IOV_MAX);
+	int flags = MSG_NOSIGNAL;
+	if (conn->zerocopy && send->left >= params_->zerocopy_threshold)
+	    flags |= MSG_ZEROCOPY;
+	syscalls_.write++;
+	if ((n = sendmsg(conn->sockfd, &msg, flags)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		SetConnState(conn, CS_WRITING_WANT_WRITE);
+		return 1;
+	    }
+	    //锁住的页超过optmem限制, 这个socket上不再用zerocopy
+	    if ((flags & MSG_ZEROCOPY) && errno == ENOBUFS) {
+		conn->zerocopy = 0;
+		continue;
+	    }
+	    return -1;
+	}
+	if (flags & MSG_ZEROCOPY) {
+	    send->zerocopy = true;
+	    send->zc_id = conn->zc_seq++;
+	}
+	total_tx_bytes_ += n;
+	__send_advance(send, n);
+    }
+    return 0;
+}
+
+/**
+ * 写conn->send, 写完后进入读状态
+ */
+int Fetcher::SendFetchRequest(Connection *conn)
 {
-    int new_state = CS_CLOSED;
+    ConnSend *send = conn->send;
+    int new_state = CS_READING;
     int n;
 
 #if ENABLE_SSL
     if (SCHEME_USE_SSL(conn->scheme))
     {
-	if ((n = SSLWritev(conn, request->vector, request->count)) == 0)
-	    new_state = CS_READING_WANT_READ;
-	else if (n < 0)
-	    return -1;
+	n = SSLWritev(conn, send);
+	new_state = CS_READING_WANT_READ;
     }
     else
 #endif
-    {
-	if ((n = writev(conn->sockfd, request->vector, request->count)) >= 0){
-	    new_state = CS_READING;
-	}
-	else
-	    return -1;
+	n = SockWritev(conn, send);
+
+    if (n > 0) {
+	//每次有进展重新计时, 大请求不按总时间超时
+	ArmTimer(conn, GetConnTimeOut(params_, params_->ttfb_timeout_ms));
+	return 0;
     }
 
-    if (new_state != CS_CLOSED)
-    {
+    conn->send = NULL;
+    //内核还引用着的挂到连接上, 收到完成通知再释放
+    if (n == 0 && send->zerocopy) {
+	ConnSend **tail = &conn->zc_sends;
+	while (*tail)
+	    tail = &(*tail)->next;
+	*tail = send;
+    }
+    else
+	FreeSend(send);
+    return n < 0 ? -1 : RequestSent(conn, new_state);
+}
+
+/**
+ * 请求已发出，准备接收回应
+ */
+int Fetcher::RequestSent(Connection *conn, int new_state)
+{
+    ConnPipeline *pipe = conn->pipe;
+    uint64_t now = LatencyNowUs();
+    if (!pipe || !pipe->sent)
+	conn->timing.sent_us = now;
+    if (pipe) {
+	for (unsigned i = pipe->sent; i < pipe->sent + pipe->sending; i++)
+	    PIPE_REQ(pipe, i).sent_us = now;
+	pipe->sent += pipe->sending;
+	pipe->sending = 0;
+    }
+    //流水线上队头的回应已经在收
+    if (!pipe || !conn->message) {
 	conn->message = message_events_->CreateFetchResponse(conn->address, conn->user_data);
 	if (!conn->message) {
 	    return -1;
 	}
-	SetConnState(conn, new_state);
     }
-
-    conn->resp_time = cur_time_;
+    SetConnState(conn, new_state);
+    ArmTimer(conn, GetConnTimeOut(params_, params_->ttfb_timeout_ms));
     return 0;
 }
 
 int Fetcher::SendRequest(Connection *conn)
 {
-    struct RequestData *request = message_events_->CreateRequestData(conn->user_data);
-    int i;
-
-    if (request)
-    {
-	for(i=0; i <request->count; ++i) {
-	    total_tx_bytes_ += request->vector[i].iov_len;
-	}
-	int ret = SendFetchRequest(request, conn);
-	message_events_->FreeRequestData(request);
-	return ret;
-    } else {
-	return -1;
+#if ENABLE_IO_URING
+    if (uring_ && !SCHEME_USE_SSL(conn->scheme))
+	return UringSend(conn);
+#endif
+    //上次没写完的接着写
+    if (!conn->send) {
+	struct RequestData *request = CreateRequest(conn);
+	if (!request)
+	    return -1;
+	conn->send = __send_new(request, conn->pipe != NULL);
     }
+    return SendFetchRequest(conn);
 }
 
 /**
- * @return 0 connect succeed.
- * 	   -1 socket failed
+ * 要发出的请求; 流水线连接上是排队的请求拼成的一批
  */
-int Fetcher::ConnectToServer(Connection *conn)
+struct RequestData *Fetcher::CreateRequest(Connection *conn)
+{
+    ConnPipeline *pipe = conn->pipe;
+    if (!pipe)
+	return message_events_->CreateRequestData(conn->user_data);
+
+    unsigned end = MIN(pipe->count, pipe->depth);
+    PipelineBatch *batch = new PipelineBatch;
+    size_t bytes = 0;
+    for (unsigned i = pipe->sent; i < end; i++) {
+	//一批不太大，写的时候不耽误收回应
+	if (bytes >= PIPELINE_SEND_MAX)
+	    break;
+	struct RequestData *request = message_events_->CreateRequestData(PIPE_REQ(pipe, i).context);
+	if (!request) {
+	    FreeRequest(batch, true);
+	    return NULL;
+	}
+	batch->requests.push_back(request);
+	for (int j = 0; j < request->count; j++) {
+	    batch->iov.push_back(request->vector[j]);
+	    bytes += request->vector[j].iov_len;
+	}
+    }
+    pipe->sending = batch->requests.size();
+    batch->vector = batch->iov.empty() ? NULL : &batch->iov[0];
+    batch->count = batch->iov.size();
+    return batch;
+}
+
+void Fetcher::FreeSend(ConnSend *send)
+{
+    FreeRequest(send->request, send->batch);
+    free(send->stage);
+    delete send;
+}
+
+/**
+ * 关socket时释放没写完的和等zerocopy通知的请求; socket关了页也就放了
+ */
+void Fetcher::ReleaseSends(Connection *conn)
+{
+    if (conn->send) {
+	FreeSend(conn->send);
+	conn->send = NULL;
+    }
+    while (conn->zc_sends) {
+	ConnSend *send = conn->zc_sends;
+	conn->zc_sends = send->next;
+	FreeSend(send);
+    }
+    conn->zerocopy = 0;
+    conn->zc_seq = 0;
+}
+
+/**
+ * 收MSG_ZEROCOPY的完成通知. TCP上按序完成, 通知到hi的id及之前的都可以释放
+ */
+void Fetcher::ReapZerocopy(Connection *conn)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    while (conn->zc_sends) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(conn->sockfd, &msg, MSG_ERRQUEUE) < 0)
+	    return;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+	    if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+		    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+		continue;
+	    struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+	    if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+		continue;
+	    while (conn->zc_sends && (int32_t)(conn->zc_sends->zc_id - serr->ee_data) <= 0) {
+		ConnSend *send = conn->zc_sends;
+		conn->zc_sends = send->next;
+		FreeSend(send);
+	    }
+	}
+    }
+}
+
+void Fetcher::FreeRequest(struct RequestData *request, bool batch)
+{
+    if (!batch) {
+	message_events_->FreeRequestData(request);
+	return;
+    }
+    PipelineBatch *pipeline_batch = static_cast<PipelineBatch *>(request);
+    for (size_t i = 0; i < pipeline_batch->requests.size(); i++)
+	message_events_->FreeRequestData(pipeline_batch->requests[i]);
+    delete pipeline_batch;
+}
+
+/**
+ * 创建非阻塞socket, 设置socket选项并绑定本地地址
+ * 本地地址与family不同时(赛跑中的另一族地址)不绑定
+ * @return fd, -1 failed
+ */
+int Fetcher::NewSocket(Connection *conn, int family)
 {
-    conn->sockfd = socket(conn->socket_family, conn->socket_type, conn->protocol);
-    if (conn->sockfd < 0) 
+    int fd = socket(family, conn->socket_type, conn->protocol);
+    if (fd < 0) 
     {
 	    return -1;
     }
-    if(params_->socket_sndbuf_size && setsockopt(conn->sockfd, 
+    if(params_->socket_sndbuf_size && setsockopt(fd, 
         SOL_SOCKET, SO_SNDBUF, &params_->socket_sndbuf_size, sizeof(params_->socket_sndbuf_size)) < 0)
     {
-        return -1;
+        goto fail;
     }
-    if(params_->socket_rcvbuf_size && setsockopt(conn->sockfd, 
+    if(params_->socket_rcvbuf_size && setsockopt(fd, 
         SOL_SOCKET, SO_RCVBUF, &params_->socket_rcvbuf_size, sizeof(params_->socket_rcvbuf_size)) < 0)
     {
-        return -1;
+        goto fail;
     }
 
-    int on = 1;
-    if(setsockopt(conn->sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
-        return -1;
+    {
+	int on = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+	    goto fail;
+	//老内核不支持时照常发送; 要在connect前设置
+	if (params_->zerocopy_threshold && !SCHEME_USE_SSL(conn->scheme) && !uring_)
+	    conn->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    }
 
-    if (conn->address.local_addr != NULL) {
-	if (bind(conn->sockfd, conn->address.local_addr, conn->address.local_addrlen) == -1) {
+    if (conn->address.local_addr != NULL && conn->address.local_addr->sa_family == family) {
+	//端口留到connect时按四元组选，不因bind占满本地端口
+	if (__sockaddr_port(conn->address.local_addr) == 0) {
+	    int on = 1;
+	    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+	    if (conn->local_port_range)
+		setsockopt(fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE,
+			&conn->local_port_range, sizeof(conn->local_port_range));
+	}
+	if (bind(fd, conn->address.local_addr, conn->address.local_addrlen) == -1) {
 	    assert(false);
-	    return -1;
+	    goto fail;
 	}
     }
 
-    if (__set_fd_nonblock(conn->sockfd) >= 0)
+    if (__set_fd_nonblock(fd) >= 0)
+	return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/**
+ * @return 0 succeed.
+ * 	   -1 failed, socket closed
+ */
+int Fetcher::OpenSocket(Connection *conn)
+{
+    conn->sockfd = NewSocket(conn, conn->socket_family);
+    if (conn->sockfd < 0)
+	return -1;
+    conn->stale = 0;
+    conn->sock_gen++;
+    conn->recv_armed = 0;
+    conn->ep_events = 0;
+    return 0;
+}
+
+/**
+ * @return 0 connect succeed.
+ * 	   -1 socket failed
+ */
+int Fetcher::ConnectToServer(Connection *conn)
+{
+    if (OpenSocket(conn) < 0)
+	return -1;
+
+    //connect和SSL握手共用一个超时
+    ArmTimer(conn, GetConnTimeOut(params_, params_->connect_timeout_ms));
+    if (connect(conn->sockfd, conn->address.remote_addr, conn->address.remote_addrlen) < 0)
     {
-	if (connect(conn->sockfd, conn->address.remote_addr, conn->address.remote_addrlen) < 0)
+	if (errno == EINPROGRESS)
 	{
-	    if (errno == EINPROGRESS)
-	    {
-		SetConnState(conn, CS_CONNECTING);
-		conn->resp_time = cur_time_;
-		return 0;
-	    }
+	    SetConnState(conn, CS_CONNECTING);
+	    return 0;
 	}
+	goto fail;
+    }
+
+    conn->timing.connect_us = LatencyNowUs();
 #if ENABLE_SSL
-	else if (SCHEME_USE_SSL(conn->scheme))
-	{
-	    if (SSLInitialize(conn) >= 0)
-		return 0;
-	}
-#endif
-	else if (SendRequest(conn) >= 0) {
+    if (SCHEME_USE_SSL(conn->scheme))
+    {
+	if (SSLInitialize(conn) >= 0)
 	    return 0;
-	}
+    }
+    else
+#endif
+    if (SendRequest(conn) >= 0) {
+	return 0;
     }
 
+fail:
     close(conn->sockfd);
+    conn->sockfd = -1;
     return -1;
 }
 
-void Fetcher::UpdateTime(time_t cur_time)
+void Fetcher::UpdateTime()
+{
+    now_ms_ = __monotonic_ms();
+}
+
+void Fetcher::ArmTimer(Connection *conn, unsigned int timeout_ms)
+{
+    timer_wheel_.del(conn->timer);
+    timer_wheel_.add_back(now_ms_ + timeout_ms, conn->timer);
+}
+
+void Fetcher::CheckTimeout()
+{
+    // 重新设置的定时器至少在1ms之后，这一轮不会再取出来
+    TimerNode *node;
+    while ((node = timer_wheel_.pop_expired(now_ms_)) != NULL) {
+	Connection *conn = list_entry(node, Connection, timer);
+	if (conn->parked)
+	    UnparkConn(conn);
+	else if (!RaceStep(conn))
+	    RemoveErrorConn(conn, ETIMEDOUT);
+    }
+}
+
+size_t Fetcher::RxAllowance(Connection *conn, size_t want)
+{
+    if (conn->message)
+	want = MIN(want, conn->message->RxWindow());
+    if (want)
+	want = rx_bucket_->Available(now_ms_, want);
+    if (want && conn->serv_bucket)
+	want = conn->serv_bucket->Available(now_ms_, want);
+    if (want && conn->conn_bucket)
+	want = conn->conn_bucket->Available(now_ms_, want);
+    return want;
+}
+
+void Fetcher::RxConsume(Connection *conn, size_t bytes)
+{
+    rx_bucket_->Consume(bytes);
+    if (conn->serv_bucket)
+	conn->serv_bucket->Consume(bytes);
+    if (conn->conn_bucket)
+	conn->conn_bucket->Consume(bytes);
+}
+
+/**
+ * 令牌用完或回应的接收窗口为0：撤掉epoll关注的事件，定时器到期后再读
+ */
+void Fetcher::ParkConn(Connection *conn)
+{
+    unsigned int wait_ms = rx_bucket_->WaitTime(RX_THROTTLE_CHUNK);
+    if (conn->serv_bucket)
+	wait_ms = MAX(wait_ms, conn->serv_bucket->WaitTime(RX_THROTTLE_CHUNK));
+    if (conn->conn_bucket)
+	wait_ms = MAX(wait_ms, conn->conn_bucket->WaitTime(RX_THROTTLE_CHUNK));
+    if (conn->message && conn->message->RxWindow() == 0)
+	wait_ms = MAX(wait_ms, (unsigned int)RX_WINDOW_RETRY_MS);
+
+    if (!conn->parked) {
+	//只保留ERR/HUP，边沿触发避免反复通知
+	UpdateEvents(conn, EPOLLET);
+	conn->parked = 1;
+    }
+    ArmTimer(conn, MAX(wait_ms, 1U));
+}
+
+/**
+ * 恢复epoll事件；边沿触发下数据可能已在socket缓冲区，直接读一次
+ */
+void Fetcher::UnparkConn(Connection *conn)
+{
+    struct epoll_event event;
+    conn->parked = 0;
+    ArmTimer(conn, GetConnTimeOut(params_, params_->idle_timeout_ms));
+#if ENABLE_IO_URING
+    if (uring_ && !SCHEME_USE_SSL(conn->scheme)) {
+	if (UringArmRecv(conn) < 0)
+	    RemoveErrorConn(conn, errno);
+	return;
+    }
+#endif
+    event.events = __get_state_events(conn->state);
+    event.data.ptr = conn;
+    if (UpdateEvents(conn, event.events) < 0) {
+	RemoveErrorConn(conn, errno);
+	return;
+    }
+    ProcessEvent(&event);
+}
+
+/**
+ * 只在关注的事件真正变化时才epoll_ctl，第一次为ADD
+ */
+int Fetcher::UpdateEvents(Connection *conn, unsigned int events)
+{
+    //赛跑中primary失败，等attempt
+    if (conn->sockfd < 0)
+	return 0;
+#if ENABLE_IO_URING
+    //明文连接在io_uring下不需要poll
+    if (uring_)
+	return SCHEME_USE_SSL(conn->scheme) ? UringPoll(conn, events) : 0;
+#endif
+    if (conn->ep_events == events)
+	return 0;
+
+    struct epoll_event event;
+    int op;
+    event.events = events;
+    event.data.ptr = conn;
+    if (conn->ep_events) {
+	op = EPOLL_CTL_MOD;
+	syscalls_.epoll_ctl_mod++;
+    } else {
+	op = EPOLL_CTL_ADD;
+	syscalls_.epoll_ctl_add++;
+    }
+    if (epoll_ctl(epfd_, op, conn->sockfd, &event) < 0)
+	return -1;
+    conn->ep_events = events;
+    return 0;
+}
+
+void Fetcher::ProcessEvent(struct epoll_event *event)
 {
-    cur_time_ = cur_time;
+    Connection* conn = (Connection *)event->data.ptr;
+    //MSG_ZEROCOPY的完成通知在错误队列里, 以EPOLLERR报上来; 只是通知的不算事件
+    if (conn->zc_sends && (event->events & EPOLLERR)) {
+	ReapZerocopy(conn);
+	int error = 0;
+	socklen_t n = sizeof(error);
+	if (!(event->events & (EPOLLIN | EPOLLOUT | EPOLLHUP))
+		&& getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &n) == 0 && !error)
+	    return;
+    }
+    if (!conn->active) {
+	//空闲长连接上的事件，复用前重新建连
+	conn->stale = 1;
+	return;
+    }
+    list_del(&conn->list);
+    INIT_LIST_HEAD(&conn->list);
+    if (CheckEvent(event, &conn_list_) == 0) {
+	list_add_tail(&conn->list, &conn_list_);
+    }
 }
 
 int Fetcher::NewConnection(Connection *conn)
 {
     int ret;
+    bool racing = RaceReset(conn);
 
-    ret = ConnectToServer(conn);
-    if (ret == 0)
+#if ENABLE_IO_URING
+    if (uring_ && !SCHEME_USE_SSL(conn->scheme))
+	ret = UringConnect(conn);
+    else
+#endif
     {
-	if (__add__event(conn, epfd_) < 0) {
-	    ret = -1;
+	ret = ConnectToServer(conn);
+	//connect直接失败(如没有路由)时换下一个地址
+	while (ret < 0 && racing && conn->race->next < conn->race->count) {
+	    __race_set_addr(conn, conn->race->order[conn->race->next++]);
+	    ret = ConnectToServer(conn);
+	}
+	if (ret == 0)
+	{
+	    if (UpdateEvents(conn, __get_state_events(conn->state)) < 0) {
+		ret = -1;
+	    }
 	}
     }
 
     if (ret == 0) {
+	if (racing && conn->state == CS_CONNECTING)
+	    ArmTimer(conn, RaceStepTimeout(conn));
+	else if (racing)
+	    RaceFinish(conn);
 	return 0;
     } else {
+	if (racing)
+	    conn->race->deadline = 0;
 	return -1;
     }
 
@@ -578,15 +1566,33 @@ int Fetcher::NewConnection(Connection *conn)
 
 int Fetcher::AddConn(int *n, Connection *conn, struct list_head *conn_list)
 {
+    conn->owner = this;
+    __start_timing(conn);
+    //其他线程关闭后又放进来的, 还没等到ReapConnections
+    if (conn->close_pending) {
+	pthread_mutex_lock(&free_mutex_);
+	bool close = __take_close_pending(conn);
+	pthread_mutex_unlock(&free_mutex_);
+	if (close)
+	    ResetConnection(conn);
+    }
+    //空闲期间对端可能已关闭长连接，重新建连
+    //io_uring下空闲连接可能没有挂着recv/poll，只能探测一下
+    if (conn->state == CS_FINISH && (conn->stale
+		|| (uring_ && !conn->recv_armed && !__idle_conn_alive(conn))))
+	ResetConnection(conn);
     if (conn->state == CS_FINISH) {
-	if (__add__event(conn, epfd_) < 0) {
-	    assert(false);
-	}
+	//fd一直注册在epoll上，边沿触发不会再通知可写，直接发请求
+	if (SendRequest(conn) < 0
+		|| UpdateEvents(conn, __get_state_events(conn->state)) < 0)
+	    return -1;
+	conn->active = 1;
 	list_add_tail(&conn->list, conn_list);
 	(*n)++;
 	return 0;
     }
     if (NewConnection(conn) == 0) {
+	conn->active = 1;
 	list_add_tail(&conn->list, conn_list);
 	(*n)++;
 	return 0;
@@ -616,6 +1622,8 @@ void Fetcher::AddConnList(int *n)
         for(unsigned i = 0; i < req_vec.size(); i++)
         {
             assert(req_vec[i].conn);
+            if (req_vec[i].conn->pipe && PipelineQueue(req_vec[i].conn, req_vec[i].context))
+                continue;
             req_vec[i].conn->user_data = req_vec[i].context;
             INIT_LIST_HEAD(&req_vec[i].conn->list); 
             if (AddConn(n, req_vec[i].conn, &conn_list_) != 0) 
@@ -650,28 +1658,46 @@ int Fetcher::ReadData(Connection *conn, struct epoll_event *event)
     int n = ReadFromConn(conn, &alive);
 
     if (n > 0) {
-	conn->resp_time = cur_time_;
+	//流水线: 读完一轮再发排队的请求
+	if (conn->pipe && PipelineFlush(conn) < 0)
+	    return -1;
 	return 0;
     } else if (n < 0) {
 	return -1;
     }
 
+    return FinishRead(conn, alive);
+}
+
+/**
+ * 一次抓取结束
+ * \return -1 We have error
+ * \return 0 next request sent on the keep-alive connection
+ * \return 1 connection is idle now
+ */
+int Fetcher::FinishRead(Connection *conn, int alive)
+{
     alive = alive && conn->message->IsKeepAlive();
+    // 一次抓取结束，归还接收缓冲区，空闲连接不占用缓冲区
+    __release_rbuf(conn);
+    timer_wheel_.del(conn->timer);
     
     SetConnState(conn, CS_FINISH);
-    epoll_ctl(epfd_, EPOLL_CTL_DEL, conn->sockfd, event);
-    //ssl多线程需加锁，故ssl连接不支持长连接
-    if (SCHEME_USE_SSL(conn->scheme)) {
-	CloseConnection(conn);
-    }
+    //长连接的fd不从epoll摘除，空闲期间的事件只标记stale
+    conn->active = 0;
+    conn->timing.last_byte_us = LatencyNowUs();
+    latency_.AddFetch(conn->timing);
     
     bool inst_fetch = fetch_events_->FinishFetch(conn, conn->user_data, conn->message);
+    if (conn->pipe)
+	return PipelineFinish(conn, alive);
 
     //support keep alive
     if (alive) {
 	if (inst_fetch) {
+	    __start_timing(conn);
 	    if (SendRequest(conn) >= 0) {
-		epoll_ctl(epfd_, EPOLL_CTL_ADD, conn->sockfd, event);
+		conn->active = 1;
 		return 0;
 	    } else {
 		return -1;
@@ -687,129 +1713,423 @@ int Fetcher::ReadData(Connection *conn, struct epoll_event *event)
 }
 
 /**
- * Read data from conn
+ * 把收到的数据交给当前回应.
+ * 流水线连接上逐块交, 一个回应收完后多出的数据(Overread)交给下一个
  * \return -1 We have error
- * \return 0 read finished, 
- * \return 1 EAGAIN, 
+ * \return 0 read finished, 流水线上为最后一个回应或连接不能再用
+ * \return 1 keep on reading
+ * \return 2 流水线连接已在新socket上重发请求
  */
-int Fetcher::ReadFromConn(Connection *conn, int *alive)
+int Fetcher::AppendData(Connection *conn, const IOBufferSlice *slices, int count)
 {
-    static char buf[IOBUFSIZE];
-    int n, ret;
+    ConnPipeline *pipe = conn->pipe;
+    int ret;
+
+    if (!pipe || count == 0) {
+	//回应之间对端关闭了连接: 还没收到回应的请求换新连接重发
+	if (__pipe_retry(conn, 0))
+	    return PipelineRestart(conn) < 0 ? -1 : 2;
+	if ((ret = conn->message->AppendBuffers(slices, count)) == 0
+		&& count && conn->message->Overread())
+	    //对端多发了数据，连接不再复用
+	    conn->stale = 1;
+	return ret > 0 ? 1 : ret;
+    }
 
-    if(rx_speed_max_ > 0 && total_rx_bytes_ - last_total_rx_bytes_ >= rx_speed_max_){
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	long diffusec = 1000000L - ((now.tv_sec - last_rx_stat_time_.tv_sec) * 1000000L + 
-		(now.tv_usec - last_rx_stat_time_.tv_usec));
-	if(diffusec > 0){
-	    struct timeval sleeptime;
-	    if(diffusec == 1000000L){
-		sleeptime.tv_sec = 1;
-		sleeptime.tv_usec = 0;
+    for (int i = 0; i < count; i++) {
+	IOBufferSlice slice = slices[i];
+	while (slice.length) {
+	    //对端回应了还没发出的请求
+	    if (!conn->message) {
+		errno = EPROTO;
+		return -1;
 	    }
-	    else
-	    {
-		sleeptime.tv_sec = 0;
-		sleeptime.tv_usec = diffusec;
+	    if (!conn->timing.first_byte_us)
+		conn->timing.first_byte_us = LatencyNowUs();
+	    pipe->msg_bytes += slice.length;
+	    if ((ret = conn->message->AppendBuffers(&slice, 1)) < 0)
+		return -1;
+	    if (ret > 0)
+		break;
+	    size_t over = MIN(conn->message->Overread(), slice.length);
+	    slice.data += slice.length - over;
+	    slice.length = over;
+	    if (pipe->count == 1 || !conn->message->IsKeepAlive()) {
+		if (over || i + 1 < count)
+		    conn->stale = 1;
+		return 0;
 	    }
-	    select(1, NULL, NULL, NULL, &sleeptime);
+	    if (PipelineNext(conn) < 0)
+		return -1;
 	}
-	gettimeofday(&last_rx_stat_time_, NULL);
-	last_total_rx_bytes_ = total_rx_bytes_;
     }
+    return 1;
+}
 
-    do
-    {
-#if ENABLE_SSL
-	if (SCHEME_USE_SSL(conn->scheme))
-	    n = SSLRead(conn, buf, IOBUFSIZE);
-	else
-#endif
-	    n = read(conn->sockfd, buf, IOBUFSIZE);
-
-	if (n >= 0) {
-	    total_rx_bytes_ += n;
-	}
-	else if (errno == EAGAIN)
-	    return 1;
-	else
-	    return -1;
-
-	if ((ret = conn->message->Append(buf, n)) < 0) {
+/**
+ * 流水线上队头的回应收完且后面还有请求：交出结果, 下一个请求成为队头
+ */
+int Fetcher::PipelineNext(Connection *conn)
+{
+    ConnPipeline *pipe = conn->pipe;
+    IFetchMessage *message = conn->message;
+    conn->message = NULL;
+    conn->timing.last_byte_us = LatencyNowUs();
+    latency_.AddFetch(conn->timing);
+    fetch_events_->FinishFetch(conn, conn->user_data, message);
+
+    __pipe_pop(pipe);
+    __pipe_set_head(conn);
+    //没发出的请求等PipelineFlush
+    if (pipe->sent) {
+	conn->message = message_events_->CreateFetchResponse(conn->address, conn->user_data);
+	if (!conn->message)
 	    return -1;
-	}
-    } while (n && ret);
-
-    *alive = !!n;
+    }
     return 0;
 }
 
-/*
- * \return: 0 success
- *          -1 error
+/**
+ * 流水线上最后一个回应收完，或连接不能再用(回应要求关闭、对端关闭).
+ * 流水线连接由Fetcher自己关闭，还有请求时在新连接上重发
+ * \return -1 We have error
+ * \return 0 requests sent again
+ * \return 1 connection is idle now
  */
-int Fetcher::CompleteConnection(Connection *conn)
+int Fetcher::PipelineFinish(Connection *conn, int alive)
 {
-    socklen_t n = sizeof (int);
-    int error;
-
-    if (getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &n) >= 0)
-    {
-	if (error == 0)
-	{
-#if ENABLE_SSL
-	    if (SCHEME_USE_SSL(conn->scheme))
-	    {
-		if (SSLInitialize(conn) >= 0)
-		    return 0;
-	    }
-	    else
-#endif
-	    {
-		if (SendRequest(conn) >= 0)
-		{
-		    return 0;
-		}
-	    }
-	}
+    ConnPipeline *pipe = conn->pipe;
+    conn->message = NULL;
+    __pipe_pop(pipe);
+    if (!pipe->count) {
+	if (alive)
+	    nconns_--;
 	else
-	    errno = error;
+	    CloseConnection(conn);
+	return 1;
     }
 
-    return -1;
+    //FinishFetch里又来了请求，或连接关闭时还有没收到回应的请求
+    __pipe_set_head(conn);
+    if (!alive || pipe->sent)
+	return PipelineRestart(conn) < 0 ? -1 : 0;
+    conn->active = 1;
+    return SendRequest(conn) < 0 ? -1 : 0;
 }
 
-void Fetcher::SetConnState(Connection *conn, int state)
+/**
+ * 关掉连接，在新连接上重发所有还没收到回应的请求
+ */
+int Fetcher::PipelineRestart(Connection *conn)
 {
-    conn_count_[conn->state]--;
-    conn_count_[state]++;
-    conn->state = state;
+    ConnPipeline *pipe = conn->pipe;
+    if (conn->message) {
+	message_events_->FreeFetchMessage(conn->message);
+	conn->message = NULL;
+    }
+    ResetConnection(conn);
+    pipe->sent = 0;
+    pipe->sending = 0;
+    pipe->msg_bytes = 0;
+    pipe->retries++;
+    conn->timing.sent_us = 0;
+    conn->timing.first_byte_us = 0;
+    if (NewConnection(conn) < 0)
+	return -1;
+    conn->active = 1;
+    return 0;
 }
 
-
-void Fetcher::RemoveErrorConn(Connection *conn, int error)
+/**
+ * 流水线上有空位时发出排队的请求; 连接中、SSL握手中或
+ * 上一批还没写完时不发，等它们完成后再一起发
+ */
+int Fetcher::PipelineFlush(Connection *conn)
 {
+    ConnPipeline *pipe = conn->pipe;
+    if (pipe->sending || pipe->sent >= MIN(pipe->count, pipe->depth))
+	return 0;
+    if (conn->state != CS_READING
 #if ENABLE_SSL
-    if (SCHEME_USE_SSL(conn->scheme) && conn->state != CS_CONNECTING) {
-	SSL_free(conn->ssl);
-	conn->ssl = NULL;
-    }
+	    && conn->state != CS_READING_WANT_READ
 #endif
+       )
+	return 0;
+    if (SendRequest(conn) < 0) {
+	if (__pipe_retry(conn, errno))
+	    return PipelineRestart(conn);
+	return -1;
+    }
+    return 0;
+}
 
-    if (__should_close_message(conn)) {
-	message_events_->FreeFetchMessage(conn->message);
+/**
+ * 请求排到流水线连接上
+ * \return true 连接正忙，请求已排队
+ * \return false 连接空闲，请求成为队头，由调用者发起抓取
+ */
+bool Fetcher::PipelineQueue(Connection *conn, void *context)
+{
+    ConnPipeline *pipe = conn->pipe;
+    if (!pipe->count) {
+	pipe->head = 0;
+	pipe->retries = 0;
+	pipe->sent = 0;
+	pipe->sending = 0;
+	pipe->msg_bytes = 0;
 	conn->message = NULL;
+    } else if (pipe->count == PIPELINE_MAX_DEPTH) {
+	fetch_events_->FetchError(conn, context, EBUSY);
+	return true;
     }
-    close(conn->sockfd);
-    SetConnState(conn, CS_CLOSED);
-    SetConnError(conn, error);
+    PIPE_REQ(pipe, pipe->count).context = context;
+    PIPE_REQ(pipe, pipe->count).start_us = LatencyNowUs();
+    PIPE_REQ(pipe, pipe->count).sent_us = 0;
+    return pipe->count++ > 0;
 }
 
-int Fetcher::GetTrafficBytes(uint64_t *rx_bytes, uint64_t *tx_bytes) {
-    *rx_bytes = total_rx_bytes_;
-    *tx_bytes = total_tx_bytes_;
-     return 0;
+/**
+ * 连接出错，流水线上所有请求都以error结束.
+ * 先清空队列，回调里可以在这个连接上发起新的请求
+ */
+void Fetcher::PipelineFail(Connection *conn, int error)
+{
+    ConnPipeline *pipe = conn->pipe;
+    if (conn->message) {
+	message_events_->FreeFetchMessage(conn->message);
+	conn->message = NULL;
+    }
+    ConnPipeline failed = *pipe;
+    pipe->count = 0;
+    pipe->sent = 0;
+    pipe->sending = 0;
+    for (unsigned i = 0; i < failed.count; i++) {
+	if (i) {
+	    memset(&conn->timing, 0, sizeof(conn->timing));
+	    conn->timing.start_us = PIPE_REQ(&failed, i).start_us;
+	    conn->timing.last_byte_us = LatencyNowUs();
+	}
+	conn->user_data = PIPE_REQ(&failed, i).context;
+	fetch_events_->FetchError(conn, conn->user_data, error);
+    }
+}
+
+/**
+ * Read data from conn
+ * \return -1 We have error
+ * \return 0 read finished, 
+ * \return 1 EAGAIN, 
+ */
+int Fetcher::ReadFromConn(Connection *conn, int *alive)
+{
+    int n, ret;
+
+    do
+    {
+	IOBufferSlice slices[2];
+	int count = 0;
+	IOBuffer *full = NULL;
+
+	// 当前缓冲区写满则换一块
+	if (conn->rbuf && conn->rbuf->length == conn->rbuf->capacity)
+	    __release_rbuf(conn);
+	if (!conn->rbuf && !(conn->rbuf = AcquireRecvBuffer())) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	IOBuffer *rbuf = conn->rbuf;
+	size_t room = rbuf->capacity - rbuf->length;
+	// 限速：令牌不够时停止读，等定时器唤醒
+	size_t allow = RxAllowance(conn, room + IOBUFSIZE);
+	if (allow == 0) {
+	    __drop_unused_rbuf(conn);
+	    ParkConn(conn);
+	    return 1;
+	}
+#if ENABLE_SSL
+	if (SCHEME_USE_SSL(conn->scheme))
+	{
+	    // SSL_read不支持readv，剩余空间太小时直接换新缓冲区
+	    if (room < SSL_READ_MIN_ROOM) {
+		__release_rbuf(conn);
+		if (!(conn->rbuf = rbuf = AcquireRecvBuffer())) {
+		    errno = ENOMEM;
+		    return -1;
+		}
+		room = rbuf->capacity;
+	    }
+	    n = SSLRead(conn, rbuf->data + rbuf->length, MIN(room, allow));
+	}
+	else
+#endif
+	{
+	    // 读到当前缓冲区的剩余空间，不够时溢出到备用缓冲区
+	    if (!spare_rbuf_ && !(spare_rbuf_ = AcquireRecvBuffer())) {
+		errno = ENOMEM;
+		return -1;
+	    }
+	    struct iovec iov[2];
+	    iov[0].iov_base = rbuf->data + rbuf->length;
+	    iov[0].iov_len = MIN(room, allow);
+	    iov[1].iov_base = spare_rbuf_->data;
+	    iov[1].iov_len = MIN(spare_rbuf_->capacity, allow - iov[0].iov_len);
+	    syscalls_.read++;
+	    n = readv(conn->sockfd, iov, 2);
+	}
+
+	if (n > 0) {
+	    if (!conn->timing.first_byte_us)
+		conn->timing.first_byte_us = LatencyNowUs();
+	    total_rx_bytes_ += n;
+	    RxConsume(conn, n);
+	    ArmTimer(conn, GetConnTimeOut(params_, params_->idle_timeout_ms));
+	}
+	else if (n < 0 && errno == EAGAIN) {
+	    __drop_unused_rbuf(conn);
+	    return 1;
+	}
+	else if (n < 0 && __pipe_retry(conn, errno))
+	    return PipelineRestart(conn) < 0 ? -1 : 1;
+	else if (n < 0)
+	    return -1;
+
+	if (n > 0) {
+	    size_t head = MIN((size_t)n, room);
+	    slices[count].buffer = rbuf;
+	    slices[count].data = rbuf->data + rbuf->length;
+	    slices[count].length = head;
+	    rbuf->length += head;
+	    ++count;
+	    if ((size_t)n > head) {
+		// 备用缓冲区被用到，成为该连接的当前缓冲区
+		IOBuffer *spare = spare_rbuf_;
+		spare_rbuf_ = NULL;
+		spare->length = n - head;
+		slices[count].buffer = spare;
+		slices[count].data = spare->data;
+		slices[count].length = spare->length;
+		++count;
+		//写满的缓冲区还在slices[0]里, AppendData之后再放
+		full = conn->rbuf;
+		conn->rbuf = spare;
+	    }
+	}
+
+	ret = AppendData(conn, slices, count);
+	IOBufferRelease(full);
+	if (ret < 0) {
+	    return -1;
+	}
+	//流水线连接已在新socket上重发
+	if (ret > 1)
+	    return 1;
+    } while (n && ret);
+
+    *alive = !!n;
+    return 0;
+}
+
+IOBuffer* Fetcher::AcquireRecvBuffer()
+{
+    return rbuf_pool_->Acquire();
+}
+
+void Fetcher::GetBufferStats(uint64_t *allocated, uint64_t *leased, size_t *outstanding)
+{
+    rbuf_pool_->GetStats(allocated, leased, outstanding);
+}
+
+void Fetcher::GetLatencyStats(LatencyStats *stats)
+{
+    *stats = latency_;
+}
+
+void Fetcher::GetConnectionTiming(Connection *conn, FetchTiming *timing)
+{
+    *timing = conn->timing;
+}
+
+void Fetcher::GetSyscallStats(SyscallStats *stats)
+{
+    *stats = syscalls_;
+#if ENABLE_IO_URING
+    if (uring_)
+	stats->io_uring_enter = uring_->EnterCount();
+#endif
+}
+
+/*
+ * \return: 0 success
+ *          -1 error
+ */
+int Fetcher::CompleteConnection(Connection *conn)
+{
+    socklen_t n = sizeof (int);
+    int error;
+
+    if (getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &n) >= 0)
+    {
+	if (error == 0)
+	{
+	    conn->timing.connect_us = LatencyNowUs();
+	    RaceFinish(conn);
+#if ENABLE_SSL
+	    if (SCHEME_USE_SSL(conn->scheme))
+	    {
+		if (SSLInitialize(conn) >= 0)
+		    return 0;
+	    }
+	    else
+#endif
+	    {
+		if (SendRequest(conn) >= 0)
+		{
+		    return 0;
+		}
+	    }
+	}
+	else if (RaceFailover(conn, error))
+	    return 0;
+	else
+	    errno = error;
+    }
+
+    return -1;
+}
+
+void Fetcher::SetConnState(Connection *conn, int state)
+{
+    conn_count_[conn->state]--;
+    conn_count_[state]++;
+    conn->state = state;
+}
+
+
+void Fetcher::RemoveErrorConn(Connection *conn, int error)
+{
+#if ENABLE_SSL
+    if (SCHEME_USE_SSL(conn->scheme) && conn->state != CS_CONNECTING) {
+	SSL_free(conn->ssl);
+	conn->ssl = NULL;
+    }
+#endif
+
+    if (__should_close_message(conn)) {
+	message_events_->FreeFetchMessage(conn->message);
+	conn->message = NULL;
+    }
+    __release_rbuf(conn);
+    conn->parked = 0;
+    ReleaseSends(conn);
+    __close_socket(conn, uring_ != NULL);
+    SetConnState(conn, CS_CLOSED);
+    SetConnError(conn, error);
+}
+
+int Fetcher::GetTrafficBytes(uint64_t *rx_bytes, uint64_t *tx_bytes) {
+    *rx_bytes = total_rx_bytes_;
+    *tx_bytes = total_tx_bytes_;
+     return 0;
 }
 
 Connection* Fetcher::CreateConnection(
@@ -825,7 +2145,13 @@ Connection* Fetcher::CreateConnection(
 	return NULL;
     }
 
-    Connection *conn = (Connection*)malloc(sizeof(Connection));
+    if (address.remote_addrlen > sizeof(struct sockaddr_storage)
+	    || address.local_addrlen > sizeof(struct sockaddr_storage)) {
+	assert(false);
+	return NULL;
+    }
+
+    Connection *conn = __conn_alloc();
     if (conn) {
 	INIT_LIST_HEAD(&conn->list);
 	conn->state = CS_CLOSED; 
@@ -837,42 +2163,158 @@ Connection* Fetcher::CreateConnection(
 	conn->socket_type = socket_type;
 	conn->protocol = protocol;
 	
-	assert(address.remote_addrlen == sizeof(struct sockaddr));
-	conn->address.remote_addr = (struct sockaddr *)malloc(sizeof(struct sockaddr));
-	memcpy(conn->address.remote_addr, address.remote_addr, sizeof(struct sockaddr));
+	conn->address.remote_addr = (struct sockaddr *)&conn->remote_storage;
+	memcpy(conn->address.remote_addr, address.remote_addr, address.remote_addrlen);
 	conn->address.remote_addrlen = address.remote_addrlen;
+	conn->local_port_range = 0;
 	conn->address.local_addrlen = address.local_addrlen;
 	if (conn->address.local_addrlen > 0) {
-	    conn->address.local_addr = (struct sockaddr *)malloc(sizeof(struct sockaddr));
-	    memcpy(conn->address.local_addr, address.local_addr, sizeof(struct sockaddr));
+	    conn->address.local_addr = (struct sockaddr *)&conn->local_storage;
+	    memcpy(conn->address.local_addr, address.local_addr, address.local_addrlen);
 	} else {
 	    conn->address.local_addr = NULL;
 	}
 	conn->ssl = NULL;
 	conn->user_data = NULL;
+	conn->rbuf = NULL;
+	conn->serv_bucket = NULL;
+	conn->conn_bucket = NULL;
+	conn->parked = 0;
+	conn->ep_events = 0;
+	conn->active = 0;
+	conn->stale = 0;
+	conn->close_pending = 0;
+	conn->sock_gen = 0;
+	conn->uring_ops = 0;
+	conn->recv_armed = 0;
+	conn->owner = NULL;
+	conn->server_name = NULL;
+	conn->race = NULL;
+	conn->pipe = NULL;
+	conn->send = NULL;
+	conn->zc_sends = NULL;
+	conn->zerocopy = 0;
+	conn->zc_seq = 0;
+	memset(&conn->timing, 0, sizeof(conn->timing));
+	TimerNodeInit(&conn->timer);
     }
     return conn;
 }
     
+static void __free_connection(Connection *conn)
+{
+    __release_rbuf(conn);
+    delete conn->conn_bucket;
+    free(conn->server_name);
+    delete conn->race;
+    conn->race = NULL;
+    delete conn->pipe;
+    conn->pipe = NULL;
+    __conn_release(conn);
+}
+
 void Fetcher::FreeConnection (Connection *conn) {
     if (conn) {
-	assert(conn->state == CS_CLOSED);
 	assert(list_empty(&conn->list));
 	conn->user_data = NULL;
-	free(conn->address.remote_addr);
-	if (conn->address.local_addr) {
-	    free(conn->address.local_addr);
+	//空闲的长连接由loop线程关闭, 这里读它的状态会和loop处理空闲事件竞争
+	if (conn->owner)
+	    conn->owner->DeferFree(conn);
+	else {
+	    assert(conn->state == CS_CLOSED);
+	    __free_connection(conn);
 	}
-	free(conn);
     }
 }
 
-int ThreadingFetcher::GetSockAddr(Connection* conn, struct sockaddr* addr)
+void Fetcher::GetConnectionStats(uint64_t *allocated, uint64_t *created, size_t *in_use)
+{
+    pthread_mutex_lock(&__conn_slab_lock);
+    if (allocated)
+	*allocated = __conn_allocated;
+    if (created)
+	*created = __conn_created;
+    if (in_use)
+	*in_use = __conn_in_use;
+    pthread_mutex_unlock(&__conn_slab_lock);
+}
+
+/**
+ * loop线程可能正拿着epoll_wait返回的该连接的事件，
+ * 由它在下一轮Poll开始时关闭并释放
+ */
+void Fetcher::DeferFree(Connection *conn)
+{
+    pthread_mutex_lock(&free_mutex_);
+    list_add_tail(&conn->list, &free_list_);
+    pthread_mutex_unlock(&free_mutex_);
+    Wakeup();
+}
+
+/**
+ * 同DeferFree, 连接还要复用: 下一轮Poll开始时关闭.
+ * 之后的PutRequest先于它被loop取到时, 在AddConn里关闭
+ */
+void Fetcher::DeferClose(Connection *conn, int how)
+{
+    pthread_mutex_lock(&free_mutex_);
+    if (!conn->close_pending)
+	close_list_.push_back(conn);
+    if (conn->close_pending != CLOSE_ALWAYS)
+	conn->close_pending = how;
+    pthread_mutex_unlock(&free_mutex_);
+    Wakeup();
+}
+
+void Fetcher::ReapConnections()
+{
+    struct list_head reap;
+    INIT_LIST_HEAD(&reap);
+    std::vector<Connection *> closes;
+    //两个队列一起取: 释放之前提交的关闭一定在这一批或更早
+    pthread_mutex_lock(&free_mutex_);
+    list_splice_init(&free_list_, &reap);
+    closes.swap(close_list_);
+    for (size_t i = 0; i < closes.size(); i++) {
+	//已在AddConn里关过的为0
+	if (!__take_close_pending(closes[i]))
+	    closes[i] = NULL;
+    }
+    pthread_mutex_unlock(&free_mutex_);
+
+    for (size_t i = 0; i < closes.size(); i++) {
+	if (closes[i])
+	    ResetConnection(closes[i]);
+    }
+
+    struct list_head busy;
+    INIT_LIST_HEAD(&busy);
+    while (!list_empty(&reap)) {
+	Connection *conn = list_entry(reap.next, Connection, list);
+	list_del(&conn->list);
+	INIT_LIST_HEAD(&conn->list);
+	ResetConnection(conn);
+	assert(!TimerNodePending(&conn->timer));
+	//还有io_uring op未完成，等下一轮
+	if (uring_ && conn->uring_ops)
+	    list_add_tail(&conn->list, &busy);
+	else
+	    __free_connection(conn);
+    }
+
+    if (!list_empty(&busy)) {
+	pthread_mutex_lock(&free_mutex_);
+	list_splice(&busy, &free_list_);
+	pthread_mutex_unlock(&free_mutex_);
+    }
+}
+
+int ThreadingFetcher::GetSockAddr(Connection* conn, struct sockaddr_storage* addr)
 {
     if (!conn) {
 	return -1;
     }
-    *addr = *conn->address.remote_addr;
+    memcpy(addr, conn->address.remote_addr, MIN(conn->address.remote_addrlen, sizeof(*addr)));
     return 0;
 }
 
@@ -886,17 +2328,32 @@ void ThreadingFetcher::ConnectionToString(Connection * conn, char* str, size_t s
 
 void Fetcher::CloseConnection (Connection *conn) {
     assert(list_empty(&conn->list));
+    //流水线上还有请求时由Fetcher自己重连
+    assert(!conn->pipe || !conn->pipe->count);
+    ResetConnection(conn);
+}
+
+/**
+ * 关掉socket, 连接可以在任何链表上
+ */
+void Fetcher::ResetConnection (Connection *conn) {
     if (conn->state != CS_CLOSED) {
 #if ENABLE_SSL
 	if (SCHEME_USE_SSL(conn->scheme)) {
 	    if (conn->ssl) {
+		//正常关闭, 不发close_notify; 否则SSL_free会把session标记为不可复用
+		if (conn->state == CS_FINISH)
+		    SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
 		SSL_free(conn->ssl);
 		conn->ssl = NULL;
 	    }
 	}
 #endif
-	close(conn->sockfd);
-	conn->sockfd = -1;
+	__release_rbuf(conn);
+	timer_wheel_.del(conn->timer);
+	conn->parked = 0;
+	ReleaseSends(conn);
+	__close_socket(conn, uring_ != NULL);
 	SetConnState(conn, CS_CLOSED);
     }
 }
@@ -904,12 +2361,115 @@ void Fetcher::CloseConnection (Connection *conn) {
 void Fetcher::StartRequest (Connection *conn, void *context) 
 {
     assert(!req_generator_);
+    //流水线连接正忙: 排队, Poll之外可以马上发出
+    if (conn->pipe && PipelineQueue(conn, context)) {
+	if (!in_poll_ && conn->active && (PipelineFlush(conn) < 0
+		    || UpdateEvents(conn, __get_state_events(conn->state)) < 0))
+	    RemoveErrorConn(conn, errno);
+	return;
+    }
     assert(conn->state == CS_CLOSED || conn->state == CS_FINISH);
     assert(list_empty(&conn->list));
     conn->user_data = context;
     list_add_tail(&conn->list, &new_conn_list_);
 }
 
+void Fetcher::SetConnectionServerName(Connection *conn, const char *server_name)
+{
+    if (conn->server_name && server_name && !strcmp(conn->server_name, server_name))
+	return;
+    //SNI变化的https长连接不能复用, 由loop线程关闭
+    if (conn->owner)
+	conn->owner->DeferClose(conn, CLOSE_SSL);
+    free(conn->server_name);
+    conn->server_name = server_name && *server_name ? strdup(server_name) : NULL;
+}
+
+void Fetcher::SetConnectionPipeline(Connection *conn, unsigned depth)
+{
+    assert(list_empty(&conn->list));
+    assert(!conn->pipe || !conn->pipe->count);
+    if (depth <= 1) {
+	delete conn->pipe;
+	conn->pipe = NULL;
+	return;
+    }
+    if (!conn->pipe)
+	conn->pipe = new ConnPipeline();
+    conn->pipe->depth = MIN(depth, PIPELINE_MAX_DEPTH);
+}
+
+void Fetcher::SetConnectionLocalAddr(Connection *conn, const struct sockaddr *addr,
+	socklen_t addrlen, uint16_t port_min, uint16_t port_max)
+{
+    assert(list_empty(&conn->list));
+    if (!addr || !addrlen || addrlen > sizeof(struct sockaddr_storage)) {
+	conn->address.local_addr = NULL;
+	conn->address.local_addrlen = 0;
+	conn->local_port_range = 0;
+	return;
+    }
+    conn->address.local_addr = (struct sockaddr *)&conn->local_storage;
+    memcpy(conn->address.local_addr, addr, addrlen);
+    conn->address.local_addrlen = addrlen;
+    conn->local_port_range = port_min && port_max >= port_min
+	? ((uint32_t)port_max << 16 | port_min) : 0;
+}
+
+void Fetcher::SetConnectionAddrList(Connection *conn, const struct addrinfo *ai)
+{
+    assert(list_empty(&conn->list));
+    if (!conn->race) {
+	conn->race = new ConnectRace();
+	memcpy(&conn->race->addrs[0], conn->address.remote_addr, conn->address.remote_addrlen);
+	conn->race->addrlens[0] = conn->address.remote_addrlen;
+    }
+    ConnectRace *race = conn->race;
+    race->count = 1;
+    race->cur = 0;
+    for (; ai && race->count < RACE_MAX_ADDRS; ai = ai->ai_next) {
+	if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+		|| ai->ai_addrlen > sizeof(struct sockaddr_storage))
+	    continue;
+	int i = 0;
+	while (i < race->count && (race->addrlens[i] != ai->ai_addrlen
+		    || memcmp(&race->addrs[i], ai->ai_addr, ai->ai_addrlen)))
+	    i++;
+	if (i < race->count)
+	    continue;
+	memcpy(&race->addrs[i], ai->ai_addr, ai->ai_addrlen);
+	race->addrlens[i] = ai->ai_addrlen;
+	race->count++;
+	//空闲长连接连着的地址
+	if (race->addrlens[i] == conn->address.remote_addrlen
+		&& !memcmp(&race->addrs[i], conn->address.remote_addr, race->addrlens[i]))
+	    race->cur = i;
+    }
+    if (race->count < 2) {
+	delete race;
+	conn->race = NULL;
+    }
+}
+
+void Fetcher::SetRxBucket(TokenBucket *bucket)
+{
+    rx_bucket_ = bucket ? bucket : &own_rx_bucket_;
+}
+
+void Fetcher::SetConnectionRxLimit(Connection *conn, TokenBucket *serv_bucket, unsigned int conn_rx_speed_max)
+{
+    assert(list_empty(&conn->list));
+    conn->serv_bucket = serv_bucket;
+    if (conn_rx_speed_max) {
+	if (!conn->conn_bucket)
+	    conn->conn_bucket = new TokenBucket();
+	conn->conn_bucket->SetRate(conn_rx_speed_max);
+    } else if (conn->conn_bucket) {
+	delete conn->conn_bucket;
+	conn->conn_bucket = NULL;
+    }
+}
+
 void Fetcher::SetRequestGenerator(RequestGenerator req_generator)
 {
     req_generator_ = req_generator; 
@@ -919,9 +2479,15 @@ void Fetcher::SetConnError(Connection *conn, int error)
 {
     list_del(&conn->list);
     INIT_LIST_HEAD(&conn->list);
+    timer_wheel_.del(conn->timer);
     conn->error = error;
+    conn->active = 0;
+    conn->timing.last_byte_us = LatencyNowUs();
     nconns_--;
-    fetch_events_->FetchError(conn, conn->user_data, error);
+    if (conn->pipe)
+	PipelineFail(conn, error);
+    else
+	fetch_events_->FetchError(conn, conn->user_data, error);
 }
 
 /*
@@ -930,7 +2496,6 @@ void Fetcher::SetConnError(Connection *conn, int error)
  */
 int Fetcher::CheckEvent(struct epoll_event *event, struct list_head *conn_list) {
     Connection *conn = (Connection *)event->data.ptr;
-    int old_state = conn->state;
     int ret = 0;
     
     switch (conn->state)
@@ -945,9 +2510,11 @@ int Fetcher::CheckEvent(struct epoll_event *event, struct list_head *conn_list)
 	    ret = SSLConnect(conn);
 	    break;
 	case CS_WRITING_WANT_READ:
+#endif
 	case CS_WRITING_WANT_WRITE:
 	    ret = SendRequest(conn);
 	    break;
+#if ENABLE_SSL
 	case CS_READING_WANT_READ:
 	case CS_READING_WANT_WRITE:
 #endif
@@ -963,14 +2530,7 @@ int Fetcher::CheckEvent(struct epoll_event *event, struct list_head *conn_list)
     
     if (ret >= 0)
     {
-	int new_events = __get_state_events(conn->state);
-	int old_events = __get_state_events(old_state);
-
-	if (new_events != old_events)
-	{
-	    event->events = new_events;
-	    ret = epoll_ctl(epfd_, EPOLL_CTL_MOD, conn->sockfd, event);
-	}
+	ret = UpdateEvents(conn, __get_state_events(conn->state));
 
 	if (ret >= 0)
 	{
@@ -984,104 +2544,1001 @@ int Fetcher::CheckEvent(struct epoll_event *event, struct list_head *conn_list)
 }
 
 void Fetcher::Poll (const Params* params, const struct timeval *timeout) {
+    in_poll_ = true;
+    PollEvents(params, timeout);
+    in_poll_ = false;
+}
+
+void Fetcher::PollEvents (const Params* params, const struct timeval *timeout) {
     params_ = params;
+    ReapConnections();
     //connnection list that we made a connection to.
-    rx_speed_max_ = params_->rx_speed_max;
+    rx_bucket_->SetRate(params_->rx_speed_max);
     int newconns = 0;
     AddConnList(&newconns);
     nconns_ += newconns;
 
-    UpdateTime(time(NULL));
+    UpdateTime();
     unsigned int epoll_timeout = GetEpollTimeOut(timeout);
+    //不要睡过最近的超时
+    uint64_t next_expire = timer_wheel_.empty() ? (uint64_t)-1 : timer_wheel_.next_expire();
+    if (next_expire <= now_ms_)
+	epoll_timeout = 0;
+    else if (next_expire - now_ms_ < epoll_timeout)
+	epoll_timeout = next_expire - now_ms_;
+#if ENABLE_IO_URING
+    if (uring_) {
+	if (uring_->SubmitAndWait(epoll_timeout) < 0)
+	    return;
+	UpdateTime();
+	UringComplete();
+	CheckTimeout();
+	return;
+    }
+#endif
     int n = 0;
-    if ((n = __alloc_events_space(&epoll_events_, max_events_, nconns_)) >= 0) {
+    if ((n = __alloc_events_space(&epoll_events_, max_events_, nconns_ + 1)) >= 0) {
 	max_events_ = n;
-	n = epoll_wait(epfd_, epoll_events_, nconns_ + 1, epoll_timeout);
+	syscalls_.epoll_wait++;
+	n = epoll_wait(epfd_, epoll_events_, nconns_ + 2, epoll_timeout);
     }
 
-    UpdateTime(time(NULL));
+    UpdateTime();
 
     if (n >= 0) {
 	for (int i = 0; i < n; i++) {
-	    Connection* conn = (Connection *)(epoll_events_ + i)->data.ptr;
-	    list_del(&conn->list);
-	    INIT_LIST_HEAD(&conn->list);
-	    if (CheckEvent(epoll_events_ + i, &conn_list_) == 0) {
-		list_add_tail(&conn->list, &conn_list_);
+	    if (epoll_events_[i].data.ptr == &wake_fd_) {
+		__sync_lock_release(&wake_pending_);
+		if (read(wake_fd_, &wake_buf_, sizeof(wake_buf_)) > 0)
+		    syscalls_.read++;
+		continue;
 	    }
-	}
-
-	Connection *conn = NULL;
-	struct list_head *pos, *tmp;
-	list_for_each_safe(pos, tmp, &conn_list_) {
-	    conn = list_entry(pos, Connection, list);
-	    if (cur_time_ >= conn->resp_time + GetConnTimeOut(&params_->conn_timeout)) {
-		RemoveErrorConn(conn, ETIMEDOUT);
-	    } else {
-		break;
+	    if (epoll_events_[i].data.u64 & 1) {
+		uint64_t data = epoll_events_[i].data.u64;
+		RaceEvent(__race_conn(data), data >> 48, epoll_events_[i].events);
+		continue;
 	    }
+	    ProcessEvent(epoll_events_ + i);
 	}
+
+	CheckTimeout();
     } else if (errno != EINTR) {
 	return;
     }
 }
 
-ThreadingFetcher::ThreadingFetcher(IMessageEvents *message_events):
-	request_queue_max_(DEFAULT_QUEUE_MAX),
-	result_queue_max_(DEFAULT_QUEUE_MAX),
-	stop_(true), param_changed_(false)
+#if ENABLE_IO_URING
+/**
+ * io_uring backend
+ *
+ * 明文连接全部走完成事件: CONNECT与WRITEV链接提交，之后在连接上挂一个
+ * multishot RECV, 内核从provided buffer ring里挑缓冲区，空闲连接不占内存。
+ * 限速的连接用单次RECV, len取令牌数。
+ * https连接仍用原来的SSL状态机，只是用POLL_ADD代替epoll。
+ * 所有SQE在Poll里随等待一起提交，一轮只有一次io_uring_enter。
+ */
+enum
 {
-    fetcher_.reset(new Fetcher(message_events, this));
-    pthread_mutex_init(&param_mutex_, NULL);
-    pthread_mutex_init(&request_queue_mutex_, NULL);
-    pthread_mutex_init(&result_queue_mutex_, NULL);
-    pthread_cond_init(&result_queue_not_empty_cond_, NULL);
-    pthread_cond_init(&result_queue_not_full_cond_, NULL);
-}
+    UOP_CONNECT = 1,
+    UOP_SEND,
+    UOP_RECV,
+    UOP_POLL,
+    UOP_WAKEUP,
+    UOP_RACE,
+    UOP_MASK = 7
+};
 
-ThreadingFetcher::~ThreadingFetcher() {
-    pthread_mutex_destroy(&param_mutex_);
-    pthread_mutex_destroy(&request_queue_mutex_);
-    pthread_mutex_destroy(&result_queue_mutex_);
-    pthread_cond_destroy(&result_queue_not_empty_cond_);
-    pthread_cond_destroy(&result_queue_not_full_cond_);
-}
+struct UringSendOp
+{
+    Connection *conn;
+    ConnSend *send;
+    struct msghdr msg;
+};
 
-int ThreadingFetcher::Begin(const Fetcher::Params &params) {
-    UpdateParams(params);
-    int ret;
-    if (stop_) {
-	stop_ = false;
-	ret = pthread_create(&tid_, NULL, RunThread, this);
-	if (ret == 0) {
-	    return 0;
-	} else {
-	    stop_ = true;
-	    errno = ret;
-	    return -1;
-	}
-    } else {
-	return 1;
-    }
+static inline uint64_t __uring_data(void *ptr, unsigned short gen, int op)
+{
+    return (uint64_t)(uintptr_t)ptr | ((uint64_t)gen << 48) | op;
 }
 
-void ThreadingFetcher::SetMaxQueueSize(size_t request_size, size_t result_size)
+static inline void *__uring_ptr(uint64_t data)
 {
-    request_queue_max_ = request_size;
-    result_queue_max_  = result_size; 
+    return (void *)(uintptr_t)(data & 0x0000fffffffffff8ULL);
 }
 
-void ThreadingFetcher::SetResultCallback(ResultCallback result_cb)
+int Fetcher::UringInit()
+{
+    uring_ = new IoUring();
+    if (uring_->Init(URING_ENTRIES) < 0
+	    || uring_->SetupBufRing(URING_BGID, URING_BUF_COUNT) < 0) {
+	delete uring_;
+	uring_ = NULL;
+	return -1;
+    }
+
+    uring_buf_pool_ = new IOBufferPool(URING_BUF_SIZE);
+    uring_bufs_.resize(URING_BUF_COUNT);
+    for (unsigned short bid = 0; bid < URING_BUF_COUNT; bid++) {
+	IOBuffer *buf = uring_buf_pool_->Acquire();
+	if (!buf) {
+	    UringExit();
+	    return -1;
+	}
+	uring_bufs_[bid] = buf;
+	uring_->AddBuf(buf->data, buf->capacity, bid);
+    }
+    uring_->CommitBufs();
+    if (UringArmWakeup() < 0) {
+	UringExit();
+	return -1;
+    }
+    return 0;
+}
+
+void Fetcher::UringExit()
+{
+    //关闭ring时内核取消所有未完成的op
+    delete uring_;
+    uring_ = NULL;
+    for (size_t i = 0; i < uring_bufs_.size(); i++)
+	IOBufferRelease(uring_bufs_[i]);
+    uring_bufs_.clear();
+    if (uring_buf_pool_) {
+	uring_buf_pool_->Close();
+	uring_buf_pool_ = NULL;
+    }
+}
+
+/**
+ * 把buffer放回ring; 消息还引用着的话换一块新的
+ */
+void Fetcher::UringRecycleBuf(unsigned short bid)
+{
+    IOBuffer *buf = uring_bufs_[bid];
+    if (buf->ref > 1) {
+	IOBufferRelease(buf);
+	if (!(buf = uring_buf_pool_->Acquire())) {
+	    //这个bid暂时不可用
+	    uring_bufs_[bid] = NULL;
+	    return;
+	}
+	uring_bufs_[bid] = buf;
+    }
+    buf->length = 0;
+    uring_->AddBuf(buf->data, buf->capacity, bid);
+}
+
+/**
+ * 发send剩下的部分, 短写时完成后接着发
+ */
+int Fetcher::UringQueueSend(Connection *conn, ConnSend *send, unsigned char flags)
+{
+    struct io_uring_sqe *sqe = uring_->GetSqe();
+    if (!sqe) {
+	FreeSend(send);
+	errno = EBUSY;
+	return -1;
+    }
+    UringSendOp *op = new UringSendOp;
+    op->conn = conn;
+    op->send = send;
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = &send->iov[send->pos];
+    op->msg.msg_iovlen = MIN(send->iov.size() - send->pos, IOV_MAX);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->flags = flags;
+    sqe->fd = conn->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = __uring_data(op, conn->sock_gen, UOP_SEND);
+    conn->uring_ops++;
+    return 0;
+}
+
+/**
+ * 长连接上发请求，完成后才进入读状态
+ */
+int Fetcher::UringSend(Connection *conn)
+{
+    struct RequestData *request = CreateRequest(conn);
+    if (!request)
+	return -1;
+    ArmTimer(conn, GetConnTimeOut(params_, params_->ttfb_timeout_ms));
+    return UringQueueSend(conn, __send_new(request, conn->pipe != NULL), 0);
+}
+
+int Fetcher::UringConnect(Connection *conn)
+{
+    struct RequestData *request = CreateRequest(conn);
+    if (!request)
+	return -1;
+    //connect和send要在同一次submit里链上
+    if (!uring_->Reserve(2)) {
+	FreeRequest(request, conn->pipe != NULL);
+	errno = EBUSY;
+	return -1;
+    }
+    if (OpenSocket(conn) < 0) {
+	FreeRequest(request, conn->pipe != NULL);
+	return -1;
+    }
+
+    ArmTimer(conn, GetConnTimeOut(params_, params_->connect_timeout_ms));
+    SetConnState(conn, CS_CONNECTING);
+    struct io_uring_sqe *sqe = uring_->GetSqe();
+    if (!sqe) {
+	FreeRequest(request, conn->pipe != NULL);
+	errno = EBUSY;
+	return -1;
+    }
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = conn->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->address.remote_addr;
+    sqe->off = conn->address.remote_addrlen;
+    sqe->user_data = __uring_data(conn, conn->sock_gen, UOP_CONNECT);
+    if (UringQueueSend(conn, __send_new(request, conn->pipe != NULL), 0) < 0) {
+	//还没提交, 改成不关心结果的NOP
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 0;
+	return -1;
+    }
+    //两个SQE都拿到了才链上
+    sqe->flags = IOSQE_IO_LINK;
+    conn->uring_ops++;
+    return 0;
+}
+
+int Fetcher::UringArmRecv(Connection *conn)
+{
+    if (conn->recv_armed)
+	return 0;
+
+    unsigned int len = 0;
+    bool multishot = uring_multishot_;
+    bool throttled = rx_bucket_->Rate()
+	|| (conn->serv_bucket && conn->serv_bucket->Rate())
+	|| (conn->conn_bucket && conn->conn_bucket->Rate())
+	|| (conn->message && conn->message->RxWindow() != (size_t)-1);
+    if (throttled) {
+	len = RxAllowance(conn, URING_BUF_SIZE);
+	if (len == 0) {
+	    ParkConn(conn);
+	    return 0;
+	}
+	multishot = false;
+    }
+
+    struct io_uring_sqe *sqe = uring_->GetSqe();
+    if (!sqe) {
+	errno = EBUSY;
+	return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->fd = conn->sockfd;
+    sqe->len = len;
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = __uring_data(conn, conn->sock_gen, UOP_RECV);
+    conn->recv_armed = 1;
+    conn->uring_ops++;
+    return 0;
+}
+
+/**
+ * 在eventfd上挂一个READ, 完成即有Wakeup
+ */
+int Fetcher::UringArmWakeup()
+{
+    struct io_uring_sqe *sqe = uring_->GetSqe();
+    if (!sqe) {
+	errno = EBUSY;
+	return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd_;
+    sqe->addr = (uint64_t)(uintptr_t)&wake_buf_;
+    sqe->len = sizeof(wake_buf_);
+    sqe->user_data = __uring_data(NULL, 0, UOP_WAKEUP);
+    return 0;
+}
+
+/**
+ * https连接: 单次POLL_ADD代替epoll, 电平检查不会丢事件，完成后由CheckEvent重新挂上
+ */
+int Fetcher::UringPoll(Connection *conn, unsigned int events)
+{
+    events &= ~EPOLLET;
+    if (conn->ep_events == events)
+	return 0;
+
+    struct io_uring_sqe *sqe = uring_->GetSqe();
+    if (!sqe) {
+	errno = EBUSY;
+	return -1;
+    }
+    uint64_t data = __uring_data(conn, conn->sock_gen, UOP_POLL);
+    if (conn->ep_events) {
+	//已挂着poll: 修改关注的事件或撤掉
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = data;
+	if (events) {
+	    sqe->len = IORING_POLL_UPDATE_EVENTS;
+	    sqe->poll32_events = events;
+	}
+    } else {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = conn->sockfd;
+	sqe->poll32_events = events;
+	sqe->user_data = data;
+	conn->uring_ops++;
+    }
+    conn->ep_events = events;
+    return 0;
+}
+
+void Fetcher::UringComplete()
+{
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_->PeekCqe())) {
+	uint64_t data = cqe->user_data;
+	int res = cqe->res;
+	unsigned int flags = cqe->flags;
+	uring_->AdvanceCqe();
+	//POLL_REMOVE, NOP等不关心结果
+	if (!data)
+	    continue;
+
+	int op = data & UOP_MASK;
+	unsigned short gen = data >> 48;
+	Connection *conn;
+	if (op == UOP_WAKEUP) {
+	    __sync_lock_release(&wake_pending_);
+	    if (UringArmWakeup() < 0)
+		__sync_lock_test_and_set(&wake_pending_, 1);
+	    continue;
+	}
+	ConnSend *send = NULL;
+	if (op == UOP_SEND) {
+	    UringSendOp *send_op = (UringSendOp *)__uring_ptr(data);
+	    conn = send_op->conn;
+	    send = send_op->send;
+	    delete send_op;
+	} else {
+	    conn = (Connection *)__uring_ptr(data);
+	}
+	if (!(flags & IORING_CQE_F_MORE))
+	    conn->uring_ops--;
+
+	//attempt的gen与sock_gen无关
+	if (op == UOP_RACE) {
+	    RaceEvent(conn, gen, res < 0 ? EPOLLERR : res);
+	    continue;
+	}
+
+	//旧socket上的op
+	if (gen != conn->sock_gen) {
+	    if (send)
+		FreeSend(send);
+	    if (flags & IORING_CQE_F_BUFFER)
+		UringRecycleBuf(flags >> IORING_CQE_BUFFER_SHIFT);
+	    continue;
+	}
+
+	switch (op)
+	{
+	    case UOP_CONNECT:
+		if (!conn->active)
+		    break;
+		if (res == 0) {
+		    conn->timing.connect_us = LatencyNowUs();
+		    RaceFinish(conn);
+		}
+		else if (!RaceFailover(conn, -res))
+		    RemoveErrorConn(conn, -res);
+		break;
+	    case UOP_SEND:
+		if (!conn->active || res < 0)
+		    FreeSend(send);
+		if (!conn->active || res == -ECANCELED)
+		    break;
+		if (res < 0) {
+		    if (__pipe_retry(conn, -res)) {
+			if (PipelineRestart(conn) < 0)
+			    RemoveErrorConn(conn, errno);
+			break;
+		    }
+		    RemoveErrorConn(conn, -res);
+		    break;
+		}
+		total_tx_bytes_ += res;
+		__send_advance(send, res);
+		//短写: 接着发剩下的
+		if (send->left) {
+		    ArmTimer(conn, GetConnTimeOut(params_, params_->ttfb_timeout_ms));
+		    if (UringQueueSend(conn, send, 0) < 0)
+			RemoveErrorConn(conn, errno);
+		    break;
+		}
+		FreeSend(send);
+		if (RequestSent(conn, CS_READING) < 0 || UringArmRecv(conn) < 0
+			|| (conn->pipe && PipelineFlush(conn) < 0))
+		    RemoveErrorConn(conn, errno);
+		break;
+	    case UOP_RECV:
+		UringRecv(conn, res, flags);
+		break;
+	    case UOP_POLL:
+		//撤掉的poll, ep_events在撤的时候已清掉
+		if (res == -ECANCELED)
+		    break;
+		conn->ep_events = 0;
+		{
+		    struct epoll_event event;
+		    event.events = res < 0 ? EPOLLERR : res;
+		    event.data.ptr = conn;
+		    ProcessEvent(&event);
+		}
+		break;
+	}
+    }
+    uring_->CommitBufs();
+}
+
+void Fetcher::UringRecv(Connection *conn, int res, unsigned int flags)
+{
+    IOBuffer *buf = NULL;
+    unsigned short bid = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+	bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = uring_bufs_[bid];
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+	conn->recv_armed = 0;
+
+    if (!conn->active) {
+	//空闲长连接上收到数据或FIN
+	if (res >= 0)
+	    conn->stale = 1;
+	if (buf)
+	    UringRecycleBuf(bid);
+	return;
+    }
+
+    int ret = 1;
+    int alive = 1;
+    int error = 0;
+    if (res > 0 && buf && __should_close_message(conn)) {
+	if (!conn->timing.first_byte_us)
+	    conn->timing.first_byte_us = LatencyNowUs();
+	total_rx_bytes_ += res;
+	RxConsume(conn, res);
+	ArmTimer(conn, GetConnTimeOut(params_, params_->idle_timeout_ms));
+	IOBufferSlice slice;
+	buf->length = res;
+	slice.buffer = buf;
+	slice.data = buf->data;
+	slice.length = res;
+	if ((ret = AppendData(conn, &slice, 1)) < 0)
+	    error = errno ? errno : EPROTO;
+    } else if (res == 0 && __should_close_message(conn)) {
+	alive = 0;
+	if ((ret = AppendData(conn, NULL, 0)) < 0)
+	    error = errno ? errno : EPROTO;
+	else if (ret < 2)
+	    ret = 0;
+    } else if (res < 0 && __should_close_message(conn) && __pipe_retry(conn, -res)) {
+	if ((ret = PipelineRestart(conn) < 0 ? -1 : 2) < 0)
+	    error = errno;
+    } else if (res == -EINVAL && uring_multishot_) {
+	//内核不支持multishot recv
+	uring_multishot_ = false;
+    } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+	error = -res;
+    } else if (res >= 0) {
+	//请求还没发完就收到数据
+	error = EPROTO;
+    }
+    if (buf)
+	UringRecycleBuf(bid);
+
+    if (error) {
+	RemoveErrorConn(conn, error);
+	return;
+    }
+    //流水线连接已在新socket上重发
+    if (ret > 1)
+	return;
+    if (ret == 0) {
+	list_del(&conn->list);
+	INIT_LIST_HEAD(&conn->list);
+	int n = FinishRead(conn, alive);
+	if (n < 0)
+	    RemoveErrorConn(conn, errno);
+	else if (n == 0)
+	    list_add_tail(&conn->list, &conn_list_);
+	return;
+    }
+    if ((!conn->recv_armed && !conn->parked && UringArmRecv(conn) < 0)
+	    || (conn->pipe && PipelineFlush(conn) < 0))
+	RemoveErrorConn(conn, errno);
+}
+#endif
+
+/**
+ * 开始一轮赛跑: 先连上次连上的地址，其余的按IPv6/IPv4交替排队
+ * @return true 本轮赛跑
+ */
+bool Fetcher::RaceReset(Connection *conn)
+{
+    ConnectRace *race = conn->race;
+    if (!race)
+	return false;
+    race->deadline = 0;
+    if (!params_->connect_attempt_delay_ms)
+	return false;
+
+    bool taken[RACE_MAX_ADDRS] = {false};
+    int n = 0;
+    int family = race->addrs[race->cur].ss_family;
+    taken[race->cur] = true;
+    race->order[n++] = race->cur;
+    while (n < race->count) {
+	//RFC 8305: 相邻两次尝试尽量换一个地址族
+	int pick = -1;
+	for (int i = 0; i < race->count; i++) {
+	    if (taken[i])
+		continue;
+	    if (race->addrs[i].ss_family != family) {
+		pick = i;
+		break;
+	    }
+	    if (pick < 0)
+		pick = i;
+	}
+	taken[pick] = true;
+	family = race->addrs[pick].ss_family;
+	race->order[n++] = pick;
+    }
+    race->next = 1;
+    race->error = 0;
+    race->deadline = now_ms_ + GetConnTimeOut(params_, params_->connect_timeout_ms);
+    __race_set_addr(conn, race->cur);
+    return true;
+}
+
+/**
+ * 向下一个候选地址发起connect
+ * @return false 没有地址可连了
+ */
+bool Fetcher::RaceNext(Connection *conn)
+{
+    ConnectRace *race = conn->race;
+    while (race->next < race->count) {
+	if (RaceAttempt(conn, race->order[race->next++]) == 0)
+	    return true;
+	race->error = errno;
+    }
+    return false;
+}
+
+/**
+ * attempt另开socket连addrs[idx], 只关注可写(连上或失败)
+ */
+int Fetcher::RaceAttempt(Connection *conn, int idx)
+{
+    ConnectRace *race = conn->race;
+    int error;
+    int fd = NewSocket(conn, race->addrs[idx].ss_family);
+    if (fd < 0)
+	return -1;
+    if (connect(fd, (struct sockaddr *)&race->addrs[idx], race->addrlens[idx]) < 0
+	    && errno != EINPROGRESS)
+	goto fail;
+
+    ++race->attempt_gen;
+#if ENABLE_IO_URING
+    if (uring_) {
+	struct io_uring_sqe *sqe = uring_->GetSqe();
+	if (!sqe) {
+	    errno = EBUSY;
+	    goto fail;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = EPOLLOUT;
+	sqe->user_data = __uring_data(conn, race->attempt_gen, UOP_RACE);
+	conn->uring_ops++;
+    }
+    else
+#endif
+    {
+	struct epoll_event event;
+	event.events = EPOLLOUT | EPOLLET;
+	event.data.u64 = __race_data(conn, race->attempt_gen);
+	syscalls_.epoll_ctl_add++;
+	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event) < 0)
+	    goto fail;
+    }
+    race->attempts[race->nattempts].fd = fd;
+    race->attempts[race->nattempts].addr = idx;
+    race->attempts[race->nattempts].gen = race->attempt_gen;
+    race->nattempts++;
+    return 0;
+
+fail:
+    error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
+
+/**
+ * 下一次启动attempt的时间，都已启动则为整体超时
+ */
+unsigned int Fetcher::RaceStepTimeout(Connection *conn)
+{
+    ConnectRace *race = conn->race;
+    unsigned int left = race->deadline > now_ms_ ? race->deadline - now_ms_ : 1;
+    if (race->next < race->count)
+	return MIN(left, params_->connect_attempt_delay_ms);
+    return left;
+}
+
+/**
+ * 赛跑中连接定时器到期: 还没到整体超时就再启动一个地址
+ * @return false 不在赛跑或已超时
+ */
+bool Fetcher::RaceStep(Connection *conn)
+{
+    ConnectRace *race = conn->race;
+    if (!race || !race->deadline || now_ms_ >= race->deadline)
+	return false;
+    if (!RaceNext(conn) && conn->sockfd < 0 && !race->nattempts)
+	return false;
+    ArmTimer(conn, RaceStepTimeout(conn));
+    return true;
+}
+
+/**
+ * primary连接失败: 关掉它，不等间隔立即连下一个地址
+ * @return false 没有在连的了
+ */
+bool Fetcher::RaceFailover(Connection *conn, int error)
+{
+    ConnectRace *race = conn->race;
+    if (!race || !race->deadline)
+	return false;
+    if (uring_)
+	shutdown(conn->sockfd, SHUT_RDWR);
+    close(conn->sockfd);
+    conn->sockfd = -1;
+    conn->sock_gen++;
+    conn->recv_armed = 0;
+    conn->ep_events = 0;
+    race->error = error;
+    if (RaceNext(conn) || race->nattempts)
+	return true;
+    race->deadline = 0;
+    return false;
+}
+
+/**
+ * attempt上的事件: 失败的换下一个地址，连上的胜出
+ */
+void Fetcher::RaceEvent(Connection *conn, unsigned short gen, unsigned int events)
+{
+    ConnectRace *race = conn->race;
+    if (!race)
+	return;
+    int i = 0;
+    while (i < race->nattempts && race->attempts[i].gen != gen)
+	i++;
+    //已关掉的attempt
+    if (i == race->nattempts)
+	return;
+
+    int error = 0;
+    socklen_t n = sizeof(error);
+    if (getsockopt(race->attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &n) < 0)
+	error = errno;
+    else if (!error && (events & (EPOLLERR | EPOLLHUP)))
+	error = ECONNREFUSED;
+    if (!error) {
+	RaceAdopt(conn, i);
+	return;
+    }
+
+    __race_close_attempt(race, i, false);
+    race->error = error;
+    if (!RaceNext(conn) && conn->sockfd < 0 && !race->nattempts) {
+	race->deadline = 0;
+	RemoveErrorConn(conn, error);
+    }
+}
+
+/**
+ * attempt先连上: 换成连接的socket，关掉primary和其余的attempt
+ */
+void Fetcher::RaceAdopt(Connection *conn, int i)
+{
+    ConnectRace *race = conn->race;
+    int fd = race->attempts[i].fd;
+    int idx = race->attempts[i].addr;
+    int ret = 0;
+    race->attempts[i] = race->attempts[--race->nattempts];
+    if (conn->sockfd >= 0) {
+	if (uring_)
+	    shutdown(conn->sockfd, SHUT_RDWR);
+	close(conn->sockfd);
+    }
+    conn->sockfd = fd;
+    conn->sock_gen++;
+    conn->recv_armed = 0;
+    conn->ep_events = 0;
+    __race_set_addr(conn, idx);
+    conn->timing.connect_us = LatencyNowUs();
+    RaceFinish(conn);
+
+    if (!uring_) {
+	//attempt注册时的data不是conn
+	struct epoll_event event;
+	event.events = __get_state_events(CS_CONNECTING);
+	event.data.ptr = conn;
+	syscalls_.epoll_ctl_mod++;
+	if ((ret = epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &event)) == 0)
+	    conn->ep_events = event.events;
+    }
+    if (ret == 0) {
+#if ENABLE_SSL
+	if (SCHEME_USE_SSL(conn->scheme))
+	    ret = SSLInitialize(conn);
+	else
+#endif
+	    ret = SendRequest(conn);
+    }
+    if (ret < 0 || UpdateEvents(conn, __get_state_events(conn->state)) < 0)
+	RemoveErrorConn(conn, errno);
+}
+
+/**
+ * 已连上: 关掉其余的attempt, SSL握手用剩下的connect超时
+ */
+void Fetcher::RaceFinish(Connection *conn)
+{
+    ConnectRace *race = conn->race;
+    if (!race || !race->deadline)
+	return;
+    uint64_t deadline = race->deadline;
+    __race_cancel(race, uring_ != NULL);
+    if (conn->state == CS_CONNECTING)
+	ArmTimer(conn, deadline > now_ms_ ? deadline - now_ms_ : 1);
+}
+
+/**
+ * One event loop of ThreadingFetcher: a Fetcher(epoll fd) running on its own
+ * thread, with its own request ring and result ring.
+ */
+struct ThreadingFetcher::Loop
+{
+    ThreadingFetcher* owner;
+    unsigned idx;
+    boost::shared_ptr<Fetcher> fetcher;
+    pthread_t tid;
+    bool running;
+
+    //任意线程PutRequest, 本loop线程取
+    MpscRing<RawFetcherRequest>* request_ring;
+    //本loop线程放, GetResult取
+    SpscRing<RawFetcherResult>* result_ring;
+    //一轮Poll产生的结果, Poll之后一次放入result_ring
+    std::vector<RawFetcherResult> pending_results;
+    //result_ring满时loop线程在此等待
+    pthread_mutex_t result_full_mutex;
+    pthread_cond_t result_not_full_cond;
+    volatile unsigned result_full_waiting;
+    //credit流控: 已开始、结果还没放进result_ring的请求数, 只有loop线程改
+    volatile size_t inflight;
+    //credit用完时置1, PopResults取走结果后Wakeup本loop
+    volatile unsigned credit_waiting;
+    volatile uint64_t blocked_us;
+    volatile uint64_t stalled_us;
+    uint64_t stall_begin_us;
+
+    Loop(ThreadingFetcher* threading_fetcher, unsigned loop_idx, 
+            IMessageEvents* message_events, int backend,
+            size_t request_max, size_t result_max):
+        owner(threading_fetcher), idx(loop_idx), running(false),
+        request_ring(NULL), result_ring(NULL), result_full_waiting(0),
+        inflight(0), credit_waiting(0), blocked_us(0), stalled_us(0),
+        stall_begin_us(0)
+    {
+        fetcher.reset(new Fetcher(message_events, threading_fetcher, backend));
+        CreateRings(request_max, result_max);
+        pthread_mutex_init(&result_full_mutex, NULL);
+        pthread_cond_init(&result_not_full_cond, NULL);
+    }
+
+    ~Loop()
+    {
+        delete request_ring;
+        delete result_ring;
+        pthread_mutex_destroy(&result_full_mutex);
+        pthread_cond_destroy(&result_not_full_cond);
+    }
+
+    //只能在loop线程未运行时调用
+    void CreateRings(size_t request_max, size_t result_max)
+    {
+        delete request_ring;
+        delete result_ring;
+        request_ring = new MpscRing<RawFetcherRequest>(request_max);
+        result_ring = new SpscRing<RawFetcherResult>(result_max);
+    }
+
+    //result_ring里还能预占的位置
+    size_t Credits() const
+    {
+        size_t used = result_ring->Size() + inflight;
+        size_t capacity = result_ring->Capacity();
+        return used < capacity ? capacity - used : 0;
+    }
+};
+
+/**
+ * hash of remote ip, connections to the same server share one loop
+ */
+static unsigned __address_hash(const struct sockaddr* addr)
+{
+    const unsigned char* p = NULL;
+    size_t len = 0;
+    switch (addr->sa_family)
+    {
+        case AF_INET:
+            p = (const unsigned char*)&((const struct sockaddr_in *)addr)->sin_addr;
+            len = sizeof(struct in_addr);
+            break;
+        case AF_INET6:
+            p = (const unsigned char*)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+            len = sizeof(struct in6_addr);
+            break;
+        default:
+            break;
+    }
+    //FNV-1a
+    unsigned hash = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+ThreadingFetcher::ThreadingFetcher(IMessageEvents *message_events):
+	message_events_(message_events),
+	backend_(Fetcher::BACKEND_EPOLL),
+	request_queue_max_(DEFAULT_QUEUE_MAX),
+	result_queue_max_(DEFAULT_QUEUE_MAX),
+	result_waiters_(0), result_cursor_(0),
+	stop_(true), credit_flow_(false), param_version_(0)
+{
+    pthread_mutex_init(&param_mutex_, NULL);
+    pthread_mutex_init(&result_wait_mutex_, NULL);
+    pthread_cond_init(&result_queue_not_empty_cond_, NULL);
+    pthread_spin_init(&result_pop_lock_, PTHREAD_PROCESS_PRIVATE);
+    CreateLoops(1, Fetcher::BACKEND_EPOLL);
+}
+
+ThreadingFetcher::~ThreadingFetcher() {
+    loops_.clear();
+    pthread_mutex_destroy(&param_mutex_);
+    pthread_mutex_destroy(&result_wait_mutex_);
+    pthread_cond_destroy(&result_queue_not_empty_cond_);
+    pthread_spin_destroy(&result_pop_lock_);
+}
+
+void ThreadingFetcher::CreateLoops(unsigned loop_count, int backend)
+{
+    if (loop_count == 0)
+        loop_count = 1;
+    if (loop_count == loops_.size() && backend == backend_)
+        return;
+    loops_.clear();
+    backend_ = backend;
+    for (unsigned i = 0; i < loop_count; i++) {
+        LoopPtr loop(new Loop(this, i, message_events_, backend,
+                    request_queue_max_, result_queue_max_));
+        if (req_generator_)
+            loop->fetcher->SetRequestGenerator(req_generator_);
+        //rx_speed_max对所有loop总体生效
+        loop->fetcher->SetRxBucket(&rx_bucket_);
+        loops_.push_back(loop);
+    }
+}
+
+ThreadingFetcher::Loop* ThreadingFetcher::GetLoop(Connection* conn) const
+{
+    if (loops_.size() == 1)
+        return loops_[0].get();
+    //赛跑胜出的地址会变，按原来的地址分配
+    return loops_[__address_hash(__home_addr(conn)) % loops_.size()].get();
+}
+
+unsigned ThreadingFetcher::LoopCount() const
+{
+    return loops_.size();
+}
+
+int ThreadingFetcher::GetBackend() const
+{
+    return loops_[0]->fetcher->GetBackend();
+}
+
+int ThreadingFetcher::Begin(const Fetcher::Params &params, unsigned loop_count, int backend) {
+    UpdateParams(params);
+    if (!stop_) {
+        return 1;
+    }
+    //request generator只能在单个loop上工作
+    assert(!req_generator_ || loop_count <= 1);
+    CreateLoops(loop_count, backend);
+    stop_ = false;
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        int ret = pthread_create(&loops_[i]->tid, NULL, RunThread, loops_[i].get());
+        if (ret != 0) {
+            End();
+            stop_ = true;
+            errno = ret;
+            return -1;
+        }
+        loops_[i]->running = true;
+    }
+    return 0;
+}
+
+/**
+ * 队列大小向上取整到2的幂, 在Begin之前调用才生效
+ */
+void ThreadingFetcher::SetMaxQueueSize(size_t request_size, size_t result_size)
+{
+    request_queue_max_ = request_size;
+    result_queue_max_  = result_size; 
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        if (!loops_[i]->running)
+            loops_[i]->CreateRings(request_queue_max_, result_queue_max_);
+    }
+}
+
+void ThreadingFetcher::SetResultCallback(ResultCallback result_cb)
 {
     result_cb_ = result_cb;
 }
 
+void ThreadingFetcher::SetCreditFlowControl(bool enable)
+{
+    //request generator自己控制拉取
+    assert(!enable || !req_generator_);
+    credit_flow_ = enable;
+}
+
+void ThreadingFetcher::SetNotifyCallback(NotifyCallback notify_cb)
+{
+    notify_cb_ = notify_cb;
+}
+
 void ThreadingFetcher::End() {
     void *ret;
 
     if (!stop_) {
 	stop_ = true;
-	pthread_join(tid_, &ret);
+        for (unsigned i = 0; i < loops_.size(); i++)
+            loops_[i]->fetcher->Wakeup();
+        for (unsigned i = 0; i < loops_.size(); i++) {
+            if (loops_[i]->running) {
+                pthread_join(loops_[i]->tid, &ret);
+                loops_[i]->running = false;
+            }
+        }
     }
     stop_ = false;
 }
@@ -1089,56 +3546,99 @@ void ThreadingFetcher::End() {
 void ThreadingFetcher::UpdateParams(const Fetcher::Params& params) {
     pthread_mutex_lock(&param_mutex_);
     memcpy(&params_, &params, sizeof(Fetcher::Params));
-    param_changed_ = true;
+    ++param_version_;
     pthread_mutex_unlock(&param_mutex_);
+    for (unsigned i = 0; i < loops_.size(); i++)
+        loops_[i]->fetcher->Wakeup();
 }
 
 void* ThreadingFetcher::RunThread(void *context) {
-    ThreadingFetcher* fetcher = (ThreadingFetcher *)context;
-    fetcher->Run();
+    Loop* loop = (Loop *)context;
+    loop->owner->Run(loop);
     return 0;
 }
 
 unsigned ThreadingFetcher::AvailableQuota()
 {
-    return request_queue_.size() >= request_queue_max_ ? 
-        0 : request_queue_max_ - request_queue_.size();
+    unsigned quota = 0;
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        size_t size = loops_[i]->request_ring->Size();
+        size_t capacity = loops_[i]->request_ring->Capacity();
+        size_t free = size < capacity ? capacity - size : 0;
+        if (credit_flow_) {
+            //已排队的请求也要占结果队列的位置
+            size_t credits = loops_[i]->Credits();
+            credits = credits > size ? credits - size : 0;
+            free = MIN(free, credits);
+        }
+        quota += free;
+    }
+    return quota;
 }
 
-void ThreadingFetcher::Run() {
-	Fetcher::Params params;
+void ThreadingFetcher::Run(Loop* loop) {
+    Fetcher::Params params;
+    unsigned param_version = param_version_ - 1;
+    RawFetcherRequest requests[RING_BATCH];
     while(!stop_) 
     {
-        if(param_changed_)
+        if(param_version != param_version_)
         {
             pthread_mutex_lock(&param_mutex_);
             memcpy(&params, &params_, sizeof(Fetcher::Params));
-            param_changed_ = false;
+            param_version = param_version_;
             pthread_mutex_unlock(&param_mutex_);
         }
         //get request
-        if(!request_queue_.empty())
+        unsigned quota = loop->fetcher->AvailableQuota();
+        if (credit_flow_)
+            quota = CreditQuota(loop, quota);
+        //请求队列满时调用方在等AvailableQuota, 取走后通知它
+        bool ring_full = quota && notify_cb_ &&
+            loop->request_ring->Size() >= loop->request_ring->Capacity();
+        size_t popped = 0;
+        while (quota > 0)
         {
-            unsigned quota = fetcher_->AvailableQuota();
-            unsigned cnt = 0;
-            pthread_mutex_lock(&request_queue_mutex_);
-            while (!request_queue_.empty() && cnt < quota) 
-            {
-                RawFetcherRequest request = request_queue_.front();
-                request_queue_.pop();
-                fetcher_->StartRequest(request.conn, request.context);
-                ++cnt;
-            }
-            pthread_mutex_unlock(&request_queue_mutex_);
+            size_t n = loop->request_ring->Pop(requests, MIN(quota, RING_BATCH));
+            if (credit_flow_)
+                loop->inflight += n;
+            for (size_t i = 0; i < n; i++)
+                loop->fetcher->StartRequest(requests[i].conn, requests[i].context);
+            popped += n;
+            if (n < RING_BATCH)
+                break;
+            quota -= n;
         }
-	    fetcher_->Poll(&params, &TIMEOUT_MS);
+        if (ring_full && popped)
+            notify_cb_();
+        //request generator是拉取的, 只能轮询; 否则等IO、超时或Wakeup
+	    loop->fetcher->Poll(&params, req_generator_ ? &TIMEOUT_MS : &IDLE_TIMEOUT);
+        FlushResults(loop);
     }
 }
 
 Connection * ThreadingFetcher::CreateConnection(Connection* conn)
 {
-    return CreateConnection(conn->scheme,conn->socket_family,
-            conn->socket_type, conn->protocol, conn->address);
+    //从原来的地址复制，候选地址一并带上
+    FetchAddress address = conn->address;
+    int family = conn->socket_family;
+    if (conn->race) {
+        address.remote_addr = (struct sockaddr*)&conn->race->addrs[0];
+        address.remote_addrlen = conn->race->addrlens[0];
+        family = conn->race->addrs[0].ss_family;
+    }
+    Connection* new_conn = CreateConnection(conn->scheme, family,
+            conn->socket_type, conn->protocol, address);
+    if (new_conn && conn->race) {
+        new_conn->race = new ConnectRace(*conn->race);
+        new_conn->race->deadline = 0;
+        new_conn->race->nattempts = 0;
+    }
+    if (new_conn && conn->pipe)
+        Fetcher::SetConnectionPipeline(new_conn, conn->pipe->depth);
+    if (new_conn)
+        new_conn->local_port_range = conn->local_port_range;
+    return new_conn;
 }
 
 void ThreadingFetcher::SetConnectionScheme(Connection* conn, int scheme)
@@ -1146,6 +3646,32 @@ void ThreadingFetcher::SetConnectionScheme(Connection* conn, int scheme)
     conn->scheme = scheme;
 }
 
+void ThreadingFetcher::SetConnectionServerName(Connection* conn, const char* server_name)
+{
+    Fetcher::SetConnectionServerName(conn, server_name);
+}
+
+void ThreadingFetcher::SetConnectionRxLimit(Connection* conn, TokenBucket* serv_bucket, unsigned int conn_rx_speed_max)
+{
+    Fetcher::SetConnectionRxLimit(conn, serv_bucket, conn_rx_speed_max);
+}
+
+void ThreadingFetcher::SetConnectionAddrList(Connection* conn, const struct addrinfo* ai)
+{
+    Fetcher::SetConnectionAddrList(conn, ai);
+}
+
+void ThreadingFetcher::SetConnectionPipeline(Connection* conn, unsigned depth)
+{
+    Fetcher::SetConnectionPipeline(conn, depth);
+}
+
+void ThreadingFetcher::SetConnectionLocalAddr(Connection* conn, const struct sockaddr* addr,
+        socklen_t addrlen, uint16_t port_min, uint16_t port_max)
+{
+    Fetcher::SetConnectionLocalAddr(conn, addr, addrlen, port_min, port_max);
+}
+
 Connection* ThreadingFetcher::CreateConnection(
 		int scheme,
 		int socket_family,
@@ -1162,107 +3688,343 @@ void ThreadingFetcher::FreeConnection(Connection *conn)
     Fetcher::FreeConnection(conn);
 }
 
+void ThreadingFetcher::GetConnectionStats(uint64_t *allocated, uint64_t *created, size_t *in_use)
+{
+    Fetcher::GetConnectionStats(allocated, created, in_use);
+}
+
 void ThreadingFetcher::CloseConnection (Connection *conn) {
-    fetcher_->CloseConnection(conn);
+    //空闲长连接的事件由loop线程处理, 交给它关闭
+    if (conn->owner)
+	conn->owner->DeferClose(conn, CLOSE_ALWAYS);
 }
 
 int ThreadingFetcher::GetTrafficBytes(uint64_t *rx_bytes, uint64_t *tx_bytes) {
-    return fetcher_->GetTrafficBytes(rx_bytes, tx_bytes);
+    *rx_bytes = 0;
+    *tx_bytes = 0;
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        uint64_t rx = 0, tx = 0;
+        loops_[i]->fetcher->GetTrafficBytes(&rx, &tx);
+        *rx_bytes += rx;
+        *tx_bytes += tx;
+    }
+    return 0;
 }
 
 int ThreadingFetcher::GetConnCount(size_t *connecting, size_t *established, size_t * closed) {
-    return fetcher_->GetConnCount(connecting, established, closed);
+    size_t total_connecting = 0, total_established = 0, total_closed = 0;
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        size_t n_connecting = 0, n_established = 0, n_closed = 0;
+        loops_[i]->fetcher->GetConnCount(&n_connecting, &n_established, &n_closed);
+        total_connecting  += n_connecting;
+        total_established += n_established;
+        total_closed      += n_closed;
+    }
+    if (connecting)
+        *connecting = total_connecting;
+    if (established)
+        *established = total_established;
+    if (closed)
+        *closed = total_closed;
+    return 0;
+}
+
+void ThreadingFetcher::GetSSLStats(uint64_t *handshakes, uint64_t *resumed) {
+    uint64_t total_handshakes = 0, total_resumed = 0;
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        uint64_t n_handshakes = 0, n_resumed = 0;
+        loops_[i]->fetcher->GetSSLStats(&n_handshakes, &n_resumed);
+        total_handshakes += n_handshakes;
+        total_resumed    += n_resumed;
+    }
+    if (handshakes)
+        *handshakes = total_handshakes;
+    if (resumed)
+        *resumed = total_resumed;
+}
+
+void ThreadingFetcher::GetBufferStats(uint64_t *allocated, uint64_t *leased, size_t *outstanding) {
+    uint64_t total_allocated = 0, total_leased = 0;
+    size_t total_outstanding = 0;
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        uint64_t n_allocated = 0, n_leased = 0;
+        size_t n_outstanding = 0;
+        loops_[i]->fetcher->GetBufferStats(&n_allocated, &n_leased, &n_outstanding);
+        total_allocated   += n_allocated;
+        total_leased      += n_leased;
+        total_outstanding += n_outstanding;
+    }
+    if (allocated)
+        *allocated = total_allocated;
+    if (leased)
+        *leased = total_leased;
+    if (outstanding)
+        *outstanding = total_outstanding;
+}
+
+void ThreadingFetcher::GetSyscallStats(Fetcher::SyscallStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        Fetcher::SyscallStats n;
+        loops_[i]->fetcher->GetSyscallStats(&n);
+        stats->epoll_wait    += n.epoll_wait;
+        stats->epoll_ctl_add += n.epoll_ctl_add;
+        stats->epoll_ctl_mod += n.epoll_ctl_mod;
+        stats->read          += n.read;
+        stats->write         += n.write;
+        stats->io_uring_enter += n.io_uring_enter;
+    }
+}
+
+void ThreadingFetcher::GetFlowStats(FlowStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        Loop* loop = loops_[i].get();
+        stats->result_queued += loop->result_ring->Size();
+        stats->inflight      += loop->inflight;
+        stats->blocked_us    += loop->blocked_us;
+        stats->stalled_us    += loop->stalled_us;
+    }
+}
+
+void ThreadingFetcher::GetLatencyStats(LatencyStats *stats) {
+    stats->Clear();
+    for (unsigned i = 0; i < loops_.size(); i++) {
+        LatencyStats n;
+        loops_[i]->fetcher->GetLatencyStats(&n);
+        stats->Merge(n);
+    }
 }
 
 int ThreadingFetcher::PutRequest(const RawFetcherRequest& request) 
 {
     assert(!req_generator_);
     assert(request.conn);
-    assert(list_empty(&request.conn->list));
-    pthread_mutex_lock(&request_queue_mutex_);
-    if (request_queue_.size() > request_queue_max_) {
-	pthread_mutex_unlock(&request_queue_mutex_);
-	return -1;
-    }
-    request_queue_.push(request);
-    pthread_mutex_unlock(&request_queue_mutex_);
+    //流水线连接忙时也可以放请求
+    assert(request.conn->pipe || list_empty(&request.conn->list));
+    Loop* loop = GetLoop(request.conn);
+    if (!loop->request_ring->Push(request))
+        return -1;
+    loop->fetcher->Wakeup();
     return 0;
 }
 
+size_t ThreadingFetcher::PutRequests(std::vector<RawFetcherRequest>& requests)
+{
+    assert(!req_generator_);
+    size_t done = 0, kept = 0, begin = 0;
+    //队列满了的loop, 同一loop后面的请求也不放, 保持顺序
+    std::vector<char> full(loops_.size(), 0);
+    while (begin < requests.size()) {
+        //相邻的、属于同一loop的请求一次放入
+        Loop* loop = GetLoop(requests[begin].conn);
+        size_t end = begin;
+        do {
+            assert(requests[end].conn);
+            assert(requests[end].conn->pipe || list_empty(&requests[end].conn->list));
+            ++end;
+        } while (end < requests.size() && GetLoop(requests[end].conn) == loop);
+        size_t n = 0;
+        if (!full[loop->idx]) {
+            n = loop->request_ring->Push(&requests[begin], end - begin);
+            if (n)
+                loop->fetcher->Wakeup();
+            if (begin + n < end)
+                full[loop->idx] = 1;
+        }
+        done += n;
+        //没放入的前移, kept不会超过begin + n
+        for (size_t i = begin + n; i < end; i++)
+            requests[kept++] = requests[i];
+        begin = end;
+    }
+    requests.resize(kept);
+    return done;
+}
+
 void ThreadingFetcher::SetRequestGenerator(RequestGenerator req_generator)
 {
-    fetcher_->SetRequestGenerator(req_generator);
+    assert(loops_.size() == 1);
+    loops_[0]->fetcher->SetRequestGenerator(req_generator);
     req_generator_ = req_generator;
 }
 
+/**
+ * credit模式下本轮最多开始的请求数, credit用完时计停顿时间,
+ * 等PopResults取走结果后唤醒
+ */
+unsigned ThreadingFetcher::CreditQuota(Loop* loop, unsigned quota)
+{
+    size_t credits = loop->Credits();
+    if (!credits && loop->request_ring->Size()) {
+        loop->credit_waiting = 1;
+        __sync_synchronize();
+        //置位前取走的结果不会有Wakeup, 再看一次
+        credits = loop->Credits();
+        if (!credits) {
+            if (!loop->stall_begin_us)
+                loop->stall_begin_us = LatencyNowUs();
+            return 0;
+        }
+    }
+    loop->credit_waiting = 0;
+    if (loop->stall_begin_us) {
+        loop->stalled_us += LatencyNowUs() - loop->stall_begin_us;
+        loop->stall_begin_us = 0;
+    }
+    return MIN(quota, credits);
+}
+
 void ThreadingFetcher::PutResult(const RawFetcherResult& result) {
     if(result_cb_)
     {
+        if (credit_flow_) {
+            //回调直接交出, 预占的位置还回去
+            Loop* loop = GetLoop(result.conn);
+            if (loop->inflight)
+                --loop->inflight;
+        }
         result_cb_(result);
         return;
     }
-    pthread_mutex_lock(&result_queue_mutex_);
-    result_queue_.push(result);
-    if (result_queue_.size() == 1) {
-        pthread_cond_signal(&result_queue_not_empty_cond_);
-    } else if (result_queue_.size() == result_queue_max_) {
-	pthread_cond_wait(&result_queue_not_full_cond_, &result_queue_mutex_);
-    }
-    pthread_mutex_unlock(&result_queue_mutex_);
+    //在loop线程中调用, Poll之后由FlushResults批量交出
+    GetLoop(result.conn)->pending_results.push_back(result);
 }
 
-int ThreadingFetcher::GetResult(struct RawFetcherResult *result, const struct timeval *timeout) 
+/**
+ * 把一轮Poll的结果放入result_ring, 满时等GetResult取走;
+ * credit模式下位置已预占, 放不下的留到下一轮, 不等
+ */
+void ThreadingFetcher::FlushResults(Loop* loop)
 {
-    assert(!result_cb_);
-    if(!timeout){
-	pthread_mutex_lock(&result_queue_mutex_);
-
-	while (result_queue_.empty())
-	    pthread_cond_wait(&result_queue_not_empty_cond_, &result_queue_mutex_);
+    std::vector<RawFetcherResult>& pending = loop->pending_results;
+    size_t done = 0;
+    while (done < pending.size()) {
+        size_t n = loop->result_ring->Push(&pending[done], pending.size() - done);
+        done += n;
+        if (credit_flow_)
+            loop->inflight -= MIN(n, (size_t)loop->inflight);
+        if (n) {
+            __sync_synchronize();
+            if (result_waiters_) {
+                pthread_mutex_lock(&result_wait_mutex_);
+                pthread_cond_signal(&result_queue_not_empty_cond_);
+                pthread_mutex_unlock(&result_wait_mutex_);
+            }
+            if (notify_cb_)
+                notify_cb_();
+        }
+        if (done == pending.size() || stop_ || credit_flow_)
+            break;
 
-	*result = result_queue_.front();
-	result_queue_.pop();
-	if (result_queue_.size() == result_queue_max_ - 1) {
-	    pthread_cond_signal(&result_queue_not_full_cond_);
-	}
-	pthread_mutex_unlock(&result_queue_mutex_);
-	return 0;
+        struct timespec abstime;
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_nsec += 10 * 1000000;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+        uint64_t wait_begin_us = LatencyNowUs();
+        pthread_mutex_lock(&loop->result_full_mutex);
+        loop->result_full_waiting = 1;
+        __sync_synchronize();
+        if (loop->result_ring->Size() >= loop->result_ring->Capacity())
+            pthread_cond_timedwait(&loop->result_not_full_cond, &loop->result_full_mutex, &abstime);
+        loop->result_full_waiting = 0;
+        loop->blocked_us += LatencyNowUs() - wait_begin_us;
+        pthread_mutex_unlock(&loop->result_full_mutex);
     }
+    pending.erase(pending.begin(), pending.begin() + done);
+}
 
-    struct timespec abstime;
-    struct timeval now;
-    int ret = 0;
-
-    pthread_mutex_lock(&result_queue_mutex_);
+/**
+ * pop at most max results from the loops in round robin order
+ * 判空在Pop里读ring的tail_/head_计数, 不另外看队列;
+ * result_pop_lock_保证每个ring只有一个消费者
+ */
+size_t ThreadingFetcher::PopResults(RawFetcherResult *results, size_t max)
+{
+    size_t count = 0;
+    unsigned loop_count = loops_.size();
+    pthread_spin_lock(&result_pop_lock_);
+    unsigned cursor = result_cursor_;
+    for (unsigned i = 0; i < loop_count && count < max; i++) {
+        Loop* loop = loops_[(cursor + i) % loop_count].get();
+        size_t n = loop->result_ring->Pop(results + count, max - count);
+        if (!n)
+            continue;
+        count += n;
+        result_cursor_ = loop->idx + 1;
+        __sync_synchronize();
+        if (loop->result_full_waiting) {
+            pthread_mutex_lock(&loop->result_full_mutex);
+            pthread_cond_signal(&loop->result_not_full_cond);
+            pthread_mutex_unlock(&loop->result_full_mutex);
+        }
+        if (loop->credit_waiting) {
+            loop->credit_waiting = 0;
+            loop->fetcher->Wakeup();
+        }
+    }
+    pthread_spin_unlock(&result_pop_lock_);
+    return count;
+}
 
-    gettimeofday(&now, NULL);
-    abstime.tv_sec = now.tv_sec + timeout->tv_sec;
-    abstime.tv_nsec = 1000 * (now.tv_usec + timeout->tv_usec);
+size_t ThreadingFetcher::WaitResults(RawFetcherResult *results, size_t max, const struct timeval *timeout)
+{
+    size_t count = PopResults(results, max);
+    if (count || (timeout && !timeout->tv_sec && !timeout->tv_usec))
+        return count;
 
-    // abstime normalize
-    const long BILLION = 1000000000;
-    if (abstime.tv_nsec >= BILLION)
-    {
-	abstime.tv_sec += abstime.tv_nsec / BILLION;
-	abstime.tv_nsec %= BILLION;
+    struct timespec abstime;
+    if (timeout) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        abstime.tv_sec = now.tv_sec + timeout->tv_sec;
+        abstime.tv_nsec = 1000 * (now.tv_usec + timeout->tv_usec);
+
+        // abstime normalize
+        const long BILLION = 1000000000;
+        if (abstime.tv_nsec >= BILLION)
+        {
+            abstime.tv_sec += abstime.tv_nsec / BILLION;
+            abstime.tv_nsec %= BILLION;
+        }
     }
 
-    while (result_queue_.empty() && ret != ETIMEDOUT) {
-	ret = pthread_cond_timedwait(&result_queue_not_empty_cond_, &result_queue_mutex_, &abstime);
+    int ret = 0;
+    pthread_mutex_lock(&result_wait_mutex_);
+    __sync_fetch_and_add(&result_waiters_, 1);
+    while (!(count = PopResults(results, max))) {
+        if (ret == ETIMEDOUT)
+            break;
+        if (!timeout)
+            pthread_cond_wait(&result_queue_not_empty_cond_, &result_wait_mutex_);
+        else
+            ret = pthread_cond_timedwait(&result_queue_not_empty_cond_, &result_wait_mutex_, &abstime);
     }
+    __sync_fetch_and_sub(&result_waiters_, 1);
+    pthread_mutex_unlock(&result_wait_mutex_);
+    return count;
+}
 
-    if (ret != ETIMEDOUT)
-    {
-	*result = result_queue_.front();
-	result_queue_.pop();
-	pthread_cond_signal(&result_queue_not_full_cond_);
-	ret = 0;
-    } else {
-	ret = 1;
-    }
+int ThreadingFetcher::GetResult(struct RawFetcherResult *result, const struct timeval *timeout) 
+{
+    assert(!result_cb_);
+    return WaitResults(result, 1, timeout) ? 0 : 1;
+}
 
-    pthread_mutex_unlock(&result_queue_mutex_);
-    return ret;
+size_t ThreadingFetcher::GetResults(std::vector<RawFetcherResult>& results, size_t max,
+        const struct timeval *timeout)
+{
+    assert(!result_cb_);
+    if (!max)
+        return 0;
+    size_t size = results.size();
+    results.resize(size + max);
+    size_t count = WaitResults(&results[size], max, timeout);
+    results.resize(size + count);
+    return count;
 }
 
 bool ThreadingFetcher::FinishFetch(Connection *conn, void *request_context, IFetchMessage *message) {
@@ -1271,6 +4033,7 @@ bool ThreadingFetcher::FinishFetch(Connection *conn, void *request_context, IFet
     result.message = message;
     result.err_num = 0;
     result.context = request_context;
+    result.timing = conn->timing;
     PutResult(result);
     return false;
 }
@@ -1281,5 +4044,6 @@ void ThreadingFetcher::FetchError(Connection *conn, void *request_context, int e
     result.message = NULL;
     result.err_num = err_num;
     result.context = request_context;
+    result.timing = conn->timing;
     PutResult(result);
 }
@@ -10,11 +10,19 @@
 #include <sys/time.h>
 #include <sys/epoll.h>
 #include <netdb.h> 
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp> 
 #include <queue> 
+#include <vector>
+#include <map>
+#include <string>
 #include "list.h"
+#include "IOBuffer.hpp"
+#include "TimerWheel.hpp"
+#include "TokenBucket.hpp"
+#include "LatencyStats.hpp"
 
 /**
  * Data to send to remote server
@@ -33,6 +41,36 @@ class IFetchMessage {
 	virtual int Append(const void * data, size_t length) = 0;
 	virtual bool IsKeepAlive() const = 0;
 
+	/**
+	 * Append taking the filled ranges of the Fetcher's pooled receive
+	 * buffers. The Fetcher drops its lease after the call returns, so a
+	 * message keeping the data must IOBufferRef() the buffer.
+	 * count == 0 means the connection is closed by remote server.
+	 * Default implementation copies each slice through Append;
+	 * HttpFetcherResponse keeps large body slices by reference instead.
+	 */
+	virtual int AppendBuffers(const IOBufferSlice *slices, int count)
+	{
+	    if (count == 0)
+		return Append("", 0);
+	    int ret = 1;
+	    for (int i = 0; i < count && ret > 0; i++)
+		ret = Append(slices[i].data, slices[i].length);
+	    return ret;
+	}
+
+	/**
+	 * 回应收完(Append返回0)时, 最后一次Append的数据末尾有多少字节不属于它.
+	 * 流水线连接上这些字节交给下一个回应; 默认为0
+	 */
+	virtual size_t Overread() const { return 0; }
+
+	/**
+	 * 此刻还能收多少字节，为0时Fetcher暂停读该连接，之后定时再看;
+	 * 默认不限。不为不限时io_uring后端不用multishot recv
+	 */
+	virtual size_t RxWindow() const { return (size_t)-1; }
+
 	virtual ~IFetchMessage(){}
 };
 
@@ -45,6 +83,7 @@ struct FetchAddress {
 
 struct __connection;
 typedef struct __connection Connection;
+class IoUring;
 
 class IMessageEvents {
     public:
@@ -91,6 +130,8 @@ struct RawFetcherResult {
     IFetchMessage *message;
     int err_num;
     void* context;
+    //各阶段的时间点
+    FetchTiming timing;
 };
 
 class Fetcher {
@@ -104,14 +145,47 @@ class Fetcher {
 	    struct timeval conn_timeout;    // 在以下网络操作上的超时时间:
 					    // connect, read
 	    unsigned int rx_speed_max;      // 最大入流量，bytes/seconds
-					    // 超过此流量时read会阻塞，强行降低入流量
+					    // 超过此流量时暂停读，不阻塞事件循环
         unsigned int max_connecting_cnt;// 最大并发连接数目
         unsigned int socket_rcvbuf_size;// socket接受缓冲区大小
         unsigned int socket_sndbuf_size;// socket发送缓冲区大小
+	    unsigned int connect_timeout_ms;// connect(含SSL握手)超时，毫秒
+	    unsigned int ttfb_timeout_ms;   // 请求发出后到收到首字节的超时，毫秒
+	    unsigned int idle_timeout_ms;   // 读响应时两次收到数据的最大间隔，毫秒
+					    // 以上三项为0时使用conn_timeout
+	    unsigned int connect_attempt_delay_ms;// 有多个候选地址的连接每隔这么久
+					    // 再向下一个地址connect，先连上的胜出
+					    // (happy eyeballs, RFC 8305建议250)
+					    // 0为只连一个地址
+	    unsigned int zerocopy_threshold;// 明文请求剩余不少于这么多字节时用
+					    // MSG_ZEROCOPY发，0为不用(epoll后端)
+	};
+
+	/**
+	 * 系统调用计数，用于观察每次抓取的系统调用开销
+	 */
+	struct SyscallStats
+	{
+	    uint64_t epoll_wait;
+	    uint64_t epoll_ctl_add;
+	    uint64_t epoll_ctl_mod;
+	    uint64_t read;		    // readv, SSL_read
+	    uint64_t write;		    // writev, SSL_write
+	    uint64_t io_uring_enter;	    // io_uring后端的提交和等待
+	};
+
+	/**
+	 * IO引擎，io_uring不可用(老内核或未开启ENABLE_IO_URING)时退回epoll
+	 */
+	enum Backend
+	{
+	    BACKEND_EPOLL = 0,
+	    BACKEND_IO_URING
 	};
 
     public:
-	Fetcher(IMessageEvents *message_events, IFetcherEvents *fetcher_events);
+	Fetcher(IMessageEvents *message_events, IFetcherEvents *fetcher_events,
+		int backend = BACKEND_EPOLL);
 	virtual ~Fetcher();
 
 	/**
@@ -122,9 +196,11 @@ class Fetcher {
 	 *
 	 * StartRequest 之后，Fetcher会依次回调以下方法
 	 *	- CreateRequestData:
-	 *	    客户此时应返回RequestData对象，Fetcher负责将数据发送给远端服务器
+	 *	    客户此时应返回RequestData对象，Fetcher负责将数据发送给远端服务器。
+	 *	    vector指向的内存(如大的请求体)不会被拷贝，到FreeRequestData前须有效
 	 *	- FreeRequestData:
-	 *	    RequestData发送完毕，释放
+	 *	    RequestData发送完毕，释放; 用MSG_ZEROCOPY发的要等内核用完，
+	 *	    可能在FinishFetch之后
 	 *	- CreateFetchResponse:
 	 *	    准备接收回应，客户应创建IFetchMessage对象接收数据
 	 *	- while(IFetchMessage::Append() == 0)
@@ -145,6 +221,8 @@ class Fetcher {
 	 *	- FinishFetch之后，不必立即调用FreeConnection释放Connection,
 	 *	    可以在此句柄上再发起请求
 	 *  - 何时FreeConnection由客户控制，但注意别发生资源泄漏。
+	 *  - 连接的socket从建立到关闭只在epoll上注册一次，空闲的长连接也不摘除；
+	 *	    因此被某个Fetcher驱动过的Connection由该Fetcher在下一轮Poll时真正释放。
 	 */
 	static Connection * CreateConnection(
 		int scheme,
@@ -154,6 +232,48 @@ class Fetcher {
 		const FetchAddress& address
 		);
 	static void FreeConnection(Connection *conn);
+	/**
+	 * Connection分配统计: slab中已分配的个数，累计创建次数，正在使用的个数
+	 */
+	static void GetConnectionStats(uint64_t *allocated, uint64_t *created, size_t *in_use);
+	/**
+	 * 设置连接的入流量限制，在连接空闲(未StartRequest)时调用
+	 * @param serv_bucket: 同一ServChannel共享的令牌桶，可为NULL
+	 * @param conn_rx_speed_max: 单连接最大入流量, bytes/seconds, 0为不限
+	 */
+	static void SetConnectionRxLimit(Connection *conn, TokenBucket *serv_bucket, unsigned int conn_rx_speed_max);
+	/**
+	 * 设置https连接的SNI, 同时作为TLS session缓存key的一部分
+	 */
+	static void SetConnectionServerName(Connection *conn, const char *server_name);
+	/**
+	 * 设置连接的候选地址(同一域名解析出的全部地址)，在连接空闲时调用。
+	 * 建连时先连上次连上的地址，之后按connect_attempt_delay_ms错开，
+	 * IPv6/IPv4交替地向其余地址发起connect，第一个连上的胜出，其余的关掉。
+	 * 连接原来的remote_addr总是排在第一位，ThreadingFetcher按它分配loop。
+	 */
+	static void SetConnectionAddrList(Connection *conn, const struct addrinfo *ai);
+	/**
+	 * HTTP/1.1 pipelining: 连接上同时发出至多depth个请求，按顺序收回应，
+	 * depth<=1为不用流水线. 在连接空闲时调用.
+	 * 流水线连接忙时也可以StartRequest, 请求排在队尾(FinishFetch/FetchError
+	 * 回调里发起的只排队)，排队的超过16个时以EBUSY失败.
+	 * 对端关闭或回应要求关闭时Fetcher自己关闭连接，没收到回应的请求在新连接上重发;
+	 * 队列不空时不能CloseConnection.
+	 */
+	static void SetConnectionPipeline(Connection *conn, unsigned depth);
+	/**
+	 * 设置连接的本地地址，在连接空闲时调用，下次建连生效. addr为NULL时不绑定.
+	 * 端口为0时用IP_BIND_ADDRESS_NO_PORT推迟到connect时选端口，同一本地IP
+	 * 连不同目的地址时端口可以复用; port_min/port_max不为0时用
+	 * IP_LOCAL_PORT_RANGE(Linux 6.3+)限定选端口的范围，内核不支持时忽略
+	 */
+	static void SetConnectionLocalAddr(Connection *conn, const struct sockaddr *addr,
+		socklen_t addrlen, uint16_t port_min = 0, uint16_t port_max = 0);
+	/**
+	 * 当前(或刚结束的)一次抓取各阶段的时间点，在FinishFetch/FetchError里取
+	 */
+	static void GetConnectionTiming(Connection *conn, FetchTiming *timing);
 	void CloseConnection (Connection *conn);
 
 	/**
@@ -164,39 +284,114 @@ class Fetcher {
 	 */
 	void StartRequest(Connection *conn, void *context);
     void SetRequestGenerator(RequestGenerator req_generator);
+	/**
+	 * 替换全局限速的令牌桶，多个Fetcher可共享一个，NULL恢复为自有的桶
+	 */
+	void SetRxBucket(TokenBucket *bucket);
 	/**
 	 * 进行实际的网络IO驱动，阻塞最多timeout时长（如果timeout != 0)
+	 * 有IO、连接超时到期或Wakeup时提前返回
 	 */
 	void Poll(const Fetcher::Params *params, const struct timeval *timeout);
+	/**
+	 * 唤醒阻塞中的Poll，可在任意线程调用
+	 */
+	void Wakeup();
 	int GetTrafficBytes(uint64_t *rx_bytes, uint64_t *tx_bytes); 
 	int GetConnCount(size_t *connecting, size_t *established, size_t * closed);
+	void GetBufferStats(uint64_t *allocated, uint64_t *leased, size_t *outstanding);
+	void GetSSLStats(uint64_t *handshakes, uint64_t *resumed);
+	void GetSyscallStats(SyscallStats *stats);
+	/**
+	 * 成功抓取的各阶段耗时分布, 只由loop线程写, 其他线程读到的是近似快照
+	 */
+	void GetLatencyStats(LatencyStats *stats);
+	int GetBackend() const { return backend_; }
       
     inline unsigned AvailableQuota();
 
     private:
+	//CloseConnection交给连接所在的loop
+	friend class ThreadingFetcher;
 	int CheckEvent(struct epoll_event *event, struct list_head *conn_list);
 	void AddConnList(int *n);
 	int AddConn(int *n, Connection *conn, struct list_head *conn_list);
 	int NewConnection(Connection *conn);
+	int NewSocket(Connection *conn, int family);
+	int OpenSocket(Connection *conn);
 	int ConnectToServer(Connection *conn);
+	bool RaceReset(Connection *conn);
+	bool RaceNext(Connection *conn);
+	int RaceAttempt(Connection *conn, int idx);
+	unsigned int RaceStepTimeout(Connection *conn);
+	bool RaceStep(Connection *conn);
+	bool RaceFailover(Connection *conn, int error);
+	void RaceEvent(Connection *conn, unsigned short gen, unsigned int events);
+	void RaceAdopt(Connection *conn, int i);
+	void RaceFinish(Connection *conn);
 #if ENABLE_SSL
 	int SSLNew(Connection *conn);
 	int SSLInitialize(Connection *conn);
 	int SSLConnect(Connection *conn);
 	int SSLRead(Connection *conn, char *buf, int count);
-	int SSLWritev(Connection *conn, const struct iovec *vector, int count);
+	int SSLWritev(Connection *conn, struct ConnSend *send);
+	void SSLSessionKey(Connection *conn, std::string *key);
+	void SSLRemoveSession(Connection *conn);
+	static int SSLNewSession(SSL *ssl, SSL_SESSION *session);
 #endif
 	int SendRequest(Connection *conn);
-	int SendFetchRequest(const struct RequestData *request, Connection *conn);
+	struct RequestData *CreateRequest(Connection *conn);
+	void FreeRequest(struct RequestData *request, bool batch);
+	void FreeSend(struct ConnSend *send);
+	void ReleaseSends(Connection *conn);
+	void ReapZerocopy(Connection *conn);
+	int SockWritev(Connection *conn, struct ConnSend *send);
+	int SendFetchRequest(Connection *conn);
+	int RequestSent(Connection *conn, int new_state);
 	int ReadData(Connection *conn, struct epoll_event *event);
+	int FinishRead(Connection *conn, int alive);
 	int ReadFromConn(Connection *conn, int *alive);
+	int AppendData(Connection *conn, const IOBufferSlice *slices, int count);
+	int PipelineNext(Connection *conn);
+	int PipelineFinish(Connection *conn, int alive);
+	int PipelineRestart(Connection *conn);
+	int PipelineFlush(Connection *conn);
+	bool PipelineQueue(Connection *conn, void *context);
+	void PipelineFail(Connection *conn, int error);
+	void ResetConnection(Connection *conn);
+	IOBuffer* AcquireRecvBuffer();
 	int CompleteConnection(Connection *conn);
 	void SetConnState(Connection *conn, int state);
 
 	void SetConnError(Connection *conn, int error);
 	void RemoveErrorConn(Connection *conn, int error);
 	void Exit();
-	void UpdateTime(time_t cur_time);
+	void UpdateTime();
+	void ArmTimer(Connection *conn, unsigned int timeout_ms);
+	void CheckTimeout();
+	void ProcessEvent(struct epoll_event *event);
+	void PollEvents(const Fetcher::Params *params, const struct timeval *timeout);
+	size_t RxAllowance(Connection *conn, size_t want);
+	void RxConsume(Connection *conn, size_t bytes);
+	void ParkConn(Connection *conn);
+	void UnparkConn(Connection *conn);
+	int UpdateEvents(Connection *conn, unsigned int events);
+	void DeferFree(Connection *conn);
+	void DeferClose(Connection *conn, int how);
+	void ReapConnections();
+#if ENABLE_IO_URING
+	int UringInit();
+	void UringExit();
+	int UringConnect(Connection *conn);
+	int UringSend(Connection *conn);
+	int UringQueueSend(Connection *conn, struct ConnSend *send, unsigned char flags);
+	int UringArmRecv(Connection *conn);
+	int UringPoll(Connection *conn, unsigned int events);
+	int UringArmWakeup();
+	void UringComplete();
+	void UringRecv(Connection *conn, int res, unsigned int flags);
+	void UringRecycleBuf(unsigned short bid);
+#endif
 
     protected:
 	IMessageEvents* message_events_;
@@ -207,27 +402,73 @@ class Fetcher {
 	int epfd_;
 	int nconns_;
 	int max_events_;
-	unsigned int rx_speed_max_;
+	uint64_t now_ms_;
+	//连接的connect/ttfb/idle超时
+	TimerWheel timer_wheel_;
 	SSL_CTX* ssl_ctx_;
+	//TLS session缓存，key见SSLSessionKey
+	typedef std::map<std::string, SSL_SESSION*> SSLSessionMap;
+	SSLSessionMap ssl_sessions_;
+	uint64_t ssl_handshakes_;
+	uint64_t ssl_resumed_;
 	unsigned int* conn_count_;
 
 	struct list_head conn_list_;    //connection which is fetching
 	struct list_head new_conn_list_;
-	time_t cur_time_;
-	struct timeval last_rx_stat_time_;
 	uint64_t total_rx_bytes_;
 	uint64_t total_tx_bytes_; 
-	uint64_t last_total_rx_bytes_;
 
     const Fetcher::Params *params_;
+    //在Poll里: 回调中对流水线连接的StartRequest只排队
+    bool in_poll_;
     RequestGenerator req_generator_;
+    //接收缓冲区池, 每个Connection读数据时租用一块
+    IOBufferPool* rbuf_pool_;
+    IOBuffer* spare_rbuf_;
+    //入流量限速
+    TokenBucket own_rx_bucket_;
+    TokenBucket* rx_bucket_;
+    SyscallStats syscalls_;
+    LatencyStats latency_;
+    //eventfd, 在epoll/io_uring上等待其他线程的Wakeup
+    int wake_fd_;
+    volatile int wake_pending_;
+    uint64_t wake_buf_;
+    //其他线程释放、关闭的连接，下一轮Poll开始时再free、close
+    pthread_mutex_t free_mutex_;
+    struct list_head free_list_;
+    std::vector<Connection *> close_list_;
+    //io_uring后端, 见Fetcher.cpp中的说明
+    int backend_;
+    IoUring* uring_;
+    IOBufferPool* uring_buf_pool_;
+    std::vector<IOBuffer*> uring_bufs_;     //provided buffer id -> IOBuffer
+    bool uring_multishot_;
 };
 
+/**
+ * ThreadingFetcher drives one or more Fetcher event loops, each on its own
+ * pthread with its own epoll fd and request/result queues.
+ * A Connection is pinned to one loop by the hash of its remote address,
+ * so every request, close and result of it is handled by the same loop.
+ */
 class ThreadingFetcher : IFetcherEvents {
     public:
     typedef boost::function<void (const RawFetcherResult& result)>  ResultCallback;
+    typedef boost::function<void ()> NotifyCallback;
     typedef Fetcher::RequestGenerator RequestGenerator;
 
+    /**
+     * 结果队列的流控统计
+     */
+    struct FlowStats
+    {
+	size_t result_queued;	    // 各结果队列里等GetResult取走的
+	size_t inflight;	    // credit模式下已开始、结果还没进结果队列的
+	uint64_t blocked_us;	    // 结果队列满时loop线程阻塞的总时间
+	uint64_t stalled_us;	    // credit模式下credit用完、有请求未开始的总时间
+    };
+
     public:
  	ThreadingFetcher(IMessageEvents *message_events);
 	virtual ~ThreadingFetcher();
@@ -242,56 +483,122 @@ class ThreadingFetcher : IFetcherEvents {
 		);
     static Connection* CreateConnection(Connection*);
     static void SetConnectionScheme(Connection*, int scheme);
+    static void SetConnectionRxLimit(Connection*, TokenBucket* serv_bucket, unsigned int conn_rx_speed_max);
+    static void SetConnectionServerName(Connection*, const char* server_name);
+    static void SetConnectionAddrList(Connection*, const struct addrinfo* ai);
+    static void SetConnectionPipeline(Connection*, unsigned depth);
+    static void SetConnectionLocalAddr(Connection*, const struct sockaddr* addr,
+            socklen_t addrlen, uint16_t port_min = 0, uint16_t port_max = 0);
 	static void FreeConnection(Connection *conn);
-	static int GetSockAddr(Connection* conn, struct sockaddr* addr);
+	static void GetConnectionStats(uint64_t *allocated, uint64_t *created, size_t *in_use);
+    /**
+     * 复制连接的远端地址
+     */
+	static int GetSockAddr(Connection* conn, struct sockaddr_storage* addr);
     static void ConnectionToString(Connection * conn, char* str, size_t str_len); 
 
+    /**
+     * 关闭空闲的长连接, 可在任意线程调用: 交给连接所在的loop线程,
+     * 在它下一轮Poll开始时或该连接的下一个请求开始前关闭
+     */
 	void CloseConnection (Connection *conn);
-	int Begin(const Fetcher::Params& params);
+    /**
+     * 启动loop_count个抓取线程(每个线程一个epoll/io_uring loop)，
+     * Connection按远端地址的hash固定分配到其中一个loop
+     * @param backend: Fetcher::BACKEND_EPOLL或BACKEND_IO_URING,
+     *	    实际使用的见GetBackend()
+     */
+	int Begin(const Fetcher::Params& params, unsigned loop_count = 1,
+		int backend = Fetcher::BACKEND_EPOLL);
     void SetMaxQueueSize(size_t request_size, size_t result_size);
     void SetResultCallback(ResultCallback result_cb);
     void SetRequestGenerator(RequestGenerator req_generator);
+    /**
+     * credit流控: 每个开始的请求预占结果队列的一个位置, 用完时loop不再
+     * 开始新请求(AvailableQuota也不再给额度), IO、超时照常处理, 
+     * loop线程不会阻塞在满的结果队列上. 在Begin之前调用
+     */
+    void SetCreditFlowControl(bool enable);
+    /**
+     * 结果放入结果队列、或满的请求队列腾出位置时在loop线程调用,
+     * 调用方据此等待GetResults/AvailableQuota的变化而不必轮询. 在Begin之前调用
+     */
+    void SetNotifyCallback(NotifyCallback notify_cb);
 	void End();
 	void UpdateParams(const Fetcher::Params &params);
 	int PutRequest(const RawFetcherRequest& request);
 	int GetResult(struct RawFetcherResult *result, const struct timeval *timeout = NULL);
+    /**
+     * 批量版本，每个loop的队列上只做一次同步
+     * PutRequests: 按顺序放入各自loop的队列, 返回放入的个数; 队列满了没放入的
+     *	    按原顺序留在requests里, 由调用方下次再放, 其它loop的照常放入
+     * GetResults: 向results追加至多max个结果，没有结果时按timeout等待
+     *	    (同GetResult, NULL为一直等待)，返回取到的个数
+     */
+    size_t PutRequests(std::vector<RawFetcherRequest>& requests);
+    size_t GetResults(std::vector<RawFetcherResult>& results, size_t max,
+            const struct timeval *timeout = NULL);
 	void UpdateFetcherParam(const Fetcher::Params &fetch_param);
 	int GetConnCount(size_t *connecting, size_t *established, size_t * closed);
 	int GetTrafficBytes(uint64_t *rx_bytes, uint64_t *tx_bytes); 
+	void GetSSLStats(uint64_t *handshakes, uint64_t *resumed);
+	void GetBufferStats(uint64_t *allocated, uint64_t *leased, size_t *outstanding);
+	void GetSyscallStats(Fetcher::SyscallStats *stats);
+    /**
+     * 所有loop的各阶段耗时分布之和
+     */
+    void GetLatencyStats(LatencyStats *stats);
+    void GetFlowStats(FlowStats *stats);
+	int GetBackend() const;
     unsigned AvailableQuota();
+    unsigned LoopCount() const;
 
     protected:
 	virtual bool FinishFetch(Connection* conn, void *request_context, IFetchMessage *message);
 	virtual void FetchError(Connection* conn, void *request_context, int err_num);
 
     private:
-	void Run();
+    struct Loop;
+    typedef boost::shared_ptr<Loop> LoopPtr;
+
+	void Run(Loop* loop);
 	static void* RunThread(void *context);
 	void PutResult(const RawFetcherResult& result);
+    void FlushResults(Loop* loop);
+    unsigned CreditQuota(Loop* loop, unsigned quota);
+    size_t PopResults(RawFetcherResult *results, size_t max);
+    size_t WaitResults(RawFetcherResult *results, size_t max, const struct timeval *timeout);
+    void CreateLoops(unsigned loop_count, int backend);
+    Loop* GetLoop(Connection* conn) const;
 
     protected:
 	IFetcherEvents* threading_fetch_events_;
 
     private:
+    IMessageEvents* message_events_;
 	Fetcher::Params params_;
 	pthread_mutex_t param_mutex_;
 
-	std::queue<RawFetcherRequest> request_queue_;
-	pthread_mutex_t request_queue_mutex_;
+    std::vector<LoopPtr> loops_;
+    int backend_;
 	size_t request_queue_max_; 
+	size_t result_queue_max_; 
 
-	pthread_mutex_t result_queue_mutex_;
+    //GetResult在所有loop的结果队列上等待
+	pthread_mutex_t result_wait_mutex_;
 	pthread_cond_t result_queue_not_empty_cond_;
-	pthread_cond_t result_queue_not_full_cond_;
-	std::queue<RawFetcherResult> result_queue_;
-	size_t result_queue_max_; 
+    volatile unsigned result_waiters_;
+    unsigned result_cursor_;
+    //结果队列是单消费者的，多个线程同时GetResult时串行化
+    pthread_spinlock_t result_pop_lock_;
 
 	bool stop_;
-	pthread_t tid_;
-
-	boost::shared_ptr<Fetcher> fetcher_;
-    bool param_changed_;
+    bool credit_flow_;
+    volatile unsigned param_version_;
+    //所有loop共享的全局入流量令牌桶
+    TokenBucket rx_bucket_;
     ResultCallback result_cb_;
+    NotifyCallback notify_cb_;
     RequestGenerator req_generator_;
 };
 
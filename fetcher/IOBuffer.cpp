@@ -0,0 +1,115 @@
+/**
+ */
+#include "IOBuffer.hpp"
+
+#include <stdlib.h>
+#include <assert.h>
+
+void IOBufferRef(IOBuffer* buffer)
+{
+    __sync_fetch_and_add(&buffer->ref, 1);
+}
+
+void IOBufferRelease(IOBuffer* buffer)
+{
+    if (buffer && __sync_sub_and_fetch(&buffer->ref, 1) == 0)
+	buffer->pool->Recycle(buffer);
+}
+
+IOBufferPool::IOBufferPool(size_t buffer_size, size_t max_free):
+    buffer_size_(buffer_size),
+    max_free_(max_free),
+    free_list_(NULL),
+    free_count_(0),
+    returned_(NULL),
+    returned_count_(0),
+    refs_(1),
+    allocated_(0),
+    leased_(0),
+    closed_(false)
+{
+}
+
+static void __free_buffers(IOBuffer* list)
+{
+    while (list) {
+	IOBuffer* buffer = list;
+	list = buffer->next;
+	free(buffer);
+    }
+}
+
+IOBufferPool::~IOBufferPool()
+{
+    __free_buffers(free_list_);
+    __free_buffers(returned_);
+}
+
+IOBuffer* IOBufferPool::Acquire()
+{
+    if (!free_list_ && returned_) {
+	// 一次取走其它线程还回来的全部, 没有ABA问题
+	free_list_ = __sync_lock_test_and_set(&returned_, (IOBuffer*)NULL);
+	free_count_ += __sync_lock_test_and_set(&returned_count_, 0);
+    }
+    IOBuffer* buffer = free_list_;
+    if (buffer) {
+	free_list_ = buffer->next;
+	if (free_count_)
+	    --free_count_;
+    } else {
+	// header and data in one allocation
+	buffer = (IOBuffer*)malloc(sizeof(IOBuffer) + buffer_size_);
+	if (!buffer)
+	    return NULL;
+	buffer->pool = this;
+	buffer->capacity = buffer_size_;
+	buffer->data = (char*)(buffer + 1);
+	__sync_fetch_and_add(&allocated_, 1);
+    }
+    __sync_fetch_and_add(&refs_, 1);
+    __sync_fetch_and_add(&leased_, 1);
+    buffer->next = NULL;
+    buffer->ref = 1;
+    buffer->length = 0;
+    return buffer;
+}
+
+void IOBufferPool::Recycle(IOBuffer* buffer)
+{
+    // free_count_由owner改, 这里读到的是近似值, 只用来限制空闲个数
+    if (!closed_ && free_count_ + returned_count_ < max_free_) {
+	IOBuffer* head;
+	do {
+	    head = returned_;
+	    buffer->next = head;
+	} while (!__sync_bool_compare_and_swap(&returned_, head, buffer));
+	__sync_fetch_and_add(&returned_count_, 1);
+    } else {
+	free(buffer);
+    }
+    Unref();
+}
+
+void IOBufferPool::Unref()
+{
+    // Close之后放回的buffer由析构释放
+    if (__sync_sub_and_fetch(&refs_, 1) == 0)
+	delete this;
+}
+
+void IOBufferPool::Close()
+{
+    closed_ = true;
+    Unref();
+}
+
+void IOBufferPool::GetStats(uint64_t *allocated, uint64_t *leased, size_t *outstanding)
+{
+    if (allocated)
+	*allocated = allocated_;
+    if (leased)
+	*leased = leased_;
+    if (outstanding)
+	*outstanding = refs_ - !closed_;
+}
@@ -0,0 +1,83 @@
+/**
+ * Refcounted receive buffers leased by the Fetcher.
+ *
+ * Fetcher reads socket data into pooled IOBuffer slabs instead of a
+ * static buffer, and hands the filled ranges (IOBufferSlice) to
+ * IFetchMessage::AppendBuffers. A message keeps the data without copying
+ * by taking its own reference with IOBufferRef() and dropping it with
+ * IOBufferRelease(); HttpFetcherResponse does so for response bodies.
+ * The Fetcher only holds a connection's slab while some message still
+ * references part of it.
+ */
+
+#ifndef  IOBUFFER_INC
+#define  IOBUFFER_INC
+#include <stddef.h>
+#include <stdint.h>
+
+class IOBufferPool;
+
+struct IOBuffer {
+    IOBuffer* next;             // free list link
+    IOBufferPool* pool;
+    volatile int ref;
+    size_t capacity;
+    size_t length;              // bytes filled by the fetcher
+    char* data;
+};
+
+/**
+ * A filled range of one IOBuffer
+ */
+struct IOBufferSlice {
+    IOBuffer* buffer;
+    const char* data;
+    size_t length;
+};
+
+void IOBufferRef(IOBuffer* buffer);
+void IOBufferRelease(IOBuffer* buffer);
+
+/**
+ * Free list of fixed size slabs, one pool per Fetcher loop.
+ * Acquire and Close are called by the owner loop only, Release may come
+ * from any thread: released slabs are pushed onto a lock-free stack which
+ * Acquire takes over as a whole when its own free list runs dry, so no
+ * call takes a lock.
+ * The pool is destroyed by Close() once every leased buffer came back.
+ */
+class IOBufferPool {
+    public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+    static const size_t DEFAULT_MAX_FREE    = 1024;
+
+    IOBufferPool(size_t buffer_size = DEFAULT_BUFFER_SIZE,
+            size_t max_free = DEFAULT_MAX_FREE);
+
+    IOBuffer* Acquire();
+    void Close();
+    size_t BufferSize() const { return buffer_size_; }
+    void GetStats(uint64_t *allocated, uint64_t *leased, size_t *outstanding);
+
+    private:
+    ~IOBufferPool();
+    friend void IOBufferRelease(IOBuffer* buffer);
+    void Recycle(IOBuffer* buffer);
+    void Unref();
+
+    size_t buffer_size_;
+    size_t max_free_;
+    // changed by the owner loop only, Recycle reads free_count_ as a hint
+    IOBuffer* free_list_;
+    volatile size_t free_count_;
+    // pushed by Recycle from any thread
+    IOBuffer* volatile returned_;
+    volatile size_t returned_count_;
+    // leased buffers, plus one until Close()
+    volatile size_t refs_;
+    volatile uint64_t allocated_;
+    volatile uint64_t leased_;
+    volatile bool closed_;
+};
+
+#endif   /* ----- #ifndef IOBUFFER_INC  ----- */
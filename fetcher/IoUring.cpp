@@ -0,0 +1,226 @@
+/**
+ */
+#include "IoUring.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup		425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter		426
+#endif
+#ifndef __NR_io_uring_register
+# define __NR_io_uring_register		427
+#endif
+
+static inline unsigned __load_acquire(const unsigned *p)
+{
+    unsigned v = *(volatile const unsigned *)p;
+    __sync_synchronize();
+    return v;
+}
+
+static inline void __store_release(unsigned *p, unsigned v)
+{
+    __sync_synchronize();
+    *(volatile unsigned *)p = v;
+}
+
+IoUring::IoUring():
+    fd_(-1),
+    ring_(MAP_FAILED),
+    ring_len_(0),
+    sqes_((struct io_uring_sqe *)MAP_FAILED),
+    sqes_len_(0),
+    sqe_tail_(0),
+    sqe_submitted_(0),
+    buf_ring_(NULL),
+    bgid_(0),
+    buf_mask_(0),
+    buf_tail_(0),
+    buf_pending_(0),
+    enters_(0)
+{
+}
+
+IoUring::~IoUring()
+{
+    if (buf_ring_) {
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = bgid_;
+	syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	free(buf_ring_);
+    }
+    if (sqes_ != MAP_FAILED)
+	munmap(sqes_, sqes_len_);
+    if (ring_ != MAP_FAILED)
+	munmap(ring_, ring_len_);
+    if (fd_ >= 0)
+	close(fd_);
+}
+
+int IoUring::Init(unsigned int entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ < 0)
+	return -1;
+
+    const unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & need) != need) {
+	errno = ENOSYS;
+	return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring_len_ = sq_len > cq_len ? sq_len : cq_len;
+    ring_ = mmap(NULL, ring_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    fd_, IORING_OFF_SQ_RING);
+    if (ring_ == MAP_FAILED)
+	return -1;
+    sqes_len_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe *)mmap(NULL, sqes_len_, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+	return -1;
+
+    char *ring = (char *)ring_;
+    sq_head_ = (unsigned *)(ring + p.sq_off.head);
+    sq_tail_ = (unsigned *)(ring + p.sq_off.tail);
+    sq_mask_ = *(unsigned *)(ring + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    // sqe i 总是放在 array[i]，之后不用再写array
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+	array[i] = i;
+    sqe_tail_ = sqe_submitted_ = *sq_tail_;
+
+    cq_head_ = (unsigned *)(ring + p.cq_off.head);
+    cq_tail_ = (unsigned *)(ring + p.cq_off.tail);
+    cq_mask_ = *(unsigned *)(ring + p.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+struct io_uring_sqe* IoUring::GetSqe()
+{
+    if (sqe_tail_ - __load_acquire(sq_head_) >= sq_entries_) {
+	SubmitAndWait(0);
+	if (sqe_tail_ - __load_acquire(sq_head_) >= sq_entries_)
+	    return NULL;
+    }
+    struct io_uring_sqe *sqe = &sqes_[sqe_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail_;
+    return sqe;
+}
+
+bool IoUring::Reserve(unsigned int n)
+{
+    if (sqe_tail_ - __load_acquire(sq_head_) + n > sq_entries_)
+	SubmitAndWait(0);
+    return sqe_tail_ - __load_acquire(sq_head_) + n <= sq_entries_;
+}
+
+int IoUring::SubmitAndWait(unsigned int timeout_ms)
+{
+    unsigned to_submit = sqe_tail_ - sqe_submitted_;
+    if (!to_submit && !timeout_ms)
+	return 0;
+
+    __store_release(sq_tail_, sqe_tail_);
+    unsigned flags = 0;
+    unsigned wait_nr = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms) {
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	wait_nr = 1;
+    }
+    ++enters_;
+    int ret = syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr, flags,
+	    timeout_ms ? &arg : NULL, timeout_ms ? sizeof(arg) : 0);
+    if (ret >= 0) {
+	// 内核取走的SQE数, 可能少于to_submit, 余下的下次再提交
+	sqe_submitted_ += ret;
+	return 0;
+    }
+    // 出错(含超时/中断)时按内核移动的SQ head算取走了多少, 没取的留着
+    sqe_submitted_ = __load_acquire(sq_head_);
+    if (errno == ETIME || errno == EINTR)
+	return 0;
+    return -1;
+}
+
+struct io_uring_cqe* IoUring::PeekCqe()
+{
+    unsigned head = *cq_head_;
+    if (head == __load_acquire(cq_tail_))
+	return NULL;
+    return &cqes_[head & cq_mask_];
+}
+
+void IoUring::AdvanceCqe()
+{
+    __store_release(cq_head_, *cq_head_ + 1);
+}
+
+int IoUring::SetupBufRing(unsigned short bgid, unsigned int entries)
+{
+    void *ring = NULL;
+    if (posix_memalign(&ring, sysconf(_SC_PAGESIZE), entries * sizeof(struct io_uring_buf)))
+	return -1;
+    memset(ring, 0, entries * sizeof(struct io_uring_buf));
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+	free(ring);
+	return -1;
+    }
+    buf_ring_ = (struct io_uring_buf *)ring;
+    bgid_ = bgid;
+    buf_mask_ = entries - 1;
+    buf_tail_ = 0;
+    buf_pending_ = 0;
+    return 0;
+}
+
+void IoUring::AddBuf(void *addr, unsigned int len, unsigned short bid)
+{
+    struct io_uring_buf *buf = &buf_ring_[(unsigned short)(buf_tail_ + buf_pending_) & buf_mask_];
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+    ++buf_pending_;
+}
+
+void IoUring::CommitBufs()
+{
+    if (!buf_pending_)
+	return;
+    buf_tail_ += buf_pending_;
+    buf_pending_ = 0;
+    // ring tail与bufs[0].resv重叠
+    __sync_synchronize();
+    *(volatile unsigned short *)&buf_ring_[0].resv = buf_tail_;
+}
@@ -0,0 +1,94 @@
+/**
+ * Minimal io_uring wrapper on the raw syscalls, no liburing needed.
+ *
+ * One ring belongs to one Fetcher loop: SQEs are queued with GetSqe() and
+ * go to the kernel together with the wait for completions in a single
+ * io_uring_enter(). A provided buffer ring lets recv pick its receive
+ * buffer in the kernel, so idle connections don't pin any memory.
+ * Not thread safe.
+ */
+
+#ifndef  IO_URING_INC
+#define  IO_URING_INC
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+class IoUring {
+    public:
+    IoUring();
+    ~IoUring();
+
+    /**
+     * @return 0 on success,
+     *	       -1 with errno set when the kernel lacks io_uring or
+     *	       one of the features we rely on (single mmap, ext arg, nodrop)
+     */
+    int Init(unsigned int entries);
+
+    /**
+     * Next free SQE, zeroed. Queued SQEs are submitted first when the SQ is full.
+     */
+    struct io_uring_sqe* GetSqe();
+
+    /**
+     * Make room for n SQEs, so that linked SQEs go in one submit
+     * @return false when the SQ can't be drained that far
+     */
+    bool Reserve(unsigned int n);
+
+    /**
+     * Submit queued SQEs, then wait up to timeout_ms for one completion,
+     * timeout_ms = 0 doesn't wait.
+     * @return -1 on error other than timeout and EINTR
+     */
+    int SubmitAndWait(unsigned int timeout_ms);
+
+    /**
+     * Completions: PeekCqe until NULL, AdvanceCqe after each one is handled
+     */
+    struct io_uring_cqe* PeekCqe();
+    void AdvanceCqe();
+
+    /**
+     * Register a provided buffer ring of entries (power of 2) buffers as group bgid.
+     * Buffers added by AddBuf are visible to the kernel after CommitBufs.
+     */
+    int SetupBufRing(unsigned short bgid, unsigned int entries);
+    void AddBuf(void *addr, unsigned int len, unsigned short bid);
+    void CommitBufs();
+
+    uint64_t EnterCount() const { return enters_; }
+
+    private:
+    IoUring(const IoUring&);
+    IoUring& operator=(const IoUring&);
+
+    int fd_;
+    void *ring_;
+    size_t ring_len_;
+    struct io_uring_sqe *sqes_;
+    size_t sqes_len_;
+
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned sqe_tail_;         // queued, not yet published
+    unsigned sqe_submitted_;
+
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    struct io_uring_cqe *cqes_;
+
+    struct io_uring_buf *buf_ring_;
+    unsigned short bgid_;
+    unsigned buf_mask_;
+    unsigned short buf_tail_;
+    unsigned short buf_pending_;
+
+    uint64_t enters_;
+};
+
+#endif   /* ----- #ifndef IO_URING_INC  ----- */
@@ -0,0 +1,108 @@
+/**
+ */
+#include "LatencyStats.hpp"
+#include <string.h>
+
+static inline uint64_t __lat_diff(uint64_t end, uint64_t begin)
+{
+    return end > begin ? end - begin : 0;
+}
+
+void LatencyHistogram::Clear()
+{
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+    memset(buckets_, 0, sizeof(buckets_));
+}
+
+void LatencyHistogram::Add(uint64_t us)
+{
+    int i = 0;
+    while (i < LATENCY_BUCKETS - 1 && us >> i)
+	i++;
+    buckets_[i]++;
+    sum_ += us;
+    if (us > max_)
+	max_ = us;
+    count_++;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+	buckets_[i] += other.buckets_[i];
+    sum_ += other.sum_;
+    if (other.max_ > max_)
+	max_ = other.max_;
+    count_ += other.count_;
+}
+
+uint64_t LatencyHistogram::Percentile(double percent) const
+{
+    //并发写时count_与桶里的个数可能差几个, 以桶为准
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+	total += buckets_[i];
+    if (!total)
+	return 0;
+    uint64_t rank = (uint64_t)(total * percent / 100);
+    if (rank >= total)
+	rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+	seen += buckets_[i];
+	if (seen > rank) {
+	    //最后一个桶没有上界
+	    if (i == LATENCY_BUCKETS - 1)
+		return max_;
+	    uint64_t upper = i ? (1ULL << i) - 1 : 0;
+	    return upper < max_ ? upper : max_;
+	}
+    }
+    return max_;
+}
+
+void LatencyStats::Clear()
+{
+    for (int i = 0; i < LAT_NPHASES; i++)
+	phases_[i].Clear();
+}
+
+void LatencyStats::AddFetch(const FetchTiming &t)
+{
+    if (!t.start_us || !t.last_byte_us)
+	return;
+    uint64_t ready = t.start_us;
+    if (t.connect_us) {
+	Add(LAT_CONNECT, __lat_diff(t.connect_us, ready));
+	ready = t.connect_us;
+    }
+    if (t.tls_us) {
+	Add(LAT_TLS, __lat_diff(t.tls_us, ready));
+	ready = t.tls_us;
+    }
+    if (t.sent_us) {
+	Add(LAT_SEND, __lat_diff(t.sent_us, ready));
+	if (t.first_byte_us)
+	    Add(LAT_TTFB, __lat_diff(t.first_byte_us, t.sent_us));
+    }
+    if (t.first_byte_us)
+	Add(LAT_TRANSFER, __lat_diff(t.last_byte_us, t.first_byte_us));
+    Add(LAT_FETCH, __lat_diff(t.last_byte_us, t.start_us));
+}
+
+void LatencyStats::Merge(const LatencyStats &other)
+{
+    for (int i = 0; i < LAT_NPHASES; i++)
+	phases_[i].Merge(other.phases_[i]);
+}
+
+const char* LatencyStats::PhaseName(int phase)
+{
+    static const char *names[LAT_NPHASES] = {
+	"dns", "connect", "tls", "send", "ttfb",
+	"transfer", "fetch", "deliver", "total"
+    };
+    return phase >= 0 && phase < LAT_NPHASES ? names[phase] : "unknown";
+}
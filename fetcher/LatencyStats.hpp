@@ -0,0 +1,91 @@
+/**
+ * Per-phase fetch latency.
+ *
+ * FetchTiming holds the CLOCK_MONOTONIC microsecond stamps of one fetch,
+ * 0 for a phase that did not happen (no connect or TLS on a reused
+ * keep-alive connection, no first byte on a failed fetch).
+ * LatencyHistogram counts microseconds in log2 buckets.
+ * LatencyStats is one histogram per phase. Each LatencyStats has a single
+ * writer thread (a fetcher loop, the HttpClient thread) and takes no lock;
+ * readers copy or Merge() it and may see a snapshot a few samples old.
+ */
+
+#ifndef  LATENCY_STATS_INC
+#define  LATENCY_STATS_INC
+#include <stdint.h>
+#include <time.h>
+
+#define LATENCY_BUCKETS		32
+
+static inline uint64_t LatencyNowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct FetchTiming
+{
+    uint64_t start_us;		//loop开始处理请求
+    uint64_t connect_us;	//TCP连上
+    uint64_t tls_us;		//TLS握手完成
+    uint64_t sent_us;		//请求发完
+    uint64_t first_byte_us;	//收到首字节
+    uint64_t last_byte_us;	//收完, 出错时为出错的时间
+};
+
+class LatencyHistogram {
+    public:
+    LatencyHistogram() { Clear(); }
+
+    void Clear();
+    void Add(uint64_t us);
+    void Merge(const LatencyHistogram &other);
+
+    uint64_t Count() const { return count_; }
+    uint64_t Average() const { return count_ ? sum_ / count_ : 0; }
+    uint64_t Max() const { return max_; }
+    /**
+     * 第percent(0~100)百分位所在桶的上界, 微秒
+     */
+    uint64_t Percentile(double percent) const;
+
+    private:
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+    //buckets_[i]: [2^(i-1), 2^i)微秒, buckets_[0]为0, 最后一个桶到无穷
+    uint64_t buckets_[LATENCY_BUCKETS];
+};
+
+class LatencyStats {
+    public:
+    enum Phase
+    {
+	LAT_DNS = 0,	//请求到达到DNS解析完成(HttpClient)
+	LAT_CONNECT,	//开始处理到TCP连上
+	LAT_TLS,	//TCP连上到TLS握手完成
+	LAT_SEND,	//连上(复用连接时为开始处理)到请求发完
+	LAT_TTFB,	//请求发完到首字节
+	LAT_TRANSFER,	//首字节到末字节
+	LAT_FETCH,	//fetcher里一次抓取的总时间
+	LAT_DELIVER,	//末字节到HttpClient交出结果: 结果队列和解析(HttpClient)
+	LAT_TOTAL,	//请求到达到交出结果(HttpClient)
+	LAT_NPHASES
+    };
+
+    void Clear();
+    void Add(int phase, uint64_t us) { phases_[phase].Add(us); }
+    /**
+     * 一次成功抓取的fetcher内各阶段
+     */
+    void AddFetch(const FetchTiming &timing);
+    void Merge(const LatencyStats &other);
+    const LatencyHistogram& Get(int phase) const { return phases_[phase]; }
+    static const char* PhaseName(int phase);
+
+    private:
+    LatencyHistogram phases_[LAT_NPHASES];
+};
+
+#endif   /* ----- #ifndef LATENCY_STATS_INC  ----- */
@@ -0,0 +1,177 @@
+/**
+ * Bounded lock-free rings handing requests and results between threads.
+ *
+ * SpscRing: one producer thread, one consumer thread.
+ * MpscRing: any number of producer threads, one consumer thread.
+ *	Producers claim a run of slots with one CAS on the tail, fill them
+ *	and publish each slot through its sequence number, so the consumer
+ *	never sees a half written slot.
+ *
+ * Both move items in batches: one fence per Push/Pop, not per item.
+ * Capacity is rounded up to a power of 2. Size() is a snapshot.
+ */
+
+#ifndef  RING_INC
+#define  RING_INC
+#include <stddef.h>
+
+#define RING_CACHE_LINE		64
+
+static inline size_t __ring_capacity(size_t capacity)
+{
+    size_t n = 2;
+    while (n < capacity)
+	n <<= 1;
+    return n;
+}
+
+template <typename T>
+class SpscRing {
+    public:
+    explicit SpscRing(size_t capacity):
+	mask_(__ring_capacity(capacity) - 1), head_(0), tail_(0)
+    {
+	items_ = new T[mask_ + 1];
+    }
+    ~SpscRing() { delete [] items_; }
+
+    /**
+     * @return number of items pushed, less than n when the ring is full
+     */
+    size_t Push(const T *items, size_t n)
+    {
+	size_t tail = tail_;
+	size_t room = mask_ + 1 - (tail - head_);
+	if (n > room)
+	    n = room;
+	if (!n)
+	    return 0;
+	// 读到的head_之前的slot已被读走, 才能覆盖
+	__sync_synchronize();
+	for (size_t i = 0; i < n; i++)
+	    items_[(tail + i) & mask_] = items[i];
+	__sync_synchronize();
+	tail_ = tail + n;
+	return n;
+    }
+    bool Push(const T &item) { return Push(&item, 1) == 1; }
+
+    /**
+     * @return number of items popped, at most max
+     */
+    size_t Pop(T *items, size_t max)
+    {
+	// 判空只看tail_, 不需要加锁; 读到的tail_之前的slot已写好
+	size_t head = head_;
+	size_t n = tail_ - head;
+	if (n > max)
+	    n = max;
+	if (!n)
+	    return 0;
+	__sync_synchronize();
+	for (size_t i = 0; i < n; i++)
+	    items[i] = items_[(head + i) & mask_];
+	__sync_synchronize();
+	head_ = head + n;
+	return n;
+    }
+    bool Pop(T *item) { return Pop(item, 1) == 1; }
+
+    size_t Size() const { return tail_ - head_; }
+    size_t Capacity() const { return mask_ + 1; }
+
+    private:
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+
+    T *items_;
+    size_t mask_;
+    char pad0_[RING_CACHE_LINE];
+    volatile size_t head_;	//consumer
+    char pad1_[RING_CACHE_LINE];
+    volatile size_t tail_;	//producer
+    char pad2_[RING_CACHE_LINE];
+};
+
+template <typename T>
+class MpscRing {
+    public:
+    explicit MpscRing(size_t capacity):
+	mask_(__ring_capacity(capacity) - 1), head_(0), tail_(0)
+    {
+	cells_ = new Cell[mask_ + 1];
+	for (size_t i = 0; i <= mask_; i++)
+	    cells_[i].seq = i;
+    }
+    ~MpscRing() { delete [] cells_; }
+
+    /**
+     * @return number of items pushed, less than n when the ring is full
+     */
+    size_t Push(const T *items, size_t n)
+    {
+	size_t tail, want = n;
+	for (;;) {
+	    // 先读head_再读tail_, used只会偏大;
+	    // head_只在slot被读走之后才前移，据此算出的空位一定可写
+	    size_t head = head_;
+	    tail = tail_;
+	    size_t used = tail - head;
+	    if (used > mask_ || !want)
+		return 0;
+	    n = want < mask_ + 1 - used ? want : mask_ + 1 - used;
+	    if (__sync_bool_compare_and_swap(&tail_, tail, tail + n))
+		break;
+	}
+	for (size_t i = 0; i < n; i++)
+	    cells_[(tail + i) & mask_].item = items[i];
+	__sync_synchronize();
+	for (size_t i = 0; i < n; i++)
+	    cells_[(tail + i) & mask_].seq = tail + i + 1;
+	return n;
+    }
+    bool Push(const T &item) { return Push(&item, 1) == 1; }
+
+    /**
+     * @return number of items popped, at most max
+     */
+    size_t Pop(T *items, size_t max)
+    {
+	size_t head = head_;
+	size_t n = 0;
+	// 按顺序取已发布的slot, 遇到还在写的slot就停
+	while (n < max && cells_[(head + n) & mask_].seq == head + n + 1)
+	    n++;
+	if (!n)
+	    return 0;
+	__sync_synchronize();
+	for (size_t i = 0; i < n; i++)
+	    items[i] = cells_[(head + i) & mask_].item;
+	__sync_synchronize();
+	head_ = head + n;
+	return n;
+    }
+    bool Pop(T *item) { return Pop(item, 1) == 1; }
+
+    size_t Size() const { return tail_ - head_; }
+    size_t Capacity() const { return mask_ + 1; }
+
+    private:
+    MpscRing(const MpscRing&);
+    MpscRing& operator=(const MpscRing&);
+
+    struct Cell {
+	T item;
+	volatile size_t seq;
+    };
+
+    Cell *cells_;
+    size_t mask_;
+    char pad0_[RING_CACHE_LINE];
+    volatile size_t head_;	//consumer
+    char pad1_[RING_CACHE_LINE];
+    volatile size_t tail_;	//producers
+    char pad2_[RING_CACHE_LINE];
+};
+
+#endif   /* ----- #ifndef RING_INC  ----- */
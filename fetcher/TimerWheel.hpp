@@ -0,0 +1,35 @@
+/**
+ * Millisecond timing wheel for connection timeouts.
+ *
+ * This is the scheduler's hierarchical wheel (linklist/timing_wheel.hpp)
+ * keyed by absolute ms: 256 slots for the next 256ms, then 4 levels of
+ * 64 slots each, covering 2^32 ms. Arm, re-arm and cancel are O(1) list
+ * operations on a TimerNode embedded in the owner object; pop_expired()
+ * skips empty slots through per-level bitmaps instead of ticking.
+ * Not thread safe, one wheel belongs to one event loop.
+ */
+
+#ifndef  TIMER_WHEEL_INC
+#define  TIMER_WHEEL_INC
+#include <stdint.h>
+#include "linklist/timing_wheel.hpp"
+
+struct TimerNode {
+    linked_list_node_t node;
+    uint64_t expire;            // absolute time in ms
+};
+
+typedef timing_wheel_t<uint64_t, TimerNode, &TimerNode::node, &TimerNode::expire> TimerWheel;
+
+static inline void TimerNodeInit(TimerNode *node)
+{
+    node->node.next = node->node.prev = &node->node;
+    node->expire = 0;
+}
+
+static inline bool TimerNodePending(const TimerNode *node)
+{
+    return node->node.next != &node->node;
+}
+
+#endif   /* ----- #ifndef TIMER_WHEEL_INC  ----- */
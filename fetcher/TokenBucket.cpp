@@ -0,0 +1,100 @@
+/**
+ */
+#include "TokenBucket.hpp"
+
+#define TOKEN_BUCKET_MIN_BURST		(4 * 1024)
+//补充时最多算一天, 避免乘rate溢出; 这么久桶早满了
+#define TOKEN_BUCKET_MAX_REFILL_MS	(24 * 3600 * 1000ULL)
+
+TokenBucket::TokenBucket(unsigned int rate, unsigned int burst):
+    rate_(0),
+    burst_(0),
+    tokens_(0),
+    milli_tokens_(0),
+    last_ms_(0)
+{
+    pthread_spin_init(&lock_, PTHREAD_PROCESS_PRIVATE);
+    SetRate(rate, burst);
+}
+
+TokenBucket::~TokenBucket()
+{
+    pthread_spin_destroy(&lock_);
+}
+
+void TokenBucket::SetRate(unsigned int rate, unsigned int burst)
+{
+    if (!burst)
+	burst = rate;
+    if (burst && burst < TOKEN_BUCKET_MIN_BURST)
+	burst = TOKEN_BUCKET_MIN_BURST;
+    if (rate == rate_ && burst == burst_)
+	return;
+
+    pthread_spin_lock(&lock_);
+    // 限速从无到有时桶是满的
+    if (!rate_)
+	tokens_ = burst;
+    rate_ = rate;
+    burst_ = burst;
+    if (tokens_ > (int64_t)burst_)
+	tokens_ = burst_;
+    pthread_spin_unlock(&lock_);
+}
+
+void TokenBucket::Refill(uint64_t now_ms)
+{
+    if (now_ms <= last_ms_)
+	return;
+    uint64_t elapsed = now_ms - last_ms_;
+    if (elapsed > TOKEN_BUCKET_MAX_REFILL_MS)
+	elapsed = TOKEN_BUCKET_MAX_REFILL_MS;
+    // 不足一个token的部分留到下次, 低速率时每毫秒调用也不会被截断成0
+    uint64_t milli = elapsed * rate_ + milli_tokens_;
+    tokens_ += milli / 1000;
+    milli_tokens_ = milli % 1000;
+    if (tokens_ >= (int64_t)burst_) {
+	tokens_ = burst_;
+	milli_tokens_ = 0;
+    }
+    last_ms_ = now_ms;
+}
+
+size_t TokenBucket::Available(uint64_t now_ms, size_t want)
+{
+    if (!rate_)
+	return want;
+
+    pthread_spin_lock(&lock_);
+    Refill(now_ms);
+    size_t avail = tokens_ > 0 ? (size_t)tokens_ : 0;
+    pthread_spin_unlock(&lock_);
+    return avail < want ? avail : want;
+}
+
+void TokenBucket::Consume(size_t bytes)
+{
+    if (!rate_)
+	return;
+
+    pthread_spin_lock(&lock_);
+    tokens_ -= bytes;
+    pthread_spin_unlock(&lock_);
+}
+
+unsigned int TokenBucket::WaitTime(size_t bytes)
+{
+    if (!rate_)
+	return 0;
+
+    pthread_spin_lock(&lock_);
+    if (bytes > burst_)
+	bytes = burst_;
+    int64_t lack = (int64_t)bytes - tokens_;
+    unsigned int rate = rate_;
+    pthread_spin_unlock(&lock_);
+
+    if (lack <= 0)
+	return 0;
+    return (unsigned int)((lack * 1000 + rate - 1) / rate);
+}
@@ -0,0 +1,54 @@
+/**
+ * Token bucket for receive bandwidth shaping.
+ *
+ * Tokens are bytes, refilled at rate bytes/second up to burst.
+ * A rate of 0 means unlimited. The bucket never blocks: the caller asks
+ * how many bytes it may read now and, when the answer is 0, how long to
+ * wait before trying again.
+ * Shared buckets (global, per ServChannel) are used from several loop
+ * threads, so every method takes a spin lock.
+ */
+
+#ifndef  TOKEN_BUCKET_INC
+#define  TOKEN_BUCKET_INC
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+class TokenBucket {
+    public:
+    explicit TokenBucket(unsigned int rate = 0, unsigned int burst = 0);
+    ~TokenBucket();
+
+    /**
+     * burst = 0 means one second worth of tokens
+     */
+    void SetRate(unsigned int rate, unsigned int burst = 0);
+    unsigned int Rate() const { return rate_; }
+
+    /**
+     * bytes that may be read at now_ms, at most want
+     */
+    size_t Available(uint64_t now_ms, size_t want);
+    void Consume(size_t bytes);
+
+    /**
+     * milliseconds until bytes tokens are available (bytes is capped to burst)
+     */
+    unsigned int WaitTime(size_t bytes);
+
+    private:
+    TokenBucket(const TokenBucket&);
+    TokenBucket& operator=(const TokenBucket&);
+    void Refill(uint64_t now_ms);
+
+    volatile unsigned int rate_;
+    unsigned int burst_;
+    int64_t tokens_;
+    //不足一个token的余数, 单位1/1000 token
+    unsigned int milli_tokens_;
+    uint64_t last_ms_;
+    pthread_spinlock_t lock_;
+};
+
+#endif   /* ----- #ifndef TOKEN_BUCKET_INC  ----- */
@@ -0,0 +1,342 @@
+/**
+ * epoll与io_uring两种后端的对比测试
+ *
+ * 子进程在127.0.0.1上跑一个最简单的HTTP服务(固定长度的body)，
+ * 父进程用ThreadingFetcher保持c个连接并发抓取，共n个请求，
+ * 输出每种后端的耗时、QPS、客户端CPU时间和系统调用次数。
+ *
+ * bench_backend [-n requests] [-c conns] [-s body_size] [-l loops] [-k] [-b epoll|io_uring|both]
+ *	-k: 使用长连接，否则每个请求重新建连
+ */
+#include "Fetcher.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+static int g_keep_alive = 0;
+static size_t g_body_size = 1024;
+
+/************************* 服务端 *************************/
+
+struct ServConn {
+    int fd;
+    std::string in;
+    std::string out;
+    size_t sent;
+};
+
+static void ServClose(int epfd, ServConn *sc)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sc->fd, NULL);
+    close(sc->fd);
+    delete sc;
+}
+
+static bool ServRead(ServConn *sc)
+{
+    char buf[4096];
+    for (;;) {
+	ssize_t n = read(sc->fd, buf, sizeof(buf));
+	if (n > 0) {
+	    sc->in.append(buf, n);
+	    continue;
+	}
+	if (n < 0 && errno == EAGAIN)
+	    break;
+	return false;
+    }
+
+    // 只处理GET, 一个请求以空行结束
+    size_t pos;
+    while ((pos = sc->in.find("\r\n\r\n")) != std::string::npos) {
+	sc->in.erase(0, pos + 4);
+	char head[256];
+	snprintf(head, sizeof(head),
+		"HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+		g_body_size, g_keep_alive ? "keep-alive" : "close");
+	sc->out.append(head);
+	sc->out.append(g_body_size, 'x');
+    }
+    return true;
+}
+
+static bool ServWrite(ServConn *sc)
+{
+    while (sc->sent < sc->out.size()) {
+	ssize_t n = write(sc->fd, sc->out.data() + sc->sent, sc->out.size() - sc->sent);
+	if (n < 0 && errno == EAGAIN)
+	    return true;
+	if (n <= 0)
+	    return false;
+	sc->sent += n;
+    }
+    sc->out.clear();
+    sc->sent = 0;
+    return g_keep_alive;
+}
+
+static void ServRun(int lfd)
+{
+    int epfd = epoll_create(1024);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    struct epoll_event events[256];
+    for (;;) {
+	int n = epoll_wait(epfd, events, 256, -1);
+	for (int i = 0; i < n; i++) {
+	    ServConn *sc = (ServConn *)events[i].data.ptr;
+	    if (!sc) {
+		int fd;
+		while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		    fcntl(fd, F_SETFL, O_NONBLOCK);
+		    int one = 1;
+		    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		    sc = new ServConn;
+		    sc->fd = fd;
+		    sc->sent = 0;
+		    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		    ev.data.ptr = sc;
+		    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		}
+		continue;
+	    }
+	    if (!ServRead(sc)) {
+		ServClose(epfd, sc);
+		continue;
+	    }
+	    if (!sc->out.empty() && !ServWrite(sc))
+		ServClose(epfd, sc);
+	}
+    }
+}
+
+/************************* 客户端 *************************/
+
+class BenchMessage: public IFetchMessage {
+    public:
+    BenchMessage(): header_end_(0), content_length_(-1), keep_alive_(false) {}
+
+    virtual int Append(const void *data, size_t length)
+    {
+	if (length == 0)
+	    return data_.empty() ? (errno = ECONNRESET, -1) : 0;
+	data_.append((const char *)data, length);
+	if (!header_end_) {
+	    size_t pos = data_.find("\r\n\r\n");
+	    if (pos == std::string::npos)
+		return 1;
+	    header_end_ = pos + 4;
+	    std::string head = data_.substr(0, header_end_);
+	    size_t cl = head.find("Content-Length: ");
+	    if (cl != std::string::npos)
+		content_length_ = atol(head.c_str() + cl + 16);
+	    keep_alive_ = head.find("Connection: keep-alive") != std::string::npos;
+	}
+	if (content_length_ >= 0 && data_.size() >= header_end_ + content_length_)
+	    return 0;
+	return 1;
+    }
+
+    virtual bool IsKeepAlive() const { return keep_alive_; }
+
+    size_t BodySize() const { return data_.size() - header_end_; }
+
+    private:
+    std::string data_;
+    size_t header_end_;
+    long content_length_;
+    bool keep_alive_;
+};
+
+class BenchEvents: public IMessageEvents {
+    public:
+    BenchEvents()
+    {
+	request_ = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n";
+	request_ += g_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+	iov_.iov_base = (void *)request_.data();
+	iov_.iov_len = request_.size();
+	data_.vector = &iov_;
+	data_.count = 1;
+    }
+
+    virtual RequestData* CreateRequestData(void *) { return &data_; }
+    virtual void FreeRequestData(RequestData *) {}
+    virtual IFetchMessage* CreateFetchResponse(const FetchAddress&, void *) { return new BenchMessage; }
+    virtual void FreeFetchMessage(IFetchMessage *message) { delete message; }
+
+    private:
+    std::string request_;
+    struct iovec iov_;
+    RequestData data_;
+};
+
+static double TimeDiff(const struct timeval &begin, const struct timeval &end)
+{
+    return (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1000000.0;
+}
+
+static int Bench(int backend, unsigned short port, int requests, int concurrency, unsigned loops)
+{
+    BenchEvents events;
+    ThreadingFetcher fetcher(&events);
+    Fetcher::Params params;
+    memset(&params, 0, sizeof(params));
+    params.conn_timeout.tv_sec = 10;
+    fetcher.Begin(params, loops, backend);
+    if (fetcher.GetBackend() != backend) {
+	fprintf(stderr, "backend %d not available\n", backend);
+	fetcher.End();
+	return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    FetchAddress address;
+    address.remote_addr = (struct sockaddr *)&addr;
+    address.remote_addrlen = sizeof(addr);
+    address.local_addr = NULL;
+    address.local_addrlen = 0;
+
+    struct rusage ru0, ru1;
+    struct timeval t0, t1;
+    getrusage(RUSAGE_SELF, &ru0);
+    gettimeofday(&t0, NULL);
+
+    std::vector<Connection *> conns;
+    int started = 0, ok = 0, err = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < concurrency && started < requests; i++, started++) {
+	Connection *conn = ThreadingFetcher::CreateConnection(0, AF_INET, SOCK_STREAM, 0, address);
+	conns.push_back(conn);
+	RawFetcherRequest request = {conn, NULL};
+	fetcher.PutRequest(request);
+    }
+    while (ok + err < started) {
+	RawFetcherResult result;
+	struct timeval timeout = {10, 0};
+	if (fetcher.GetResult(&result, &timeout)) {
+	    fprintf(stderr, "timeout, %d requests outstanding\n", started - ok - err);
+	    break;
+	}
+	if (result.err_num) {
+	    err++;
+	    fetcher.CloseConnection(result.conn);
+	} else {
+	    ok++;
+	    BenchMessage *message = (BenchMessage *)result.message;
+	    bytes += message->BodySize();
+	    if (!message->IsKeepAlive())
+		fetcher.CloseConnection(result.conn);
+	    delete message;
+	}
+	if (started < requests) {
+	    RawFetcherRequest request = {result.conn, NULL};
+	    fetcher.PutRequest(request);
+	    started++;
+	}
+    }
+
+    gettimeofday(&t1, NULL);
+    getrusage(RUSAGE_SELF, &ru1);
+    Fetcher::SyscallStats stats;
+    fetcher.GetSyscallStats(&stats);
+    fetcher.End();
+    for (size_t i = 0; i < conns.size(); i++)
+	ThreadingFetcher::FreeConnection(conns[i]);
+
+    double wall = TimeDiff(t0, t1);
+    double user = TimeDiff(ru0.ru_utime, ru1.ru_utime);
+    double sys = TimeDiff(ru0.ru_stime, ru1.ru_stime);
+    uint64_t syscalls = stats.epoll_wait + stats.epoll_ctl_add + stats.epoll_ctl_mod
+	+ stats.read + stats.write + stats.io_uring_enter;
+    printf("%-9s ok=%d err=%d bytes=%zu wall=%.3fs qps=%.0f user=%.3fs sys=%.3fs "
+	    "syscalls=%llu (%.2f/req)\n",
+	    backend == Fetcher::BACKEND_IO_URING ? "io_uring" : "epoll",
+	    ok, err, bytes, wall, wall > 0 ? ok / wall : 0, user, sys,
+	    (unsigned long long)syscalls, ok ? (double)syscalls / ok : 0);
+    printf("          epoll_wait=%llu epoll_ctl_add=%llu epoll_ctl_mod=%llu read=%llu write=%llu io_uring_enter=%llu\n",
+	    (unsigned long long)stats.epoll_wait, (unsigned long long)stats.epoll_ctl_add,
+	    (unsigned long long)stats.epoll_ctl_mod, (unsigned long long)stats.read,
+	    (unsigned long long)stats.write, (unsigned long long)stats.io_uring_enter);
+    return err ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int requests = 20000;
+    int concurrency = 64;
+    unsigned loops = 1;
+    const char *backend = "both";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:s:l:kb:")) != -1) {
+	switch (opt) {
+	    case 'n': requests = atoi(optarg); break;
+	    case 'c': concurrency = atoi(optarg); break;
+	    case 's': g_body_size = atol(optarg); break;
+	    case 'l': loops = atoi(optarg); break;
+	    case 'k': g_keep_alive = 1; break;
+	    case 'b': backend = optarg; break;
+	    default:
+		fprintf(stderr, "usage: %s [-n requests] [-c conns] [-s body_size] [-l loops] [-k] "
+			"[-b epoll|io_uring|both]\n", argv[0]);
+		return 1;
+	}
+    }
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, 4096)
+	    || getsockname(lfd, (struct sockaddr *)&addr, &len)) {
+	perror("listen");
+	return 1;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+
+    // 服务端在子进程，rusage只统计客户端
+    pid_t pid = fork();
+    if (pid == 0) {
+	ServRun(lfd);
+	_exit(0);
+    }
+    close(lfd);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("requests=%d conns=%d body=%zu loops=%u %s\n", requests, concurrency,
+	    g_body_size, loops, g_keep_alive ? "keep-alive" : "close");
+    int ret = 0;
+    if (strcmp(backend, "io_uring"))
+	ret |= Bench(Fetcher::BACKEND_EPOLL, ntohs(addr.sin_port), requests, concurrency, loops);
+    if (strcmp(backend, "epoll"))
+	ret |= Bench(Fetcher::BACKEND_IO_URING, ntohs(addr.sin_port), requests, concurrency, loops);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+#include "LatencyStats.hpp"
+#include <stdio.h>
+#include <assert.h>
+
+int main()
+{
+    LatencyHistogram h;
+    assert(h.Count() == 0 && h.Percentile(50) == 0);
+
+    // 1~1000微秒各一个
+    for (uint64_t us = 1; us <= 1000; us++)
+        h.Add(us);
+    assert(h.Count() == 1000);
+    assert(h.Average() == 500);
+    assert(h.Max() == 1000);
+    // 500落在[256, 512)桶, 990落在[512, 1024)桶但不超过max
+    assert(h.Percentile(50) == 511);
+    assert(h.Percentile(99) == 1000);
+    assert(h.Percentile(100) == 1000);
+
+    // 0单独一个桶
+    LatencyHistogram z;
+    z.Add(0);
+    assert(z.Percentile(50) == 0);
+    h.Merge(z);
+    assert(h.Count() == 1001 && h.Percentile(0) == 0);
+
+    // 特别大的值都进最后一个桶
+    LatencyHistogram big;
+    big.Add(1ULL << 40);
+    assert(big.Percentile(50) == (1ULL << 40));
+
+    // 复用连接: 没有connect/tls, send从开始算
+    LatencyStats stats;
+    FetchTiming t = {1000, 0, 0, 1010, 1500, 1600};
+    stats.AddFetch(t);
+    assert(stats.Get(LatencyStats::LAT_CONNECT).Count() == 0);
+    assert(stats.Get(LatencyStats::LAT_TLS).Count() == 0);
+    assert(stats.Get(LatencyStats::LAT_SEND).Max() == 10);
+    assert(stats.Get(LatencyStats::LAT_TTFB).Max() == 490);
+    assert(stats.Get(LatencyStats::LAT_TRANSFER).Max() == 100);
+    assert(stats.Get(LatencyStats::LAT_FETCH).Max() == 600);
+
+    // 新的https连接
+    FetchTiming s = {1000, 1200, 1700, 1710, 2000, 2001};
+    stats.AddFetch(s);
+    assert(stats.Get(LatencyStats::LAT_CONNECT).Max() == 200);
+    assert(stats.Get(LatencyStats::LAT_TLS).Max() == 500);
+    assert(stats.Get(LatencyStats::LAT_SEND).Count() == 2);
+    assert(stats.Get(LatencyStats::LAT_FETCH).Max() == 1001);
+
+    // 没收完的不计
+    FetchTiming e = {1000, 1200, 0, 0, 0, 0};
+    stats.AddFetch(e);
+    assert(stats.Get(LatencyStats::LAT_CONNECT).Count() == 1);
+
+    LatencyStats all;
+    all.Merge(stats);
+    all.Merge(stats);
+    assert(all.Get(LatencyStats::LAT_FETCH).Count() == 4);
+
+    for (int i = 0; i < LatencyStats::LAT_NPHASES; i++) {
+        const LatencyHistogram &p = all.Get(i);
+        printf("%-8s n=%llu avg=%llu p50=%llu p99=%llu\n",
+            LatencyStats::PhaseName(i), (unsigned long long)p.Count(),
+            (unsigned long long)p.Average(),
+            (unsigned long long)p.Percentile(50),
+            (unsigned long long)p.Percentile(99));
+    }
+    printf("test latency stats ok\n");
+    return 0;
+}
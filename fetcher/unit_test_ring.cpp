@@ -0,0 +1,103 @@
+#include "Ring.hpp"
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+struct Item {
+    unsigned producer;
+    unsigned seq;
+};
+
+static const unsigned PRODUCERS = 4;
+static const unsigned PER_PRODUCER = 200000;
+static MpscRing<Item> mpsc(1024);
+static SpscRing<Item> spsc(64);
+
+static void* MpscProduce(void *arg)
+{
+    unsigned id = (unsigned)(long)arg;
+    Item batch[16];
+    unsigned seq = 0;
+    while (seq < PER_PRODUCER) {
+        // 批大小在1~16间变化
+        unsigned n = 1 + seq % 16;
+        if (n > PER_PRODUCER - seq)
+            n = PER_PRODUCER - seq;
+        for (unsigned i = 0; i < n; i++) {
+            batch[i].producer = id;
+            batch[i].seq = seq + i;
+        }
+        size_t pushed = mpsc.Push(batch, n);
+        seq += pushed;
+        if (!pushed)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void* SpscProduce(void *)
+{
+    for (unsigned seq = 0; seq < PER_PRODUCER; ) {
+        Item item = {0, seq};
+        if (spsc.Push(item))
+            seq++;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t tids[PRODUCERS];
+    for (unsigned i = 0; i < PRODUCERS; i++)
+        pthread_create(&tids[i], NULL, MpscProduce, (void *)(long)i);
+
+    // 每个生产者的元素按顺序到达，不丢不重
+    std::vector<unsigned> next(PRODUCERS, 0);
+    Item items[64];
+    unsigned total = 0;
+    while (total < PRODUCERS * PER_PRODUCER) {
+        size_t n = mpsc.Pop(items, 64);
+        if (!n)
+            sched_yield();
+        for (size_t i = 0; i < n; i++) {
+            assert(items[i].producer < PRODUCERS);
+            assert(items[i].seq == next[items[i].producer]);
+            next[items[i].producer]++;
+        }
+        total += n;
+        assert(mpsc.Size() <= mpsc.Capacity());
+    }
+    for (unsigned i = 0; i < PRODUCERS; i++)
+        pthread_join(tids[i], NULL);
+    assert(mpsc.Size() == 0);
+    assert(!mpsc.Pop(items));
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, SpscProduce, NULL);
+    unsigned expect = 0;
+    while (expect < PER_PRODUCER) {
+        size_t n = spsc.Pop(items, 64);
+        if (!n)
+            sched_yield();
+        for (size_t i = 0; i < n; i++)
+            assert(items[i].seq == expect++);
+    }
+    pthread_join(tid, NULL);
+    assert(spsc.Capacity() == 64);
+
+    // 满时Push只放入剩余的空位
+    SpscRing<Item> small(3);
+    Item batch[8] = {};
+    assert(small.Capacity() == 4);
+    assert(small.Push(batch, 8) == 4);
+    assert(small.Push(batch, 1) == 0);
+    assert(small.Pop(batch, 2) == 2);
+    assert(small.Push(batch, 8) == 2);
+
+    printf("ring test ok\n");
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "TimerWheel.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+struct Item {
+    TimerNode timer;
+    int id;
+};
+
+static int Expire(TimerWheel &wheel, uint64_t prev, uint64_t now)
+{
+    int n = 0;
+    TimerNode *node;
+    while ((node = wheel.pop_expired(now)) != NULL) {
+        assert(!TimerNodePending(node));
+        assert(node->expire <= now);
+        // 不会晚于到期时间触发: 上一次推进时还没到期
+        assert(node->expire > prev || prev == now);
+        n++;
+    }
+    return n;
+}
+
+int main()
+{
+    const int N = 10000;
+    uint64_t now = 1000;
+    TimerWheel wheel(now);
+    Item *items = new Item[N];
+
+    // 随机到期时间，覆盖多级
+    for (int i = 0; i < N; i++) {
+        TimerNodeInit(&items[i].timer);
+        items[i].id = i;
+        wheel.add_back(now + rand() % (1 << 22), items[i].timer);
+    }
+    // 取消一半，重新设置四分之一
+    for (int i = 0; i < N; i += 2)
+        assert(wheel.del(items[i].timer));
+    for (int i = 1; i < N; i += 4) {
+        wheel.del(items[i].timer);
+        wheel.add_back(now + 300, items[i].timer);
+    }
+    assert(wheel.size() == (size_t)N / 2);
+    assert(!wheel.del(items[0].timer));
+
+    int fired = 0;
+    while (!wheel.empty()) {
+        // next_expire是下界，按它推进不会跳过任何定时器
+        uint64_t next = wheel.next_expire();
+        assert(next >= now);
+        uint64_t prev = now;
+        now = next;
+        fired += Expire(wheel, prev, now);
+    }
+    assert(fired == N / 2);
+
+    // 过期时间已过
+    wheel.add_back(now - 10, items[0].timer);
+    assert(Expire(wheel, now, now) == 1);
+    assert(wheel.empty());
+
+    delete [] items;
+    fprintf(stderr, "timer wheel test passed, %d timers fired\n", fired);
+    return 0;
+}
@@ -0,0 +1,54 @@
+//release编译定义了NDEBUG, 这里的assert里有要执行的调用
+#undef NDEBUG
+#include <assert.h>
+#include "TokenBucket.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+// 每毫秒取一次, 有多少取多少, 返回seconds秒内取到的字节数
+static uint64_t Drain(TokenBucket &bucket, uint64_t now, unsigned int seconds)
+{
+    // 先把满桶取空, 只算补充进来的
+    bucket.Consume(bucket.Available(now, (size_t)-1));
+    uint64_t total = 0;
+    for (uint64_t t = now + 1; t <= now + seconds * 1000; t++) {
+        size_t n = bucket.Available(t, (size_t)-1);
+        bucket.Consume(n);
+        total += n;
+    }
+    return total;
+}
+
+int main()
+{
+    // 不是1000整数倍的速率, 之前按毫秒截断后500B/s取不到数据
+    unsigned int rates[] = {1, 500, 999, 1500, 4097, 100000, 123457};
+    const unsigned int SECONDS = 10;
+    uint64_t now = 1000;
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        TokenBucket bucket(rates[i]);
+        uint64_t total = Drain(bucket, now, SECONDS);
+        uint64_t expect = (uint64_t)rates[i] * SECONDS;
+        // 余数累积, 最多差一个token
+        assert(total + 1 >= expect && total <= expect);
+        now += SECONDS * 1000;
+    }
+
+    // 隔很久才取也不超过burst
+    TokenBucket bucket(500, 8192);
+    bucket.Consume(bucket.Available(now, (size_t)-1));
+    assert(bucket.Available(now + 3600 * 1000, (size_t)-1) == 8192);
+
+    // 欠着的token要补回来才能再取, WaitTime按速率算
+    bucket.Consume(8192 + 1000);
+    assert(bucket.Available(now + 3600 * 1000 + 1000, (size_t)-1) == 0);
+    assert(bucket.WaitTime(500) == 2000);
+
+    // 不限速
+    TokenBucket unlimited;
+    assert(unlimited.Available(now, 12345) == 12345);
+    assert(unlimited.WaitTime(12345) == 0);
+
+    fprintf(stderr, "token bucket test passed\n");
+    return 0;
+}
@@ -3,11 +3,13 @@
 
 #include "linklist/linked_list.hpp"
 #include "linklist/linked_list_map.hpp"
+#include "linklist/timing_wheel.hpp"
 #include "SchedulerTypes.hpp"
 #include "httpparser/TUtility.hpp"
 #include "lock/lock.hpp"
 #include "httpparser/HttpFetchProtocal.hpp"
 #include "Resource.hpp"
+#include "LocalAddrPool.hpp"
 #include "utility/stastic_count.h"
 
 /**
@@ -40,13 +42,17 @@ struct HostChannel
     unsigned    ref_cnt_;
     //dns更新时间
     time_t      update_time_;
+    //最近一次dns结果到达的时间, CLOCK_MONOTONIC微秒
+    uint64_t    dns_done_us_;
+    //所属的调度分片, 见HttpClient::SetSchedulerThreads
+    unsigned    shard_;
     SpinLock    lock_;
 
     HostChannel(): 
         scheme_(PROTOCOL_HTTP), dns_resolving_(0),
         host_error_(0), port_(80), host_key_(0), 
         serv_(NULL), fetch_interval_ms_(0), 
-        ref_cnt_(0), update_time_(0)
+        ref_cnt_(0), update_time_(0), dns_done_us_(0), shard_(0)
     {}
     HostKey GetHostKey() const
     {
@@ -58,26 +64,227 @@ typedef linked_list_t<HostChannel, &HostChannel::queue_node_> HostChannelList;
 typedef linked_list_t<Resource, &Resource::queue_node_> ResourceList; 
 typedef boost::shared_ptr<ResourceList> ResourceListPtr; 
 
+/**
+ * 同一serv在各调度分片的ServChannel共用的限额: 并发数, 抓取间隔, 自适应窗口.
+ * 调度分片按HostKey划分, 解析到同一IP的Host可能落在不同分片, 各分片有自己的
+ * ServChannel和连接, 限额放在这里才是按serv算的. 各分片线程都会访问, 加锁
+ */
+struct ServLimit
+{
+    typedef long long ServKey;
+    //自适应并发: 健康时每次成功抓取间隔减少的毫秒数, 退避时间隔的上下限
+    static const unsigned ADAPT_INTERVAL_STEP_MS = 20;
+    static const unsigned ADAPT_MIN_BACKOFF_MS   = 100;
+    static const unsigned ADAPT_MAX_INTERVAL_MS  = 30000;
+    //响应时间超过基线的这么多倍(且多出ADAPT_LATENCY_SLACK_MS)视为serv变慢
+    static const unsigned ADAPT_LATENCY_INFLATE  = 3;
+    static const unsigned ADAPT_LATENCY_SLACK_MS = 50;
+
+    ServKey  serv_key_;
+    //引用它的ServChannel数目, 见ChannelManager::CreateServChannel
+    unsigned ref_cnt_;
+    //各分片正在抓取的总数
+    unsigned fetching_;
+    //并发上限: 一个ServChannel的连接数*流水线深度, 0为不限
+    unsigned slots_;
+    //记录最近的抓取时间
+    time_t   fetch_time_ms_;
+    //抓取间隔时间 
+    unsigned fetch_interval_ms_;
+    //自适应并发(AIMD)的窗口上限, 为0时不用: 并发数和抓取间隔固定
+    unsigned adapt_max_window_;
+    //允许同时抓取的数目: 健康时每轮加1, 超时/5xx/变慢时减半
+    double   adapt_window_;
+    //自适应的抓取间隔, 实际间隔不小于fetch_interval_ms_
+    unsigned adapt_interval_ms_;
+    //最近一次退避的时间, 一轮抓取内只退避一次
+    time_t   adapt_backoff_ms_;
+    //响应时间基线: 观察到的最小值, 慢慢上浮以跟随serv的变化
+    double   adapt_base_resp_ms_;
+    //因并发满停下的分片, 第i位对应分片i%64, 放出额度时通知
+    uint64_t waiters_;
+    SpinLock lock_;
+
+    ServLimit(ServKey serv_key, unsigned slots):
+        serv_key_(serv_key), ref_cnt_(0), fetching_(0), slots_(slots),
+        fetch_time_ms_(0), fetch_interval_ms_(0),
+        adapt_max_window_(0), adapt_window_(1.0),
+        adapt_interval_ms_(0), adapt_backoff_ms_(0),
+        adapt_base_resp_ms_(0), waiters_(0)
+    {}
+
+    //window为初始窗口, 即连接数
+    void SetAdaptive(unsigned max_window, unsigned window)
+    {
+        SpinGuard guard(lock_);
+        adapt_max_window_ = max_window;
+        adapt_window_     = window;
+        if(adapt_window_ < 1.0)
+            adapt_window_ = 1.0;
+        if(adapt_window_ > max_window)
+            adapt_window_ = max_window;
+    }
+    //当前的自适应窗口, 不用自适应时为0
+    unsigned GetWindow()
+    {
+        SpinGuard guard(lock_);
+        return adapt_max_window_ ? (unsigned)adapt_window_ : 0;
+    }
+    void SetFetchInterval(unsigned fetch_interval_ms)
+    {
+        SpinGuard guard(lock_);
+        if(fetch_interval_ms && fetch_interval_ms < fetch_interval_ms_)
+            fetch_interval_ms_ = fetch_interval_ms;
+    }
+    unsigned GetFetchInterval()
+    {
+        SpinGuard guard(lock_);
+        return fetch_interval_ms_;
+    }
+    //err_delay_ms为该分片ServChannel的错误退避时间
+    time_t GetReadyTime(time_t err_delay_ms)
+    {
+        SpinGuard guard(lock_);
+        return __ready_time(err_delay_ms);
+    }
+    /**
+     * 还有并发额度时返回true, 否则记下shard, 有额度时通知
+     */
+    bool TryOpen(unsigned shard)
+    {
+        SpinGuard guard(lock_);
+        if(__open())
+            return true;
+        waiters_ |= 1ULL << (shard % 64);
+        return false;
+    }
+    /**
+     * 到了就绪时间且有并发额度时占用一个, 记下抓取时间, 返回true.
+     * 还没到就绪时间时ready_time为就绪时间; 并发满时ready_time为0, 
+     * 记下shard, 放出额度时通知
+     */
+    bool TryAcquire(time_t cur_time, time_t err_delay_ms, unsigned shard, time_t* ready_time)
+    {
+        SpinGuard guard(lock_);
+        *ready_time = 0;
+        if(!__open())
+        {
+            waiters_ |= 1ULL << (shard % 64);
+            return false;
+        }
+        time_t ready = __ready_time(err_delay_ms);
+        if(ready > cur_time)
+        {
+            *ready_time = ready;
+            return false;
+        }
+        ++fetching_;
+        fetch_time_ms_ = cur_time;
+        return true;
+    }
+    /**
+     * 放出一个额度, 返回要通知的分片, 见waiters_
+     */
+    uint64_t Release()
+    {
+        SpinGuard guard(lock_);
+        if(fetching_)
+            --fetching_;
+        if(!waiters_ || !__open())
+            return 0;
+        uint64_t waiters = waiters_;
+        waiters_ = 0;
+        return waiters;
+    }
+    //抓取成功, resp_ms为响应时间: 加性增大窗口, 减小间隔; 明显变慢时退避.
+    //healthy为错误率是否正常, 不正常时保持不动
+    void AdaptSucc(time_t resp_ms, time_t cur_time, bool healthy)
+    {
+        SpinGuard guard(lock_);
+        if(!adapt_max_window_)
+            return;
+        double resp = (double)resp_ms;
+        if(adapt_base_resp_ms_ <= 0 || resp < adapt_base_resp_ms_)
+            adapt_base_resp_ms_ = resp;
+        else
+            adapt_base_resp_ms_ += (resp - adapt_base_resp_ms_) / 256;
+        if(resp > adapt_base_resp_ms_*ADAPT_LATENCY_INFLATE && 
+           resp > adapt_base_resp_ms_ + ADAPT_LATENCY_SLACK_MS)
+        {
+            __adapt_backoff(cur_time);
+            return;
+        }
+        if(!healthy)
+            return;
+        adapt_window_ += 1.0 / adapt_window_;
+        if(adapt_window_ > adapt_max_window_)
+            adapt_window_ = adapt_max_window_;
+        if(adapt_interval_ms_ > ADAPT_INTERVAL_STEP_MS)
+            adapt_interval_ms_ -= ADAPT_INTERVAL_STEP_MS;
+        else
+            adapt_interval_ms_ = 0;
+    }
+    //超时/连接错误/5xx: 窗口减半, 间隔加倍
+    void AdaptBackoff(time_t cur_time)
+    {
+        SpinGuard guard(lock_);
+        if(adapt_max_window_)
+            __adapt_backoff(cur_time);
+    }
+
+private:
+    bool __open() const
+    {
+        if(adapt_max_window_)
+            return fetching_ < (unsigned)adapt_window_;
+        return !slots_ || fetching_ < slots_;
+    }
+    time_t __ready_time(time_t delay_time) const
+    {
+        if(delay_time < fetch_interval_ms_)
+            delay_time = fetch_interval_ms_;
+        if(delay_time < adapt_interval_ms_)
+            delay_time = adapt_interval_ms_;
+        return fetch_time_ms_ + delay_time;
+    }
+    void __adapt_backoff(time_t cur_time)
+    {
+        //同一轮发出的抓取一起失败时只算一次
+        time_t round_ms = adapt_interval_ms_ + (time_t)adapt_base_resp_ms_;
+        if(adapt_backoff_ms_ && cur_time < adapt_backoff_ms_ + round_ms)
+            return;
+        adapt_backoff_ms_ = cur_time;
+        adapt_window_ /= 2;
+        if(adapt_window_ < 1.0)
+            adapt_window_ = 1.0;
+        adapt_interval_ms_ *= 2;
+        if(adapt_interval_ms_ < ADAPT_MIN_BACKOFF_MS)
+            adapt_interval_ms_ = ADAPT_MIN_BACKOFF_MS;
+        if(adapt_interval_ms_ > ADAPT_MAX_INTERVAL_MS)
+            adapt_interval_ms_ = ADAPT_MAX_INTERVAL_MS;
+    }
+};
+
 struct ServChannel
 {
     //正在抓取的resource
-    typedef long long ServKey;
+    typedef ServLimit::ServKey ServKey;
 
     static const double DEFAULT_MAX_ERR_RATE  = 0.8;
     static const ConcurencyMode DEFAULT_CONCURENCY_MODE = CONCURENCY_PER_SERV;
     static const double DEFAULT_ERR_DELAY_SEC = 0;
     static const unsigned DEFAULT_MAX_ERR_NUM = 20;
+    //错误退避时间最多翻倍到err_delay_sec_的2^ERR_BACKOFF_MAX_SHIFT倍
+    static const unsigned ERR_BACKOFF_MAX_SHIFT = 8;
 
     //统计错误率
     StasticCount<double, 100> err_rate_;
-    //记录最近的抓取时间
-    time_t   fetch_time_ms_;
     //统计对端服务器答复的快慢
     StasticCount<double, 100> resp_time_;
     //该serv的国内外属性
     unsigned char is_foreign_: 1;
     //该serv连续失败的次数
-    unsigned char err_count_ : 1;
+    uint16_t err_count_;
     uint16_t err_delay_sec_;
     //并发模式
     ConcurencyMode concurency_mode_;
@@ -85,10 +292,10 @@ struct ServChannel
     std::deque<Connection*> conn_storage_;
     //流控队列的链接指针
     linked_list_node_t queue_node_;
+    //在流控时间轮中的就绪时间
+    time_t queue_key_;
     //cache队列的链接指针
     linked_list_node_t cache_node_;
-    //抓取间隔时间 
-    unsigned fetch_interval_ms_;
     //连续失败的最大次数
     unsigned max_err_count_;
     //该serv允许的最大错误率 
@@ -104,28 +311,70 @@ struct ServChannel
     //固定serv的res
     ResPriorQueue * pres_wait_queue_;
     std::string serv_addr_str_;
+    //该serv总的入流量限速, 为NULL时不限
+    TokenBucket * rx_bucket_;
+    //该serv单个连接的入流量限速, bytes/seconds
+    unsigned conn_rx_speed_max_;
+    //http流水线: 每个连接在conn_storage_里占这么多个位置, 为0时不用流水线
+    unsigned pipeline_depth_;
+    //本地源地址池, 为NULL时连接都绑定同一个本地地址
+    LocalAddrPool * addr_pool_;
+    //各分片共用的并发数, 抓取间隔和自适应窗口
+    ServLimit * limit_;
+    //本分片借出的连接数, 即本分片正在抓取的数目
+    unsigned fetching_count_;
+    //PER_SERV模式下窗口大于连接数时, 从它复制新连接; 自己不借出
+    Connection * conn_template_;
+    //创建时的连接数和当前的连接数, 不含conn_template_
+    unsigned conn_base_;
+    unsigned conn_count_;
 
-    //fetch_interval_ms为抓取的间隔时间, 单位为毫秒
     ServChannel():
-        fetch_time_ms_(0), is_foreign_(0), err_count_(0), 
+        is_foreign_(0), err_count_(0), 
         err_delay_sec_(DEFAULT_ERR_DELAY_SEC), 
         concurency_mode_(DEFAULT_CONCURENCY_MODE), 
-        fetch_interval_ms_(0), 
+        queue_key_(0),
         max_err_count_(DEFAULT_MAX_ERR_NUM),
         max_err_rate_(DEFAULT_MAX_ERR_RATE), 
-        serv_key_(0), pres_wait_queue_(NULL)
+        serv_key_(0), pres_wait_queue_(NULL),
+        rx_bucket_(NULL), conn_rx_speed_max_(0),
+        pipeline_depth_(0), addr_pool_(NULL),
+        limit_(NULL), fetching_count_(0),
+        conn_template_(NULL), conn_base_(0), conn_count_(0)
     {}
 
+    //错误退避的时间(毫秒), 抓取间隔见ServLimit
+    time_t GetErrDelayMs() const
+    {
+        unsigned shift = err_count_;
+        if(shift > ERR_BACKOFF_MAX_SHIFT)
+            shift = ERR_BACKOFF_MAX_SHIFT;
+        return (time_t)err_delay_sec_*(2 << shift)*1000;
+    }
     time_t GetReadyTime() const
     {
-        unsigned delay_time = err_delay_sec_*(2 << err_count_)*1000;
-        if(delay_time < fetch_interval_ms_)
-            delay_time = fetch_interval_ms_;
-        return fetch_time_ms_ + delay_time;
+        return limit_->GetReadyTime(GetErrDelayMs());
     }
-    void SetFetchTime(time_t cur_time)
+    //PER_SERV下连接都借出时, 窗口允许的话可以再加一个连接
+    bool CanAddConnection() const
     {
-        fetch_time_ms_ = cur_time;
+        return conn_template_ && conn_count_ < limit_->GetWindow();
+    }
+    //归还的连接是否多于窗口, 多的关掉
+    bool ConnectionSurplus() const
+    {
+        return conn_template_ && conn_count_ > conn_base_ && 
+            conn_count_ > limit_->GetWindow();
+    }
+    //抓取成功, resp_ms为响应时间, 见ServLimit::AdaptSucc; 错误率不健康时窗口保持不动
+    void AdaptSucc(time_t resp_ms, time_t cur_time)
+    {
+        limit_->AdaptSucc(resp_ms, cur_time, err_rate_.Average() <= max_err_rate_ / 2);
+    }
+    //超时/连接错误/5xx: 窗口减半, 间隔加倍
+    void AdaptBackoff(time_t cur_time)
+    {
+        limit_->AdaptBackoff(cur_time);
     }
     void AddSucc()
     {
@@ -135,13 +384,23 @@ struct ServChannel
     }
     void AddFail()
     {
-        ++err_count_;
+        if(err_count_ < 0xffff)
+            ++err_count_;
         err_rate_.Add(1.0);
     }
     void AddRespTime(time_t resp_time)
     {
         resp_time_.Add(resp_time); 
     }
+    //rx_speed_max, conn_rx_speed_max为0表示不限速
+    void SetRxSpeed(unsigned rx_speed_max, unsigned conn_rx_speed_max)
+    {
+        if(rx_speed_max && !rx_bucket_)
+            rx_bucket_ = new TokenBucket();
+        if(rx_bucket_)
+            rx_bucket_->SetRate(rx_speed_max);
+        conn_rx_speed_max_ = conn_rx_speed_max;
+    }
     void SetForeign(bool is_foreign)
     {
         is_foreign_ = (char)is_foreign;
@@ -156,7 +415,7 @@ struct ServChannel
     }
     double GetFetchIntervalMs() const
     {
-        return fetch_interval_ms_; 
+        return limit_->GetFetchInterval(); 
     }
     bool IsForeign() const
     {
@@ -1,11 +1,13 @@
+#include <algorithm>
 #include "utility/net_utility.h"
 #include "ChannelManager.hpp"
 #include "fetcher/Fetcher.hpp"
 #include "log/log.h"
 
-DEFINE_SINGLETON(ChannelManager);
+ChannelManager::ServLimitMap ChannelManager::serv_limit_map_;
+Mutex ChannelManager::serv_limit_lock_;
 
-ChannelManager::ChannelManager()
+ChannelManager::ChannelManager(unsigned shard): shard_(shard)
 {
     host_cache_cnt_ = 0;
     serv_cache_cnt_ = 0;
@@ -40,16 +42,69 @@ Resource* ChannelManager::__pop_resource(HostChannel* host_channel)
 
 Connection* ChannelManager::__acquire_connection(ServChannel* serv_channel)
 {
+    ++serv_channel->fetching_count_;
+    //自适应并发: 连接都借出了, 从模板复制一个
+    if(serv_channel->conn_storage_.empty())
+    {
+        Connection* new_conn = ThreadingFetcher::CreateConnection(serv_channel->conn_template_);
+        if(new_conn && serv_channel->addr_pool_)
+        {
+            struct sockaddr_storage remote_addr;
+            ThreadingFetcher::GetSockAddr(new_conn, &remote_addr);
+            serv_channel->addr_pool_->Acquire(new_conn, remote_addr.ss_family);
+        }
+        ++serv_channel->conn_count_;
+        return new_conn;
+    }
     Connection* conn = serv_channel->conn_storage_.front();
     serv_channel->conn_storage_.pop_front();
     if(serv_channel->concurency_mode_ == CONCURENCY_NO_LIMIT)
     {
         serv_channel->conn_storage_.push_back(conn);
-        return ThreadingFetcher::CreateConnection(conn);
+        Connection* new_conn = ThreadingFetcher::CreateConnection(conn);
+        if(new_conn && serv_channel->addr_pool_)
+        {
+            struct sockaddr_storage remote_addr;
+            ThreadingFetcher::GetSockAddr(conn, &remote_addr);
+            serv_channel->addr_pool_->Acquire(new_conn, remote_addr.ss_family);
+        }
+        return new_conn;
     }
     return conn;
 }
 
+void ChannelManager::__release_limit(ServChannel* serv_channel)
+{
+    uint64_t waiters = serv_channel->limit_->Release();
+    //本分片的serv由调用方check_serv_ready
+    if(waiters && serv_wake_cb_)
+        serv_wake_cb_(waiters, serv_channel->serv_key_);
+}
+
+ServLimit* ChannelManager::__acquire_serv_limit(ServChannel::ServKey serv_key, 
+    unsigned slots, unsigned adapt_max_window, unsigned window)
+{
+    MutexGuard guard(serv_limit_lock_);
+    ServLimit*& limit = serv_limit_map_[serv_key];
+    if(!limit)
+    {
+        limit = new ServLimit(serv_key, slots);
+        if(adapt_max_window)
+            limit->SetAdaptive(adapt_max_window, window);
+    }
+    ++limit->ref_cnt_;
+    return limit;
+}
+
+void ChannelManager::__release_serv_limit(ServLimit* limit)
+{
+    MutexGuard guard(serv_limit_lock_);
+    if(--limit->ref_cnt_)
+        return;
+    serv_limit_map_.erase(limit->serv_key_);
+    delete limit;
+}
+
 void ChannelManager::check_add_cache(ServChannel* serv_channel)
 {
     if(serv_channel && __empty(serv_channel) && 
@@ -126,11 +181,7 @@ void ChannelManager::SetServChannel(HostChannel* host_channel, ServChannel * ser
         }
         host_channel->host_error_ = 0;
         //更新抓取速度
-        if(host_channel->fetch_interval_ms_ && 
-                host_channel->fetch_interval_ms_ < serv_channel->fetch_interval_ms_)
-        {
-            serv_channel->fetch_interval_ms_ = host_channel->fetch_interval_ms_;
-        }
+        serv_channel->limit_->SetFetchInterval(host_channel->fetch_interval_ms_);
         __update_serv_host_state(host_channel);
         check_remove_cache(serv_channel);
     }
@@ -159,24 +210,41 @@ void ChannelManager::DestroyChannel(ServChannel* serv_channel)
     serv_ready_lst_map_.del(*serv_channel);
     //remove from cache list
     ServCacheList::del(*serv_channel);
-    //erase connection
+    //erase connection, 流水线连接在conn_storage_里有多份
+    if(serv_channel->pipeline_depth_)
+    {
+        std::sort(serv_channel->conn_storage_.begin(), serv_channel->conn_storage_.end());
+        serv_channel->conn_storage_.erase(std::unique(serv_channel->conn_storage_.begin(), 
+            serv_channel->conn_storage_.end()), serv_channel->conn_storage_.end());
+    }
     while(!serv_channel->conn_storage_.empty())
     {
         Connection * conn = serv_channel->conn_storage_.front();
         serv_channel->conn_storage_.pop_front();
+        if(serv_channel->addr_pool_)
+            serv_channel->addr_pool_->Release(conn);
         ThreadingFetcher::FreeConnection(conn); 
     }
+    if(serv_channel->conn_template_)
+        ThreadingFetcher::FreeConnection(serv_channel->conn_template_);
     //remove host channel && resource
     HostChannel * host_channel = NULL;
     while(!serv_channel->idle_host_lst_.empty())
     {
         host_channel = serv_channel->idle_host_lst_.get_front();
         //SpinGuard guard(host_channel->lock_);
-        HostChannelList::del(*host_channel);
+        //经由链表头摘除, 静态del(*host_channel)在gcc -O1下会被优化成死循环
+        serv_channel->idle_host_lst_.pop_front();
         host_channel->serv_ = NULL;
     }
     if(serv_channel->pres_wait_queue_)
         delete serv_channel->pres_wait_queue_;
+    if(serv_channel->rx_bucket_)
+        delete serv_channel->rx_bucket_;
+    //还借出的连接不再归还, 额度还给别的分片
+    for(; serv_channel->fetching_count_; --serv_channel->fetching_count_)
+        __release_limit(serv_channel);
+    __release_serv_limit(serv_channel->limit_);
     delete serv_channel;
 }
 
@@ -272,6 +340,8 @@ void ChannelManager::RemoveResource(Resource* res)
         {
             if(res->conn_)
             {
+                --serv_channel->fetching_count_;
+                __release_limit(serv_channel);
                 (serv_channel->conn_storage_).push_back(res->conn_);
                 res->conn_ = NULL;
             }
@@ -319,8 +389,7 @@ void ChannelManager::SetFetchIntervalMs(HostChannel* host_channel,
     //SpinGuard serv_guard(__serv_lock(serv_channel));
     //SpinGuard host_guard(host_channel->lock_);
     host_channel->fetch_interval_ms_ = fetch_interval_ms;
-    if(fetch_interval_ms && fetch_interval_ms < serv_channel->fetch_interval_ms_)
-        serv_channel->fetch_interval_ms_ = fetch_interval_ms;
+    serv_channel->limit_->SetFetchInterval(fetch_interval_ms);
 }
 
 bool ChannelManager::CheckResolveDns(HostChannel* host_channel, 
@@ -352,15 +421,23 @@ void ChannelManager::ReleaseConnection(Resource* res)
         //reset back to HTTPS
         if(res->proxy_state_ == Resource::PROXY_CONNECT)
             ThreadingFetcher::SetConnectionScheme(res->conn_, PROTOCOL_HTTPS);
-        if(res->serv_->concurency_mode_ != CONCURENCY_NO_LIMIT)
+        --res->serv_->fetching_count_;
+        __release_limit(res->serv_);
+        //自适应并发的窗口缩小后, 多出的连接关掉
+        if(res->serv_->concurency_mode_ != CONCURENCY_NO_LIMIT && 
+           !res->serv_->ConnectionSurplus())
             (res->serv_->conn_storage_).push_back(res->conn_);
         else
+        {
+            if(res->serv_->concurency_mode_ != CONCURENCY_NO_LIMIT)
+                --res->serv_->conn_count_;
+            if(res->serv_->addr_pool_)
+                res->serv_->addr_pool_->Release(res->conn_);
             ThreadingFetcher::FreeConnection(res->conn_);
+        }
         res->conn_ = NULL;
     }
     check_serv_ready(res->serv_);
-    char conn_str[100];
-    ThreadingFetcher::ConnectionToString(res->serv_->conn_storage_[0], conn_str, 100);
 }
 
 Resource* ChannelManager::pop_resource(ServChannel* serv_channel)
@@ -392,21 +469,33 @@ void ChannelManager::pop_available_resources(
     time_t cur_time = current_time_ms(); 
     //没有可抓的 或者 当前无连接可用
     while(!__wait_empty(serv_channel) 
-        && serv_channel->conn_storage_.size() > 0
+        && __can_fetch(serv_channel)
         && res_vec.size() < max_count)
     {
-        time_t ready_time = serv_channel->GetReadyTime();
-        if(ready_time >= cur_time)
+        //就绪时间和并发额度在各分片共用的ServLimit上一起检查、占用;
+        //并发满时等别的分片放出额度后通知, 见__release_limit
+        time_t ready_time = 0;
+        if(!serv_channel->limit_->TryAcquire(cur_time, 
+            serv_channel->GetErrDelayMs(), shard_, &ready_time))
         {
-            serv_ready_lst_map_.add_back(ready_time, *serv_channel);
-            if(min_ready_time_ > ready_time)
-                min_ready_time_ = ready_time;
+            //到了就绪的那一毫秒即可抓, 否则间隔为0的serv会按当前时间重新入队, 马上又被取出
+            if(ready_time)
+            {
+                serv_ready_lst_map_.add_back(ready_time, *serv_channel);
+                if(min_ready_time_ > ready_time)
+                    min_ready_time_ = ready_time;
+            }
             break;
         }
         Connection* conn = __acquire_connection(serv_channel);
         Resource*    res = pop_resource(serv_channel);
-        serv_channel->SetFetchTime(cur_time);
         res->conn_       = conn;
+        if(!serv_channel->pipeline_depth_)
+        {
+            ThreadingFetcher::SetConnectionRxLimit(conn, 
+                serv_channel->rx_bucket_, serv_channel->conn_rx_speed_max_);
+            ThreadingFetcher::SetConnectionServerName(conn, res->host_->host_.c_str());
+        }
         char conn_str[100];
         ThreadingFetcher::ConnectionToString(conn, conn_str, 100);
         // proxy connect时, 使用http协议
@@ -425,20 +514,19 @@ std::vector<Resource*> ChannelManager::PopAvailableResources(unsigned max_count)
     if(min_ready_time_ > cur_time)
         return res_vec;
     //SpinGuard ready_guard(serv_ready_lock_);
-    while(!serv_ready_lst_map_.empty() && res_vec.size() < max_count)
+    ServChannel* serv_channel = NULL; 
+    while(res_vec.size() < max_count && 
+        (serv_channel = serv_ready_lst_map_.pop_expired(cur_time)) != NULL)
     {
-        time_t ready_time    = 0;
-        ServChannel* serv_channel = NULL; 
-        serv_ready_lst_map_.get_front(ready_time, serv_channel);
-        if(ready_time > cur_time)
-        {
-            min_ready_time_ = ready_time;
-            break;
-        }
         //SpinGuard serv_guard(serv_channel->lock_);
-        serv_ready_lst_map_.pop_front();
         pop_available_resources(serv_channel, res_vec, max_count);
     }
+    if(!serv_ready_lst_map_.empty())
+    {
+        time_t ready_time = serv_ready_lst_map_.next_expire();
+        if(ready_time > cur_time)
+            min_ready_time_ = ready_time;
+    }
     return res_vec;
 }
 
@@ -446,11 +534,11 @@ std::vector<Resource*> ChannelManager::PopAvailableResources(unsigned max_count)
 void ChannelManager::check_serv_ready(ServChannel * serv_channel)
 {
     if(serv_channel && !__wait_empty(serv_channel) && 
-        serv_channel->conn_storage_.size() && 
+        __can_fetch(serv_channel) && 
         (serv_channel->queue_node_).empty() )
     {
         if(!__wait_empty(serv_channel) && 
-          serv_channel->conn_storage_.size() && 
+          __can_fetch(serv_channel) && 
             (serv_channel->queue_node_).empty() )
         {
             //SpinGuard ready_guard(serv_ready_lock_);
@@ -463,7 +551,7 @@ void ChannelManager::check_serv_ready(ServChannel * serv_channel)
     }
 }
 
-std::string ChannelManager::ToString(HostChannel* host_channel) const
+std::string ChannelManager::ToString(HostChannel* host_channel)
 {
     char buf[2048];
     size_t sz = snprintf(buf, 2048, "%s://%s", protocal2str(host_channel->scheme_), (host_channel->host_).c_str());
@@ -475,7 +563,7 @@ std::string ChannelManager::ToString(HostChannel* host_channel) const
     return buf;
 }
 
-std::string ChannelManager::ToString(ServChannel* serv_channel) const
+std::string ChannelManager::ToString(ServChannel* serv_channel)
 {
     return serv_channel->serv_addr_str_;
     /*
@@ -487,12 +575,11 @@ std::string ChannelManager::ToString(ServChannel* serv_channel) const
         conn = serv_channel->fetching_lst_.get_front()->conn_;
     if(!conn)
         return "0.0.0.0";
-    sockaddr* addr = (sockaddr*)malloc(sizeof(sockaddr));
-    ThreadingFetcher::GetSockAddr(conn, addr);
+    struct sockaddr_storage addr;
+    ThreadingFetcher::GetSockAddr(conn, &addr);
     char addr_str[20];
     uint16_t port = 0;
-    get_addr_string(addr, addr_str, 10, port);
-    free(addr);
+    get_addr_string((struct sockaddr*)&addr, addr_str, 10, port);
     size_t addr_len = strlen(addr_str);
     snprintf(addr_str + addr_len, 20 - addr_len, ":%hu", port);
     return addr_str;
@@ -503,15 +590,24 @@ ServChannel* ChannelManager::CreateServChannel(
     char scheme, struct addrinfo* ai, 
     ServChannel::ServKey serv_key, 
     ConcurencyMode concurency_mode,
-    unsigned max_err_rate, unsigned max_err_count,
-    unsigned err_delay_sec, struct sockaddr* local_addr)
+    double max_err_rate, unsigned max_err_count,
+    unsigned err_delay_sec, struct sockaddr* local_addr,
+    unsigned rx_speed_max, unsigned conn_rx_speed_max,
+    unsigned pipeline_depth, LocalAddrPool* addr_pool,
+    unsigned adapt_max_window)
 {
     ServChannel * serv     = new ServChannel();
     serv->concurency_mode_ = concurency_mode;
+    serv->SetRxSpeed(rx_speed_max, conn_rx_speed_max);
     serv->serv_key_        = serv_key;
     serv->max_err_rate_  = max_err_rate;
     serv->max_err_count_ = max_err_count;
     serv->err_delay_sec_ = err_delay_sec;
+    serv->addr_pool_     = addr_pool;
+    //流水线只用于PER_SERV模式的http: https连接绑定SNI, 不能给同一serv上的不同host共用
+    if(pipeline_depth > 1 && scheme == PROTOCOL_HTTP && 
+        concurency_mode == CONCURENCY_PER_SERV)
+        serv->pipeline_depth_ = pipeline_depth;
     struct addrinfo * cur_ai = ai;
     serv->serv_addr_str_.clear();
     while(cur_ai)
@@ -523,19 +619,44 @@ ServChannel* ChannelManager::CreateServChannel(
         serv->serv_addr_str_ += addr_str;
         FetchAddress fetch_addr;
         fetch_addr.remote_addr    = cur_ai->ai_addr;
-        fetch_addr.remote_addrlen = sizeof(struct sockaddr);
-        fetch_addr.local_addr     = local_addr;
+        fetch_addr.remote_addrlen = cur_ai->ai_addrlen;
         fetch_addr.local_addr     = local_addr;
-        if(!fetch_addr.local_addr)
-            fetch_addr.local_addrlen = 0;
-        else
-            fetch_addr.local_addrlen = sizeof(struct sockaddr);
+        fetch_addr.local_addrlen  = get_sockaddr_len(local_addr);
         Connection* conn = ThreadingFetcher::CreateConnection(
             (int)scheme, cur_ai->ai_family, cur_ai->ai_socktype, 
             cur_ai->ai_protocol, fetch_addr);
-        serv->conn_storage_.push_back(conn); 
+        // 多个地址时第一个地址的连接建连在所有地址间赛跑, 见Params::connect_attempt_delay_ms;
+        // 其余的连接固定连自己的地址, 否则都会收敛到最快的那个地址上
+        if(cur_ai == ai && ai->ai_next)
+            ThreadingFetcher::SetConnectionAddrList(conn, ai);
+        //池里有同族地址时代替local_addr
+        if(addr_pool)
+            addr_pool->Acquire(conn, cur_ai->ai_family);
+        if(serv->pipeline_depth_)
+        {
+            //借出时连接可能正忙, 限速只在这里设置一次
+            ThreadingFetcher::SetConnectionPipeline(conn, serv->pipeline_depth_);
+            ThreadingFetcher::SetConnectionRxLimit(conn, 
+                serv->rx_bucket_, serv->conn_rx_speed_max_);
+        }
+        serv->conn_storage_.push_back(conn);
         cur_ai = cur_ai->ai_next;
     }
+    //每个流水线连接占pipeline_depth_个位置, 轮流借出
+    size_t conn_num = serv->conn_storage_.size();
+    for(unsigned i = 1; i < serv->pipeline_depth_; i++)
+        for(size_t j = 0; j < conn_num; j++)
+            serv->conn_storage_.push_back(serv->conn_storage_[j]);
+    serv->conn_base_  = conn_num;
+    serv->conn_count_ = conn_num;
+    //自适应并发: PER_SERV的非流水线连接可以按窗口增减, 其它模式只用窗口限制并发
+    if(adapt_max_window && concurency_mode == CONCURENCY_PER_SERV && 
+        !serv->pipeline_depth_ && conn_num)
+        serv->conn_template_ = ThreadingFetcher::CreateConnection(serv->conn_storage_.front());
+    //各分片的该serv合计不超过一个ServChannel的连接数(流水线时乘上深度)
+    unsigned slots = concurency_mode == CONCURENCY_NO_LIMIT ? 0 : serv->conn_storage_.size();
+    serv->limit_ = __acquire_serv_limit(serv_key, slots, adapt_max_window, 
+        serv->conn_storage_.size());
     return serv;
 }
 
@@ -552,6 +673,13 @@ HostChannel* ChannelManager::CreateHostChannel(
     return host_channel;
 }
 
+time_t ChannelManager::NextReadyTime()
+{
+    if(serv_ready_lst_map_.empty())
+        return 0;
+    return serv_ready_lst_map_.next_expire();
+}
+
 bool ChannelManager::HasAvailableResource()
 {
     return min_ready_time_ <= current_time_ms(); 
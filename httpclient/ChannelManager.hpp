@@ -1,16 +1,31 @@
 #ifndef __CHANNEL_MANAGER_HPP
 #define __CHANNEL_MANAGER_HPP
 
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
 #include "Channel.hpp" 
-#include "singleton/Singleton.h"
 
 /*** function **/
+//每个调度分片一个, 只在该分片的调度线程访问, 不加锁;
+//ServLimit表是全进程共享的, 加锁
 class ChannelManager
 {
-    DECLARE_SINGLETON(ChannelManager);
-    typedef linked_list_map<time_t, ServChannel, &ServChannel::queue_node_> ServWaitMap;
+    ChannelManager(const ChannelManager&);
+    ChannelManager& operator=(const ChannelManager&);
+    typedef timing_wheel_t<time_t, ServChannel, &ServChannel::queue_node_, &ServChannel::queue_key_> ServWaitMap;
+    typedef boost::unordered_map<ServChannel::ServKey, ServLimit*> ServLimitMap;
+
+public:
+    //共用的serv放出并发额度时通知别的分片: 分片掩码(见ServLimit::waiters_), serv key
+    typedef boost::function<void (uint64_t, ServChannel::ServKey)> ServWakeCallback;
 
 private:
+    //各分片的同一serv共用一个ServLimit
+    static ServLimitMap serv_limit_map_;
+    static Mutex        serv_limit_lock_;
+
+    unsigned      shard_;
+    ServWakeCallback serv_wake_cb_;
     HostCacheList host_cache_lst_;
     //SpinLock      host_cache_lock_; 
     unsigned      host_cache_cnt_;
@@ -25,6 +40,10 @@ protected:
     void __update_serv_host_state(HostChannel* host_channel);
     Resource* __pop_resource(HostChannel* host_channel);
     Connection* __acquire_connection(ServChannel* serv_channel);
+    void __release_limit(ServChannel* serv_channel);
+    static ServLimit* __acquire_serv_limit(ServChannel::ServKey serv_key, 
+        unsigned slots, unsigned adapt_max_window, unsigned window);
+    static void __release_serv_limit(ServLimit* limit);
 
     /**** inline operation ****/
     SpinLock& __serv_lock(ServChannel * serv_channel)
@@ -52,6 +71,13 @@ protected:
     {
         return host_channel->res_wait_queue_.empty();
     }
+    //有空闲连接(或可以再加一个), 且各分片合计的并发未满
+    bool __can_fetch(ServChannel* serv_channel)
+    {
+        return (!serv_channel->conn_storage_.empty() || 
+               serv_channel->CanAddConnection()) && 
+               serv_channel->limit_->TryOpen(shard_);
+    }
 
 protected:
     void check_add_cache(ServChannel* serv_channel);
@@ -64,11 +90,25 @@ protected:
         std::vector<Resource*>&, unsigned max_count);
 
 public:
+    explicit ChannelManager(unsigned shard = 0);
+
+    void SetServWakeCallback(ServWakeCallback serv_wake_cb)
+    {
+        serv_wake_cb_ = serv_wake_cb;
+    }
+    //别的分片放出了共用的并发额度, 重新检查该serv
+    void CheckServReady(ServChannel* serv_channel)
+    {
+        check_serv_ready(serv_channel);
+    }
+
     unsigned GetHostCacheSize() { return host_cache_cnt_;}
     unsigned GetServCacheSize() { return serv_cache_cnt_;}
 
     bool WaitEmpty(ServChannel* serv_channel);
     bool HasAvailableResource(); 
+    //下一个serv可以取资源的时间(毫秒), 没有等待中的serv时返回0
+    time_t NextReadyTime();
     void SetServChannel(HostChannel*, ServChannel *);
     void DestroyChannel(HostChannel* host_channel);
     void DestroyChannel(ServChannel* serv_channel);
@@ -76,8 +116,11 @@ public:
         char scheme, struct addrinfo* ai, 
         ServChannel::ServKey serv_key, 
         ConcurencyMode concurency_mode, 
-        unsigned max_err_rate, unsigned max_err_count,
-        unsigned err_delay_sec, struct sockaddr* local_addr);
+        double max_err_rate, unsigned max_err_count,
+        unsigned err_delay_sec, struct sockaddr* local_addr,
+        unsigned rx_speed_max = 0, unsigned conn_rx_speed_max = 0,
+        unsigned pipeline_depth = 0, LocalAddrPool* addr_pool = NULL,
+        unsigned adapt_max_window = 0);
     HostChannel* CreateHostChannel(
         char scheme, const std::string& host, unsigned port, 
         HostChannel::HostKey host_key, 
@@ -88,8 +131,8 @@ public:
     void ReleaseConnection(Resource* res);
     void SetFetchIntervalMs(HostChannel*, unsigned);
     bool CheckResolveDns(HostChannel*, time_t, time_t);
-    std::string ToString(HostChannel* host_channel) const;
-    std::string ToString(ServChannel* serv_channel) const;
+    static std::string ToString(HostChannel* host_channel);
+    static std::string ToString(ServChannel* serv_channel);
     ResourceListPtr RemoveUnfinishRes(ServChannel* serv_channel);
     ResourceListPtr RemoveUnfinishRes(HostChannel* host_channel);
     std::vector<HostChannel*> PopHostCache(unsigned cnt);
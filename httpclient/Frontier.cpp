@@ -0,0 +1,440 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "Frontier.hpp"
+#include "log/log.h"
+
+Frontier::Frontier(size_t window, size_t segment_size):
+    window_(window), segment_size_(segment_size), cursor_fd_(-1),
+    base_seq_(1), dirty_(false)
+{
+    for(unsigned p = 0; p < __RES_PRIORITY_NUM; p++)
+    {
+        Queue& q = queues_[p];
+        q.write_fd_ = -1;
+        q.read_seg_ = q.commit_seg_ = 0;
+        q.read_off_ = q.commit_off_ = 0;
+        q.map_ = NULL;
+        q.map_len_ = 0;
+        q.map_seg_ = 0;
+    }
+}
+
+Frontier::~Frontier()
+{
+    Sync();
+    for(unsigned p = 0; p < __RES_PRIORITY_NUM; p++)
+    {
+        __unmap(queues_[p]);
+        if(queues_[p].write_fd_ >= 0)
+            close(queues_[p].write_fd_);
+    }
+    if(cursor_fd_ >= 0)
+        close(cursor_fd_);
+}
+
+std::string Frontier::__seg_path(unsigned prior, uint64_t id) const
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/p%u-%010llu.seg", prior, (unsigned long long)id);
+    return dir_ + name;
+}
+
+size_t Frontier::__find_seg(Queue& q, uint64_t id)
+{
+    Segment key;
+    key.id_ = id;
+    return std::lower_bound(q.segs_.begin(), q.segs_.end(), key) - q.segs_.begin();
+}
+
+bool Frontier::Open(const char* dir)
+{
+    MutexGuard guard(lock_);
+    dir_ = dir;
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        LOG_ERROR("create frontier dir %s error: %s\n", dir, strerror(errno));
+        return false;
+    }
+    std::string cursor_path = dir_ + "/cursor";
+    cursor_fd_ = open(cursor_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(cursor_fd_ < 0)
+    {
+        LOG_ERROR("open frontier cursor %s error: %s\n", cursor_path.c_str(), strerror(errno));
+        return false;
+    }
+    CursorFile cursor;
+    if(pread(cursor_fd_, &cursor, sizeof(cursor), 0) != (ssize_t)sizeof(cursor)
+        || cursor.magic_ != CURSOR_MAGIC)
+        memset(&cursor, 0, sizeof(cursor));
+
+    std::vector<uint64_t> ids[__RES_PRIORITY_NUM];
+    DIR* pdir = opendir(dir);
+    if(!pdir)
+    {
+        LOG_ERROR("open frontier dir %s error: %s\n", dir, strerror(errno));
+        return false;
+    }
+    struct dirent* ent;
+    while((ent = readdir(pdir)) != NULL)
+    {
+        unsigned prior = 0;
+        unsigned long long id = 0;
+        int len = 0;
+        if(sscanf(ent->d_name, "p%u-%llu.seg%n", &prior, &id, &len) == 2
+            && len == (int)strlen(ent->d_name)
+            && prior > RES_PRIORITY_NOUSE && prior < __RES_PRIORITY_NUM)
+            ids[prior].push_back(id);
+    }
+    closedir(pdir);
+
+    for(unsigned p = RES_PRIORITY_LEVEL_1; p < __RES_PRIORITY_NUM; p++)
+    {
+        queues_[p].commit_seg_ = cursor.pos_[p][0];
+        queues_[p].commit_off_ = cursor.pos_[p][1];
+        if(!__recover(p, ids[p]))
+            return false;
+    }
+    dirty_ = true;
+    __write_cursor();
+    return true;
+}
+
+bool Frontier::__recover(unsigned prior, std::vector<uint64_t>& ids)
+{
+    Queue& q = queues_[prior];
+    std::sort(ids.begin(), ids.end());
+    for(size_t i = 0; i < ids.size(); i++)
+    {
+        std::string path = __seg_path(prior, ids[i]);
+        //提交位置之前的, 上次没来得及删
+        if(ids[i] < q.commit_seg_)
+        {
+            unlink(path.c_str());
+            continue;
+        }
+        struct stat st;
+        if(stat(path.c_str(), &st) < 0)
+            continue;
+        Segment seg;
+        seg.id_ = ids[i];
+        seg.size_ = st.st_size;
+        q.segs_.push_back(seg);
+    }
+    if(q.segs_.empty())
+    {
+        q.commit_seg_ = q.commit_seg_ ? q.commit_seg_ : 1;
+        q.commit_off_ = 0;
+        q.read_seg_ = q.commit_seg_;
+        q.read_off_ = 0;
+        return __open_write_seg(prior, q.commit_seg_, true);
+    }
+    if(q.commit_seg_ < q.segs_.front().id_)
+    {
+        q.commit_seg_ = q.segs_.front().id_;
+        q.commit_off_ = 0;
+    }
+
+    //只有最后一个分段可能写了一半, 截掉不完整的记录
+    Segment& last = q.segs_.back();
+    size_t off = last.id_ == q.commit_seg_ ? std::min(q.commit_off_, last.size_) : 0;
+    if(off < last.size_ && __map(q, prior, last))
+    {
+        while(off + sizeof(uint32_t) <= last.size_)
+        {
+            uint32_t len;
+            memcpy(&len, q.map_ + off, sizeof(len));
+            if(!len || len > MAX_URI_LENGTH || off + sizeof(len) + len > last.size_)
+                break;
+            off += sizeof(len) + len;
+        }
+        __unmap(q);
+    }
+    if(off < last.size_)
+    {
+        LOG_WARNING("frontier segment %s truncated from %zu to %zu\n",
+            __seg_path(prior, last.id_).c_str(), last.size_, off);
+        if(truncate(__seg_path(prior, last.id_).c_str(), off) < 0)
+        {
+            LOG_ERROR("truncate frontier segment error: %s\n", strerror(errno));
+            return false;
+        }
+        last.size_ = off;
+    }
+    Segment& commit = q.segs_[std::min(__find_seg(q, q.commit_seg_), q.segs_.size() - 1)];
+    if(commit.id_ != q.commit_seg_ || q.commit_off_ > commit.size_)
+    {
+        q.commit_seg_ = commit.id_;
+        q.commit_off_ = std::min(q.commit_off_, commit.size_);
+    }
+    q.read_seg_ = q.commit_seg_;
+    q.read_off_ = q.commit_off_;
+    return __open_write_seg(prior, last.id_, false);
+}
+
+//create为新建分段, 否则接着已有的分段写
+bool Frontier::__open_write_seg(unsigned prior, uint64_t id, bool create)
+{
+    Queue& q = queues_[prior];
+    std::string path = __seg_path(prior, id);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC
+        | (create ? O_TRUNC : 0), 0644);
+    if(fd < 0)
+    {
+        LOG_ERROR("open frontier segment %s error: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    if(q.write_fd_ >= 0)
+        close(q.write_fd_);
+    q.write_fd_ = fd;
+    if(create)
+    {
+        Segment seg;
+        seg.id_ = id;
+        seg.size_ = 0;
+        q.segs_.push_back(seg);
+    }
+    return true;
+}
+
+bool Frontier::__flush(unsigned prior)
+{
+    Queue& q = queues_[prior];
+    if(q.buf_.empty())
+        return true;
+    Segment& seg = q.segs_.back();
+    size_t done = 0;
+    while(done < q.buf_.size())
+    {
+        ssize_t n = write(q.write_fd_, q.buf_.data() + done, q.buf_.size() - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            LOG_ERROR("write frontier segment %s error: %s\n",
+                __seg_path(prior, seg.id_).c_str(), strerror(errno));
+            //写了一半的去掉, 缓冲里的丢弃
+            if(ftruncate(q.write_fd_, seg.size_) < 0)
+                LOG_ERROR("truncate frontier segment error: %s\n", strerror(errno));
+            q.buf_.clear();
+            return false;
+        }
+        done += n;
+    }
+    seg.size_ += done;
+    q.buf_.clear();
+    return true;
+}
+
+bool Frontier::__map(Queue& q, unsigned prior, const Segment& seg)
+{
+    if(q.map_ && q.map_seg_ == seg.id_ && q.map_len_ >= seg.size_)
+        return true;
+    __unmap(q);
+    //正在写的分段按分段大小映射, 写进来的不用重新映射
+    size_t len = seg.size_;
+    if(&seg == &q.segs_.back())
+        len = std::max(len, segment_size_);
+    std::string path = __seg_path(prior, seg.id_);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        LOG_ERROR("open frontier segment %s error: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    void* addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)
+    {
+        LOG_ERROR("mmap frontier segment %s error: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    q.map_ = (char*)addr;
+    q.map_len_ = len;
+    q.map_seg_ = seg.id_;
+    return true;
+}
+
+void Frontier::__unmap(Queue& q)
+{
+    if(q.map_)
+    {
+        munmap(q.map_, q.map_len_);
+        q.map_ = NULL;
+        q.map_len_ = 0;
+        q.map_seg_ = 0;
+    }
+}
+
+bool Frontier::Append(const std::string& url, ResourcePriority prior)
+{
+    if(url.empty() || url.size() > MAX_URI_LENGTH
+        || prior <= RES_PRIORITY_NOUSE || prior >= __RES_PRIORITY_NUM)
+        return false;
+    MutexGuard guard(lock_);
+    Queue& q = queues_[prior];
+    if(q.write_fd_ < 0)
+        return false;
+    uint32_t len = url.size();
+    size_t cur_size = q.segs_.back().size_ + q.buf_.size();
+    if(cur_size && cur_size + sizeof(len) + len > segment_size_)
+    {
+        if(!__flush(prior) || !__open_write_seg(prior, q.segs_.back().id_ + 1, true))
+            return false;
+    }
+    q.buf_.append((const char*)&len, sizeof(len));
+    q.buf_.append(url);
+    if(q.buf_.size() >= BUFFER_SIZE)
+        return __flush(prior);
+    return true;
+}
+
+size_t Frontier::Take(std::vector<Record>& records, size_t max_count)
+{
+    MutexGuard guard(lock_);
+    size_t count = 0;
+    for(unsigned p = RES_PRIORITY_LEVEL_1; p < __RES_PRIORITY_NUM; p++)
+    {
+        Queue& q = queues_[p];
+        if(q.write_fd_ < 0)
+            continue;
+        while(count < max_count && tickets_.size() < window_)
+        {
+            size_t idx = __find_seg(q, q.read_seg_);
+            Segment& seg = q.segs_[idx];
+            if(q.read_off_ >= seg.size_)
+            {
+                if(idx + 1 < q.segs_.size())
+                {
+                    q.read_seg_ = q.segs_[idx + 1].id_;
+                    q.read_off_ = 0;
+                    continue;
+                }
+                //读到了写的位置, 缓冲里的写下去接着读
+                if(q.buf_.empty() || !__flush(p))
+                    break;
+                continue;
+            }
+            if(!__map(q, p, seg))
+                break;
+            uint32_t len;
+            memcpy(&len, q.map_ + q.read_off_, sizeof(len));
+            if(!len || len > MAX_URI_LENGTH || q.read_off_ + sizeof(len) + len > seg.size_)
+            {
+                LOG_ERROR("frontier segment %s corrupted at %zu\n",
+                    __seg_path(p, seg.id_).c_str(), q.read_off_);
+                q.read_off_ = seg.size_;
+                continue;
+            }
+            records.push_back(Record());
+            Record& record = records.back();
+            record.seq_ = base_seq_ + tickets_.size();
+            record.prior_ = (ResourcePriority)p;
+            record.url_.assign(q.map_ + q.read_off_ + sizeof(len), len);
+            q.read_off_ += sizeof(len) + len;
+            Ticket ticket;
+            ticket.prior_ = p;
+            ticket.done_ = false;
+            ticket.seg_ = q.read_seg_;
+            ticket.end_off_ = q.read_off_;
+            tickets_.push_back(ticket);
+            count++;
+        }
+    }
+    return count;
+}
+
+void Frontier::Release(uint64_t seq)
+{
+    MutexGuard guard(lock_);
+    if(seq < base_seq_ || seq - base_seq_ >= tickets_.size())
+        return;
+    tickets_[seq - base_seq_].done_ = true;
+    unsigned touched = 0;
+    while(!tickets_.empty() && tickets_.front().done_)
+    {
+        const Ticket& ticket = tickets_.front();
+        Queue& q = queues_[ticket.prior_];
+        q.commit_seg_ = ticket.seg_;
+        q.commit_off_ = ticket.end_off_;
+        touched |= 1 << ticket.prior_;
+        tickets_.pop_front();
+        base_seq_++;
+        dirty_ = true;
+    }
+    for(unsigned p = RES_PRIORITY_LEVEL_1; touched && p < __RES_PRIORITY_NUM; p++)
+    {
+        if(touched & (1 << p))
+            __drop_committed(p);
+    }
+}
+
+void Frontier::__drop_committed(unsigned prior)
+{
+    Queue& q = queues_[prior];
+    while(q.segs_.size() > 1 && q.segs_.front().id_ < q.commit_seg_)
+    {
+        if(q.map_seg_ == q.segs_.front().id_)
+            __unmap(q);
+        unlink(__seg_path(prior, q.segs_.front().id_).c_str());
+        q.segs_.pop_front();
+    }
+}
+
+void Frontier::__write_cursor()
+{
+    if(!dirty_ || cursor_fd_ < 0)
+        return;
+    CursorFile cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.magic_ = CURSOR_MAGIC;
+    for(unsigned p = 0; p < __RES_PRIORITY_NUM; p++)
+    {
+        cursor.pos_[p][0] = queues_[p].commit_seg_;
+        cursor.pos_[p][1] = queues_[p].commit_off_;
+    }
+    if(pwrite(cursor_fd_, &cursor, sizeof(cursor), 0) != (ssize_t)sizeof(cursor))
+    {
+        LOG_ERROR("write frontier cursor error: %s\n", strerror(errno));
+        return;
+    }
+    dirty_ = false;
+}
+
+void Frontier::Sync()
+{
+    MutexGuard guard(lock_);
+    for(unsigned p = RES_PRIORITY_LEVEL_1; p < __RES_PRIORITY_NUM; p++)
+    {
+        if(queues_[p].write_fd_ >= 0)
+            __flush(p);
+    }
+    __write_cursor();
+}
+
+void Frontier::GetStats(Stats* stats)
+{
+    MutexGuard guard(lock_);
+    stats->queued_bytes = 0;
+    stats->segments = 0;
+    stats->outstanding = tickets_.size();
+    for(unsigned p = RES_PRIORITY_LEVEL_1; p < __RES_PRIORITY_NUM; p++)
+    {
+        Queue& q = queues_[p];
+        stats->segments += q.segs_.size();
+        for(size_t i = 0; i < q.segs_.size(); i++)
+        {
+            if(q.segs_[i].id_ == q.read_seg_)
+                stats->queued_bytes += q.segs_[i].size_ - std::min(q.read_off_, q.segs_[i].size_);
+            else if(q.segs_[i].id_ > q.read_seg_)
+                stats->queued_bytes += q.segs_[i].size_;
+        }
+        stats->queued_bytes += q.buf_.size();
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef __FRONTIER_HPP
+#define __FRONTIER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "lock/lock.hpp"
+#include "SchedulerTypes.hpp"
+
+/**
+    磁盘上的抓取队列: 请求按优先级追加写到dir下的分段文件p<prior>-<id>.seg,
+    每条为4字节长度+url. 读端mmap分段, 按优先级从高到低取, 内存里只有取出
+    还没抓完的(至多window条). 抓完后Release, 按取出顺序连续完成的部分推进
+    提交位置, 写进dir/cursor, 提交位置之前的分段删除.
+    崩溃或Close时取出没抓完的和没取的, 下次Open从提交位置重新取, 至少抓一次;
+    Append先写进缓冲, 满BUFFER_SIZE或Sync时才写进文件, 崩溃丢掉缓冲里的.
+    用户线程Append, 各调度线程Take/Release, 加锁
+**/
+class Frontier
+{
+public:
+    static const size_t DEFAULT_SEGMENT_SIZE = 64 << 20;
+    static const size_t BUFFER_SIZE = 64 << 10;
+
+    struct Record
+    {
+        uint64_t seq_;
+        ResourcePriority prior_;
+        std::string url_;
+    };
+
+    struct Stats
+    {
+        uint64_t queued_bytes;  //各分段里还没取的(含缓冲)
+        size_t   outstanding;   //取出还没Release的
+        size_t   segments;
+    };
+
+    Frontier(size_t window, size_t segment_size = DEFAULT_SEGMENT_SIZE);
+    ~Frontier();
+
+    bool Open(const char* dir);
+    bool Append(const std::string& url, ResourcePriority prior);
+    /**
+     * 取至多max_count条, 已取出未Release的加上本次不超过window
+     */
+    size_t Take(std::vector<Record>& records, size_t max_count);
+    void Release(uint64_t seq);
+    //缓冲写进分段文件, 提交位置写进cursor文件
+    void Sync();
+    void GetStats(Stats* stats);
+
+private:
+    struct Segment
+    {
+        uint64_t id_;
+        size_t   size_;
+
+        bool operator < (const Segment& other) const { return id_ < other.id_; }
+    };
+    //一个优先级的分段
+    struct Queue
+    {
+        //按id升序, back为正在写的
+        std::deque<Segment> segs_;
+        int write_fd_;
+        std::string buf_;
+        uint64_t read_seg_;
+        size_t   read_off_;
+        uint64_t commit_seg_;
+        size_t   commit_off_;
+        //读端当前映射的分段
+        char*    map_;
+        size_t   map_len_;
+        uint64_t map_seg_;
+    };
+    //取出的请求, 按seq顺序
+    struct Ticket
+    {
+        unsigned prior_;
+        bool     done_;
+        uint64_t seg_;
+        size_t   end_off_;
+    };
+    struct CursorFile
+    {
+        uint64_t magic_;
+        uint64_t pos_[__RES_PRIORITY_NUM][2];
+    };
+
+    static const uint64_t CURSOR_MAGIC = 0x31544e4f5246ULL;
+
+    Frontier(const Frontier&);
+    Frontier& operator = (const Frontier&);
+
+    std::string __seg_path(unsigned prior, uint64_t id) const;
+    //第一个id不小于id的分段的下标
+    size_t __find_seg(Queue& q, uint64_t id);
+    bool __recover(unsigned prior, std::vector<uint64_t>& ids);
+    bool __open_write_seg(unsigned prior, uint64_t id, bool create);
+    bool __flush(unsigned prior);
+    bool __map(Queue& q, unsigned prior, const Segment& seg);
+    void __unmap(Queue& q);
+    void __drop_committed(unsigned prior);
+    void __write_cursor();
+
+    size_t window_;
+    size_t segment_size_;
+    std::string dir_;
+    int cursor_fd_;
+    Queue queues_[__RES_PRIORITY_NUM];
+    std::deque<Ticket> tickets_;
+    //tickets_.front()的seq
+    uint64_t base_seq_;
+    bool dirty_;
+    Mutex lock_;
+};
+
+#endif
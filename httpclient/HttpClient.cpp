@@ -1,4 +1,7 @@
 #include <HttpClient.hpp>
+#include <algorithm>
+#include <new>
+#include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
 #include "lock/lock.hpp"
 #include "TRedirectChecker.hpp"
@@ -8,6 +11,15 @@
 
 typedef Storage::HostKey HostKey;
 
+//Pool每次从fetcher取结果的批大小
+#define FETCH_RESULT_BATCH 256
+//Pool没有事件时最多睡这么久, 兜底没有通知的状态变化
+#define MAX_POOL_WAIT_MS 1000
+//调度线程每轮从frontier取的上限
+#define FRONTIER_TAKE_BATCH 1024
+//frontier缓冲和提交位置写盘的间隔
+#define FRONTIER_SYNC_MS 100
+
 struct FetchRequest
 {
     URI uri_;
@@ -19,6 +31,10 @@ struct FetchRequest
     struct addrinfo * proxy_ai_;
     Resource*         root_res_;
     time_t            fetch_time_;
+    //处理该请求的调度分片
+    unsigned          shard_;
+    //从frontier取出的seq, 0为不是
+    uint64_t          frontier_seq_;
 
     FetchRequest(
             const URI& uri,
@@ -34,6 +50,8 @@ struct FetchRequest
         batch_cfg_(batch_cfg), proxy_ai_(proxy_ai)
     {
         root_res_ = NULL;
+        shard_ = 0;
+        frontier_seq_ = 0;
     }
 
     FetchRequest(const URI& uri, Resource* root_res)
@@ -46,9 +64,29 @@ struct FetchRequest
         batch_cfg_ = NULL;
         proxy_ai_ = NULL; 
         root_res_ = root_res;    
+        shard_ = 0;
+        frontier_seq_ = 0;
     }
 };
 
+//FetchRequest在目标分片的request_pool_上placement new
+static void __free_request(SizeClassPool& pool, FetchRequest* request)
+{
+    request->~FetchRequest();
+    pool.Free(request);
+}
+
+//DNS请求的上下文, 结果交回发起解析的分片
+struct DnsContext
+{
+    HostKey  host_key_;
+    unsigned shard_;
+
+    DnsContext(HostKey host_key, unsigned shard):
+        host_key_(host_key), shard_(shard)
+    {}
+};
+
 static FETCH_FAIL_GROUP __srv_error_group(int error) 
 {
     assert(error);
@@ -58,26 +96,28 @@ static FETCH_FAIL_GROUP __srv_error_group(int error)
 HttpClient::HttpClient(
     size_t max_req_size, size_t max_result_size, const char* eth_name, 
     boost::shared_ptr<DNSResolver> dns_resolver):
-    request_queue_(max_req_size*2), 
     result_queue_(max_result_size), 
+    result_backpressure_(false),
     max_req_size_(max_req_size),
     max_result_size_(max_result_size),
     cur_req_size_(0),
-    cur_time_(0), stopped_(false), local_addr_(NULL),
+    stopped_(false), local_addr_(NULL),
     serv_concurency_mode_(ServChannel::DEFAULT_CONCURENCY_MODE),
     serv_max_err_rate_(ServChannel::DEFAULT_MAX_ERR_RATE),
     serv_err_delay_sec_(ServChannel::DEFAULT_ERR_DELAY_SEC),
     serv_max_err_count_(ServChannel::DEFAULT_MAX_ERR_NUM),
+    serv_rx_speed_max_(0), conn_rx_speed_max_(0),
+    serv_pipeline_depth_(0),
+    serv_adapt_max_window_(0),
+    fetch_loop_count_(1),
+    fetch_backend_(Fetcher::BACKEND_EPOLL),
     dns_update_time_(HostChannel::DEFAULT_DNS_UPDATE_TIME),
     dns_error_time_(HostChannel::DEFAULT_DNS_ERROR_TIME) 
 {
-    fetcher_.reset(new ThreadingFetcher(this));
     if(!dns_resolver)
         dns_resolver_.reset(new DNSResolver());
     else
         dns_resolver_ = dns_resolver;
-    pthread_create(&tid_, NULL, RunThread, this);
-    channel_manager_ = ChannelManager::Instance();
     if(eth_name)
     {
         local_addr_ = (struct sockaddr*)malloc(sizeof(struct sockaddr));
@@ -87,18 +127,57 @@ HttpClient::HttpClient(
     }
     memset(&fetcher_params_, 0, sizeof(fetcher_params_));
     BatchConfig batch_cfg;
-    default_batch_cfg_ = Storage::Instance()->AcquireBatchCfg(BatchConfig::DEFAULT_BATCH_ID, batch_cfg);
+    default_batch_cfg_ = Storage::AcquireBatchCfg(BatchConfig::DEFAULT_BATCH_ID, batch_cfg);
+    __create_shards(1);
+}
+
+HttpClient::Shard::Shard(HttpClient* client, unsigned idx, size_t max_req_size):
+    idx_(idx), client_(client), tid_(0), running_(false),
+    request_pool_(true), request_queue_(max_req_size*2), cur_time_(0),
+    result_overflow_size_(0), result_blocked_us_(0),
+    result_block_begin_us_(0), frontier_sync_time_(0)
+{
+    fetcher_.reset(new ThreadingFetcher(client));
+    fetcher_->SetNotifyCallback(boost::bind(&Notifier::Notify, &notifier_));
+    channel_manager_.reset(new ChannelManager(idx));
+    channel_manager_->SetServWakeCallback(
+        boost::bind(&HttpClient::__wake_serv, client, this, _1, _2));
+    storage_.reset(new Storage(channel_manager_, idx));
+}
+
+//只能在调度线程启动之前调用
+void HttpClient::__create_shards(unsigned shard_count)
+{
+    shards_.clear();
+    for(unsigned i = 0; i < shard_count; i++)
+    {
+        ShardPtr shard(new Shard(this, i, max_req_size_));
+        shard->fetcher_->UpdateParams(fetcher_params_);
+        shards_.push_back(shard);
+    }
 }
 
 BatchConfig* HttpClient::AcquireBatchCfg(const std::string& batch_id, const BatchConfig& batch_cfg)
 {
-    return Storage::Instance()->AcquireBatchCfg(batch_id, batch_cfg);
+    return Storage::AcquireBatchCfg(batch_id, batch_cfg);
 }
 
 void HttpClient::Open()
 {
     dns_resolver_->Open();
-    fetcher_->Begin(fetcher_params_);
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        Shard* shard = shards_[i].get();
+        if(shard->running_)
+            continue;
+        shard->fetcher_->SetCreditFlowControl(result_backpressure_);
+        shard->storage_->SetFrontier(frontier_.get());
+        shard->fetcher_->Begin(fetcher_params_, fetch_loop_count_, fetch_backend_);
+        if(pthread_create(&shard->tid_, NULL, RunThread, shard) == 0)
+            shard->running_ = true;
+        else
+            LOG_ERROR("shard %u, create scheduler thread failed\n", i);
+    }
 }
 
 void HttpClient::SetServConfig(
@@ -112,6 +191,45 @@ void HttpClient::SetServConfig(
     serv_max_err_count_   = serv_max_err_count;
 }
 
+//只对之后创建的ServChannel生效
+void HttpClient::SetServRxSpeed(unsigned serv_rx_speed_max, unsigned conn_rx_speed_max)
+{
+    serv_rx_speed_max_ = serv_rx_speed_max;
+    conn_rx_speed_max_ = conn_rx_speed_max;
+}
+
+//只对之后创建的ServChannel生效
+void HttpClient::SetServPipeline(unsigned pipeline_depth)
+{
+    serv_pipeline_depth_ = pipeline_depth;
+}
+
+//只对之后创建的ServChannel生效
+void HttpClient::SetServAdaptive(unsigned max_window)
+{
+    serv_adapt_max_window_ = max_window;
+}
+
+bool HttpClient::AddLocalAddr(const char* ip, uint16_t port_min, uint16_t port_max)
+{
+    if(!local_addr_pool_.Add(ip, port_min, port_max))
+    {
+        LOG_ERROR("%s, invalid local address\n", ip);
+        return false;
+    }
+    return true;
+}
+
+void HttpClient::SetLocalAddrPolicy(LocalAddrPool::Policy policy)
+{
+    local_addr_pool_.SetPolicy(policy);
+}
+
+void HttpClient::GetLocalAddrStats(std::vector<LocalAddrPool::Stat>& stats)
+{
+    local_addr_pool_.GetStats(stats);
+}
+
 void HttpClient::SetDnsCacheTime(time_t dns_update_time, time_t dns_error_time)
 {
     dns_update_time_ = dns_update_time;
@@ -121,25 +239,49 @@ void HttpClient::SetDnsCacheTime(time_t dns_update_time, time_t dns_error_time)
 void HttpClient::SetDefaultBatchConfig(const BatchConfig& batch_cfg)
 {
     std::string default_batch_id = BatchConfig::DEFAULT_BATCH_ID;
-    Storage::Instance()->UpdateBatchConfig(default_batch_id, batch_cfg);
+    Storage::UpdateBatchConfig(default_batch_id, batch_cfg);
 }
 
 void HttpClient::UpdateBatchConfig(std::string batch_id, const BatchConfig& batch_cfg)
 {
-    Storage::Instance()->UpdateBatchConfig(batch_id, batch_cfg);
+    Storage::UpdateBatchConfig(batch_id, batch_cfg);
 }
 
 void HttpClient::SetFetcherParams(Fetcher::Params params)
 {
     memcpy(&fetcher_params_, &params, sizeof(params));
-    fetcher_->UpdateParams(fetcher_params_);
+    for(unsigned i = 0; i < shards_.size(); i++)
+        shards_[i]->fetcher_->UpdateParams(fetcher_params_);
+}
+
+//需在Open之前调用
+void HttpClient::SetSchedulerThreads(unsigned thread_count)
+{
+    if(!thread_count)
+        thread_count = 1;
+    if(thread_count == shards_.size() || shards_[0]->running_)
+        return;
+    __create_shards(thread_count);
+}
+
+//需在Open之前调用
+void HttpClient::SetFetchLoopCount(unsigned loop_count)
+{
+    fetch_loop_count_ = loop_count ? loop_count : 1;
+}
+
+//需在Open之前调用, io_uring不可用时退回epoll
+void HttpClient::SetFetchBackend(int backend)
+{
+    fetch_backend_ = backend;
 }
 
 void* HttpClient::RunThread(void *contex) 
 {
-    HttpClient* http_client = (HttpClient*)contex;
+    Shard* shard = (Shard*)contex;
+    HttpClient* http_client = shard->client_;
     while(!http_client->stopped_)
-        http_client->Pool();
+        http_client->Pool(shard);
     return NULL;
 }
 
@@ -147,28 +289,84 @@ void HttpClient::Close()
 {
     if(!__sync_bool_compare_and_swap(&stopped_, false, true))
         return;
-    request_queue_.exit();
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        shards_[i]->request_queue_.exit();
+        shards_[i]->notifier_.Notify();
+    }
     result_queue_.exit();
-    fetcher_->End();
+    for(unsigned i = 0; i < shards_.size(); i++)
+        shards_[i]->fetcher_->End();
     dns_resolver_->Close(); 
-    pthread_join(tid_, NULL);
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        if(shards_[i]->running_)
+            pthread_join(shards_[i]->tid_, NULL);
+        shards_[i]->running_ = false;
+    }
+    if(frontier_)
+        frontier_->Sync();
 }
 
 void HttpClient::UpdateBatchConfig(std::string& batch_id, 
     const BatchConfig& cfg)
 {
-    Storage::Instance()->UpdateBatchConfig(batch_id, cfg);
+    Storage::UpdateBatchConfig(batch_id, cfg);
 }
 
 void HttpClient::PutResult(FetchErrorType error, 
-    HttpFetcherResponse *message, const void* contex)
+    HttpFetcherResponse *message, Resource* res)
 {
-    boost::shared_ptr<FetchResult> result(
-        new FetchResult(error, message, contex));
+    Shard* shard = __shard(res);
+    //结果和引用计数一次分配
+    boost::shared_ptr<FetchResult> result =
+        boost::make_shared<FetchResult>(error, message, res->contex_);
+    result->arrive_us_ = res->arrive_us_;
+    result->dns_us_    = res->dns_us_;
+    result->timing_    = res->timing_;
+    result->done_us_   = LatencyNowUs();
+    result->resp_cost_ms_ = (result->done_us_ - res->arrive_us_) / 1000;
+    if(!result->is_error())
+    {
+        if(res->dns_us_ && !res->is_redirect_)
+            shard->latency_.Add(LatencyStats::LAT_DNS, res->dns_us_ - res->arrive_us_);
+        if(res->timing_.last_byte_us && result->done_us_ > res->timing_.last_byte_us)
+            shard->latency_.Add(LatencyStats::LAT_DELIVER, result->done_us_ - res->timing_.last_byte_us);
+        shard->latency_.Add(LatencyStats::LAT_TOTAL, result->done_us_ - res->arrive_us_);
+    }
     if(result_cb_)
         result_cb_(result);
-    else
+    else if(!result_backpressure_)
         result_queue_.enqueue(result);
+    //已有暂存的结果时排在后面, 保持顺序
+    else if(!shard->result_overflow_.empty() || !result_queue_.try_enqueue(result))
+    {
+        shard->result_overflow_.push_back(result);
+        shard->result_overflow_size_ = shard->result_overflow_.size();
+    }
+}
+
+/**
+ * 把暂存的结果放入result_queue_, 全部放完返回true
+ */
+bool HttpClient::__flush_result_overflow(Shard* shard)
+{
+    std::deque<ResultPtr>& overflow = shard->result_overflow_;
+    while(!overflow.empty() && result_queue_.try_enqueue(overflow.front()))
+        overflow.pop_front();
+    shard->result_overflow_size_ = overflow.size();
+    if(overflow.empty())
+    {
+        if(shard->result_block_begin_us_)
+        {
+            shard->result_blocked_us_ += LatencyNowUs() - shard->result_block_begin_us_;
+            shard->result_block_begin_us_ = 0;
+        }
+        return true;
+    }
+    if(!shard->result_block_begin_us_)
+        shard->result_block_begin_us_ = LatencyNowUs();
+    return false;
 }
 
 void HttpClient::ProcessSuccResult(Resource* res, HttpFetcherResponse* message)
@@ -178,8 +376,8 @@ void HttpClient::ProcessSuccResult(Resource* res, HttpFetcherResponse* message)
     LOG_INFO("%s, SUCCESS, msg size: %zd\n", res->GetUrl().c_str(), message->MessageSize());
     if(res->serv_)
         res->serv_->AddSucc();
-    PutResult(fetch_ok, message, res->contex_);
-    Storage::Instance()->DestroyResource(res);
+    PutResult(fetch_ok, message, res);
+    __shard(res)->storage_->DestroyResource(res);
 }
 
 void HttpClient::ProcessFailResult(FetchErrorType fetch_error, 
@@ -188,26 +386,27 @@ void HttpClient::ProcessFailResult(FetchErrorType fetch_error,
     __sync_fetch_and_sub(&cur_req_size_, 1);
     LOG_ERROR("%s, FAILED, %s\n", res->GetUrl().c_str(), 
         GetSpiderError(fetch_error).c_str());
-    PutResult(fetch_error, message, res->contex_);
-    Storage::Instance()->DestroyResource(res);
+    Shard* shard = __shard(res);
+    PutResult(fetch_error, message, res);
+    shard->storage_->DestroyResource(res);
     // 检查是否Server错误
     if(res->serv_ && fetch_error.group() == FETCH_FAIL_GROUP_SERVER)
     {
         res->serv_->AddFail();
         if(res->serv_->IsServErr())
         {
-            LOG_ERROR("%s: server ERROR\n", channel_manager_->ToString(res->serv_).c_str());
-            ResourceListPtr res_lst = channel_manager_->RemoveUnfinishRes(res->host_);
+            LOG_ERROR("%s: server ERROR\n", ChannelManager::ToString(res->serv_).c_str());
+            ResourceListPtr res_lst = shard->channel_manager_->RemoveUnfinishRes(res->host_);
             while(!res_lst->empty())
             {
                 Resource * res = res_lst->get_front();
                 res_lst->pop_front();
-                timed_lst_map_.del(*res);
-                PutResult(fetch_error, NULL, res->contex_);
-                Storage::Instance()->DestroyResource(res);
+                shard->timed_lst_map_.del(*res);
+                PutResult(fetch_error, NULL, res);
+                shard->storage_->DestroyResource(res);
             }
             // 删除这个serv
-            channel_manager_->DestroyChannel(res->serv_);
+            shard->channel_manager_->DestroyChannel(res->serv_);
         }
     }
 }
@@ -218,45 +417,53 @@ void HttpClient::PutDnsResult(DnsResultType dns_result)
     uint16_t port = 0;
     dns_result->GetAddr(addr_str, port);
     //LOG_DEBUG("Put dns result: %s\n", addr_str.c_str());
-    dns_queue_.enqueue(dns_result);
+    DnsContext* dns_ctx = (DnsContext*)dns_result->contex_;
+    Shard* shard = shards_[dns_ctx->shard_].get();
+    shard->dns_queue_.enqueue(dns_result);
+    shard->notifier_.Notify();
 }
 
 void HttpClient::HandleDnsResult(DnsResultType dns_result)
 {
     std::string err_msg  = dns_result->err_msg_;
     struct addrinfo * ai = dns_result->ai_;
-    HostKey*  host_key   = (HostKey*)dns_result->contex_;
-    HostChannel *host_channel = Storage::Instance()->GetHostChannel(*host_key);
-    delete host_key;
+    DnsContext* dns_ctx  = (DnsContext*)dns_result->contex_;
+    Shard* shard = shards_[dns_ctx->shard_].get();
+    HostChannel *host_channel = shard->storage_->GetHostChannel(dns_ctx->host_key_);
+    delete dns_ctx;
     if(!host_channel)
         return;
+    host_channel->dns_done_us_ = LatencyNowUs();
     if(err_msg.empty())
     {
         char ai_str[1024];
         get_ai_string(ai, ai_str, 1024);
         LOG_INFO("%s, DNS resolve success: %p %s.\n", 
             host_channel->host_.c_str(), ai, ai_str);
-        ServChannel* serv_channel  = Storage::Instance()->AcquireServChannel(
+        ServChannel* serv_channel  = shard->storage_->AcquireServChannel(
             host_channel->scheme_, ai, 
             serv_concurency_mode_, serv_max_err_rate_,
             serv_max_err_count_,   serv_err_delay_sec_,
-            local_addr_ );
-        channel_manager_->SetServChannel(host_channel, serv_channel);
+            local_addr_, serv_rx_speed_max_, conn_rx_speed_max_,
+            serv_pipeline_depth_, 
+            local_addr_pool_.Empty() ? NULL : &local_addr_pool_,
+            serv_adapt_max_window_);
+        shard->channel_manager_->SetServChannel(host_channel, serv_channel);
         return;
     }
     //dns resolve error
     LOG_ERROR("%s, DNS resolve error, %s\n", host_channel->host_.c_str(),
         err_msg.c_str());
-    ResourceListPtr res_lst = channel_manager_->RemoveUnfinishRes(host_channel);
+    ResourceListPtr res_lst = shard->channel_manager_->RemoveUnfinishRes(host_channel);
     while(!res_lst->empty())
     {
         Resource * res = res_lst->get_front();
         res_lst->pop_front();
-        timed_lst_map_.del(*res);
+        shard->timed_lst_map_.del(*res);
         FetchErrorType fetch_err(FETCH_FAIL_GROUP_DNS, RS_DNS_SUBMIT_FAIL);
         ProcessFailResult(fetch_err, res, NULL);
     }
-    channel_manager_->SetServChannel(host_channel, NULL);
+    shard->channel_manager_->SetServChannel(host_channel, NULL);
 }
 
 void HttpClient::HandleHttpResponse3xx(Resource* res, HttpFetcherResponse *resp)
@@ -264,6 +471,10 @@ void HttpClient::HandleHttpResponse3xx(Resource* res, HttpFetcherResponse *resp)
     // error 304
     if(resp->StatusCode == 304)
     {
+        //带了缓存里的校验值
+        if(response_cache_ && res->GetHttpMethod() == "GET" &&
+            response_cache_->Touch(ResponseCache::UrlFingerprint(res->GetUrl())))
+            return __process_not_modified(res, resp);
         FetchErrorType fetch_error(FETCH_FAIL_GROUP_HTTP,304);
         return ProcessFailResult(fetch_error, res, resp);
     }
@@ -301,8 +512,8 @@ void HttpClient::HandleHttpResponse2xx(Resource* res, HttpFetcherResponse *resp)
         HandleRedirectResult(res, resp, ri);
         return;
     }
-    // Meta redirect check
-    if(TRedirectChecker::Instance()->checkMetaRedirect(
+    // Meta redirect check, 流式的响应体不在Body里
+    if(!resp->IsStreamed() && TRedirectChecker::Instance()->checkMetaRedirect(
         res->GetUrl(), *resp, ri.to_url))
     {
         ri.type = REDIRECT_TYPE_META_REFRESH;
@@ -322,9 +533,37 @@ void HttpClient::HandleHttpResponse2xx(Resource* res, HttpFetcherResponse *resp)
     }
 #endif
 
+    if(response_cache_ && resp->StatusCode == 200 && res->GetHttpMethod() == "GET")
+        __update_response_cache(res, resp);
     ProcessSuccResult(res, resp);
 }
 
+void HttpClient::__update_response_cache(Resource* res, HttpFetcherResponse* resp)
+{
+    int etag_idx = resp->Headers.Find("ETag");
+    int lm_idx   = resp->Headers.Find("Last-Modified");
+    if(etag_idx < 0 && lm_idx < 0)
+        return;
+    uint64_t content_hash = 0;
+    if(!resp->Body.empty())
+        MurmurHash_x64_64(&resp->Body[0], resp->Body.size(), &content_hash);
+    response_cache_->Put(ResponseCache::UrlFingerprint(res->GetUrl()),
+        etag_idx >= 0 ? resp->Headers[etag_idx].Value.c_str() : "",
+        lm_idx >= 0 ? resp->Headers[lm_idx].Value.c_str() : "",
+        content_hash, resp->BodySize());
+}
+
+void HttpClient::__process_not_modified(Resource* res, HttpFetcherResponse* resp)
+{
+    __sync_fetch_and_sub(&cur_req_size_, 1);
+    FetchErrorType not_modified(FETCH_FAIL_GROUP_OK, RS_PAGESIZE_NOCHANGE);
+    LOG_INFO("%s, NOT MODIFIED\n", res->GetUrl().c_str());
+    if(res->serv_)
+        res->serv_->AddSucc();
+    PutResult(not_modified, resp, res);
+    __shard(res)->storage_->DestroyResource(res);
+}
+
 void HttpClient::HandleRedirectResult( Resource* res, 
     HttpFetcherResponse *resp, RedirectInfo ri)
 {
@@ -341,8 +580,13 @@ void HttpClient::HandleRedirectResult( Resource* res,
         LOG_ERROR("%s, invalid uri\n", ri.to_url.c_str());
         return;
     }
+    //重定向留在原来的分片, root_res只在本分片访问
     Resource*  root_res = res->RootResource();
-    request_queue_.enqueue(new FetchRequest(uri, root_res)); 
+    Shard* shard = __shard(root_res);
+    FetchRequest* request = new (shard->request_pool_.Alloc(sizeof(FetchRequest)))
+        FetchRequest(uri, root_res);
+    request->shard_ = shard->idx_;
+    shard->request_queue_.enqueue(request); 
 }
 
 REDIRECT_TYPE HttpClient::__get_redirect_type(int status_code)
@@ -361,6 +605,7 @@ REDIRECT_TYPE HttpClient::__get_redirect_type(int status_code)
 void HttpClient::HandleRequest(RequestPtr request)
 {
     char scheme = str2protocal(request->uri_.Scheme());
+    Shard* shard = shards_[request->shard_].get();
     ServChannel * proxy_serv = NULL;
     Resource* res = NULL;
     //重定向的request
@@ -369,7 +614,7 @@ void HttpClient::HandleRequest(RequestPtr request)
         // 如果root resource使用了代理，则使用该代理
         if(request->root_res_->proxy_state_ != Resource::NO_PROXY)
             proxy_serv = request->root_res_->serv_;
-        res = Storage::Instance()->CreateResource(
+        res = shard->storage_->CreateResource(
             request->uri_,  request->root_res_->contex_, 
             request->root_res_->cfg_, request->prior_,
             request->root_res_->GetUserHeaders(),
@@ -381,15 +626,18 @@ void HttpClient::HandleRequest(RequestPtr request)
     {
         if(request->proxy_ai_)
         {
-            proxy_serv = Storage::Instance()->AcquireServChannel(
+            proxy_serv = shard->storage_->AcquireServChannel(
                 scheme, request->proxy_ai_, serv_concurency_mode_, 
                 serv_max_err_rate_,   serv_max_err_count_,   
-                serv_err_delay_sec_,  local_addr_);
+                serv_err_delay_sec_,  local_addr_,
+                serv_rx_speed_max_,   conn_rx_speed_max_, 0,
+                local_addr_pool_.Empty() ? NULL : &local_addr_pool_,
+                serv_adapt_max_window_);
         }
-        res = Storage::Instance()->CreateResource(
+        res = shard->storage_->CreateResource(
             request->uri_, request->contex_, request->batch_cfg_, 
             request->prior_, request->user_headers_, 
-            request->content_, NULL, proxy_serv);
+            request->content_, NULL, proxy_serv, request->frontier_seq_);
     }
 
     __sync_fetch_and_add(&cur_req_size_, 1);
@@ -397,14 +645,14 @@ void HttpClient::HandleRequest(RequestPtr request)
     // 不使用代理时，去检查解dns
     if(proxy_serv == NULL)
     {
-        if(channel_manager_->CheckResolveDns(host_channel, 
+        if(shard->channel_manager_->CheckResolveDns(host_channel, 
             dns_update_time_, dns_error_time_))
         {
-            HostKey* host_key = new HostKey(host_channel->host_key_);
+            DnsContext* dns_ctx = new DnsContext(host_channel->host_key_, shard->idx_);
             DNSResolver::ResolverCallback dns_resolver_cb = 
                 boost::bind(&HttpClient::PutDnsResult, this, _1);
             dns_resolver_->Resolve(host_channel->host_, host_channel->port_, 
-                dns_resolver_cb, host_key);
+                dns_resolver_cb, dns_ctx);
             LOG_INFO("%s, request DNS\n", host_channel->host_.c_str()); 
         }
         else if(host_channel->host_error_)
@@ -418,7 +666,7 @@ void HttpClient::HandleRequest(RequestPtr request)
     //加入到超时队列中, 0表示不超时
     time_t timeout_stamp = res->GetTimeoutStamp();
     if(timeout_stamp > 0)
-        timed_lst_map_.add_back(timeout_stamp, *res);
+        shard->timed_lst_map_.add_back(timeout_stamp, *res);
 }
 
 bool HttpClient::PutRequest(
@@ -430,7 +678,10 @@ bool HttpClient::PutRequest(
     struct addrinfo * proxy_ai,
     ResourcePriority prior)
 {
-    if(cur_req_size_ > max_req_size_)
+    //能落盘的请求进frontier
+    bool to_frontier = frontier_ && !contex && !user_headers && !content
+        && !proxy_ai && (!batch_cfg || batch_cfg == default_batch_cfg_);
+    if(!to_frontier && cur_req_size_ > max_req_size_)
     {
         LOG_ERROR("%s, exceed max request size: %zd\n", 
             url.c_str(), max_req_size_);
@@ -448,46 +699,139 @@ bool HttpClient::PutRequest(
     //如果不指定Resource优先级，则使用批次的优先级
     if(prior == RES_PRIORITY_NOUSE)
         prior = batch_cfg->prior_;
-    request_queue_.enqueue(new FetchRequest(uri, contex, 
-        user_headers, content, prior, batch_cfg, proxy_ai));
+    if(to_frontier)
+    {
+        if(!frontier_->Append(url, prior))
+            return false;
+        shards_[0]->notifier_.Notify();
+        return true;
+    }
+    //同一个Host总在同一个分片
+    unsigned shard_idx = (unsigned long long)Storage::GetHostKey(uri) % shards_.size();
+    Shard* shard = shards_[shard_idx].get();
+    FetchRequest* request = new (shard->request_pool_.Alloc(sizeof(FetchRequest)))
+        FetchRequest(uri, contex, user_headers, content, prior, batch_cfg, proxy_ai);
+    request->shard_ = shard_idx;
+    shard->request_queue_.enqueue(request);
+    shard->notifier_.Notify();
     return true;
 }
 
-void HttpClient::__update_curent_time()
+void HttpClient::__feed_frontier(Shard* shard)
+{
+    if(shard->cur_time_ - shard->frontier_sync_time_ >= FRONTIER_SYNC_MS)
+    {
+        frontier_->Sync();
+        shard->frontier_sync_time_ = shard->cur_time_;
+    }
+    std::vector<Frontier::Record>& records = shard->frontier_records_;
+    records.clear();
+    if(!frontier_->Take(records, FRONTIER_TAKE_BATCH))
+        return;
+    for(size_t i = 0; i < records.size(); i++)
+    {
+        Frontier::Record& record = records[i];
+        URI uri;
+        if(!UriParse(record.url_.c_str(), record.url_.length(), uri)
+            || !HttpUriNormalize(uri))
+        {
+            LOG_ERROR("%s, invalid uri\n", record.url_.c_str());
+            frontier_->Release(record.seq_);
+            continue;
+        }
+        unsigned shard_idx = (unsigned long long)Storage::GetHostKey(uri) % shards_.size();
+        Shard* target = shards_[shard_idx].get();
+        FetchRequest* request = new (target->request_pool_.Alloc(sizeof(FetchRequest)))
+            FetchRequest(uri, NULL, NULL, NULL, record.prior_, default_batch_cfg_, NULL);
+        request->shard_ = shard_idx;
+        request->frontier_seq_ = record.seq_;
+        target->request_queue_.enqueue(request);
+        if(target != shard)
+            target->notifier_.Notify();
+    }
+    records.clear();
+}
+
+//在放出额度的分片线程调用, shard_mask见ServLimit::waiters_
+void HttpClient::__wake_serv(Shard* from, uint64_t shard_mask, ServChannel::ServKey serv_key)
+{
+    //Close之后各分片逐个析构, 删serv时放出的额度不用再通知
+    if(stopped_)
+        return;
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        Shard* shard = shards_[i].get();
+        if(shard == from || !(shard_mask & (1ULL << (i % 64))))
+            continue;
+        {
+            SpinGuard guard(shard->serv_wake_lock_);
+            shard->serv_wake_.push_back(serv_key);
+        }
+        shard->notifier_.Notify();
+    }
+}
+
+void HttpClient::__check_woken_servs(Shard* shard)
+{
+    std::vector<ServChannel::ServKey>& serv_keys = shard->serv_woken_;
+    {
+        SpinGuard guard(shard->serv_wake_lock_);
+        serv_keys.swap(shard->serv_wake_);
+    }
+    //serv可能已经被删掉
+    for(size_t i = 0; i < serv_keys.size(); i++)
+    {
+        ServChannel* serv = shard->storage_->GetServChannel(serv_keys[i]);
+        if(serv)
+            shard->channel_manager_->CheckServReady(serv);
+    }
+    serv_keys.clear();
+}
+
+void HttpClient::__update_curent_time(Shard* shard)
 {
     timeval tv; 
     gettimeofday(&tv, NULL);
-    cur_time_ = (tv.tv_sec*1000000 + tv.tv_usec) / 1000;
+    shard->cur_time_ = (tv.tv_sec*1000000 + tv.tv_usec) / 1000;
 }
 
 void HttpClient::__fetch_resource(Resource* p_res)
 {
     assert(p_res);
+    Shard* shard = __shard(p_res);
     //进入内核后不再控制超时，从超时队列中删除
-    timed_lst_map_.del(*p_res);
+    shard->timed_lst_map_.del(*p_res);
     p_res->fetch_time_ = current_time_ms();
     p_res->cur_retry_times_++;
+    //等过DNS的从DNS结果到达算起, 代理请求不解析DNS
+    if(!p_res->dns_us_)
+    {
+        p_res->dns_us_ = p_res->arrive_us_;
+        if(p_res->proxy_state_ == Resource::NO_PROXY && 
+            p_res->host_->dns_done_us_ > p_res->arrive_us_)
+            p_res->dns_us_ = p_res->host_->dns_done_us_;
+    }
     RawFetcherRequest request;
     request.conn = p_res->conn_;
     request.context = p_res;
-    fetcher_->PutRequest(request);
+    //Pool结束时一次放入fetcher
+    shard->fetch_requests_.push_back(request);
 }
 
-time_t HttpClient::__handle_timeout_list()
+time_t HttpClient::__handle_timeout_list(Shard* shard)
 {
-    __update_curent_time();
-    while(!timed_lst_map_.empty())
+    __update_curent_time(shard);
+    ResTimedMap& timed_lst_map = shard->timed_lst_map_;
+    time_t cur_time = shard->cur_time_/1000;
+    Resource* p_res = NULL;
+    while((p_res = timed_lst_map.pop_expired(cur_time)) != NULL)
     {
-        time_t timeout_stamp = 0;
-        Resource* p_res = NULL;
-        timed_lst_map_.get_front(timeout_stamp, p_res);
-        if(timeout_stamp > cur_time_/1000)
-            return timeout_stamp - cur_time_/1000;
-        timed_lst_map_.pop_front();
         FetchErrorType fetch_error(FETCH_FAIL_GROUP_CANCELED, RS_PADDING_TIMEOUT); 
         ProcessFailResult(fetch_error, p_res, NULL);
     }
-    return 0;
+    if(timed_lst_map.empty())
+        return 0;
+    return timed_lst_map.next_expire()*1000;
 }
 
 IFetchMessage* HttpClient::CreateFetchResponse(const FetchAddress& address, void * request_context)
@@ -503,6 +847,11 @@ IFetchMessage* HttpClient::CreateFetchResponse(const FetchAddress& address, void
     HttpFetcherResponse* resp = new HttpFetcherResponse(address.remote_addr, 
         address.remote_addrlen, address.local_addr,
         address.local_addrlen, max_body_size, truncate_size);
+    if(p_res->cfg_->stream_window_size_ && stream_cb_ && max_body_size)
+    {
+        resp->SetStream(ResponseStreamPtr(new ResponseStream(p_res->cfg_->stream_window_size_,
+            p_res->contex_, p_res->GetUrl(), stream_cb_)));
+    }
     return resp;
 }
 
@@ -538,7 +887,19 @@ struct RequestData* HttpClient::CreateRequestData(void * request_context)
             snprintf(content_len_str, 16, "%zd", content_len);
             req->Headers.Add("Content-Type", "application/x-www-form-urlencoded");
             req->Headers.Add("Content-Length", content_len_str);
-            req->Body = *post_content;
+            //post_content跟Resource一样活到抓取结束, 不拷贝
+            if(content_len)
+                req->SetBodyRef(&(*post_content)[0], content_len);
+        }
+        //条件抓取, 用户头里的同名头优先
+        ResponseCache::Entry cached;
+        if(response_cache_ && req->Method == "GET" &&
+            response_cache_->Get(ResponseCache::UrlFingerprint(req->Uri), cached))
+        {
+            if(cached.etag_[0])
+                req->Headers.Add("If-None-Match", cached.etag_);
+            if(cached.last_modified_[0])
+                req->Headers.Add("If-Modified-Since", cached.last_modified_);
         }
         // add user header
         const MessageHeaders* user_headers = res->GetUserHeaders();
@@ -553,9 +914,8 @@ struct RequestData* HttpClient::CreateRequestData(void * request_context)
 
     req->Close();
     char conn_addr_str[200];
-    fetcher_->ConnectionToString(res->conn_, conn_addr_str, 200);
+    ThreadingFetcher::ConnectionToString(res->conn_, conn_addr_str, 200);
     LOG_INFO("%s, FETCH request %s.\n", req->Uri.c_str(), conn_addr_str);
-    req->Dump();
     return req; 
 }
 
@@ -569,6 +929,11 @@ void HttpClient::ProcessResult(RawFetcherResult& fetch_result)
     Resource * res = (Resource*)fetch_result.context;
     HttpFetcherResponse *resp = (HttpFetcherResponse *)fetch_result.message;
     assert(res);
+    //响应体还引用着fetcher的slab, 在调度线程拼成Body再往下交
+    if(resp)
+        resp->FlattenBody();
+    Shard* shard = __shard(res);
+    res->timing_ = fetch_result.timing;
     // handle proxy result
     if(res->proxy_state_ != Resource::NO_PROXY && 
         !HandleProxyResult(fetch_result))
@@ -576,14 +941,29 @@ void HttpClient::ProcessResult(RawFetcherResult& fetch_result)
         return;
     }
 
-    fetcher_->CloseConnection(res->conn_);
-    channel_manager_->ReleaseConnection(res);
+    //长连接(含https)不关闭，放回连接池复用; NO_LIMIT模式的连接是临时复制的
+    //流水线连接上可能还有别的请求, 由fetcher自己关闭重连
+    if((fetch_result.err_num || !resp || !resp->IsKeepAlive() ||
+        res->proxy_state_ != Resource::NO_PROXY ||
+        res->serv_->concurency_mode_ == CONCURENCY_NO_LIMIT) &&
+        !res->serv_->pipeline_depth_)
+        shard->fetcher_->CloseConnection(res->conn_);
     ServChannel * serv = res->serv_;
     int err_num = fetch_result.err_num;
+    //对端的响应时间: 有fetcher计时的取发完请求到收到首字节, 不含排队
     time_t resp_time = 0;
-    if(res->arrive_time_ < cur_time_)
-        resp_time = cur_time_ - res->arrive_time_;
+    if(res->timing_.sent_us && res->timing_.first_byte_us > res->timing_.sent_us)
+        resp_time = (res->timing_.first_byte_us - res->timing_.sent_us) / 1000;
+    else if(res->arrive_time_ < shard->cur_time_)
+        resp_time = shard->cur_time_ - res->arrive_time_;
     serv->AddRespTime(resp_time);
+    //自适应并发: 在归还连接之前调整, 归还时按新的窗口和间隔排队
+    if((err_num && __srv_error_group(err_num) == FETCH_FAIL_GROUP_SERVER) ||
+       (!err_num && resp && (5 == resp->StatusCode / 100 || 429 == resp->StatusCode)))
+        serv->AdaptBackoff(shard->cur_time_);
+    else if(!err_num)
+        serv->AdaptSucc(resp_time, shard->cur_time_);
+    shard->channel_manager_->ReleaseConnection(res);
 
     if(err_num)
     {
@@ -633,7 +1013,7 @@ bool HttpClient::HandleProxyResult(RawFetcherResult& fetch_result)
             if(resp->StatusCode == 200)
             {
                 res->proxy_state_ = Resource::PROXY_HTTPS; 
-                fetcher_->SetConnectionScheme(res->conn_, PROTOCOL_HTTPS);
+                ThreadingFetcher::SetConnectionScheme(res->conn_, PROTOCOL_HTTPS);
                 __fetch_resource(res);
                 return false;
             }
@@ -647,42 +1027,171 @@ bool HttpClient::HandleProxyResult(RawFetcherResult& fetch_result)
     return true;
 }
 
-void HttpClient::Pool()
+void HttpClient::Pool(Shard* shard)
 {
     struct timeval timeout; 
     timeout.tv_sec = 0;
     timeout.tv_usec = 0;
-    __update_curent_time();
+    ThreadingFetcher* fetcher = shard->fetcher_.get();
+    std::vector<RawFetcherResult>& fetch_results = shard->fetch_results_;
+    __update_curent_time(shard);
+    //result_queue_满时先不收fetcher的结果、不派新请求
+    bool blocked = !__flush_result_overflow(shard);
     //handle fetch result
-    RawFetcherResult fetch_result;
-    while (fetcher_->GetResult(&fetch_result, &timeout) == 0) 
-        ProcessResult(fetch_result);
+    while (!blocked && fetcher->GetResults(fetch_results, FETCH_RESULT_BATCH, &timeout) > 0)
+    {
+        for (size_t i = 0; i < fetch_results.size(); i++)
+            ProcessResult(fetch_results[i]);
+        fetch_results.clear();
+        blocked = !shard->result_overflow_.empty();
+    }
 
+    if(frontier_ && !blocked)
+        __feed_frontier(shard);
     //handle request
     RequestPtr request;
-    while(request_queue_.try_dequeue(request))
+    while(shard->request_queue_.try_dequeue(request))
     {
         HandleRequest(request);
-        delete request;
+        __free_request(shard->request_pool_, request);
     }
 
     //handle dns result
     DnsResultType dns_result;
-    while(dns_queue_.try_dequeue(dns_result))
+    while(shard->dns_queue_.try_dequeue(dns_result))
         HandleDnsResult(dns_result);
-    unsigned quota = fetcher_->AvailableQuota();
-    std::vector<Resource*> res_vec = channel_manager_->PopAvailableResources(quota);
+    __check_woken_servs(shard);
+    std::vector<RawFetcherRequest>& fetch_requests = shard->fetch_requests_;
+    unsigned quota = blocked ? 0 : fetcher->AvailableQuota();
+    //上一轮没放进fetcher的请求先占额度
+    quota = quota > fetch_requests.size() ? quota - fetch_requests.size() : 0;
+    std::vector<Resource*> res_vec = shard->channel_manager_->PopAvailableResources(quota);
     for(unsigned i = 0; i < res_vec.size(); i++)
         __fetch_resource(res_vec[i]);
-    __handle_timeout_list();
+    //额度是各loop之和, 请求按地址分到loop, 某个loop的队列可能先满;
+    //没放入的已占着连接, 留在fetch_requests_里, 该loop取走请求后会通知
+    if (!fetch_requests.empty())
+        fetcher->PutRequests(fetch_requests);
+    time_t deadline = __handle_timeout_list(shard);
+    //额度用完时等fetcher的通知, 否则还要等下一个serv就绪
+    if(res_vec.size() < quota)
+    {
+        time_t ready_time = shard->channel_manager_->NextReadyTime();
+        if(ready_time && (!deadline || ready_time < deadline))
+            deadline = ready_time;
+    }
+    //睡到下一个到期时间, 期间的请求、DNS结果、fetcher结果和result_queue_的空位会唤醒
+    int wait_ms = MAX_POOL_WAIT_MS;
+    if(deadline)
+    {
+        __update_curent_time(shard);
+        time_t left = deadline - shard->cur_time_;
+        //到期时间就在当前这一毫秒时至少睡到下一毫秒, 否则这一毫秒内空转
+        if(left < 0)
+            wait_ms = 0;
+        else
+            wait_ms = (int)std::max((time_t)1, std::min(left, (time_t)MAX_POOL_WAIT_MS));
+    }
+    if(!stopped_)
+        shard->notifier_.Wait(wait_ms);
 }
 
 bool HttpClient::GetResult(ResultPtr& result)
 {
-    return result_queue_.dequeue(result);
+    if(!result_queue_.dequeue(result))
+        return false;
+    //有空位了, 唤醒因result_queue_满而停下的分片
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        if(shards_[i]->result_overflow_size_)
+            shards_[i]->notifier_.Notify();
+    }
+    return true;
+}
+
+void HttpClient::GetAllocStats(AllocStats* stats)
+{
+    memset(stats, 0, sizeof(AllocStats));
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        SizeClassPool::Stats pool_stats;
+        shards_[i]->storage_->GetResourceAllocStats(&pool_stats);
+        stats->resource.Add(pool_stats);
+        shards_[i]->request_pool_.GetStats(&pool_stats);
+        stats->request.Add(pool_stats);
+    }
+}
+
+void HttpClient::GetLatencyStats(LatencyStats* stats)
+{
+    stats->Clear();
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        LatencyStats fetcher_stats;
+        shards_[i]->fetcher_->GetLatencyStats(&fetcher_stats);
+        stats->Merge(fetcher_stats);
+        stats->Merge(shards_[i]->latency_);
+    }
+}
+
+void HttpClient::SetStreamCallback(ResponseStream::Callback stream_cb)
+{
+    stream_cb_ = stream_cb;
+}
+
+bool HttpClient::SetResponseCache(size_t max_mem_entries, const char* spill_file,
+    size_t spill_slots)
+{
+    response_cache_.reset(new ResponseCache(max_mem_entries));
+    if(spill_file && !response_cache_->OpenSpillFile(spill_file, spill_slots))
+        return false;
+    return true;
+}
+
+bool HttpClient::SetFrontier(const char* dir, size_t window, size_t segment_size)
+{
+    frontier_.reset(new Frontier(std::min(window, max_req_size_), segment_size));
+    if(!frontier_->Open(dir))
+    {
+        frontier_.reset();
+        return false;
+    }
+    return true;
+}
+
+bool HttpClient::GetFrontierStats(Frontier::Stats* stats)
+{
+    if(!frontier_)
+        return false;
+    frontier_->GetStats(stats);
+    return true;
 }
 
 void HttpClient::SetResultCallback(ResultCallback call_cb)
 {
     result_cb_ = call_cb;
 }
+
+//需在Open之前调用
+void HttpClient::SetResultBackpressure(bool enable)
+{
+    result_backpressure_ = enable;
+}
+
+void HttpClient::GetFlowStats(FlowStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->result_queued = result_queue_.size();
+    for(unsigned i = 0; i < shards_.size(); i++)
+    {
+        Shard* shard = shards_[i].get();
+        ThreadingFetcher::FlowStats fetcher_stats;
+        shard->fetcher_->GetFlowStats(&fetcher_stats);
+        stats->result_overflow += shard->result_overflow_size_;
+        stats->blocked_us      += shard->result_blocked_us_;
+        stats->fetcher.result_queued += fetcher_stats.result_queued;
+        stats->fetcher.inflight      += fetcher_stats.inflight;
+        stats->fetcher.blocked_us    += fetcher_stats.blocked_us;
+        stats->fetcher.stalled_us    += fetcher_stats.stalled_us;
+    }
+}
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <map>
 #include <list>
 #include <boost/shared_ptr.hpp>
@@ -12,9 +13,11 @@
 #include "SchedulerTypes.hpp"
 #include "queue/CQueue.h"
 #include "linklist/linked_list.hpp"
-#include "linklist/linked_list_map.hpp"
 #include "Channel.hpp"
 #include "Storage.hpp"
+#include "ResponseStream.hpp"
+#include "ResponseCache.hpp"
+#include "Frontier.hpp"
 #include "dnsresolver/DNSResolver.hpp"
 #include "TRedirectChecker.hpp"
 
@@ -29,12 +32,19 @@ public:
         HttpFetcherResponse*  resp_;
         const void* contex_;
         time_t resp_cost_ms_;
+        //各阶段的时间点, CLOCK_MONOTONIC微秒, 没经过的阶段为0
+        uint64_t arrive_us_;    //请求进入HttpClient
+        uint64_t dns_us_;       //DNS解析完成(DNS有缓存时同arrive_us_)
+        FetchTiming timing_;    //fetcher里的connect, TLS, 发送, 首字节, 末字节
+        uint64_t done_us_;      //结果交出
 
         FetchResult(FetchErrorType error, 
             HttpFetcherResponse *resp, const void* contex): 
             error_(error), resp_(resp), contex_(contex),
-            resp_cost_ms_(86400000)
-        {}
+            resp_cost_ms_(86400000), arrive_us_(0), dns_us_(0), done_us_(0)
+        {
+            memset(&timing_, 0, sizeof(timing_));
+        }
         ~FetchResult()
         {
             if(resp_)
@@ -43,9 +53,15 @@ public:
                 resp_ = NULL;
             }
         }
+        //304命中响应缓存不算错误, 见not_modified
         bool is_error() const
         {
-            return error_.error_num() != RS_OK;
+            return error_.error_num() != RS_OK && !not_modified();
+        }
+        //条件抓取回了304, 内容和缓存里记的一样, resp_为304回应
+        bool not_modified() const
+        {
+            return error_.error_num() == RS_PAGESIZE_NOCHANGE;
         }
         std::string error_msg() const
         {
@@ -61,23 +77,97 @@ public:
     typedef DNSResolver::DnsResultType DnsResultType;
     typedef CQueue<DnsResultType > DnsResultQueue;
 
+    //结果流控统计, 见SetResultBackpressure
+    struct FlowStats
+    {
+        size_t   result_queued;     //result_queue_里等GetResult取的
+        size_t   result_overflow;   //result_queue_满时暂存在各调度线程的
+        uint64_t blocked_us;        //因result_queue_满暂停收fetcher结果的总时间
+        ThreadingFetcher::FlowStats fetcher;
+    };
+
+    //各调度分片内存池的合计, 见SizeClassPool
+    struct AllocStats
+    {
+        SizeClassPool::Stats resource;  //Resource(含path/query)
+        SizeClassPool::Stats request;   //FetchRequest
+    };
+
 private:
     static const unsigned DEFAULT_REQUEST_SIZE = 1000000;
     static const unsigned DEFAULT_RESULT_SIZE  = 1000000;
-    typedef linked_list_map<time_t, ServChannel, &ServChannel::queue_node_> ServWaitMap;
+
+    /**
+     * 调度分片: 请求按HostKey分到各分片, 每个分片一个调度线程(Pool)和
+     * 自己的fetcher, Storage/ChannelManager/超时队列只在本分片线程访问.
+     * 重定向留在原请求的分片里. 不同分片的Host解析到同一个IP时各有各的
+     * ServChannel, 并发数、抓取间隔和自适应窗口在它们共用的ServLimit上计算
+     */
+    struct Shard
+    {
+        unsigned idx_;
+        HttpClient* client_;
+        pthread_t tid_;
+        bool running_;
+        boost::shared_ptr<ThreadingFetcher> fetcher_;
+        boost::shared_ptr<ChannelManager>   channel_manager_;
+        boost::shared_ptr<Storage>          storage_;
+        //发往本分片的FetchRequest, 用户线程分配、本分片线程释放, 加锁
+        SizeClassPool request_pool_;
+        //超时队列, 精度为秒
+        ResTimedMap  timed_lst_map_;
+        RequestQueue request_queue_;
+        DnsResultQueue dns_queue_;
+        //Pool一轮中攒下的fetcher请求/结果，批量交给ThreadingFetcher
+        std::vector<RawFetcherRequest> fetch_requests_;
+        std::vector<RawFetcherResult>  fetch_results_;
+        //当前时间，单位为毫秒
+        time_t cur_time_;
+        //只在本分片线程写
+        LatencyStats latency_;
+        //结果背压: result_queue_放不下的结果
+        std::deque<ResultPtr> result_overflow_;
+        volatile size_t result_overflow_size_;
+        volatile uint64_t result_blocked_us_;
+        uint64_t result_block_begin_us_;
+        //Pool在这里等待: 请求/DNS结果入队、fetcher结果、result_queue_腾出空位时通知
+        Notifier notifier_;
+        //从frontier取出的, 按host分到各分片
+        std::vector<Frontier::Record> frontier_records_;
+        time_t frontier_sync_time_;
+        //别的分片放出了共用serv的并发额度, 本分片要重新检查的serv, 加锁
+        std::vector<ServChannel::ServKey> serv_wake_;
+        std::vector<ServChannel::ServKey> serv_woken_;
+        SpinLock serv_wake_lock_;
+
+        Shard(HttpClient* client, unsigned idx, size_t max_req_size);
+    };
+    typedef boost::shared_ptr<Shard> ShardPtr;
 
 private:
+    void __create_shards(unsigned shard_count);
+    Shard* __shard(const Resource* res) const
+    {
+        return shards_[res->host_->shard_].get();
+    }
     void __fetch_resource(Resource* p_res);
     void __fetch_serv(ServChannel* serv);
-    time_t __handle_timeout_list();
-    void __update_curent_time();
+    //处理到期的超时, 返回下一个超时的时间(毫秒), 没有时返回0
+    time_t __handle_timeout_list(Shard* shard);
+    bool __flush_result_overflow(Shard* shard);
+    void __update_curent_time(Shard* shard);
     REDIRECT_TYPE __get_redirect_type(int status_code);
+    void __update_response_cache(Resource* res, HttpFetcherResponse* resp);
+    void __process_not_modified(Resource* res, HttpFetcherResponse* resp);
+    void __feed_frontier(Shard* shard);
+    void __wake_serv(Shard* from, uint64_t shard_mask, ServChannel::ServKey serv_key);
+    void __check_woken_servs(Shard* shard);
 
 protected:
     static  void* RunThread(void *context);
     void UpdateBatchConfig(std::string&, const BatchConfig&);
-    void Pool();
-    void PutResult(FetchErrorType, HttpFetcherResponse*, const void*);
+    void Pool(Shard* shard);
+    void PutResult(FetchErrorType, HttpFetcherResponse*, Resource*);
     void PutDnsResult(DnsResultType dns_result);
     void HandleRequest(RequestPtr req);
 
@@ -118,44 +208,109 @@ public:
     virtual void Close();
 
     void SetFetcherParams(Fetcher::Params params);
+    /**
+     * 调度线程(分片)数, 每个分片有自己的fetcher, 其loop数为SetFetchLoopCount.
+     * 多个分片时结果回调在各调度线程中并发调用. 在Open之前调用
+     */
+    void SetSchedulerThreads(unsigned thread_count);
+    void SetFetchLoopCount(unsigned loop_count);
+    void SetFetchBackend(int backend);
     void SetResultCallback(ResultCallback call_cb);
+    /**
+     * 流式回应的事件回调, 在fetcher线程调用, 见ResponseStream.
+     * 只对stream_window_size_不为0的BatchConfig生效, 不设时都收进Body. 在Open之前调用
+     */
+    void SetStreamCallback(ResponseStream::Callback stream_cb);
+    /**
+     * 响应缓存: GET请求带上次200回应的ETag/Last-Modified做条件抓取,
+     * 304作为not_modified的结果交出. spill_file不为空时内存里放不下的
+     * 换出到该文件(spill_slots条), 重启后接着用. 在Open之前调用
+     */
+    bool SetResponseCache(size_t max_mem_entries, const char* spill_file = NULL,
+        size_t spill_slots = 0);
+    /**
+     * 结果背压: result_queue_满时调度线程不再阻塞在enqueue上,
+     * 结果暂存并停止收fetcher结果、派新请求, fetcher按credit停止开始新请求,
+     * DNS、超时照常处理; GetResult取走后恢复. 在Open之前调用
+     */
+    void SetResultBackpressure(bool enable);
+    /**
+     * 磁盘frontier: 之后不带contex/user_headers/content/代理、用默认批次的
+     * PutRequest写进dir下的分段文件, 不受max_req_size限制, 也不会阻塞;
+     * 调度线程从中取请求, 取出还没抓完的至多window条(不超过max_req_size).
+     * 重启后从上次抓完的位置接着取, 见Frontier. 在Open之前调用
+     */
+    bool SetFrontier(const char* dir, size_t window,
+        size_t segment_size = Frontier::DEFAULT_SEGMENT_SIZE);
+    bool GetFrontierStats(Frontier::Stats* stats);
+    void GetFlowStats(FlowStats* stats);
+    void GetAllocStats(AllocStats* stats);
     void SetServConfig(ConcurencyMode, double, unsigned, unsigned);
+    void SetServRxSpeed(unsigned serv_rx_speed_max, unsigned conn_rx_speed_max);
+    /**
+     * http流水线: PER_SERV模式下每个连接上同时发出至多pipeline_depth个请求,
+     * serv的并发请求数为连接数*pipeline_depth; 0或1为不用流水线.
+     * 只用于http(https连接的SNI随host变化), 不用于代理
+     */
+    void SetServPipeline(unsigned pipeline_depth);
+    /**
+     * 自适应并发(AIMD): 每个serv的并发数在[1, max_window]间调整,
+     * 响应时间和错误率正常时逐步加并发、缩短抓取间隔; 超时/5xx/429或
+     * 响应时间明显变长时并发减半、间隔加倍. 0为不用, 并发由连接数决定
+     */
+    void SetServAdaptive(unsigned max_window);
+    /**
+     * 本地源地址池: 连接按policy分到这些地址上, 代替eth_name的地址.
+     * port_min/port_max不为0时限定该地址上的本地端口范围. 在Open之前调用
+     */
+    bool AddLocalAddr(const char* ip, uint16_t port_min = 0, uint16_t port_max = 0);
+    void SetLocalAddrPolicy(LocalAddrPool::Policy policy);
+    //每个本地源地址上的连接数
+    void GetLocalAddrStats(std::vector<LocalAddrPool::Stat>& stats);
     void SetDefaultBatchConfig(const BatchConfig& batch_cfg);
     void SetDnsCacheTime(time_t dns_update_time, time_t dns_error_time);
+    //成功抓取的各阶段耗时分布: 各调度线程上的dns/deliver/total与fetcher各loop的合并
+    void GetLatencyStats(LatencyStats* stats);
     BatchConfig* AcquireBatchCfg(const std::string& batch_id, const BatchConfig& batch_cfg);
     void UpdateBatchConfig(std::string batch_id, const BatchConfig& batch_cfg);
 
 private:
-    boost::shared_ptr<ThreadingFetcher> fetcher_;
     boost::shared_ptr<DNSResolver>      dns_resolver_;
     ResultCallback                      result_cb_;
+    ResponseStream::Callback            stream_cb_;
+    boost::shared_ptr<ResponseCache>    response_cache_;
+    //各分片的Storage有它的裸指针, 要在shards_之后析构, 所以声明在前面
+    boost::shared_ptr<Frontier>         frontier_;
+    std::vector<ShardPtr>               shards_;
 
-    //抓取等待队列，精度为毫秒
-    ServWaitMap  wait_lst_map_;
-    //超时队列, 精度为秒
-    ResTimedMap  timed_lst_map_;
-    RequestQueue request_queue_;
     ResultQueue  result_queue_;
-    DnsResultQueue dns_queue_;
+    bool result_backpressure_;
     size_t max_req_size_;
     size_t max_result_size_;
     volatile size_t cur_req_size_;
-    //当前时间，单位为毫秒
-    time_t cur_time_;
     bool stopped_;
-    pthread_t tid_;
-    boost::shared_ptr<ChannelManager> channel_manager_;
     sockaddr * local_addr_;
-    SpinLock wait_lst_lock_;
+    LocalAddrPool local_addr_pool_;
 
     //serv配置
     ConcurencyMode serv_concurency_mode_;
     double   serv_max_err_rate_;
     unsigned serv_err_delay_sec_;
     unsigned serv_max_err_count_;
+    //单个serv及其单个连接的入流量限速, bytes/seconds, 0为不限
+    unsigned serv_rx_speed_max_;
+    unsigned conn_rx_speed_max_;
+    //http流水线深度
+    unsigned serv_pipeline_depth_;
+    //自适应并发的窗口上限, 0为不用
+    unsigned serv_adapt_max_window_;
 
     //fetcher配置
     Fetcher::Params fetcher_params_;
+    //fetcher的epoll loop(线程)数目
+    unsigned fetch_loop_count_;
+    //Fetcher::BACKEND_EPOLL或BACKEND_IO_URING
+    int fetch_backend_;
 
     //默认Batch配置
     BatchConfig* default_batch_cfg_;
@@ -0,0 +1,101 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "LocalAddrPool.hpp"
+
+bool LocalAddrPool::Add(const char* ip, uint16_t port_min, uint16_t port_max)
+{
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    struct sockaddr_in*  sin  = (struct sockaddr_in*)&entry.addr_;
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&entry.addr_;
+    if(inet_pton(AF_INET, ip, &sin->sin_addr) == 1)
+    {
+        sin->sin_family = AF_INET;
+        entry.addrlen_  = sizeof(struct sockaddr_in);
+    }
+    else if(inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1)
+    {
+        sin6->sin6_family = AF_INET6;
+        entry.addrlen_    = sizeof(struct sockaddr_in6);
+    }
+    else
+        return false;
+    if(port_max < port_min)
+        return false;
+    entry.port_min_ = port_min;
+    entry.port_max_ = port_max;
+    SpinGuard guard(lock_);
+    entries_.push_back(entry);
+    return true;
+}
+
+void LocalAddrPool::SetPolicy(Policy policy)
+{
+    policy_ = policy;
+}
+
+bool LocalAddrPool::Empty() const
+{
+    return entries_.empty();
+}
+
+bool LocalAddrPool::Acquire(Connection* conn, int family)
+{
+    Release(conn);
+    SpinGuard guard(lock_);
+    size_t n = entries_.size(), idx = n;
+    for(size_t i = 0; i < n; i++)
+    {
+        size_t cur = (next_ + i) % n;
+        if(entries_[cur].addr_.ss_family != family)
+            continue;
+        if(policy_ == ROUND_ROBIN)
+        {
+            idx = cur;
+            break;
+        }
+        if(idx == n || entries_[cur].in_use_ < entries_[idx].in_use_)
+            idx = cur;
+    }
+    if(idx == n)
+        return false;
+    next_ = (idx + 1) % n;
+    Entry& entry = entries_[idx];
+    entry.in_use_++;
+    entry.assigned_++;
+    owners_[conn] = idx;
+    ThreadingFetcher::SetConnectionLocalAddr(conn, (struct sockaddr*)&entry.addr_,
+        entry.addrlen_, entry.port_min_, entry.port_max_);
+    return true;
+}
+
+void LocalAddrPool::Release(Connection* conn)
+{
+    SpinGuard guard(lock_);
+    std::map<Connection*, size_t>::iterator it = owners_.find(conn);
+    if(it == owners_.end())
+        return;
+    entries_[it->second].in_use_--;
+    owners_.erase(it);
+}
+
+void LocalAddrPool::GetStats(std::vector<Stat>& stats)
+{
+    SpinGuard guard(lock_);
+    stats.resize(entries_.size());
+    for(size_t i = 0; i < entries_.size(); i++)
+    {
+        const Entry& entry = entries_[i];
+        char buf[INET6_ADDRSTRLEN];
+        const void* addr = entry.addr_.ss_family == AF_INET6 ?
+            (const void*)&((struct sockaddr_in6*)&entry.addr_)->sin6_addr :
+            (const void*)&((struct sockaddr_in*)&entry.addr_)->sin_addr;
+        inet_ntop(entry.addr_.ss_family, addr, buf, sizeof(buf));
+        stats[i].addr_     = buf;
+        stats[i].port_min_ = entry.port_min_;
+        stats[i].port_max_ = entry.port_max_;
+        stats[i].in_use_   = entry.in_use_;
+        stats[i].assigned_ = entry.assigned_;
+    }
+}
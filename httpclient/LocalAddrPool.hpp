@@ -0,0 +1,75 @@
+#ifndef __LOCAL_ADDR_POOL_HPP
+#define __LOCAL_ADDR_POOL_HPP
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "fetcher/Fetcher.hpp"
+#include "lock/lock.hpp"
+
+/**
+    本地源地址池: 一个本地IP到同一目的IP:port最多只有临时端口数(28k~60k)个连接,
+    连接按轮转或最少使用分到多个本地IP上. 端口到connect时才选(IP_BIND_ADDRESS_NO_PORT),
+    每个IP可以另外限定端口范围.
+    Acquire/Release在各调度线程调用, 加锁; GetStats可以在任意线程
+**/
+class LocalAddrPool
+{
+public:
+    enum Policy
+    {
+        ROUND_ROBIN = 0,
+        LEAST_USED
+    };
+
+    struct Stat
+    {
+        std::string addr_;
+        uint16_t    port_min_;
+        uint16_t    port_max_;
+        //当前绑在该地址上的连接数
+        size_t      in_use_;
+        //累计分配的连接数
+        uint64_t    assigned_;
+    };
+
+    LocalAddrPool(): policy_(ROUND_ROBIN), next_(0) {}
+
+    /**
+     * @param ip: IPv4或IPv6地址
+     * @param port_min, port_max: 为0时用系统的临时端口范围
+     * @return false 地址不合法
+     */
+    bool Add(const char* ip, uint16_t port_min = 0, uint16_t port_max = 0);
+    void SetPolicy(Policy policy);
+    bool Empty() const;
+    /**
+     * 给空闲的conn选一个family相同的地址并设置到连接上
+     * @return false 池里没有该family的地址, 连接不变
+     */
+    bool Acquire(Connection* conn, int family);
+    void Release(Connection* conn);
+    void GetStats(std::vector<Stat>& stats);
+
+private:
+    struct Entry
+    {
+        struct sockaddr_storage addr_;
+        socklen_t addrlen_;
+        uint16_t  port_min_;
+        uint16_t  port_max_;
+        size_t    in_use_;
+        uint64_t  assigned_;
+    };
+
+    std::vector<Entry> entries_;
+    //连接用的是哪个地址
+    std::map<Connection*, size_t> owners_;
+    Policy   policy_;
+    size_t   next_;
+    SpinLock lock_;
+};
+
+#endif
@@ -2,8 +2,9 @@
 #include "ChannelManager.hpp"
 
 //user_headers/post_content 在外部开内存, 浅拷贝
+//suffix拷到suffix_buf, 由调用方和Resource一起分配, 至少suffix.size()+1字节
 void Resource::Initialize(
-    HostChannel* host_channel,const std::string& suffix, 
+    HostChannel* host_channel,const std::string& suffix, char* suffix_buf,
     ResourcePriority prior, const void* contex,
     const MessageHeaders * user_headers,
     const std::vector<char>* post_content, 
@@ -11,18 +12,24 @@ void Resource::Initialize(
     BatchConfig *cfg)
 {
     host_ = host_channel;
-    suffix_ = strdup(suffix.c_str());
+    suffix_ = suffix_buf;
+    memcpy(suffix_, suffix.c_str(), suffix.size() + 1);
     prior_ = prior;
     fetch_time_  = 0;
     arrive_time_ = current_time_ms();
+    arrive_us_   = LatencyNowUs();
+    dns_us_      = 0;
+    memset(&timing_, 0, sizeof(timing_));
     contex_ = contex;
     cfg_ = cfg;
+    frontier_seq_ = 0;
     cur_retry_times_ = 0;
     conn_ = NULL;
     queue_node_.prev  = &queue_node_;
     queue_node_.next  = &queue_node_;
     timed_lst_node_.prev = &timed_lst_node_;
     timed_lst_node_.next = &timed_lst_node_;
+    timed_key_ = 0;
     ResExtend* pextend = (ResExtend*)extend_;
     serv_ = NULL;
     is_redirect_     = 0;
@@ -50,6 +57,7 @@ void Resource::Initialize(
         pextend->cur_redirect_times_  = root_res->RedirectCount() + 1;
         pextend->root_res_ = root_res; 
         arrive_time_       = root_res->arrive_time_;
+        arrive_us_         = root_res->arrive_us_;
         if(!has_user_headers_ && root_res->has_user_headers_)
         {
             pextend->user_headers_ = root_res->GetUserHeaders();
@@ -85,7 +93,7 @@ std::string Resource::GetHostWithPort(bool with_port) const
 
 std::string Resource::GetUrl() const
 {
-    return (ChannelManager::Instance())->ToString(host_) + suffix_;
+    return ChannelManager::ToString(host_) + suffix_;
 }
     
 std::string Resource::GetHttpMethod() const
@@ -111,11 +119,7 @@ URI Resource::GetURI() const
 
 void Resource::Destroy()
 {
-    if(suffix_)
-    {
-        free(suffix_);
-        suffix_ = NULL;
-    }
+    suffix_ = NULL;
     Resource* root_res = RootResource(); 
     if(is_redirect_)
         root_res->root_ref_ -= 1;
@@ -201,12 +205,9 @@ void Resource::SetFetchAddr(struct addrinfo* serv_addr, struct sockaddr* local_a
 {
     assert(valid_);
     fetch_addr.remote_addr = serv_addr->ai_addr;
-    fetch_addr.remote_addrlen = sizeof(struct sockaddr);
+    fetch_addr.remote_addrlen = serv_addr->ai_addrlen;
     fetch_addr.local_addr  = local_addr;
-    if(local_addr)
-        fetch_addr.local_addrlen = sizeof(struct sockaddr);
-    else
-        fetch_addr.local_addrlen = 0;
+    fetch_addr.local_addrlen = get_sockaddr_len(local_addr);
     MD5_CTX ctx; 
     MD5_Init(&ctx);
     MD5_Update(&ctx, fetch_addr.remote_addr, fetch_addr.remote_addrlen);
@@ -11,6 +11,7 @@
 #include "httpparser/HttpMessage.hpp"
 #include "linklist/linked_list.hpp"
 #include "linklist/linked_list_map.hpp"
+#include "linklist/timing_wheel.hpp"
 #include "fetcher/Fetcher.hpp"
 #include "SchedulerTypes.hpp"
 
@@ -33,7 +34,7 @@ public:
 
 public:
     void Initialize(HostChannel* host_channel,
-        const std::string& suffix, ResourcePriority prior, 
+        const std::string& suffix, char* suffix_buf, ResourcePriority prior, 
         const void* contex, const MessageHeaders * user_headers,
         const std::vector<char>* post_content, 
         Resource* parent_res, BatchConfig *cfg);
@@ -68,6 +69,8 @@ public:
     ResourcePriority   prior_;
     linked_list_node_t queue_node_;
     linked_list_node_t timed_lst_node_;
+    //在超时时间轮中的超时时间
+    time_t             timed_key_;
     HostChannel *      host_;
     //resource所属的serv
     ServChannel *      serv_;
@@ -75,12 +78,18 @@ public:
     char*              suffix_;
     time_t             arrive_time_;
     time_t             fetch_time_;
+    //CLOCK_MONOTONIC微秒, 见HttpClient::FetchResult
+    uint64_t           arrive_us_;
+    uint64_t           dns_us_;
+    FetchTiming        timing_;
     const void*        contex_;
     BatchConfig *      cfg_;
+    //从Frontier取出的请求的seq, 释放时交还; 0为不是
+    uint64_t           frontier_seq_;
     void*              extend_[0]; 
 };
 
-typedef linked_list_map<time_t, Resource, &Resource::timed_lst_node_> ResTimedMap;
+typedef timing_wheel_t<time_t, Resource, &Resource::timed_lst_node_, &Resource::timed_key_> ResTimedMap;
 
 struct ResExtend
 {
@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ResponseCache.hpp"
+#include "utility/murmur_hash.h"
+#include "log/log.h"
+
+ResponseCache::ResponseCache(size_t max_mem_entries):
+    max_mem_entries_(max_mem_entries), spill_fd_(-1), spill_slots_(0),
+    spill_map_size_(0), spill_header_(NULL), spill_entries_(NULL)
+{
+}
+
+ResponseCache::~ResponseCache()
+{
+    Flush();
+    __close_spill();
+}
+
+bool ResponseCache::OpenSpillFile(const char* file_name, size_t spill_slots)
+{
+    SpinGuard guard(lock_);
+    __close_spill();
+    if(!spill_slots)
+        return false;
+    int fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        LOG_ERROR("open response cache file %s error: %s\n", file_name, strerror(errno));
+        return false;
+    }
+    size_t map_size = sizeof(SpillHeader) + spill_slots * sizeof(Entry);
+    struct stat st;
+    bool reuse = fstat(fd, &st) == 0 && (size_t)st.st_size == map_size;
+    if(!reuse && (ftruncate(fd, 0) < 0 || ftruncate(fd, map_size) < 0))
+    {
+        LOG_ERROR("truncate response cache file %s error: %s\n", file_name, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED)
+    {
+        LOG_ERROR("mmap response cache file %s error: %s\n", file_name, strerror(errno));
+        close(fd);
+        return false;
+    }
+    spill_fd_ = fd;
+    spill_map_size_ = map_size;
+    spill_slots_ = spill_slots;
+    spill_header_ = (SpillHeader*)addr;
+    spill_entries_ = (Entry*)(spill_header_ + 1);
+    //新建的或者表大小对不上, 清空
+    if(!reuse || spill_header_->magic_ != SPILL_MAGIC || spill_header_->slots_ != spill_slots)
+    {
+        memset(addr, 0, map_size);
+        spill_header_->magic_ = SPILL_MAGIC;
+        spill_header_->slots_ = spill_slots;
+    }
+    return true;
+}
+
+void ResponseCache::__close_spill()
+{
+    if(spill_header_)
+    {
+        munmap(spill_header_, spill_map_size_);
+        spill_header_ = NULL;
+        spill_entries_ = NULL;
+    }
+    if(spill_fd_ >= 0)
+    {
+        close(spill_fd_);
+        spill_fd_ = -1;
+    }
+    spill_slots_ = 0;
+}
+
+uint64_t ResponseCache::UrlFingerprint(const std::string& url)
+{
+    uint64_t fp = 0;
+    MurmurHash_x64_64(url.c_str(), url.size(), &fp);
+    //0表示空位
+    return fp ? fp : 1;
+}
+
+ResponseCache::Entry* ResponseCache::__spill_find(uint64_t url_fp, bool for_write)
+{
+    if(!spill_entries_)
+        return NULL;
+    Entry* oldest = NULL;
+    size_t idx = url_fp % spill_slots_;
+    for(unsigned i = 0; i < SPILL_PROBES && i < spill_slots_; i++)
+    {
+        Entry* entry = spill_entries_ + idx;
+        if(entry->url_fp_ == url_fp)
+            return entry;
+        if(!entry->url_fp_)
+            return for_write ? entry : NULL;
+        if(!oldest || entry->update_time_ < oldest->update_time_)
+            oldest = entry;
+        if(++idx == spill_slots_)
+            idx = 0;
+    }
+    return for_write ? oldest : NULL;
+}
+
+void ResponseCache::__spill(const Entry& entry)
+{
+    Entry* slot = __spill_find(entry.url_fp_, true);
+    if(slot)
+        memcpy(slot, &entry, sizeof(Entry));
+}
+
+void ResponseCache::__insert_mem(const Entry& entry)
+{
+    MemMap::iterator it = mem_.find(entry.url_fp_);
+    if(it != mem_.end())
+    {
+        it->second.entry_ = entry;
+        lru_.splice(lru_.begin(), lru_, it->second.lru_it_);
+        return;
+    }
+    //换出最久没用的
+    while(!mem_.empty() && mem_.size() >= max_mem_entries_)
+    {
+        MemMap::iterator victim = mem_.find(lru_.back());
+        __spill(victim->second.entry_);
+        mem_.erase(victim);
+        lru_.pop_back();
+    }
+    if(!max_mem_entries_)
+    {
+        __spill(entry);
+        return;
+    }
+    lru_.push_front(entry.url_fp_);
+    MemNode& node = mem_[entry.url_fp_];
+    node.entry_ = entry;
+    node.lru_it_ = lru_.begin();
+}
+
+bool ResponseCache::Get(uint64_t url_fp, Entry& entry)
+{
+    SpinGuard guard(lock_);
+    MemMap::iterator it = mem_.find(url_fp);
+    if(it != mem_.end())
+    {
+        entry = it->second.entry_;
+        lru_.splice(lru_.begin(), lru_, it->second.lru_it_);
+        return true;
+    }
+    Entry* spilled = __spill_find(url_fp, false);
+    if(!spilled)
+        return false;
+    entry = *spilled;
+    __insert_mem(entry);
+    return true;
+}
+
+void ResponseCache::Put(uint64_t url_fp, const char* etag, const char* last_modified,
+    uint64_t content_hash, size_t content_size)
+{
+    if(!*etag && !*last_modified)
+        return;
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.url_fp_ = url_fp;
+    entry.content_hash_ = content_hash;
+    entry.content_size_ = content_size;
+    entry.update_time_ = time(NULL);
+    //放不下的校验值不可靠, 不用
+    if(strlen(etag) < sizeof(entry.etag_))
+        strcpy(entry.etag_, etag);
+    if(strlen(last_modified) < sizeof(entry.last_modified_))
+        strcpy(entry.last_modified_, last_modified);
+    if(!entry.etag_[0] && !entry.last_modified_[0])
+        return;
+    SpinGuard guard(lock_);
+    __insert_mem(entry);
+}
+
+bool ResponseCache::Touch(uint64_t url_fp)
+{
+    Entry entry;
+    if(!Get(url_fp, entry))
+        return false;
+    SpinGuard guard(lock_);
+    //Get之后已在内存里, 除非刚好被别的线程换出
+    MemMap::iterator it = mem_.find(url_fp);
+    if(it != mem_.end())
+        it->second.entry_.update_time_ = time(NULL);
+    return true;
+}
+
+void ResponseCache::Flush()
+{
+    SpinGuard guard(lock_);
+    if(!spill_entries_)
+        return;
+    for(MemMap::iterator it = mem_.begin(); it != mem_.end(); ++it)
+        __spill(it->second.entry_);
+}
+
+size_t ResponseCache::MemSize()
+{
+    SpinGuard guard(lock_);
+    return mem_.size();
+}
@@ -0,0 +1,92 @@
+#ifndef __RESPONSE_CACHE_HPP
+#define __RESPONSE_CACHE_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <boost/unordered_map.hpp>
+#include "lock/lock.hpp"
+
+/**
+    响应元数据缓存, 用于条件抓取: 按url指纹记下上次200回应的ETag、Last-Modified、
+    响应体hash和大小, 再抓时带If-None-Match/If-Modified-Since, 304即为命中.
+    内存里最多max_mem_entries条, 按LRU换出到mmap的文件里(可选), 文件是定长的
+    开放寻址表, 下次启动接着用; 文件里一个位置冲突满了时覆盖最旧的.
+    各调度线程和fetcher线程都会访问, 加锁
+**/
+class ResponseCache
+{
+public:
+    struct Entry
+    {
+        //url指纹, 0为空
+        uint64_t url_fp_;
+        //收到的响应体(未解压)的murmur64, 流式回应为0
+        uint64_t content_hash_;
+        uint32_t content_size_;
+        //最后一次200/304的时间, 秒
+        uint32_t update_time_;
+        char etag_[80];
+        char last_modified_[40];
+    };
+
+    ResponseCache(size_t max_mem_entries);
+    ~ResponseCache();
+
+    /**
+     * 换出文件, spill_slots为文件里的表大小; 已有的文件表大小不同时重建
+     */
+    bool OpenSpillFile(const char* file_name, size_t spill_slots);
+    static uint64_t UrlFingerprint(const std::string& url);
+    bool Get(uint64_t url_fp, Entry& entry);
+    /**
+     * etag/last_modified都为空时不记
+     */
+    void Put(uint64_t url_fp, const char* etag, const char* last_modified,
+        uint64_t content_hash, size_t content_size);
+    //304时刷新时间, 返回是否有该记录
+    bool Touch(uint64_t url_fp);
+    //内存里的都写到文件
+    void Flush();
+    size_t MemSize();
+
+private:
+    struct SpillHeader
+    {
+        uint64_t magic_;
+        uint64_t slots_;
+    };
+    struct MemNode
+    {
+        Entry entry_;
+        std::list<uint64_t>::iterator lru_it_;
+    };
+    typedef boost::unordered_map<uint64_t, MemNode> MemMap;
+
+    static const uint64_t SPILL_MAGIC  = 0x31454843534552ULL;
+    //文件里一个指纹最多探测这么多个位置
+    static const unsigned SPILL_PROBES = 8;
+
+    ResponseCache(const ResponseCache&);
+    ResponseCache& operator = (const ResponseCache&);
+
+    void __insert_mem(const Entry& entry);
+    Entry* __spill_find(uint64_t url_fp, bool for_write);
+    void __spill(const Entry& entry);
+    void __close_spill();
+
+    size_t max_mem_entries_;
+    MemMap mem_;
+    //队头为最近用的
+    std::list<uint64_t> lru_;
+    SpinLock lock_;
+
+    int spill_fd_;
+    size_t spill_slots_;
+    size_t spill_map_size_;
+    SpillHeader* spill_header_;
+    Entry* spill_entries_;
+};
+
+#endif
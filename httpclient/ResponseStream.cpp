@@ -0,0 +1,71 @@
+#include <string.h>
+#include "ResponseStream.hpp"
+
+ResponseStream::ResponseStream(size_t window, const void* contex,
+    const std::string& url, Callback cb):
+    window_(window), contex_(contex), url_(url), cb_(cb), status_code_(0),
+    read_pos_(0), finished_(false), complete_(false)
+{
+}
+
+size_t ResponseStream::Read(void* buf, size_t length)
+{
+    SpinGuard guard(lock_);
+    size_t n = data_.size() - read_pos_;
+    if(n > length)
+        n = length;
+    memcpy(buf, data_.data() + read_pos_, n);
+    read_pos_ += n;
+    //取完了或者前面空出一半时挪一次, 缓冲不超过window多少
+    if(read_pos_ == data_.size())
+    {
+        data_.clear();
+        read_pos_ = 0;
+    }
+    else if(read_pos_ >= data_.size() / 2)
+    {
+        data_.erase(0, read_pos_);
+        read_pos_ = 0;
+    }
+    return n;
+}
+
+size_t ResponseStream::Buffered()
+{
+    SpinGuard guard(lock_);
+    return data_.size() - read_pos_;
+}
+
+void ResponseStream::OnHeaders(const HttpFetcherResponse& resp)
+{
+    status_code_ = resp.StatusCode;
+    headers_ = resp.Headers;
+    cb_(shared_from_this(), STREAM_HEADERS);
+}
+
+void ResponseStream::OnBody(const char* data, size_t length)
+{
+    bool was_empty = false;
+    {
+        SpinGuard guard(lock_);
+        was_empty = data_.size() == read_pos_;
+        data_.append(data, length);
+    }
+    if(was_empty)
+        cb_(shared_from_this(), STREAM_DATA);
+}
+
+void ResponseStream::OnFinish(bool complete)
+{
+    complete_ = complete;
+    __sync_synchronize();
+    finished_ = true;
+    cb_(shared_from_this(), STREAM_FINISH);
+}
+
+size_t ResponseStream::Window() const
+{
+    SpinGuard guard(lock_);
+    size_t buffered = data_.size() - read_pos_;
+    return buffered < window_ ? window_ - buffered : 0;
+}
@@ -0,0 +1,74 @@
+#ifndef __RESPONSE_STREAM_HPP
+#define __RESPONSE_STREAM_HPP
+
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "httpparser/HttpFetchProtocal.hpp"
+#include "lock/lock.hpp"
+
+/**
+    流式回应: BatchConfig::stream_window_size_不为0时, 2xx的响应体不再收进Body,
+    fetcher线程写进这里, 调用方在任意线程Read取走. 缓冲满window字节时fetcher
+    暂停读该连接, Read腾出空间后恢复; 调用方一直不读时连接一直暂停.
+    事件回调在fetcher线程调用, 不能阻塞:
+    STREAM_HEADERS  头收完, 可以取StatusCode/Headers
+    STREAM_DATA     缓冲由空变为非空, Read取到0之后会再来一次
+    STREAM_FINISH   响应体收完或出错, 之后Read取完剩下的数据即结束
+    抓取结果照常从GetResult/ResultCallback交出, 其resp_的Body为空.
+    同一请求重试时会有新的stream
+**/
+class ResponseStream: public IResponseStream,
+    public boost::enable_shared_from_this<ResponseStream>
+{
+public:
+    enum Event
+    {
+        STREAM_HEADERS = 0,
+        STREAM_DATA,
+        STREAM_FINISH
+    };
+    typedef boost::function<void (boost::shared_ptr<ResponseStream>, Event)> Callback;
+
+    ResponseStream(size_t window, const void* contex, const std::string& url, Callback cb);
+
+    /**
+     * 取出至多length字节, 返回取到的字节数; 缓冲为空时返回0
+     */
+    size_t Read(void* buf, size_t length);
+    //缓冲里还没取走的字节数
+    size_t Buffered();
+    //收完或出错, 不会再有数据写进来
+    bool Finished() const { return finished_; }
+    //响应体按Content-Length/chunked/对端关闭完整收完
+    bool Complete() const { return complete_; }
+    const void* Contex() const { return contex_; }
+    const std::string& Url() const { return url_; }
+    //STREAM_HEADERS之后有效
+    int StatusCode() const { return status_code_; }
+    const MessageHeaders& Headers() const { return headers_; }
+
+    virtual void OnHeaders(const HttpFetcherResponse& resp);
+    virtual void OnBody(const char* data, size_t length);
+    virtual void OnFinish(bool complete);
+    virtual size_t Window() const;
+
+private:
+    size_t window_;
+    const void* contex_;
+    std::string url_;
+    Callback cb_;
+    int status_code_;
+    MessageHeaders headers_;
+    mutable SpinLock lock_;
+    //[read_pos_, data_.size())是还没取走的
+    std::string data_;
+    size_t read_pos_;
+    volatile bool finished_;
+    volatile bool complete_;
+};
+
+typedef boost::shared_ptr<ResponseStream> ResponseStreamPtr;
+
+#endif
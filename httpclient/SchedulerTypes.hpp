@@ -143,6 +143,7 @@ struct BatchConfig
     static const unsigned DEFAULT_MAX_REDIRECT_TIMES = 4;
     static const unsigned DEFAULT_MAX_BODY_SIZE      = UINT_MAX;
     static const unsigned DEFAULT_TRUNCATE_SIZE      = UINT_MAX;
+    static const unsigned DEFAULT_STREAM_WINDOW_SIZE = 0;
     static const ResourcePriority DEFAULT_RES_PRIOR  = RES_PRIORITY_LEVEL_5;
     static const char* DEFAULT_USER_AGENT;
     static const char* DEFAULT_BATCH_ID;
@@ -156,6 +157,9 @@ struct BatchConfig
     unsigned max_redirect_times_;
     unsigned max_body_size_;
     unsigned truncate_size_;
+    //不为0时2xx的响应体流式交出(见HttpClient::SetStreamCallback),
+    //每个回应最多缓冲这么多字节
+    unsigned stream_window_size_;
     ResourcePriority prior_;
     char user_agent_[512];
     char accept_encoding_[512];
@@ -171,6 +175,7 @@ struct BatchConfig
         max_redirect_times_ = DEFAULT_MAX_REDIRECT_TIMES;
         max_body_size_ = DEFAULT_MAX_BODY_SIZE;
         truncate_size_ = DEFAULT_TRUNCATE_SIZE;
+        stream_window_size_ = DEFAULT_STREAM_WINDOW_SIZE;
         prior_ = DEFAULT_RES_PRIOR;
         strncpy(user_agent_, DEFAULT_USER_AGENT, 512);
         strncpy(accept_encoding_, DEFAULT_ACCEPT_ENCODING, 512); 
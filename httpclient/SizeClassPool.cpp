@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "SizeClassPool.hpp"
+
+SizeClassPool::SizeClassPool(bool locked):
+    locked_(locked), alloc_count_(0), large_count_(0),
+    slab_bytes_(0), in_use_(0), in_use_bytes_(0)
+{
+    __init_classes();
+}
+
+SizeClassPool::~SizeClassPool()
+{
+    for(size_t i = 0; i < slabs_.size(); i++)
+        free(slabs_[i]);
+}
+
+void SizeClassPool::__init_classes()
+{
+    size_t size = 64;
+    while(size <= MAX_CLASS_SIZE)
+    {
+        class_size_.push_back(size);
+        if(size < 512)
+            size += 64;
+        else
+        {
+            //[2^k, 2^(k+1))分4级
+            size_t step = 1;
+            while(step * 2 <= size)
+                step *= 2;
+            size += step / 4;
+        }
+    }
+    class_index_.resize(MAX_CLASS_SIZE / 64 + 1);
+    uint32_t cls = 0;
+    for(size_t i = 0; i < class_index_.size(); i++)
+    {
+        while(class_size_[cls] < i * 64)
+            cls++;
+        class_index_[i] = cls;
+    }
+    free_list_.resize(class_size_.size(), NULL);
+}
+
+bool SizeClassPool::__refill(uint32_t cls)
+{
+    size_t block = class_size_[cls];
+    char* slab = (char*)malloc(SLAB_SIZE);
+    if(!slab)
+        return false;
+    slabs_.push_back(slab);
+    slab_bytes_ += SLAB_SIZE;
+    for(size_t off = 0; off + block <= SLAB_SIZE; off += block)
+    {
+        Header* header = (Header*)(slab + off);
+        header->next = free_list_[cls];
+        free_list_[cls] = header;
+    }
+    return true;
+}
+
+void* SizeClassPool::Alloc(size_t size)
+{
+    size_t total = size + sizeof(Header);
+    if(total > MAX_CLASS_SIZE)
+    {
+        Header* header = (Header*)malloc(total);
+        if(!header)
+            return NULL;
+        header->tag = LARGE_FLAG | total;
+        if(locked_)
+            lock_.Lock();
+        large_count_++;
+        alloc_count_++;
+        in_use_++;
+        in_use_bytes_ += total;
+        if(locked_)
+            lock_.Unlock();
+        return header + 1;
+    }
+    uint32_t cls = class_index_[(total + 63) / 64];
+    assert(class_size_[cls] >= total);
+    if(locked_)
+        lock_.Lock();
+    Header* header = free_list_[cls];
+    if(!header && __refill(cls))
+        header = free_list_[cls];
+    if(header)
+    {
+        free_list_[cls] = header->next;
+        alloc_count_++;
+        in_use_++;
+        in_use_bytes_ += class_size_[cls];
+    }
+    if(locked_)
+        lock_.Unlock();
+    if(!header)
+        return NULL;
+    header->tag = cls;
+    return header + 1;
+}
+
+void SizeClassPool::Free(void* ptr)
+{
+    if(!ptr)
+        return;
+    Header* header = (Header*)ptr - 1;
+    uint64_t tag = header->tag;
+    if(locked_)
+        lock_.Lock();
+    in_use_--;
+    if(tag & LARGE_FLAG)
+        in_use_bytes_ -= (size_t)(tag & ~LARGE_FLAG);
+    else
+    {
+        uint32_t cls = (uint32_t)tag;
+        header->next = free_list_[cls];
+        free_list_[cls] = header;
+        in_use_bytes_ -= class_size_[cls];
+    }
+    if(locked_)
+        lock_.Unlock();
+    if(tag & LARGE_FLAG)
+        free(header);
+}
+
+void SizeClassPool::GetStats(Stats* stats) const
+{
+    stats->alloc_count  = alloc_count_;
+    stats->large_count  = large_count_;
+    stats->slab_bytes   = slab_bytes_;
+    stats->in_use       = in_use_;
+    stats->in_use_bytes = in_use_bytes_;
+}
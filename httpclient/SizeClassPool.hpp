@@ -0,0 +1,78 @@
+#ifndef __SIZE_CLASS_POOL_HPP
+#define __SIZE_CLASS_POOL_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "lock/lock.hpp"
+
+/**
+    按大小分级的内存池: 每级一个空闲链表, 空了按SLAB_SIZE一批申请, Free的块挂回
+    空闲链表复用, 不还给系统(同fetcher的Connection slab), 池子析构时才释放.
+    超过最大一级的直接malloc. 每块前面8字节记所属的级, Free不用传大小.
+    locked为false时只能在一个线程用; 统计可以在任意线程读, 是近似快照
+**/
+class SizeClassPool
+{
+public:
+    struct Stats
+    {
+        uint64_t alloc_count;   //累计分配次数
+        uint64_t large_count;   //其中超过最大一级直接malloc的
+        uint64_t slab_bytes;    //向系统申请的slab总大小
+        size_t   in_use;        //还没Free的块数
+        size_t   in_use_bytes;  //还没Free的块按级的大小合计
+
+        void Add(const Stats& other)
+        {
+            alloc_count  += other.alloc_count;
+            large_count  += other.large_count;
+            slab_bytes   += other.slab_bytes;
+            in_use       += other.in_use;
+            in_use_bytes += other.in_use_bytes;
+        }
+    };
+
+    static const size_t SLAB_SIZE = 64 * 1024;
+    //64字节一级到512, 之后每翻一倍分4级, 最大8K
+    static const size_t MAX_CLASS_SIZE = 8192;
+
+    explicit SizeClassPool(bool locked = false);
+    ~SizeClassPool();
+
+    void* Alloc(size_t size);
+    void Free(void* ptr);
+    void GetStats(Stats* stats) const;
+
+private:
+    union Header
+    {
+        //所属的级; 直接malloc的为LARGE_FLAG|总大小
+        uint64_t tag;
+        //空闲时链到下一块
+        Header*  next;
+    };
+    static const uint64_t LARGE_FLAG = 1ULL << 63;
+
+    SizeClassPool(const SizeClassPool&);
+    SizeClassPool& operator = (const SizeClassPool&);
+
+    void __init_classes();
+    bool __refill(uint32_t cls);
+
+    bool locked_;
+    SpinLock lock_;
+    //每级的块大小(含Header)
+    std::vector<size_t> class_size_;
+    //按(size+Header)/64向上取整查级
+    std::vector<uint8_t> class_index_;
+    std::vector<Header*> free_list_;
+    std::vector<void*> slabs_;
+    volatile uint64_t alloc_count_;
+    volatile uint64_t large_count_;
+    volatile uint64_t slab_bytes_;
+    volatile size_t in_use_;
+    volatile size_t in_use_bytes_;
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "Storage.hpp"
 
-DEFINE_SINGLETON(Storage);
+Storage::BatchCfgMap Storage::batch_cfg_map_;
+RwLock Storage::batch_map_lock_;
+Storage::SpeedMap Storage::host_speed_map_;
+RwLock Storage::host_speed_lock_;
 
 int Storage::__aicmp(const struct addrinfo *ai1, const struct addrinfo *ai2) 
 {
@@ -60,14 +63,18 @@ void Storage::__destroy_resource(Resource* res)
     if(res->root_ref_ == 0)
     {
         channel_manager_->RemoveResource(res);
+        if(frontier_ && res->frontier_seq_)
+            frontier_->Release(res->frontier_seq_);
         res->Destroy();
-        free(res);
+        res_pool_.Free(res);
     }
     if(root_res != res && root_res->root_ref_ == 0)
     {
         channel_manager_->RemoveResource(root_res);
+        if(frontier_ && root_res->frontier_seq_)
+            frontier_->Release(root_res->frontier_seq_);
         root_res->Destroy();
-        free(root_res);
+        res_pool_.Free(root_res);
     }
 } 
 
@@ -76,17 +83,18 @@ void Storage::__save_unfinish_resource(ResourceListPtr res_lst)
     while(!res_lst->empty())
     {
         Resource * res = res_lst->get_front();
-        //TODO: save unfinish
-        free(res);
+        //先摘链再释放, 否则pop_front会访问已释放的节点
         res_lst->pop_front();
+        //TODO: save unfinish
+        res_pool_.Free(res);
     }
 }
 
-Storage::Storage():
-    host_cache_max_(MAX_CACHE_HOST), 
-    serv_cache_max_(MAX_CACHE_SERV), close_(false)
+Storage::Storage(boost::shared_ptr<ChannelManager> channel_manager, unsigned shard):
+    res_pool_(false), host_cache_max_(MAX_CACHE_HOST), 
+    serv_cache_max_(MAX_CACHE_SERV), close_(false),
+    shard_(shard), channel_manager_(channel_manager), frontier_(NULL)
 {
-    channel_manager_ = ChannelManager::Instance();
 }
 
 Storage::~Storage()
@@ -115,8 +123,6 @@ Storage::~Storage()
 BatchConfig* Storage::AcquireBatchCfg(const std::string& batch_id, 
     const BatchConfig& default_batch)
 {
-    if(close_)
-        return NULL;
     {
         ReadGuard guard(batch_map_lock_);
         BatchCfgMap::iterator batch_it = batch_cfg_map_.find(batch_id);
@@ -148,7 +154,10 @@ ServChannel* Storage::AcquireServChannel(
         char   scheme, struct addrinfo* ai, 
         ConcurencyMode concurency_mode, 
         double max_err_rate, unsigned max_err_count,
-        unsigned err_delay_sec, struct sockaddr* local_addr )
+        unsigned err_delay_sec, struct sockaddr* local_addr,
+        unsigned rx_speed_max, unsigned conn_rx_speed_max,
+        unsigned pipeline_depth, LocalAddrPool* addr_pool,
+        unsigned adapt_max_window)
 {
     ServKey serv_key = __aigetkey(ai, scheme, local_addr); 
     ServMap::iterator it = serv_map_.find(serv_key); 
@@ -158,7 +167,9 @@ ServChannel* Storage::AcquireServChannel(
     //WriteGuard guard(serv_map_lock_);
     ServChannel* serv_channel = channel_manager_->CreateServChannel(
         scheme, ai, serv_key, concurency_mode, max_err_rate, 
-        max_err_count, err_delay_sec, local_addr);
+        max_err_count, err_delay_sec, local_addr,
+        rx_speed_max, conn_rx_speed_max, pipeline_depth, addr_pool,
+        adapt_max_window);
     serv_map_.insert(ServMap::value_type(serv_key, serv_channel));
     return serv_channel;
 }
@@ -181,6 +192,15 @@ HostChannel* Storage::GetHostChannel(HostKey host_key) const
     return NULL; 
 }
 
+Storage::HostKey Storage::GetHostKey(const URI& uri)
+{
+    const std::string& scheme_str = uri.Scheme();
+    uint16_t port = GetHttpDefaultPort(str2protocal(scheme_str));
+    if(uri.HasPort())
+        port = (uint16_t)atoi(uri.Port().c_str());
+    return __hostgetkey(uri.Host(), scheme_str, port);
+}
+
 HostChannel* Storage::AcquireHostChannel(const URI& uri)
 {
     const std::string& host = uri.Host();
@@ -202,11 +222,12 @@ HostChannel* Storage::AcquireHostChannel(const URI& uri)
     //WriteGuard guard(host_map_lock_);
     HostChannel* host_channel = channel_manager_->CreateHostChannel(
             scheme, host, port, host_key, fetch_interval);
+    host_channel->shard_ = shard_;
     host_map_[host_key] = host_channel;
     return host_channel;
 }
 
-unsigned Storage::GetHostSpeed(const std::string& host) const
+unsigned Storage::GetHostSpeed(const std::string& host)
 {
     ReadGuard guard(host_speed_lock_);
     SpeedMap::const_iterator it = host_speed_map_.find(host);
@@ -235,20 +256,28 @@ Resource* Storage::CreateResource(
         ResourcePriority prior,
         const MessageHeaders* user_headers,
         const std::vector<char>* post_content,
-        Resource* root_res, ServChannel* proxy_serv)
+        Resource* root_res, ServChannel* proxy_serv,
+        uint64_t frontier_seq)
 {
     if(close_)
         return NULL;
     size_t res_size = sizeof(Resource);
     if(root_res || user_headers || post_content)
         res_size += sizeof(ResExtend);
-    Resource* res = (Resource*)malloc(res_size);
-    HostChannel* host_channel = AcquireHostChannel(uri);
     std::string suffix = uri.Path();
     if(uri.HasQuery())
-        suffix += "?" + uri.Query();
-    res->Initialize(host_channel, suffix, prior, contex, 
+    {
+        suffix += '?';
+        suffix += uri.Query();
+    }
+    //path和query接在Resource(和ResExtend)后面, 一次分配
+    Resource* res = (Resource*)res_pool_.Alloc(res_size + suffix.size() + 1);
+    if(!res)
+        return NULL;
+    HostChannel* host_channel = AcquireHostChannel(uri);
+    res->Initialize(host_channel, suffix, (char*)res + res_size, prior, contex, 
             user_headers, post_content, root_res, batch_cfg);
+    res->frontier_seq_ = frontier_seq;
     if(proxy_serv)
         res->SetProxyServ(proxy_serv);
     channel_manager_->AddResource(res);
@@ -3,23 +3,29 @@
 
 #include <openssl/md5.h>
 #include <boost/unordered_map.hpp>
-#include "singleton/Singleton.h"
 #include "Channel.hpp"
 #include "lock/lock.hpp"
 #include "utility/murmur_hash.h"
 #include "linklist/linked_list.hpp"
 #include "ChannelManager.hpp"
-#include "singleton/Singleton.h"
+#include "SizeClassPool.hpp"
+#include "Frontier.hpp"
 /*
 * Storage负责：
 * 1. Resource的创建和销毁;
 * 2. HostChannel, ServChannel的创建和销毁
 * 3. BatchConfig的创建和销毁
+* 每个调度分片一个Storage, Host/Serv表只在该分片的调度线程访问;
+* BatchConfig和抓取速度表是全进程共享的, 加锁
+* Resource从res_pool_分配, 只在调度线程分配释放, 不加锁
  */
 
 class Storage 
 {
-    DECLARE_SINGLETON(Storage);
+    Storage(const Storage&);
+    Storage& operator=(const Storage&);
+
+public:
     static const unsigned MAX_CACHE_HOST     = 100000;
     static const unsigned MAX_CACHE_SERV     = 100000;
     static const double   EXCEED_DELETE_RATE = 0.1;
@@ -35,12 +41,14 @@ class Storage
     typedef boost::unordered_map<std::string, BatchConfig*> BatchCfgMap;
 
     //批次配置查找表
-    BatchCfgMap batch_cfg_map_;
-    RwLock   batch_map_lock_;
+    static BatchCfgMap batch_cfg_map_;
+    static RwLock   batch_map_lock_;
     //抓取速度查找表
-    SpeedMap host_speed_map_;
-    mutable RwLock   host_speed_lock_;
+    static SpeedMap host_speed_map_;
+    static RwLock   host_speed_lock_;
 
+    //放在最前, 析构时最后释放
+    SizeClassPool res_pool_;
     //hostchannel查找表
     HostMap  host_map_;
     //mutable RwLock   host_map_lock_;
@@ -51,16 +59,20 @@ class Storage
     size_t   host_cache_max_; 
     size_t   serv_cache_max_;
     bool     close_;
+    unsigned shard_;
     boost::shared_ptr<ChannelManager> channel_manager_;
+    //来自frontier的Resource释放时交还
+    Frontier* frontier_;
 
     int __aicmp(const struct addrinfo *ai1, const struct addrinfo *ai2);
     ServKey __aigetkey(const struct addrinfo *addrinfo, char scheme, sockaddr* local_addr);
-    HostKey __hostgetkey(const std::string& host, 
+    static HostKey __hostgetkey(const std::string& host, 
         const std::string& scheme = "http", unsigned port = 80);
     void __destroy_resource(Resource* res);
     void __save_unfinish_resource(ResourceListPtr res_lst);
 
 public:
+    Storage(boost::shared_ptr<ChannelManager> channel_manager, unsigned shard = 0);
     ~Storage();
     
     void SetMaxCacheCount(unsigned host_cnt, unsigned serv_cnt)
@@ -72,22 +84,31 @@ public:
     {
         close_ = true;
     }
+    void SetFrontier(Frontier* frontier)
+    {
+        frontier_ = frontier;
+    }
 
-    void UpdateBatchConfig(std::string& batch_id, const BatchConfig& cfg);
+    static void UpdateBatchConfig(std::string& batch_id, const BatchConfig& cfg);
+    static BatchConfig* AcquireBatchCfg(const std::string&, const BatchConfig&);
+    static unsigned GetHostSpeed(const std::string& host);
+    //uri所属Host的key, 调度分片按它划分
+    static HostKey GetHostKey(const URI& uri);
     ServChannel* GetServChannel(ServKey serv_key) const;
     HostChannel* GetHostChannel(HostKey host_key) const;
-    unsigned GetHostSpeed(const std::string& host) const;
     void SetHostSpeed(const std::string& host, unsigned fetch_interval_ms);
     void CheckCacheLimit();
     HostChannel* AcquireHostChannel(const URI& uri);
-    BatchConfig* AcquireBatchCfg(const std::string&, const BatchConfig&);
 
     ServChannel* AcquireServChannel(
         char   scheme,
         struct addrinfo* ai,
         ConcurencyMode concurency_mode, 
         double max_err_rate, unsigned max_err_count,
-        unsigned err_delay_sec, struct sockaddr* local_addr);
+        unsigned err_delay_sec, struct sockaddr* local_addr,
+        unsigned rx_speed_max = 0, unsigned conn_rx_speed_max = 0,
+        unsigned pipeline_depth = 0, LocalAddrPool* addr_pool = NULL,
+        unsigned adapt_max_window = 0);
 
     Resource* CreateResource(
             const URI& uri,
@@ -97,9 +118,14 @@ public:
             const MessageHeaders* user_headers,
             const std::vector<char>* post_content,
             Resource* root_res,
-            ServChannel* proxy_serv);
+            ServChannel* proxy_serv,
+            uint64_t frontier_seq = 0);
     
     void DestroyResource(Resource* res);
+    void GetResourceAllocStats(SizeClassPool::Stats* stats) const
+    {
+        res_pool_.GetStats(stats);
+    }
 };
 
 #endif
@@ -0,0 +1,779 @@
+/**
+ * fetcher/HttpClient的基准测试
+ *
+ * 子进程在127.0.0.1~127.0.0.a上各监听一个端口, 跑一个可配置的HTTP/HTTPS服务:
+ * body大小, 答复延迟, chunked, gzip, 长连接及每个连接的最大请求数; HTTPS用临时
+ * 生成的自签名证书. 父进程分别用ThreadingFetcher和HttpClient保持c个请求并发抓取,
+ * 共n个请求, 轮流发往各地址, 输出req/s, MB/s(收到的body), 每个请求的客户端
+ * CPU时间和p50/p99/p999延迟.
+ *
+ * bench_fetcher [-n requests] [-c concurrency] [-s body_size] [-d delay_ms] [-C] [-z]
+ *               [-k] [-K max_per_conn] [-S] [-w server_procs] [-l loops] [-a addrs]
+ *               [-b epoll|io_uring] [-m fetcher|httpclient|both] [-W warmup]
+ *	-C: chunked, -z: gzip, -k: 长连接, -S: https
+ *	-a: 服务端地址数, 默认同loops. 连接按远端IP分配loop, 一个地址只用得到一个loop;
+ *	    HttpClient里一个地址是一个serv, 受serv的并发窗口和抓取间隔限制
+ *	-W: HttpClient的预热请求数, 不计入结果; 长连接时默认c*c, 让自适应窗口涨到c/a
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include "gzip/gzip.h"
+#include "log/log.h"
+#include "HttpClient.hpp"
+
+static size_t   g_body_size    = 1024;
+static unsigned g_delay_ms     = 0;
+static bool     g_chunked      = false;
+static bool     g_gzip         = false;
+static bool     g_keep_alive   = false;
+static unsigned g_max_per_conn = 0;
+static bool     g_https        = false;
+
+/************************* 服务端 *************************/
+
+//[0]为长连接的答复, [1]为答复后关闭
+static std::string g_reply[2];
+
+static void BuildReply()
+{
+    std::string body;
+    char line[64];
+    for(unsigned i = 0; body.size() < g_body_size; i++)
+    {
+        snprintf(line, sizeof(line), "<p>bench line %u: the quick brown fox</p>\n", i);
+        body += line;
+    }
+    body.resize(g_body_size);
+    if(g_gzip && !body.empty())
+    {
+        std::vector<char> zbody;
+        if(gzcompress(body.data(), body.size(), zbody) == 0)
+            body.assign(zbody.begin(), zbody.end());
+    }
+    std::string payload;
+    if(g_chunked)
+    {
+        for(size_t pos = 0; pos < body.size(); pos += 4096)
+        {
+            size_t len = std::min((size_t)4096, body.size() - pos);
+            snprintf(line, sizeof(line), "%zx\r\n", len);
+            payload += line;
+            payload.append(body, pos, len);
+            payload += "\r\n";
+        }
+        payload += "0\r\n\r\n";
+    }
+    else
+        payload = body;
+    for(int i = 0; i < 2; i++)
+    {
+        std::string& reply = g_reply[i];
+        reply = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n";
+        if(g_gzip)
+            reply += "Content-Encoding: gzip\r\n";
+        if(g_chunked)
+            reply += "Transfer-Encoding: chunked\r\n";
+        else
+        {
+            snprintf(line, sizeof(line), "Content-Length: %zu\r\n", body.size());
+            reply += line;
+        }
+        reply += i ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+        reply += payload;
+    }
+}
+
+//临时的自签名证书, 客户端不校验
+static SSL_CTX* ServSSLContext()
+{
+    SSL_library_init();
+    SSL_CTX* ctx = SSL_CTX_new(SSLv23_server_method());
+    EVP_PKEY* pkey = NULL;
+    EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY_keygen_init(pctx);
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(pctx, &pkey);
+    EVP_PKEY_CTX_free(pctx);
+
+    X509* x509 = X509_new();
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_get_notBefore(x509), 0);
+    X509_gmtime_adj(X509_get_notAfter(x509), 86400);
+    X509_set_pubkey(x509, pkey);
+    X509_NAME* name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x509, name);
+    X509_sign(x509, pkey, EVP_sha256());
+    if(!pkey || SSL_CTX_use_certificate(ctx, x509) != 1 || SSL_CTX_use_PrivateKey(ctx, pkey) != 1)
+    {
+        fprintf(stderr, "create server certificate failed\n");
+        _exit(1);
+    }
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    return ctx;
+}
+
+struct ServConn
+{
+    int fd;
+    SSL* ssl;
+    std::string in;
+    std::string out;
+    size_t sent;
+    //收到的请求数
+    unsigned served;
+    //等着延迟答复的请求数
+    unsigned pending;
+    //fd已关, 等pending的定时器都到了再释放
+    bool closed;
+    //最后一个请求已收到, 之后的输入忽略, 答复发完后关闭
+    bool last;
+    bool want_write;
+};
+
+struct ServDelayed
+{
+    ServConn* sc;
+    bool last;
+};
+
+static int g_epfd = -1;
+static std::vector<int> g_listen_fds;
+static SSL_CTX* g_serv_ssl_ctx = NULL;
+//延迟答复, 按到期时间(毫秒)排序
+static std::multimap<uint64_t, ServDelayed> g_delayed;
+
+static uint64_t NowMs()
+{
+    return LatencyNowUs() / 1000;
+}
+
+static void ServRelease(ServConn* sc)
+{
+    if(!sc->closed)
+    {
+        epoll_ctl(g_epfd, EPOLL_CTL_DEL, sc->fd, NULL);
+        if(sc->ssl)
+            SSL_free(sc->ssl);
+        close(sc->fd);
+        sc->closed = true;
+    }
+    if(!sc->pending)
+        delete sc;
+}
+
+//>0: 读到的字节数, 0: 对端关闭, -1: 出错, -2: 稍后再读
+static int ServRecv(ServConn* sc, char* buf, int len)
+{
+    if(sc->ssl)
+    {
+        int n = SSL_read(sc->ssl, buf, len);
+        if(n > 0)
+            return n;
+        int err = SSL_get_error(sc->ssl, n);
+        if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return -2;
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+    ssize_t n = read(sc->fd, buf, len);
+    if(n < 0)
+        return errno == EAGAIN ? -2 : -1;
+    return n;
+}
+
+static int ServSend(ServConn* sc, const char* buf, int len)
+{
+    if(sc->ssl)
+    {
+        int n = SSL_write(sc->ssl, buf, len);
+        if(n > 0)
+            return n;
+        int err = SSL_get_error(sc->ssl, n);
+        if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return -2;
+        return -1;
+    }
+    ssize_t n = write(sc->fd, buf, len);
+    if(n < 0)
+        return errno == EAGAIN ? -2 : -1;
+    return n;
+}
+
+static void ServWatch(ServConn* sc, bool want_write)
+{
+    if(sc->want_write == want_write)
+        return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = sc;
+    epoll_ctl(g_epfd, EPOLL_CTL_MOD, sc->fd, &ev);
+    sc->want_write = want_write;
+}
+
+//false: 连接已释放
+static bool ServFlush(ServConn* sc)
+{
+    while(sc->sent < sc->out.size())
+    {
+        int n = ServSend(sc, sc->out.data() + sc->sent,
+            std::min(sc->out.size() - sc->sent, (size_t)1 << 20));
+        if(n == -2)
+        {
+            ServWatch(sc, true);
+            return true;
+        }
+        if(n < 0)
+        {
+            ServRelease(sc);
+            return false;
+        }
+        sc->sent += n;
+    }
+    sc->out.clear();
+    sc->sent = 0;
+    ServWatch(sc, false);
+    if(sc->last && !sc->pending)
+    {
+        ServRelease(sc);
+        return false;
+    }
+    return true;
+}
+
+static void ServReply(ServConn* sc, bool last)
+{
+    sc->out += g_reply[last ? 1 : 0];
+}
+
+static bool ServRead(ServConn* sc)
+{
+    char buf[16384];
+    for(;;)
+    {
+        int n = ServRecv(sc, buf, sizeof(buf));
+        if(n == -2)
+            break;
+        if(n <= 0)
+        {
+            ServRelease(sc);
+            return false;
+        }
+        if(!sc->last)
+            sc->in.append(buf, n);
+    }
+
+    // 只处理GET, 一个请求以空行结束
+    size_t pos;
+    bool replied = false;
+    while(!sc->last && (pos = sc->in.find("\r\n\r\n")) != std::string::npos)
+    {
+        sc->in.erase(0, pos + 4);
+        ++sc->served;
+        sc->last = !g_keep_alive || (g_max_per_conn && sc->served >= g_max_per_conn);
+        if(g_delay_ms)
+        {
+            ServDelayed delayed = {sc, sc->last};
+            ++sc->pending;
+            g_delayed.insert(std::make_pair(NowMs() + g_delay_ms, delayed));
+            continue;
+        }
+        ServReply(sc, sc->last);
+        replied = true;
+    }
+    return replied ? ServFlush(sc) : true;
+}
+
+static void ServTimer()
+{
+    uint64_t now = NowMs();
+    while(!g_delayed.empty() && g_delayed.begin()->first <= now)
+    {
+        ServDelayed delayed = g_delayed.begin()->second;
+        g_delayed.erase(g_delayed.begin());
+        ServConn* sc = delayed.sc;
+        --sc->pending;
+        if(sc->closed)
+        {
+            ServRelease(sc);
+            continue;
+        }
+        ServReply(sc, delayed.last);
+        ServFlush(sc);
+    }
+}
+
+static void ServRun()
+{
+    if(g_https)
+        g_serv_ssl_ctx = ServSSLContext();
+    g_epfd = epoll_create(1024);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    for(size_t i = 0; i < g_listen_fds.size(); i++)
+        epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_listen_fds[i], &ev);
+
+    struct epoll_event events[256];
+    for(;;)
+    {
+        int timeout = -1;
+        if(!g_delayed.empty())
+        {
+            uint64_t now = NowMs(), due = g_delayed.begin()->first;
+            timeout = due > now ? (int)(due - now) : 0;
+        }
+        int n = epoll_wait(g_epfd, events, 256, timeout);
+        for(int i = 0; i < n; i++)
+        {
+            ServConn* sc = (ServConn*)events[i].data.ptr;
+            if(!sc)
+            {
+                //监听的fd不区分, 都accept到EAGAIN
+                for(size_t j = 0; j < g_listen_fds.size(); j++)
+                {
+                    int fd;
+                    while((fd = accept(g_listen_fds[j], NULL, NULL)) >= 0)
+                    {
+                        fcntl(fd, F_SETFL, O_NONBLOCK);
+                        int one = 1;
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                        sc = new ServConn();
+                        sc->fd = fd;
+                        sc->ssl = NULL;
+                        sc->sent = sc->served = sc->pending = 0;
+                        sc->closed = sc->last = sc->want_write = false;
+                        if(g_serv_ssl_ctx)
+                        {
+                            sc->ssl = SSL_new(g_serv_ssl_ctx);
+                            SSL_set_fd(sc->ssl, fd);
+                            SSL_set_accept_state(sc->ssl);
+                        }
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = sc;
+                        epoll_ctl(g_epfd, EPOLL_CTL_ADD, fd, &ev);
+                    }
+                }
+                continue;
+            }
+            if((events[i].events & EPOLLOUT) && !ServFlush(sc))
+                continue;
+            if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                ServRead(sc);
+        }
+        ServTimer();
+    }
+}
+
+/************************* 客户端 *************************/
+
+struct BenchResult
+{
+    int ok;
+    int err;
+    uint64_t bytes;
+    double wall;
+    double cpu;
+    //每个成功请求的延迟, 微秒
+    std::vector<uint32_t> latency;
+
+    BenchResult(): ok(0), err(0), bytes(0), wall(0), cpu(0) {}
+};
+
+static double TimeDiff(const struct timeval& begin, const struct timeval& end)
+{
+    return (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1000000.0;
+}
+
+static double CpuTime()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+static double Percentile(const std::vector<uint32_t>& sorted, double percent)
+{
+    if(sorted.empty())
+        return 0;
+    size_t idx = (size_t)(sorted.size() * percent / 100);
+    if(idx >= sorted.size())
+        idx = sorted.size() - 1;
+    return sorted[idx] / 1000.0;
+}
+
+static void Report(const char* name, BenchResult& r)
+{
+    std::sort(r.latency.begin(), r.latency.end());
+    printf("%-10s ok=%d err=%d wall=%.3fs req/s=%.0f MB/s=%.2f cpu/req=%.1fus "
+        "p50=%.2fms p99=%.2fms p999=%.2fms\n", name, r.ok, r.err, r.wall,
+        r.wall > 0 ? r.ok / r.wall : 0, r.wall > 0 ? r.bytes / r.wall / 1048576 : 0,
+        r.ok ? r.cpu * 1000000 / r.ok : 0, Percentile(r.latency, 50),
+        Percentile(r.latency, 99), Percentile(r.latency, 99.9));
+}
+
+class BenchEvents: public IMessageEvents
+{
+public:
+    BenchEvents()
+    {
+        request_.Clear();
+        request_.Method  = "GET";
+        request_.Uri     = "/bench";
+        request_.Version = "HTTP/1.1";
+        request_.Headers.Add("Host", "127.0.0.1");
+        request_.Headers.Add("Accept-Encoding", "gzip");
+        request_.Headers.Add("Connection", g_keep_alive ? "keep-alive" : "close");
+        request_.Close();
+    }
+    //所有请求共用一份, fetcher只读
+    virtual RequestData* CreateRequestData(void*) { return &request_; }
+    virtual void FreeRequestData(RequestData*) {}
+    virtual IFetchMessage* CreateFetchResponse(const FetchAddress& address, void*)
+    {
+        return new HttpFetcherResponse(address.remote_addr, address.remote_addrlen,
+            address.local_addr, address.local_addrlen, 1 << 30, 1 << 30);
+    }
+    virtual void FreeFetchMessage(IFetchMessage* message) { delete message; }
+
+private:
+    HttpFetcherRequest request_;
+};
+
+static int BenchFetcher(int backend, const std::vector<struct sockaddr_in>& addrs,
+    int requests, int concurrency, unsigned loops)
+{
+    BenchEvents events;
+    ThreadingFetcher fetcher(&events);
+    Fetcher::Params params;
+    memset(&params, 0, sizeof(params));
+    params.conn_timeout.tv_sec = 10;
+    params.max_connecting_cnt  = concurrency;
+    fetcher.Begin(params, loops, backend);
+
+    BenchResult r;
+    r.latency.reserve(requests);
+    std::vector<Connection*> conns;
+    std::vector<uint64_t> start_us;
+    struct timeval t0, t1;
+    double cpu0 = CpuTime();
+    gettimeofday(&t0, NULL);
+
+    int started = 0;
+    for(int i = 0; i < concurrency && started < requests; i++, started++)
+    {
+        //连接轮流连各地址
+        FetchAddress address;
+        address.remote_addr = (struct sockaddr*)&addrs[i % addrs.size()];
+        address.remote_addrlen = sizeof(struct sockaddr_in);
+        address.local_addr = NULL;
+        address.local_addrlen = 0;
+        Connection* conn = ThreadingFetcher::CreateConnection(
+            g_https ? PROTOCOL_HTTPS : PROTOCOL_HTTP, AF_INET, SOCK_STREAM, 0, address);
+        if(g_https)
+            ThreadingFetcher::SetConnectionServerName(conn, "localhost");
+        conns.push_back(conn);
+        start_us.push_back(LatencyNowUs());
+        RawFetcherRequest request = {conn, (void*)(long)i};
+        fetcher.PutRequest(request);
+    }
+    while(r.ok + r.err < started)
+    {
+        RawFetcherResult result;
+        struct timeval timeout = {10, 0};
+        if(fetcher.GetResult(&result, &timeout))
+        {
+            fprintf(stderr, "timeout, %d requests outstanding\n", started - r.ok - r.err);
+            break;
+        }
+        long idx = (long)result.context;
+        HttpFetcherResponse* resp = (HttpFetcherResponse*)result.message;
+        if(result.err_num || !resp)
+        {
+            r.err++;
+            fetcher.CloseConnection(result.conn);
+        }
+        else
+        {
+            r.ok++;
+            r.bytes += resp->BodySize();
+            r.latency.push_back(LatencyNowUs() - start_us[idx]);
+            if(!resp->IsKeepAlive())
+                fetcher.CloseConnection(result.conn);
+        }
+        if(resp)
+            delete resp;
+        if(started < requests)
+        {
+            start_us[idx] = LatencyNowUs();
+            RawFetcherRequest request = {result.conn, result.context};
+            fetcher.PutRequest(request);
+            started++;
+        }
+    }
+
+    gettimeofday(&t1, NULL);
+    r.cpu  = CpuTime() - cpu0;
+    r.wall = TimeDiff(t0, t1);
+    uint64_t handshakes = 0, resumed = 0;
+    fetcher.GetSSLStats(&handshakes, &resumed);
+    fetcher.End();
+    for(size_t i = 0; i < conns.size(); i++)
+        ThreadingFetcher::FreeConnection(conns[i]);
+
+    Report("fetcher", r);
+    if(g_https)
+        printf("           tls handshakes=%llu resumed=%llu\n",
+            (unsigned long long)handshakes, (unsigned long long)resumed);
+    return r.err ? -1 : 0;
+}
+
+//HttpClient线程回调, 主线程等着补请求
+struct ClientState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int done;
+    BenchResult* result;
+};
+static ClientState g_client;
+
+static void OnClientResult(boost::shared_ptr<HttpClient::FetchResult> result)
+{
+    pthread_mutex_lock(&g_client.lock);
+    BenchResult* r = g_client.result;
+    if(result->is_error() || !result->resp_)
+        r->err++;
+    else
+    {
+        r->ok++;
+        r->bytes += result->resp_->Body.size();
+        r->latency.push_back(result->done_us_ - result->arrive_us_);
+    }
+    g_client.done++;
+    pthread_cond_signal(&g_client.cond);
+    pthread_mutex_unlock(&g_client.lock);
+}
+
+//保持concurrency个请求在HttpClient里, 共requests个, 轮流发往各url
+static bool ClientDrive(HttpClient& client, const std::vector<std::string>& urls,
+    int requests, int concurrency, BenchResult* r)
+{
+    pthread_mutex_lock(&g_client.lock);
+    g_client.done   = 0;
+    g_client.result = r;
+    int started = 0;
+    while(g_client.done < requests)
+    {
+        while(started < requests && started - g_client.done < concurrency)
+        {
+            pthread_mutex_unlock(&g_client.lock);
+            bool ok = client.PutRequest(urls[started % urls.size()]);
+            pthread_mutex_lock(&g_client.lock);
+            if(!ok)
+                break;
+            started++;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 10;
+        int done = g_client.done;
+        while(g_client.done == done &&
+            pthread_cond_timedwait(&g_client.cond, &g_client.lock, &deadline) != ETIMEDOUT)
+            ;
+        if(g_client.done == done)
+        {
+            fprintf(stderr, "timeout, %d requests outstanding\n", started - done);
+            break;
+        }
+    }
+    bool finished = g_client.done >= requests;
+    g_client.result = NULL;
+    pthread_mutex_unlock(&g_client.lock);
+    return finished;
+}
+
+static int BenchHttpClient(int backend, const std::vector<struct sockaddr_in>& addrs,
+    int requests, int concurrency, unsigned loops, int warmup)
+{
+    pthread_mutex_init(&g_client.lock, NULL);
+    pthread_cond_init(&g_client.cond, NULL);
+    HttpClient client(concurrency * 2, concurrency * 2);
+    client.SetResultCallback(OnClientResult);
+    //serv不因出错被删; 长连接时各serv上的并发由自适应窗口放到concurrency/地址数
+    int serv_window = ((int)addrs.size() + concurrency - 1) / (int)addrs.size();
+    if(g_keep_alive)
+    {
+        client.SetServConfig(CONCURENCY_PER_SERV, 1.0, 0, 1000000);
+        client.SetServAdaptive(serv_window);
+    }
+    else
+        client.SetServConfig(CONCURENCY_NO_LIMIT, 1.0, 0, 1000000);
+    Fetcher::Params params;
+    memset(&params, 0, sizeof(params));
+    params.conn_timeout.tv_sec = 10;
+    params.max_connecting_cnt  = concurrency;
+    client.SetFetcherParams(params);
+    client.SetFetchLoopCount(loops);
+    client.SetFetchBackend(backend);
+    client.Open();
+
+    std::vector<std::string> urls;
+    for(size_t i = 0; i < addrs.size(); i++)
+    {
+        char url[64], ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addrs[i].sin_addr, ip, sizeof(ip));
+        snprintf(url, sizeof(url), "%s://%s:%hu/bench", g_https ? "https" : "http",
+            ip, ntohs(addrs[i].sin_port));
+        urls.push_back(url);
+    }
+    if(warmup < 0)
+        warmup = g_keep_alive ? std::min(concurrency * concurrency, requests) : 0;
+    BenchResult warm;
+    if(warmup)
+        ClientDrive(client, urls, warmup, concurrency, &warm);
+
+    BenchResult r;
+    r.latency.reserve(requests);
+    struct timeval t0, t1;
+    double cpu0 = CpuTime();
+    gettimeofday(&t0, NULL);
+    ClientDrive(client, urls, requests, concurrency, &r);
+    gettimeofday(&t1, NULL);
+    r.cpu  = CpuTime() - cpu0;
+    r.wall = TimeDiff(t0, t1);
+    client.Close();
+
+    Report("httpclient", r);
+    //serv的抓取间隔为0, 每个serv只受并发限制; 长连接时是各serv的窗口之和
+    printf("           servs=%zu fetch_interval=0ms concurrency_cap=%d\n", addrs.size(),
+        g_keep_alive ? std::min(concurrency, serv_window * (int)addrs.size()) : concurrency);
+    return r.err || r.ok < requests ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    int requests = 20000;
+    int concurrency = 64;
+    unsigned loops = 1;
+    unsigned servers = 1;
+    unsigned naddrs = 0;
+    int warmup = -1;
+    const char* backend = "epoll";
+    const char* mode = "both";
+    int opt;
+    while((opt = getopt(argc, argv, "n:c:s:d:CzkK:Sw:l:a:b:m:W:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': requests = atoi(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 's': g_body_size = atol(optarg); break;
+            case 'd': g_delay_ms = atoi(optarg); break;
+            case 'C': g_chunked = true; break;
+            case 'z': g_gzip = true; break;
+            case 'k': g_keep_alive = true; break;
+            case 'K': g_max_per_conn = atoi(optarg); break;
+            case 'S': g_https = true; break;
+            case 'w': servers = atoi(optarg); break;
+            case 'l': loops = atoi(optarg); break;
+            case 'a': naddrs = atoi(optarg); break;
+            case 'b': backend = optarg; break;
+            case 'm': mode = optarg; break;
+            case 'W': warmup = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n requests] [-c concurrency] [-s body_size] "
+                    "[-d delay_ms] [-C] [-z] [-k] [-K max_per_conn] [-S] [-w server_procs] "
+                    "[-l loops] [-a addrs] [-b epoll|io_uring] [-m fetcher|httpclient|both] "
+                    "[-W warmup]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(!naddrs)
+        naddrs = std::max(loops, 1U);
+    if(concurrency <= 0 || requests <= 0 || !servers || naddrs > 254)
+        return 1;
+    int backend_id = strcmp(backend, "io_uring") ? Fetcher::BACKEND_EPOLL : Fetcher::BACKEND_IO_URING;
+    BuildReply();
+
+    //127.0.0.1起每个地址监听一个端口
+    std::vector<struct sockaddr_in> addrs(naddrs);
+    for(unsigned i = 0; i < naddrs; i++)
+    {
+        int lfd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in& addr = addrs[i];
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i);
+        socklen_t len = sizeof(addr);
+        if(bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 4096)
+            || getsockname(lfd, (struct sockaddr*)&addr, &len))
+        {
+            perror("listen");
+            return 1;
+        }
+        fcntl(lfd, F_SETFL, O_NONBLOCK);
+        g_listen_fds.push_back(lfd);
+    }
+
+    // 服务端在子进程里, rusage只统计客户端
+    std::vector<pid_t> pids;
+    for(unsigned i = 0; i < servers; i++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            signal(SIGPIPE, SIG_IGN);
+            ServRun();
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+    for(size_t i = 0; i < g_listen_fds.size(); i++)
+        close(g_listen_fds[i]);
+    signal(SIGPIPE, SIG_IGN);
+    set_min_log_level(LOG_LEVEL_WARNING);
+
+    printf("requests=%d concurrency=%d body=%zu delay=%ums%s%s %s max_per_conn=%u %s "
+        "loops=%u servers=%u addrs=%u backend=%s\n", requests, concurrency, g_body_size, g_delay_ms,
+        g_chunked ? " chunked" : "", g_gzip ? " gzip" : "",
+        g_keep_alive ? "keep-alive" : "close", g_max_per_conn,
+        g_https ? "https" : "http", loops, servers, naddrs, backend);
+    int ret = 0;
+    if(strcmp(mode, "httpclient"))
+        ret |= BenchFetcher(backend_id, addrs, requests, concurrency, loops);
+    if(strcmp(mode, "fetcher"))
+        ret |= BenchHttpClient(backend_id, addrs, requests, concurrency, loops, warmup);
+
+    for(size_t i = 0; i < pids.size(); i++)
+    {
+        kill(pids[i], SIGTERM);
+        waitpid(pids[i], NULL, 0);
+    }
+    return ret ? 1 : 0;
+}
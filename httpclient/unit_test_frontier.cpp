@@ -0,0 +1,176 @@
+//release编译定义了NDEBUG, 这里的assert里有要执行的调用
+#undef NDEBUG
+#include <assert.h>
+#include "Frontier.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+static std::string Url(const char* tag, int i)
+{
+    char url[64];
+    snprintf(url, sizeof(url), "http://www.example.com/%s/%d", tag, i);
+    return url;
+}
+
+//取出剩下的全部, 不Release
+static void TakeAll(Frontier& frontier, std::vector<Frontier::Record>& records)
+{
+    while(frontier.Take(records, 7))
+        ;
+}
+
+//最后一个分段
+static std::string LastSegment(const std::string& dir, unsigned prior)
+{
+    std::string last;
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "p%u-", prior);
+    DIR* pdir = opendir(dir.c_str());
+    assert(pdir);
+    struct dirent* ent;
+    while((ent = readdir(pdir)) != NULL)
+    {
+        if(!strncmp(ent->d_name, prefix, strlen(prefix)) && last < ent->d_name)
+            last = ent->d_name;
+    }
+    closedir(pdir);
+    assert(!last.empty());
+    return dir + "/" + last;
+}
+
+int main()
+{
+    char tmpl[] = "/tmp/test_frontier.XXXXXX";
+    assert(mkdtemp(tmpl));
+    std::string dir = tmpl;
+    const int N = 100;
+    //分段很小, 覆盖换分段和删分段
+    const size_t SEGMENT_SIZE = 512;
+
+    // 追加, 按优先级取
+    {
+        Frontier frontier(1000, SEGMENT_SIZE);
+        assert(frontier.Open(dir.c_str()));
+        for(int i = 0; i < N; i++)
+            assert(frontier.Append(Url("low", i), RES_PRIORITY_LEVEL_3));
+        for(int i = 0; i < N / 10; i++)
+            assert(frontier.Append(Url("high", i), RES_PRIORITY_LEVEL_1));
+        assert(!frontier.Append("", RES_PRIORITY_LEVEL_1));
+        assert(!frontier.Append(Url("bad", 0), RES_PRIORITY_NOUSE));
+
+        std::vector<Frontier::Record> records;
+        TakeAll(frontier, records);
+        assert(records.size() == (size_t)N + N / 10);
+        for(int i = 0; i < N / 10; i++)
+        {
+            assert(records[i].prior_ == RES_PRIORITY_LEVEL_1);
+            assert(records[i].url_ == Url("high", i));
+        }
+        for(int i = 0; i < N; i++)
+        {
+            assert(records[N / 10 + i].prior_ == RES_PRIORITY_LEVEL_3);
+            assert(records[N / 10 + i].url_ == Url("low", i));
+        }
+        for(size_t i = 1; i < records.size(); i++)
+            assert(records[i].seq_ == records[i - 1].seq_ + 1);
+
+        // 乱序Release: 先放奇数的, 提交位置停在第一个
+        Frontier::Stats stats;
+        for(size_t i = 1; i < records.size(); i += 2)
+            frontier.Release(records[i].seq_);
+        frontier.GetStats(&stats);
+        assert(stats.outstanding == records.size());
+        size_t segments = stats.segments;
+        assert(segments > __RES_PRIORITY_NUM);
+        // 再放偶数的, 全部提交, 每个优先级只留正在写的分段
+        for(size_t i = 0; i < records.size(); i += 2)
+            frontier.Release(records[i].seq_);
+        frontier.GetStats(&stats);
+        assert(stats.outstanding == 0);
+        assert(stats.queued_bytes == 0);
+        assert(stats.segments == __RES_PRIORITY_NUM - 1);
+    }
+
+    // 重新打开: 已提交的不再取出
+    {
+        Frontier frontier(1000, SEGMENT_SIZE);
+        assert(frontier.Open(dir.c_str()));
+        std::vector<Frontier::Record> records;
+        assert(frontier.Take(records, N) == 0);
+        for(int i = 0; i < N; i++)
+            assert(frontier.Append(Url("replay", i), RES_PRIORITY_LEVEL_2));
+    }
+
+    // 窗口限制取出的条数; 中间有没Release的, 之后的都要重放
+    const int DONE = 30, WINDOW = 50;
+    {
+        Frontier frontier(WINDOW, SEGMENT_SIZE);
+        assert(frontier.Open(dir.c_str()));
+        std::vector<Frontier::Record> records;
+        TakeAll(frontier, records);
+        assert(records.size() == (size_t)WINDOW);
+        for(int i = 0; i < WINDOW; i++)
+        {
+            assert(records[i].url_ == Url("replay", i));
+            if(i < DONE || i > DONE)
+                frontier.Release(records[i].seq_);
+        }
+        // DONE之前的提交了, 窗口空出来的可以接着取
+        Frontier::Stats stats;
+        frontier.GetStats(&stats);
+        assert(stats.outstanding == (size_t)WINDOW - DONE);
+        assert(frontier.Take(records, N) == (size_t)DONE);
+    }
+    {
+        Frontier frontier(1000, SEGMENT_SIZE);
+        assert(frontier.Open(dir.c_str()));
+        std::vector<Frontier::Record> records;
+        TakeAll(frontier, records);
+        assert(records.size() == (size_t)N - DONE);
+        for(int i = 0; i < N - DONE; i++)
+            assert(records[i].url_ == Url("replay", DONE + i));
+    }
+
+    // 写了一半的记录在打开时截掉, 之后追加的接在后面
+    {
+        Frontier frontier(1000, SEGMENT_SIZE);
+        assert(frontier.Open(dir.c_str()));
+        assert(frontier.Append(Url("tail", 0), RES_PRIORITY_LEVEL_4));
+    }
+    {
+        std::string path = LastSegment(dir, RES_PRIORITY_LEVEL_4);
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+        assert(fd >= 0);
+        uint32_t len = 100;
+        assert(write(fd, &len, sizeof(len)) == (ssize_t)sizeof(len));
+        assert(write(fd, "http://", 7) == 7);
+        close(fd);
+
+        Frontier frontier(1000, SEGMENT_SIZE);
+        assert(frontier.Open(dir.c_str()));
+        assert(frontier.Append(Url("tail", 1), RES_PRIORITY_LEVEL_4));
+        std::vector<Frontier::Record> records;
+        TakeAll(frontier, records);
+        std::vector<std::string> tails;
+        for(size_t i = 0; i < records.size(); i++)
+        {
+            if(records[i].prior_ == RES_PRIORITY_LEVEL_4)
+                tails.push_back(records[i].url_);
+        }
+        assert(tails.size() == 2);
+        assert(tails[0] == Url("tail", 0));
+        assert(tails[1] == Url("tail", 1));
+    }
+
+    std::string cmd = "rm -rf " + dir;
+    if(system(cmd.c_str()) != 0)
+        return 1;
+    fprintf(stderr, "frontier test passed\n");
+    return 0;
+}
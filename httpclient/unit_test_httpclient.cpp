@@ -15,6 +15,7 @@ int main()
     http_client.SetResultCallback(HandleResult);
     http_client.SetServConfig(CONCURENCY_NO_LIMIT, 0.8, 0, 10);
     Fetcher::Params fetch_params;
+    memset(&fetch_params, 0, sizeof(fetch_params));
     fetch_params.conn_timeout.tv_sec  = 10;
     fetch_params.conn_timeout.tv_usec = 0;
     fetch_params.rx_speed_max = 0;
@@ -6,6 +6,7 @@
  */
 
 #include <assert.h>
+#include <algorithm>
 #include "HttpFetchProtocal.hpp"
 
 uint16_t GetHttpDefaultPort(int protocol)
@@ -50,7 +51,9 @@ void HttpFetcherRequest::Close()
     }
     FillVector("\r\n");
 
-    if (!Body.empty())
+    if (m_BodyRefLength)
+	FillVector(m_BodyRef, m_BodyRefLength);
+    else if (!Body.empty())
 	FillVector(&Body[0], Body.size());
     FetcherRequest::Close();
 }
@@ -74,8 +77,44 @@ size_t HttpFetcherRequest::Size()
     return sz;
 }
 
+HttpFetcherResponse::~HttpFetcherResponse()
+{
+    __CloseStream(false);
+    for (size_t i = 0; i < m_BodySegments.size(); ++i)
+	IOBufferRelease(m_BodySegments[i].buffer);
+}
+
+void HttpFetcherResponse::__CloseStream(bool complete)
+{
+    if (m_Streamed && !m_StreamClosed)
+    {
+	m_StreamClosed = true;
+	m_Stream->OnFinish(complete);
+    }
+}
+
+void HttpFetcherResponse::__AppendBodyData(const void *data, size_t length)
+{
+    if (!m_Streamed)
+    {
+	Response::AppendBody(data, length);
+	return;
+    }
+    //超过截断大小的部分不交出去, 由Append置m_Truncated
+    size_t left = m_StreamedSize < m_TruncateSize ? m_TruncateSize - m_StreamedSize : 0;
+    m_StreamedSize += length;
+    if (left > length)
+	left = length;
+    if (left)
+	m_Stream->OnBody((const char*)data, left);
+}
+
 int HttpFetcherResponse::OnHeadersComplete()
 {
+    //只流式交出2xx的响应体, 重定向、错误页照常收进Body
+    if (m_Stream && (!m_MaxBodySize || StatusCode < 200 || StatusCode >= 300))
+	m_Stream.reset();
+
     // no body
     if(!m_MaxBodySize)
         return 0;
@@ -104,9 +143,38 @@ int HttpFetcherResponse::OnHeadersComplete()
     n = Headers.Find("Content-Length");
     if (n >= 0)
 	m_ContentLength = atoi(Headers[n].Value.c_str());
+
+    // 1xx, 204, 304没有响应体
+    if ((StatusCode >= 100 && StatusCode < 200) || StatusCode == 204 || StatusCode == 304)
+    {
+	m_Chunked = false;
+	m_ContentLength = 0;
+    }
+
+    if (m_Stream)
+    {
+	m_Streamed = true;
+	m_Stream->OnHeaders(*this);
+    }
     return 1;
 }
 
+bool HttpFetcherResponse::IsKeepAlive() const
+{
+    if (!m_BodyComplete || m_Truncated || SizeExceeded())
+	return false;
+
+    int n = Headers.Find("Connection");
+    if (n >= 0)
+    {
+	if (strcasestr(Headers[n].Value.c_str(), "close"))
+	    return false;
+	if (strcasestr(Headers[n].Value.c_str(), "keep-alive"))
+	    return true;
+    }
+    return Version == "HTTP/1.1";
+}
+
 int HttpFetcherResponse::AppendBody(const void *buf, size_t length)
 {
     if (m_Chunked)
@@ -123,32 +191,170 @@ int HttpFetcherResponse::AppendBody(const void *buf, size_t length)
 	    size_t parsed_size = 0;
 	    while ((parsed_size = ExtractChunkedData(begin, size, data, data_size)) > 0)
 	    {
-		Response::AppendBody(data, data_size);
+		__AppendBodyData(data, data_size);
 		begin += parsed_size;
 		size -= parsed_size;
 		parsed = true;
+		if (data_size == 0)
+		    break;
 	    }
 	    if (parsed)
 	    {
-		m_UnparsedData.assign(begin, size);
 		if (data_size == 0)
+		{
+		    // 最后一块之后的数据属于下一个回应
+		    m_Overread = size;
+		    m_UnparsedData.clear();
+		    m_BodyComplete = true;
 		    return 0;
+		}
+		m_UnparsedData.assign(begin, size);
 	    }
 	}
     }
-    else
+    else if (m_Streamed)
     {
-	Response::AppendBody(buf, length);
-	if ((int)Body.size() == m_ContentLength)
+	if (m_ContentLength >= 0 && m_StreamedSize + length >= (size_t)m_ContentLength)
+	{
+	    // 超出Content-Length的数据属于下一个回应
+	    size_t left = m_ContentLength - m_StreamedSize;
+	    m_Overread = length - left;
+	    __AppendBodyData(buf, left);
+	    m_BodyComplete = true;
 	    return 0;
+	}
+	__AppendBodyData(buf, length);
+    }
+    else
+    {
+	return __AppendPlainBody((const char*)buf, length, NULL);
     }
 
     return 1;
 }
 
+bool HttpFetcherResponse::__CanReference() const
+{
+    return !Response::Empty() && m_MaxBodySize && !m_Chunked && !m_Streamed && !m_BodyComplete;
+}
+
+/**
+ * 不分块、不流式的响应体. buffer不为NULL时数据在slab里, 够大或紧接着上一段时引用
+ */
+int HttpFetcherResponse::__AppendPlainBody(const char *data, size_t length, IOBuffer *buffer)
+{
+    if (buffer && !m_RefBody)
+    {
+	m_RefBody = true;
+	m_RefBodyOffset = Body.size();
+    }
+    BodySegment* last = m_BodySegments.empty() ? NULL : &m_BodySegments.back();
+    if (!last && !(buffer && length >= BODY_REF_MIN))
+    {
+	// 还没有引用slab时小块照常拷进Body
+	Response::AppendBody(data, length);
+    }
+    else
+    {
+	if (buffer && last && last->buffer == buffer && last->data + last->length == data)
+	{
+	    // 同一块slab上接着读到的, 已经引用了
+	    last->length += length;
+	}
+	else if (buffer && length >= BODY_REF_MIN)
+	{
+	    IOBufferRef(buffer);
+	    BodySegment segment = {buffer, data, 0, length};
+	    m_BodySegments.push_back(segment);
+	}
+	else if (!last->buffer && last->offset + last->length == m_BodyCopy.size())
+	{
+	    m_BodyCopy.append(data, length);
+	    last->length += length;
+	}
+	else
+	{
+	    BodySegment segment = {NULL, NULL, m_BodyCopy.size(), length};
+	    m_BodyCopy.append(data, length);
+	    m_BodySegments.push_back(segment);
+	}
+	m_SegmentSize += length;
+    }
+
+    size_t body_size = BodySize();
+    if (m_ContentLength >= 0 && body_size >= (size_t)m_ContentLength)
+    {
+	// 超出Content-Length的数据属于下一个回应
+	m_Overread = body_size - m_ContentLength;
+	__TrimBody(m_ContentLength);
+	m_BodyComplete = true;
+	return 0;
+    }
+    return 1;
+}
+
+/**
+ * 响应体截到size, 先截slab里的部分
+ */
+void HttpFetcherResponse::__TrimBody(size_t size)
+{
+    size_t body_size = Body.size() + m_SegmentSize;
+    if (size >= body_size)
+	return;
+    size_t cut = body_size - size;
+    while (cut && !m_BodySegments.empty())
+    {
+	BodySegment& segment = m_BodySegments.back();
+	size_t n = std::min(cut, segment.length);
+	segment.length -= n;
+	m_SegmentSize -= n;
+	cut -= n;
+	if (!segment.length)
+	{
+	    IOBufferRelease(segment.buffer);
+	    m_BodySegments.pop_back();
+	}
+    }
+    Body.resize(Body.size() - cut);
+}
+
+void HttpFetcherResponse::FlattenBody()
+{
+    if (m_BodySegments.empty())
+	return;
+    Body.reserve(Body.size() + m_SegmentSize);
+    for (size_t i = 0; i < m_BodySegments.size(); ++i)
+    {
+	const BodySegment& segment = m_BodySegments[i];
+	const char* data = segment.buffer ? segment.data : m_BodyCopy.data() + segment.offset;
+	Body.insert(Body.end(), data, data + segment.length);
+	IOBufferRelease(segment.buffer);
+    }
+    m_BodySegments.clear();
+    m_BodyCopy.clear();
+    m_SegmentSize = 0;
+}
+
+std::string HttpFetcherResponse::DumpResponseData() const
+{
+    std::string dump = m_DumpResponseData;
+    if (!m_RefBody)
+	return dump;
+    // AppendBuffers收下的响应体没有拷进m_DumpResponseData
+    const std::vector<char>& body = m_EncodedBody.empty() ? Body : m_EncodedBody;
+    if (m_RefBodyOffset < body.size())
+	dump.append(&body[m_RefBodyOffset], body.size() - m_RefBodyOffset);
+    for (size_t i = 0; i < m_BodySegments.size(); ++i)
+    {
+	const BodySegment& segment = m_BodySegments[i];
+	dump.append(segment.buffer ? segment.data : m_BodyCopy.data() + segment.offset,
+		segment.length);
+    }
+    return dump;
+}
+
 int HttpFetcherResponse::__Append(const void *buf, size_t length)
 {
-    m_DumpResponseData.append((const char*)buf, length);
     if (length == 0)
     {
 	if (Response::Empty())
@@ -190,6 +396,13 @@ int HttpFetcherResponse::__Append(const void *buf, size_t length)
 		m_UnparsedData.assign(&Body[0], Body.size());
 		Body.clear();
 	    }
+	    else if (m_Streamed && !Body.empty())
+	    {
+		// 和头一起收到的响应体也交给stream
+		std::vector<char> head;
+		head.swap(Body);
+		return AppendBody(&head[0], head.size());
+	    }
 	    return AppendBody("", 0);
 	}
 	else
@@ -210,13 +423,43 @@ int HttpFetcherResponse::__Append(const void *buf, size_t length)
     return 1;
 }
 
+int HttpFetcherResponse::AppendBuffers(const IOBufferSlice *slices, int count)
+{
+    if (count == 0)
+	return Append("", 0);
+    int ret = 1;
+    for (int i = 0; i < count && ret > 0; ++i)
+    {
+	if (__CanReference())
+	    ret = __CheckSize(slices[i].length,
+		    __AppendPlainBody(slices[i].data, slices[i].length, slices[i].buffer));
+	else
+	    ret = Append(slices[i].data, slices[i].length);
+    }
+    return ret;
+}
+
 int HttpFetcherResponse::Append(const void *buf, size_t length)
 {
+    //流式的响应体不留底
+    bool dump = !m_Streamed;
+    if (dump)
+	m_DumpResponseData.append((const char*)buf, length);
     int result = __Append(buf, length);
     if (result < 0)
 	return result;
+    if (dump && m_Overread)
+	m_DumpResponseData.resize(m_DumpResponseData.size() - m_Overread);
+    //收完(含截断)时关闭stream, 超限的算没收完
+    result = __CheckSize(length, result);
+    if (result == 0)
+	__CloseStream(!SizeExceeded());
+    return result;
+}
 
-    size_t body_size = Body.size();
+int HttpFetcherResponse::__CheckSize(size_t length, int result)
+{
+    size_t body_size = BodySize();
 
     // if connection is closed by remote server, check response integrality
     // if (length == 0 && m_ContentLength > 0 && body_size < m_ContentLength)
@@ -234,7 +477,8 @@ int HttpFetcherResponse::Append(const void *buf, size_t length)
 
     if (body_size > m_TruncateSize)
     {
-	Body.resize(m_TruncateSize);
+	if (!m_Streamed)
+	    __TrimBody(m_TruncateSize);
 	m_Truncated = true;
 	return 0;
     }
@@ -248,6 +492,7 @@ int HttpFetcherResponse::ContentEncoding(char error_msg[50], std::vector<char>&
     int index = Headers.Find("Content-Encoding");
     if (index < 0)
         return 0;
+    FlattenBody();
     //EMPTY_BODY
     if(Body.size() == 0)
     {
@@ -289,6 +534,7 @@ int HttpFetcherResponse::ContentEncoding(char error_msg[50], std::vector<char>&
 
 int HttpFetcherResponse::ContentEncoding(char error_msg[50]) 
 {
+    FlattenBody();
     //在解压之前，保存原始数据大小，用于记录抓取流量
     m_OriginalSize = m_HeadersSize + Body.size(); 
     /// handle Content-Encoding
@@ -297,6 +543,9 @@ int HttpFetcherResponse::ContentEncoding(char error_msg[50])
     if(ret == 0)
     {
 	    std::swap(buffer, Body);
+        //原始的响应体留着拼DumpResponseData
+        if(m_RefBody && m_EncodedBody.empty())
+            m_EncodedBody.swap(buffer);
         // 已经解压了，得去除content-encoding头
         int encode_idx = Headers.Find(std::string("Content-Encoding"));
         if(encode_idx >= 0)
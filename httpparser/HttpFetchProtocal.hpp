@@ -11,6 +11,7 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <stdint.h>
+#include <boost/shared_ptr.hpp>
 #include "httpparser/Http.hpp"
 #include "FetchProtocal.hpp"
 
@@ -26,15 +27,48 @@ enum
 class HttpFetcherRequest : public FetcherRequest, public Request
 {
     public:
+	HttpFetcherRequest(): m_BodyRef(NULL), m_BodyRefLength(0) {}
 	virtual ~HttpFetcherRequest(){};
 	virtual void Clear()
 	{   
 	    FetcherRequest::Clear();
 	    Request::Clear();
+	    m_BodyRef = NULL;
+	    m_BodyRefLength = 0;
 	}
 	virtual void Close();
+    /**
+     * 请求体引用调用者的内存, 不拷贝到Body; 请求释放前必须有效
+     */
+    void SetBodyRef(const void* data, size_t length)
+    {
+	m_BodyRef = data;
+	m_BodyRefLength = length;
+    }
     void Dump();
     size_t Size();
+
+    private:
+    const void* m_BodyRef;
+    size_t m_BodyRefLength;
+};
+
+class HttpFetcherResponse;
+
+/**
+ * 流式接收2xx的响应体: 头收完后响应体不再进Body, 按到达顺序交给OnBody
+ * (chunked已解码, Content-Encoding未解). 都在fetcher线程调用, 不能阻塞.
+ * Window为此刻还能收的字节数, 为0时fetcher暂停读该连接
+ */
+class IResponseStream
+{
+    public:
+	virtual void OnHeaders(const HttpFetcherResponse& resp) = 0;
+	virtual void OnBody(const char* data, size_t length) = 0;
+	//complete为false时响应体没收完就出错了
+	virtual void OnFinish(bool complete) = 0;
+	virtual size_t Window() const = 0;
+	virtual ~IResponseStream() {}
 };
 
 class HttpFetcherResponse : public FetcherResponse, public Response
@@ -56,7 +90,15 @@ class HttpFetcherResponse : public FetcherResponse, public Response
 	    m_LocalAddress(),
 	    m_HeadersSize(0),
 	    m_ContentLength(-1),
-	    m_Chunked(false)
+	    m_Chunked(false),
+	    m_BodyComplete(false),
+	    m_Overread(0),
+	    m_StreamedSize(0),
+	    m_Streamed(false),
+	    m_StreamClosed(false),
+	    m_SegmentSize(0),
+	    m_RefBody(false),
+	    m_RefBodyOffset(0)
 	{
 	    assert(remote_addrlen <= sizeof(m_RemoteAddress));
 	    memcpy(&m_RemoteAddress, remote_addr, remote_addrlen);
@@ -64,24 +106,79 @@ class HttpFetcherResponse : public FetcherResponse, public Response
 		memcpy(&m_LocalAddress, local_addr, local_addrlen);
 	    }
 	}
+	virtual ~HttpFetcherResponse();
 
 	int ContentEncoding(char error_msg[50]);
     int ContentEncoding(char error_msg[50], std::vector<char>& buffer);
 	virtual int Append(const void *buf, size_t length);
+	/**
+	 * 头收完后, 不分块、不流式的响应体直接引用fetcher的slab, 不拷贝;
+	 * 不到BODY_REF_MIN的小块拷贝, 免得少量数据占住整块slab. 其余同Append
+	 */
+	virtual int AppendBuffers(const IOBufferSlice *slices, int count);
+	/**
+	 * 把引用的slab按顺序拼进Body并释放引用. 读Body之前调用,
+	 * ContentEncoding会先调用; 可以重复调用
+	 */
+	void FlattenBody();
 	int __Append(const void *buf, size_t length);
 
 	int AppendBody(const void *buf, size_t length);
 
 	virtual int OnHeadersComplete();
 
+	/**
+	 * 响应体按Content-Length或chunked完整读完, 且未要求关闭时连接可复用
+	 */
+	virtual bool IsKeepAlive() const;
+
+	/**
+	 * 回应收完时最后一次Append的数据里多出的字节数,
+	 * 流水线连接上属于下一个回应
+	 */
+	virtual size_t Overread() const
+	{
+	    return m_Overread;
+	}
+
 	virtual int OnTransferComplete()
 	{
 	    return 0;
 	}
+
+	/**
+	 * 在收到数据之前设置; 回应不是2xx时不用, 照常收进Body
+	 */
+	void SetStream(const boost::shared_ptr<IResponseStream>& stream)
+	{
+	    m_Stream = stream;
+	}
+
+	/**
+	 * 响应体交给了IResponseStream, Body为空
+	 */
+	bool IsStreamed() const
+	{
+	    return m_Streamed;
+	}
+
+	/**
+	 * 流式回应按stream的Window限制读
+	 */
+	virtual size_t RxWindow() const
+	{
+	    return m_Stream && !m_StreamClosed ? m_Stream->Window() : (size_t)-1;
+	}
+
+	//收到的响应体大小, 流式时不在Body里, FlattenBody之前有一部分在slab里
+	size_t BodySize() const
+	{
+	    return m_Streamed ? m_StreamedSize : Body.size() + m_SegmentSize;
+	}
 	//原始大小
 	size_t MessageSize() const
 	{
-	    return m_OriginalSize ? m_OriginalSize:m_HeadersSize + Body.size();
+	    return m_OriginalSize ? m_OriginalSize:m_HeadersSize + BodySize();
 	}
 
 	void SetRemoteAddress(const sockaddr* addr, size_t addrlen) 
@@ -108,7 +205,7 @@ class HttpFetcherResponse : public FetcherResponse, public Response
 
 	bool SizeExceeded() const
 	{
-    	    return (m_ContentLength > 0 && (size_t)m_ContentLength > m_MaxBodySize) || Body.size() > m_MaxBodySize || m_UnparsedData.size() > m_MaxBodySize;
+    	    return (m_ContentLength > 0 && (size_t)m_ContentLength > m_MaxBodySize) || BodySize() > m_MaxBodySize || m_UnparsedData.size() > m_MaxBodySize;
 	}
 
 	bool IsTruncated()
@@ -116,11 +213,34 @@ class HttpFetcherResponse : public FetcherResponse, public Response
 	    return m_Truncated;
 	}
 
-	std::string DumpResponseData() const {
-	    return m_DumpResponseData;
-	}
+	/**
+	 * 收到的原始数据, 截断的部分不在里面
+	 */
+	std::string DumpResponseData() const;
 
     private:
+	/**
+	 * 引用的一段响应体; buffer为NULL时是拷贝的小块, 在m_BodyCopy的offset处
+	 */
+	struct BodySegment
+	{
+	    IOBuffer* buffer;
+	    const char* data;
+	    size_t offset;
+	    size_t length;
+	};
+	static const size_t BODY_REF_MIN = 4096;
+
+	HttpFetcherResponse(const HttpFetcherResponse&);
+	HttpFetcherResponse& operator = (const HttpFetcherResponse&);
+
+	void __AppendBodyData(const void *data, size_t length);
+	void __CloseStream(bool complete);
+	int __CheckSize(size_t length, int result);
+	bool __CanReference() const;
+	int __AppendPlainBody(const char *data, size_t length, IOBuffer *buffer);
+	void __TrimBody(size_t size);
+
 	size_t m_OriginalSize;
 	size_t m_MaxBodySize;
 	size_t m_TruncateSize;
@@ -132,6 +252,21 @@ class HttpFetcherResponse : public FetcherResponse, public Response
 	size_t m_HeadersSize;
 	int m_ContentLength;
 	bool m_Chunked;
+	bool m_BodyComplete;
+	size_t m_Overread;
+	boost::shared_ptr<IResponseStream> m_Stream;
+	size_t m_StreamedSize;
+	bool m_Streamed;
+	bool m_StreamClosed;
+	//Body之后的响应体, FlattenBody之前
+	std::vector<BodySegment> m_BodySegments;
+	std::string m_BodyCopy;
+	size_t m_SegmentSize;
+	//AppendBuffers收下的响应体不进m_DumpResponseData, 从Body的这个位置开始
+	bool m_RefBody;
+	size_t m_RefBodyOffset;
+	//ContentEncoding解压前的Body, 拼DumpResponseData用
+	std::vector<char> m_EncodedBody;
 };
 
 bool IsHttpDefaultPort(int protocol, uint16_t port);
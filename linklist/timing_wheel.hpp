@@ -0,0 +1,285 @@
+#ifndef __TIMING_WHEEL_HPP__
+#define __TIMING_WHEEL_HPP__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "linked_list.hpp"
+
+// 分层时间轮(同linux内核的timer wheel), 代替按毫秒分桶的linked_list_map:
+// 第0层256格, 每格1个单位; 往上4层各64格, 覆盖2^32的跨度, 更远的先挂在最高层, 下沉时重新定位.
+// 节点侵入式挂在T::*list_node上, key存在T::*key_field里, 增删O(1), 不分配内存.
+// 游标cursor_只由pop_expired(now)推进且不超过now, key不大于游标的节点都挂在游标所在的格里,
+// 因此游标格中的节点总是已到期的; 到期节点之间按插入顺序返回.
+// 调度的超时/流控队列(秒, 毫秒)和fetcher的连接定时器(毫秒, 见fetcher/TimerWheel.hpp)都用它.
+template <typename K, typename T, linked_list_node_t T::*list_node, K T::*key_field>
+class timing_wheel_t
+{
+    typedef linked_list_t<T, list_node> List;
+
+    enum
+    {
+        ROOT_BITS  = 8,
+        LEVEL_BITS = 6,
+        LEVEL_NUM  = 4,
+        ROOT_SIZE  = 1 << ROOT_BITS,
+        LEVEL_SIZE = 1 << LEVEL_BITS,
+        ROOT_MASK  = ROOT_SIZE - 1,
+        LEVEL_MASK = LEVEL_SIZE - 1,
+        ROOT_WORDS = ROOT_SIZE / 64
+    };
+    timing_wheel_t& operator = (const timing_wheel_t&);
+    timing_wheel_t(const timing_wheel_t&);
+
+public:
+    //start为起始时间, key离它太远的节点要多次下沉
+    explicit timing_wheel_t(const K& start = K()): cur_cnt_(0), cursor_(start)
+    {
+        memset(root_bits_, 0, sizeof(root_bits_));
+        memset(level_bits_, 0, sizeof(level_bits_));
+    }
+
+    size_t size() const
+    {
+        return cur_cnt_;
+    }
+
+    bool empty() const
+    {
+        return cur_cnt_ == 0;
+    }
+
+    void add_back(const K& key, T& t)
+    {
+        t.*key_field = key;
+        __place(t);
+        cur_cnt_++;
+    }
+
+    bool del(T& t)
+    {
+        if(List::del(t))
+        {
+            assert(cur_cnt_ > 0);
+            cur_cnt_--;
+            return true;
+        }
+        return false;
+    }
+
+    //取出一个key <= now的节点, 没有则返回NULL
+    T* pop_expired(const K& now)
+    {
+        if(cur_cnt_ == 0)
+        {
+            //空的时候游标可以随意挪动
+            cursor_ = now;
+            return NULL;
+        }
+        while(true)
+        {
+            List& slot = root_[cursor_ & ROOT_MASK];
+            if(!slot.empty())
+            {
+                if(cursor_ > now)
+                    return NULL;
+                T* t = slot.get_front();
+                slot.pop_front();
+                cur_cnt_--;
+                return t;
+            }
+            K next = __next_event();
+            if(next > now)
+            {
+                //(cursor_, now]之间没有要下沉的格, 直接跳过去
+                if(now > cursor_)
+                    cursor_ = now;
+                return NULL;
+            }
+            cursor_ = next;
+            if((cursor_ & ROOT_MASK) == 0)
+                __cascade();
+        }
+    }
+
+    //最早到期时间的下界, 节点在第0层时是准确值; 要求非空
+    K next_expire()
+    {
+        assert(cur_cnt_ > 0);
+        if(!root_[cursor_ & ROOT_MASK].empty())
+            return cursor_;
+        return __next_event();
+    }
+
+    void clear()
+    {
+        for(unsigned i = 0; i < ROOT_SIZE; i++)
+            __clear_list(root_[i]);
+        for(unsigned l = 0; l < LEVEL_NUM; l++)
+            for(unsigned i = 0; i < LEVEL_SIZE; i++)
+                __clear_list(level_[l][i]);
+        memset(root_bits_, 0, sizeof(root_bits_));
+        memset(level_bits_, 0, sizeof(level_bits_));
+        cur_cnt_ = 0;
+    }
+
+protected:
+    static unsigned __shift(unsigned level)
+    {
+        return ROOT_BITS + level*LEVEL_BITS;
+    }
+
+    static void __clear_list(List& lst)
+    {
+        while(!lst.empty())
+            lst.pop_front();
+    }
+
+    void __place(T& t)
+    {
+        K key = t.*key_field;
+        if(key <= cursor_)
+        {
+            __add_root(cursor_ & ROOT_MASK, t);
+            return;
+        }
+        K delta = key - cursor_;
+        if(delta < ROOT_SIZE)
+        {
+            __add_root(key & ROOT_MASK, t);
+            return;
+        }
+        //超出最高层的跨度, 先挂在最远的格上
+        K max_span = ((K)1 << __shift(LEVEL_NUM)) - 1;
+        if(delta > max_span)
+            key = cursor_ + max_span;
+        unsigned level = 0;
+        while(level + 1 < LEVEL_NUM && delta >= ((K)1 << __shift(level + 1)))
+            level++;
+        unsigned idx = (unsigned)(key >> __shift(level)) & LEVEL_MASK;
+        level_[level][idx].add_back(t);
+        level_bits_[level] |= (uint64_t)1 << idx;
+    }
+
+    void __add_root(unsigned idx, T& t)
+    {
+        root_[idx].add_back(t);
+        root_bits_[idx >> 6] |= (uint64_t)1 << (idx & 63);
+    }
+
+    //游标到达第0层边界时, 把各层当前格的节点重新定位, 低层转完一圈才轮到高一层
+    void __cascade()
+    {
+        for(unsigned level = 0; level < LEVEL_NUM; level++)
+        {
+            unsigned idx = (unsigned)(cursor_ >> __shift(level)) & LEVEL_MASK;
+            List& slot = level_[level][idx];
+            if(!slot.empty())
+            {
+                List tmp;
+                tmp.splice_back(slot);
+                while(!tmp.empty())
+                {
+                    T* t = tmp.get_front();
+                    tmp.pop_front();
+                    __place(*t);
+                }
+            }
+            level_bits_[level] &= ~((uint64_t)1 << idx);
+            if(idx)
+                break;
+        }
+    }
+
+    //位图只在插入时置位, 格被del删空后留着, 查到时再清
+    int __next_root(unsigned from)
+    {
+        for(unsigned w = from >> 6; w < ROOT_WORDS; w++)
+        {
+            uint64_t bits = root_bits_[w];
+            if(w == (from >> 6))
+                bits &= ~(uint64_t)0 << (from & 63);
+            while(bits)
+            {
+                unsigned idx = (w << 6) + __builtin_ctzll(bits);
+                if(!root_[idx].empty())
+                    return idx;
+                root_bits_[w] &= ~((uint64_t)1 << (idx & 63));
+                bits &= bits - 1;
+            }
+        }
+        return -1;
+    }
+
+    int __next_slot(unsigned level, unsigned from, unsigned to)
+    {
+        if(from >= to)
+            return -1;
+        uint64_t bits = level_bits_[level] & (~(uint64_t)0 << from);
+        if(to < LEVEL_SIZE)
+            bits &= ((uint64_t)1 << to) - 1;
+        while(bits)
+        {
+            unsigned idx = __builtin_ctzll(bits);
+            if(!level_[level][idx].empty())
+                return idx;
+            level_bits_[level] &= ~((uint64_t)1 << idx);
+            bits &= bits - 1;
+        }
+        return -1;
+    }
+
+    //游标之后下一个需要处理的时刻: 第0层的非空格, 或者上层非空格下沉的时刻; 游标格为空时调用
+    K __next_event()
+    {
+        unsigned cur_idx = cursor_ & ROOT_MASK;
+        int idx = __next_root(cur_idx + 1);
+        if(idx >= 0)
+            return (cursor_ & ~(K)ROOT_MASK) + idx;
+        //第0层下一圈的节点, 到第0层边界时才轮到
+        K boundary = (cursor_ | ROOT_MASK) + 1;
+        idx = __next_root(0);
+        if(idx >= 0 && (unsigned)idx < cur_idx)
+            return boundary;
+        bool has_best = false;
+        K best = 0;
+        for(unsigned level = 0; level < LEVEL_NUM; level++)
+        {
+            unsigned shift = __shift(level);
+            unsigned cur   = (unsigned)(cursor_ >> shift) & LEVEL_MASK;
+            //本圈内还没下沉的格
+            idx = __next_slot(level, cur + 1, LEVEL_SIZE);
+            if(idx >= 0)
+            {
+                K t = ((cursor_ >> shift) + (idx - cur)) << shift;
+                return (has_best && best < t) ? best : t;
+            }
+            //本层转完一圈的时刻
+            K wrap = ((cursor_ >> (shift + LEVEL_BITS)) + 1) << (shift + LEVEL_BITS);
+            if(__next_slot(level, 0, 1) >= 0)
+                return (has_best && best < wrap) ? best : wrap;
+            //下一圈的格, 更高层在wrap时刻可能先下沉更早的节点, 继续往上看
+            idx = __next_slot(level, 1, cur + 1);
+            if(idx >= 0)
+            {
+                K t = wrap + ((K)idx << shift);
+                if(!has_best || t < best)
+                    best = t;
+                has_best = true;
+            }
+        }
+        assert(has_best);
+        return best;
+    }
+
+protected:
+    size_t   cur_cnt_;
+    K        cursor_;
+    List     root_[ROOT_SIZE];
+    List     level_[LEVEL_NUM][LEVEL_SIZE];
+    uint64_t root_bits_[ROOT_WORDS];
+    uint64_t level_bits_[LEVEL_NUM];
+};
+
+#endif /* __TIMING_WHEEL_HPP__ */
@@ -3,13 +3,15 @@
 #include "linked_list.hpp"
 #include "shared_linked_list.hpp"
 #include "linked_list_map.hpp"
+#include "timing_wheel.hpp"
 using namespace std;
 
 struct Obj
 {
     linked_list_node_t node_;
     int  e_;
-    Obj(int e): e_(e){}
+    long key_;
+    Obj(int e): e_(e), key_(0){}
 };
 
 ostream& operator << (ostream & os, const Obj& obj) 
@@ -64,4 +66,23 @@ int main()
         printf("%d %d\n", key, p_obj->e_);
         tmp_map.pop_front();
     }
+
+    timing_wheel_t<long, Obj, &Obj::node_, &Obj::key_> wheel;
+    long now = 1000;
+    wheel.pop_expired(now);
+    wheel.add_back(now + 300, obj3);
+    wheel.add_back(now + 5, obj1);
+    wheel.add_back(now + 100000, obj4);
+    wheel.add_back(now + 5, obj2);
+    wheel.add_back(now + 20, obj11);
+    wheel.del(obj11);
+    printf("size %zu next %ld\n", wheel.size(), wheel.next_expire() - now);
+    long steps[] = {4, 5, 299, 300, 100000};
+    for(unsigned i = 0; i < sizeof(steps)/sizeof(steps[0]); i++)
+    {
+        Obj * p_obj;
+        while((p_obj = wheel.pop_expired(now + steps[i])) != NULL)
+            printf("%ld %d %ld\n", steps[i], p_obj->e_, p_obj->key_ - now);
+    }
+    assert(wheel.empty());
 }
@@ -1,6 +1,11 @@
 #ifndef __LOCK_HPP
 #define __LOCK_HPP
 
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <boost/thread/mutex.hpp>
 #include <boost/interprocess/sync/interprocess_semaphore.hpp>
 #include <boost/thread/shared_mutex.hpp>
@@ -55,4 +60,53 @@ public:
     }
 };
 
+//多个线程Notify, 一个线程Wait: 基于eventfd, 两次Wait之间的多次Notify只写一次
+class Notifier
+{
+    int fd_;
+    volatile int pending_;
+
+    Notifier(const Notifier&);
+    Notifier& operator = (const Notifier&);
+
+public:
+    Notifier(): pending_(0)
+    {
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(fd_ >= 0);
+    }
+    ~Notifier()
+    {
+        close(fd_);
+    }
+    void Notify()
+    {
+        if(__sync_lock_test_and_set(&pending_, 1))
+            return;
+        uint64_t one = 1;
+        if(write(fd_, &one, sizeof(one)) < 0)
+            __sync_lock_release(&pending_);
+    }
+    /**
+     * 等到有Notify或超时, timeout_ms小于0时一直等; 返回是否被Notify.
+     * 返回前清掉通知, 调用方之后再检查各自的队列, 不会漏掉
+     */
+    bool Wait(int timeout_ms)
+    {
+        if(!pending_)
+        {
+            struct pollfd pfd;
+            pfd.fd = fd_;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, timeout_ms);
+        }
+        uint64_t val = 0;
+        bool notified = read(fd_, &val, sizeof(val)) == sizeof(val);
+        __sync_lock_release(&pending_);
+        __sync_synchronize();
+        return notified;
+    }
+};
+
 #endif
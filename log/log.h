@@ -22,5 +22,7 @@
 #define LOG_DEBUG(format, ...) log_printf(LOG_LEVEL_DEBUG, stdout, format, ##__VA_ARGS__)
 
 extern "C" void log_printf(unsigned int flags, FILE* stream, const char* format, ...) __attribute__((format(printf, 3, 4)));
+//低于level的日志不输出
+void set_min_log_level(int level);
 
 #endif
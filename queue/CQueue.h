@@ -95,7 +95,7 @@ public:
     }
 	bool try_enqueue(const DataType& data)
     {
-        if(m_exit || m_empty_semaphore.try_wait() || m_exit) 
+        if(m_exit || !m_empty_semaphore.try_wait() || m_exit) 
             return false;
         return __enqueue(data); 
     }
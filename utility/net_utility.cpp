@@ -162,6 +162,21 @@ bool get_addr_string(const struct sockaddr* addr, char* addrstr, size_t addrstr_
     return true;
 }
 
+socklen_t get_sockaddr_len(const struct sockaddr* addr)
+{
+    if (!addr)
+        return 0;
+    switch (addr->sa_family)
+    {
+    case AF_INET:
+        return sizeof(struct sockaddr_in);
+    case AF_INET6:
+        return sizeof(struct sockaddr_in6);
+    default:
+        return 0;
+    }
+}
+
 bool get_ai_string(struct addrinfo * ai, char* addrstr, size_t addrstr_length)
 {
     size_t cur_len = 0;
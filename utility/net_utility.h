@@ -12,6 +12,8 @@ int get_local_address(const std::string &eth_name, std::string &local_address);
 
 struct sockaddr * get_sockaddr_in(const char* ip, uint16_t port);
 bool get_addr_string(const struct sockaddr* addr, char* addrstr, size_t addrstr_length, uint16_t & port);
+//按地址族的长度, 未知的族为0
+socklen_t get_sockaddr_len(const struct sockaddr* addr);
 bool get_ai_string(struct addrinfo * ai, char* addrstr, size_t addrstr_length);
 struct addrinfo* copy_addrinfo(struct addrinfo* addr);
 struct addrinfo* create_addrinfo(in_addr_t ip_addr, uint16_t port);
@@ -18,10 +18,10 @@ public:
     }
     void Add(T val)
     {  
-        idx_ = idx_++ % count;
         sum_ -= val_array[idx_];
         val_array[idx_] = val;
         sum_ += val;
+        idx_ = (idx_ + 1) % count;
         ++stastic_count_;
     }
     T Average() const